@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Compares the number of VM instructions executed by each benchmark program
+# with and without the optimizer, how fast the old vm and pl0vm run them, and
+# how long they take in pl0vm compared to the assembly backend's executables.
+# Also compares the latency of compiling and running tiny programs with
+# compiler --run and with a separate pl0vm, and the speed of the vector
+# implementations. Run ./build.sh first.
+
+# Counts the executed instructions in a trace printed by the VM, which has one
+# line per instruction after the "Initial values" line.
+countInstructions() {
+    awk '/^Initial values/ { tracing = 1; next } tracing && NF > 0 { count++ } END { print count }'
+}
+
+# Prints the number of seconds it takes to run a command.
+timeCommand() {
+    local start=$(date +%s.%N)
+    "$@" < /dev/null > /dev/null 2>&1
+    local end=$(date +%s.%N)
+    awk "BEGIN { print $end - $start }"
+}
+
+printf "%-24s %12s %12s\n" "program" "unoptimized" "optimized"
+for program in bench/*.pl0; do
+    ./compiler --text "$program" 0 > bench/plain.o
+    ./compiler --text -O "$program" 0 > bench/optimized.o
+    plain=$(./vm bench/plain.o < /dev/null | countInstructions)
+    optimized=$(./vm bench/optimized.o < /dev/null | countInstructions)
+    printf "%-24s %12d %12d\n" "$(basename "$program")" "$plain" "$optimized"
+done
+
+# The old vm always prints a trace, so pl0vm is timed both with and without
+# one, with and without fused opcodes, and with the runtime checks that the
+# verifier makes unnecessary. The numbers are millions of instructions per
+# second.
+echo
+printf "%-24s %12s %14s %12s %12s %12s %12s\n" "program" "vm" "pl0vm --trace" "no fusion" \
+    "--no-verify" "pl0vm" "pl0vm --jit"
+for program in bench/*.pl0; do
+    ./compiler --text "$program" 0 > bench/plain.o
+    ./compiler --no-fuse "$program" 0 > bench/basic.o
+    ./compiler "$program" 0 > bench/program.o
+    count=$(./pl0vm --stats bench/program.o 2>&1 > /dev/null < /dev/null \
+        | sed -n 's/^Executed \([0-9]*\) instructions.*/\1/p')
+    vm=$(timeCommand ./vm bench/plain.o)
+    trace=$(timeCommand ./pl0vm --trace bench/program.o)
+    basic=$(./pl0vm --stats bench/basic.o 2>&1 > /dev/null < /dev/null \
+        | sed -n 's/.*(\([0-9.]*\) million.*/\1/p')
+    checked=$(./pl0vm --stats --no-verify bench/program.o 2>&1 > /dev/null < /dev/null \
+        | sed -n 's/.*(\([0-9.]*\) million.*/\1/p')
+    pl0vm=$(./pl0vm --stats bench/program.o 2>&1 > /dev/null < /dev/null \
+        | sed -n 's/.*(\([0-9.]*\) million.*/\1/p')
+    jit=$(./pl0vm --jit --stats bench/program.o 2>&1 > /dev/null < /dev/null \
+        | sed -n 's/.*(\([0-9.]*\) million.*/\1/p')
+    printf "%-24s %12.1f %14.1f %12.1f %12.1f %12.1f %12.1f\n" "$(basename "$program")" \
+        "$(awk "BEGIN { print $count / $vm / 1000000 }")" \
+        "$(awk "BEGIN { print $count / $trace / 1000000 }")" "$basic" "$checked" "$pl0vm" "$jit"
+done
+
+# Milliseconds to run each program, including starting the process.
+echo
+printf "%-24s %12s %12s %12s\n" "program" "pl0vm" "pl0vm --jit" "asm"
+for program in bench/*.pl0; do
+    ./compiler "$program" 0 > bench/program.o
+    ./compiler --backend=asm "$program" > bench/program.s
+    as -o bench/program.asm.o bench/program.s
+    ld -o bench/program bench/program.asm.o
+    printf "%-24s %12.1f %12.1f %12.1f\n" "$(basename "$program")" \
+        "$(awk "BEGIN { print $(timeCommand ./pl0vm bench/program.o) * 1000 }")" \
+        "$(awk "BEGIN { print $(timeCommand ./pl0vm --jit bench/program.o) * 1000 }")" \
+        "$(awk "BEGIN { print $(timeCommand bench/program) * 1000 }")"
+done
+# Milliseconds from source code to output for the tiny test programs, averaged
+# over many runs: compiling to an object file and running it with pl0vm, like
+# run.sh does with the old vm, or compiling and running it in one process.
+compileAndRun() {
+    ./compiler "$1" 0 > bench/program.o && ./pl0vm bench/program.o
+}
+averageMilliseconds() {
+    local runs=20 i
+    local start=$(date +%s.%N)
+    for ((i = 0; i < runs; i++)); do
+        "$@" < /dev/null > /dev/null 2>&1
+    done
+    local end=$(date +%s.%N)
+    awk "BEGIN { print ($end - $start) * 1000 / $runs }"
+}
+
+echo
+printf "%-24s %16s %16s\n" "program" "compiler+pl0vm" "compiler --run"
+for program in test/programs/*.pl0; do
+    printf "%-24s %16.2f %16.2f\n" "$(basename "$program")" \
+        "$(averageMilliseconds compileAndRun "$program")" \
+        "$(averageMilliseconds ./compiler --run "$program")"
+done
+rm -f bench/plain.o bench/optimized.o bench/basic.o bench/program.o bench/program.s \
+    bench/program.asm.o bench/program
+
+# Nanoseconds per item for the generic vector, the generic vector growing by a
+# fixed step like it used to, and a typed vector from DEFINE_VECTOR.
+echo
+./vectorbench
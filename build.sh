@@ -1,3 +1,32 @@
 #!/bin/bash
 
-gcc -g -o compiler src/*.c src/lib/*.c test/lib/*.c -I.
+# The VM is built with optimizations on, since its speed matters. The compiler
+# includes it for --run. The compiler's allocation functions are wrapped to
+# count its allocations for --stats (see compiler.c).
+gcc -g -O2 -pthread -o compiler src/*.c $(ls src/vm/*.c | grep -v main.c) src/lib/*.c test/lib/*.c -I. \
+    -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup,--wrap=strndup
+gcc -g -O2 -pthread -o pl0vm src/vm/*.c src/object.c src/linetable.c src/instruction.c src/cfg.c \
+    src/fusion.c src/lib/*.c -I.
+gcc -g -O2 -pthread -o pl0trace src/vm/tools/pl0trace.c src/vm/trace.c src/vm/vm.c src/vm/io.c \
+    src/vm/verifier.c src/object.c src/linetable.c src/instruction.c src/cfg.c src/fusion.c \
+    src/lib/*.c -I.
+gcc -g -O2 -o pl0sequences src/vm/tools/pl0sequences.c src/object.c src/linetable.c \
+    src/instruction.c src/cfg.c src/fusion.c src/lib/*.c -I.
+gcc -g -O2 -pthread -o pl0server src/server/*.c $(ls src/*.c | grep -v compiler.c) \
+    $(ls src/vm/*.c | grep -v main.c) src/lib/*.c -I.
+gcc -g -O2 -pthread -o pl0load src/server/tools/pl0load.c src/server/protocol.c \
+    src/lib/*.c -I.
+gcc -g -O2 -o vectorbench src/lib/tools/vectorbench.c src/lib/*.c -I.
+
+# libpl0, the compiler as a library, in static and shared versions. Only the
+# functions in src/pl0.h are exported from libpl0.so.
+LIBPL0_SOURCES="src/pl0.c src/compile.c src/lexer.c src/parser.c src/grammar.c src/generator.c \
+    src/optimizer.c src/cfg.c src/fusion.c src/instruction.c src/linetable.c src/object.c \
+    src/lib/*.c"
+mkdir -p build/libpl0
+rm -f build/libpl0/*.o libpl0.a
+for source in $LIBPL0_SOURCES; do
+    gcc -g -O2 -fPIC -fvisibility=hidden -c -o build/libpl0/$(basename $source .c).o $source -I.
+done
+ar rcs libpl0.a build/libpl0/*.o
+gcc -shared -o libpl0.so build/libpl0/*.o
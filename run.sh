@@ -1,3 +1,3 @@
 #!/bin/bash
 
-./compiler in.pl0 0 > t.o;./vm t.o;rm t.o
+./compiler --text in.pl0 0 > t.o;./vm t.o;rm t.o
@@ -0,0 +1,505 @@
+#include "src/asmgenerator.h"
+#include "src/parser.h"
+#include "src/lib/util.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+// Registers for the temporaries at depth 0, 1, ... Division and moves
+// between two frame slots use eax and edx, so they aren't in the list. No
+// temporary is live across a call to the runtime, which only happens at the
+// statement level, so the runtime can use any register.
+static char *TEMPORARY_REGISTERS[] = {
+    "%ebx", "%ecx", "%esi", "%edi", "%r8d", "%r9d", "%r10d", "%r11d",
+    "%r12d", "%r13d", "%r14d", "%r15d"
+};
+#define NUM_TEMPORARY_REGISTERS (sizeof(TEMPORARY_REGISTERS) / sizeof(char*))
+
+// The runtime that every program is linked with. Output is buffered and
+// flushed when the buffer fills up, before reading and before exiting. pl0Read
+// parses numbers like scanf("%d") does.
+static const char *ASM_RUNTIME =
+    "    .bss\n"
+    "    .lcomm outputBuffer, 4096\n"
+    "    .lcomm outputLength, 8\n"
+    "    .lcomm inputBuffer, 4096\n"
+    "    .lcomm inputPosition, 8\n"
+    "    .lcomm inputLength, 8\n"
+    "\n"
+    "    .section .rodata\n"
+    "divisionByZeroMessage:\n"
+    "    .ascii \"Division by zero.\\n\"\n"
+    "\n"
+    "    .text\n"
+    "# Write the buffered output to stdout.\n"
+    "pl0Flush:\n"
+    "    movq outputLength(%rip), %rdx\n"
+    "    leaq outputBuffer(%rip), %rsi\n"
+    "1:\n"
+    "    testq %rdx, %rdx\n"
+    "    jz 2f\n"
+    "    movl $1, %eax\n"
+    "    movl $1, %edi\n"
+    "    syscall\n"
+    "    testq %rax, %rax\n"
+    "    jle 2f\n"
+    "    addq %rax, %rsi\n"
+    "    subq %rax, %rdx\n"
+    "    jmp 1b\n"
+    "2:\n"
+    "    movq $0, outputLength(%rip)\n"
+    "    ret\n"
+    "\n"
+    "# Write the number in %edi and a newline.\n"
+    "pl0Write:\n"
+    "    movq outputLength(%rip), %rcx\n"
+    "    cmpq $4096 - 16, %rcx\n"
+    "    jbe 1f\n"
+    "    pushq %rdi\n"
+    "    call pl0Flush\n"
+    "    popq %rdi\n"
+    "    xorl %ecx, %ecx\n"
+    "1:\n"
+    "    leaq outputBuffer(%rip), %r8\n"
+    "    movl %edi, %eax\n"
+    "    testl %eax, %eax\n"
+    "    jns 2f\n"
+    "    movb $'-', (%r8,%rcx)\n"
+    "    incq %rcx\n"
+    "    negl %eax\n"
+    "2:\n"
+    "    # Divide as unsigned so that -2147483648 works. The digits come out\n"
+    "    # backwards, so put them in the red zone first.\n"
+    "    movq %rsp, %rsi\n"
+    "    movl $10, %r9d\n"
+    "3:\n"
+    "    xorl %edx, %edx\n"
+    "    divl %r9d\n"
+    "    addb $'0', %dl\n"
+    "    decq %rsi\n"
+    "    movb %dl, (%rsi)\n"
+    "    testl %eax, %eax\n"
+    "    jnz 3b\n"
+    "4:\n"
+    "    movb (%rsi), %dl\n"
+    "    movb %dl, (%r8,%rcx)\n"
+    "    incq %rcx\n"
+    "    incq %rsi\n"
+    "    cmpq %rsp, %rsi\n"
+    "    jne 4b\n"
+    "    movb $10, (%r8,%rcx)\n"
+    "    incq %rcx\n"
+    "    movq %rcx, outputLength(%rip)\n"
+    "    ret\n"
+    "\n"
+    "# Return the next byte of input in %eax without consuming it, or -1 at the\n"
+    "# end of the input. Preserves %r8 and %r9.\n"
+    "pl0Peek:\n"
+    "    movq inputPosition(%rip), %rcx\n"
+    "    cmpq inputLength(%rip), %rcx\n"
+    "    jb 2f\n"
+    "    call pl0Flush\n"
+    "    xorl %eax, %eax\n"
+    "    xorl %edi, %edi\n"
+    "    leaq inputBuffer(%rip), %rsi\n"
+    "    movl $4096, %edx\n"
+    "    syscall\n"
+    "    testq %rax, %rax\n"
+    "    jg 1f\n"
+    "    movq $0, inputLength(%rip)\n"
+    "    movq $0, inputPosition(%rip)\n"
+    "    movl $-1, %eax\n"
+    "    ret\n"
+    "1:\n"
+    "    movq %rax, inputLength(%rip)\n"
+    "    movq $0, inputPosition(%rip)\n"
+    "    xorl %ecx, %ecx\n"
+    "2:\n"
+    "    leaq inputBuffer(%rip), %rsi\n"
+    "    movzbl (%rsi,%rcx), %eax\n"
+    "    ret\n"
+    "\n"
+    "# Read a number into %eax, or 0 if the input doesn't start with one.\n"
+    "pl0Read:\n"
+    "1:\n"
+    "    call pl0Peek\n"
+    "    cmpl $' ', %eax\n"
+    "    je 2f\n"
+    "    leal -9(%rax), %edx\n"
+    "    cmpl $4, %edx\n"
+    "    ja 3f\n"
+    "2:\n"
+    "    incq inputPosition(%rip)\n"
+    "    jmp 1b\n"
+    "3:\n"
+    "    xorl %r8d, %r8d\n"
+    "    cmpl $'+', %eax\n"
+    "    je 4f\n"
+    "    cmpl $'-', %eax\n"
+    "    jne 5f\n"
+    "    movl $1, %r8d\n"
+    "4:\n"
+    "    incq inputPosition(%rip)\n"
+    "    call pl0Peek\n"
+    "5:\n"
+    "    leal -'0'(%rax), %edx\n"
+    "    cmpl $9, %edx\n"
+    "    ja 8f\n"
+    "    xorl %r9d, %r9d\n"
+    "6:\n"
+    "    imull $10, %r9d, %r9d\n"
+    "    addl %edx, %r9d\n"
+    "    incq inputPosition(%rip)\n"
+    "    call pl0Peek\n"
+    "    leal -'0'(%rax), %edx\n"
+    "    cmpl $9, %edx\n"
+    "    jbe 6b\n"
+    "    movl %r9d, %eax\n"
+    "    testl %r8d, %r8d\n"
+    "    jz 7f\n"
+    "    negl %eax\n"
+    "7:\n"
+    "    ret\n"
+    "8:\n"
+    "    xorl %eax, %eax\n"
+    "    ret\n"
+    "\n"
+    "pl0DivisionByZero:\n"
+    "    call pl0Flush\n"
+    "    movl $1, %eax\n"
+    "    movl $2, %edi\n"
+    "    leaq divisionByZeroMessage(%rip), %rsi\n"
+    "    movl $18, %edx\n"
+    "    syscall\n"
+    "    movl $60, %eax\n"
+    "    movl $1, %edi\n"
+    "    syscall\n"
+    "\n";
+
+char *generateAsm(struct parseTree tree) {
+    clearGeneratorErrors();
+
+    if (isParseTreeError(tree))
+        return NULL;
+    assert(strcmp(tree.name, "program") == 0 && hasChild(tree, "block"));
+    annotateStackDepths(&tree);
+    struct parseTree block = getChild(tree, "block");
+
+    struct asmGenerator generator = {NULL, makeGeneratorState(), 0, 0, 0};
+
+    // Add the symbols, walking the right-recursive lists of declarations.
+    struct parseTree vars = getChild(getChild(block, "var-declaration"), "vars");
+    while (!isParseTreeError(vars)) {
+        addVariable(generator.state, getChild(getChild(vars, "var"), "identifier"));
+        generator.numVariables += 1;
+        vars = getChild(vars, "vars");
+    }
+    struct parseTree constants = getChild(getChild(block, "const-declaration"), "constants");
+    while (!isParseTreeError(constants)) {
+        struct parseTree constant = getChild(constants, "constant");
+        addConstant(generator.state, getChild(constant, "identifier"),
+                getChild(constant, "number"));
+        constants = getChild(constants, "constants");
+    }
+
+    // Generate the body first, since the size of the frame depends on how
+    // many temporaries it spills.
+    char *body;
+    size_t bodySize;
+    generator.output = open_memstream(&body, &bodySize);
+    generateAsmStatement(&generator, getChild(block, "statement"));
+    fclose(generator.output);
+
+    char *source;
+    size_t size;
+    FILE *output = open_memstream(&source, &size);
+    fputs(ASM_RUNTIME, output);
+
+    int frameSize = 4 * (generator.numVariables + generator.numSpillSlots);
+    frameSize = (frameSize + 15) / 16 * 16;
+    fprintf(output, "    .globl _start\n");
+    fprintf(output, "_start:\n");
+    fprintf(output, "    movq %%rsp, %%rbp\n");
+    if (frameSize > 0)
+        fprintf(output, "    subq $%d, %%rsp\n", frameSize);
+    int i;
+    for (i = 0; i < generator.numVariables; i++)
+        fprintf(output, "    movl $0, %d(%%rbp)\n", -4 * (i + 1));
+    fputs(body, output);
+    fprintf(output, "    call pl0Flush\n");
+    fprintf(output, "    movl $60, %%eax\n");
+    fprintf(output, "    xorl %%edi, %%edi\n");
+    fprintf(output, "    syscall\n");
+
+    fclose(output);
+    free(body);
+    return source;
+}
+
+void generateAsmStatement(struct asmGenerator *generator, struct parseTree tree) {
+    if (isParseTreeError(tree))
+        return;
+
+    FILE *output = generator->output;
+    int is(char *name) {
+        return (strcmp(tree.name, name) == 0);
+    }
+    // The frame slot of a variable that can be stored into, or NULL after
+    // adding an error.
+    char *storeTarget(struct parseTree identifier) {
+        struct symbol symbol = getSymbol(generator->state, getToken(identifier));
+        if (symbol.type == PROCEDURE || symbol.type == CONSTANT)
+            addGeneratorError("Cannot store into a constant or procedure.");
+        if (symbol.type != VARIABLE)
+            return NULL;
+        return format("%d(%%rbp)", -4 * (symbol.address + 1));
+    }
+    char *newLabel() {
+        return format(".L%d", generator->numLabels++);
+    }
+
+    if (is("statement")) {
+        // An empty statement has no children.
+        generateAsmStatement(generator, getFirstChild(tree));
+    } else if (is("begin-block")) {
+        generateAsmStatement(generator, getChild(tree, "statements"));
+    } else if (is("statements")) {
+        generateAsmStatement(generator, getChild(tree, "statement"));
+        generateAsmStatement(generator, getChild(tree, "statements"));
+    } else if (is("assignment")) {
+        struct parseTree expression = getChild(tree, "expression");
+        char *variable = storeTarget(getChild(tree, "identifier"));
+        char *operand = asmOperand(generator, expression);
+        if (variable == NULL)
+            return;
+
+        if (operand == NULL) {
+            generateAsmExpression(generator, expression, 0);
+            operand = asmTemporary(generator, 0);
+        } else if (operand[0] != '$') {
+            // There's no move between two memory operands.
+            fprintf(output, "    movl %s, %%eax\n", operand);
+            operand = "%eax";
+        }
+        fprintf(output, "    movl %s, %s\n", operand, variable);
+    } else if (is("read-statement")) {
+        char *variable = storeTarget(getChild(tree, "identifier"));
+        if (variable == NULL)
+            return;
+
+        fprintf(output, "    call pl0Read\n");
+        fprintf(output, "    movl %%eax, %s\n", variable);
+    } else if (is("write-statement")) {
+        char *operand = asmOperand(generator, getChild(tree, "identifier"));
+        if (operand == NULL)
+            return;
+
+        fprintf(output, "    movl %s, %%edi\n", operand);
+        fprintf(output, "    call pl0Write\n");
+    } else if (is("if-statement")) {
+        char *end = newLabel();
+        generateAsmCondition(generator, getChild(tree, "condition"), end);
+        generateAsmStatement(generator, getChild(tree, "statement"));
+        fprintf(output, "%s:\n", end);
+    } else if (is("while-statement")) {
+        char *beginning = newLabel();
+        char *end = newLabel();
+        fprintf(output, "%s:\n", beginning);
+        generateAsmCondition(generator, getChild(tree, "condition"), end);
+        generateAsmStatement(generator, getChild(tree, "statement"));
+        fprintf(output, "    jmp %s\n", beginning);
+        fprintf(output, "%s:\n", end);
+    } else {
+        assert(0 /* Expected a statement. */);
+    }
+}
+
+void generateAsmExpression(struct asmGenerator *generator, struct parseTree tree, int depth) {
+    FILE *output = generator->output;
+    char *result = asmTemporary(generator, depth);
+
+    // dest = source, or dest op= source. Memory destinations go through eax,
+    // which also covers moves between two frame slots.
+    void apply(char *instruction, char *source, char *dest) {
+        if (dest[0] == '%') {
+            fprintf(output, "    %s %s, %s\n", instruction, source, dest);
+        } else {
+            fprintf(output, "    movl %s, %%eax\n", dest);
+            fprintf(output, "    %s %s, %%eax\n", instruction, source);
+            fprintf(output, "    movl %%eax, %s\n", dest);
+        }
+    }
+    void move(char *source, char *dest) {
+        if (source[0] == '%' || source[0] == '$' || dest[0] == '%') {
+            fprintf(output, "    movl %s, %s\n", source, dest);
+        } else {
+            fprintf(output, "    movl %s, %%eax\n", source);
+            fprintf(output, "    movl %%eax, %s\n", dest);
+        }
+    }
+
+    // left op right into the result. A right operand that doesn't need to be
+    // computed is used directly. Otherwise it goes in the next temporary,
+    // unless the operator is commutative and the right side needs more
+    // temporaries than the left, in which case it's computed first
+    // (Sethi-Ullman ordering) so that fewer temporaries are live at once.
+    void binary(char *instruction, struct parseTree left, struct parseTree right,
+            int isCommutative) {
+        char *operand = asmOperand(generator, right);
+        if (operand == NULL && isCommutative) {
+            operand = asmOperand(generator, left);
+            if (operand != NULL) {
+                left = right;
+            } else if (stackDepth(right) > stackDepth(left)) {
+                struct parseTree swap = left;
+                left = right;
+                right = swap;
+            }
+        }
+
+        generateAsmExpression(generator, left, depth);
+        if (operand == NULL) {
+            generateAsmExpression(generator, right, depth + 1);
+            operand = asmTemporary(generator, depth + 1);
+        }
+        apply(instruction, operand, result);
+    }
+
+    // The division instruction needs a register or memory divisor, and needs
+    // the checks that make it behave like the VM.
+    void divide(struct parseTree left, struct parseTree right) {
+        generateAsmExpression(generator, left, depth);
+        generateAsmExpression(generator, right, depth + 1);
+        char *divisor = asmTemporary(generator, depth + 1);
+        char *negate = format(".L%d", generator->numLabels++);
+        char *end = format(".L%d", generator->numLabels++);
+
+        fprintf(output, "    cmpl $0, %s\n", divisor);
+        fprintf(output, "    je pl0DivisionByZero\n");
+        fprintf(output, "    movl %s, %%eax\n", result);
+        fprintf(output, "    cmpl $-1, %s\n", divisor);
+        fprintf(output, "    je %s\n", negate);
+        fprintf(output, "    cltd\n");
+        fprintf(output, "    idivl %s\n", divisor);
+        fprintf(output, "    jmp %s\n", end);
+        fprintf(output, "%s:\n", negate);
+        fprintf(output, "    negl %%eax\n");
+        fprintf(output, "%s:\n", end);
+        fprintf(output, "    movl %%eax, %s\n", result);
+    }
+
+    int is(char *name) {
+        return (strcmp(tree.name, name) == 0);
+    }
+
+    char *operand = asmOperand(generator, tree);
+    if (operand != NULL) {
+        move(operand, result);
+    } else if (is("expression") && hasChild(tree, "add-or-subtract")) {
+        int isAdd = isOperator(getChild(tree, "add-or-subtract"), "+");
+        binary(isAdd ? "addl" : "subl", getChild(tree, "term"),
+                getChild(tree, "expression"), isAdd);
+    } else if (is("expression")) {
+        generateAsmExpression(generator, getChild(tree, "term"), depth);
+    } else if (is("term") && hasChild(tree, "multiply-or-divide")) {
+        if (isOperator(getChild(tree, "multiply-or-divide"), "*"))
+            binary("imull", getChild(tree, "factor"), getChild(tree, "term"), 1);
+        else
+            divide(getChild(tree, "factor"), getChild(tree, "term"));
+    } else if (is("term")) {
+        generateAsmExpression(generator, getChild(tree, "factor"), depth);
+    } else if (is("factor") && hasChild(tree, "expression")) {
+        generateAsmExpression(generator, getChild(tree, "expression"), depth);
+    } else {
+        // Symbol errors have already been added by asmOperand.
+        move("$0", result);
+    }
+}
+
+void generateAsmCondition(struct asmGenerator *generator, struct parseTree tree, char *falseLabel) {
+    FILE *output = generator->output;
+    // The temporary at depth 0 is always a register.
+    char *left = asmTemporary(generator, 0);
+
+    if (hasChild(tree, "odd")) {
+        generateAsmExpression(generator, getChild(tree, "expression"), 0);
+        fprintf(output, "    testl $1, %s\n", left);
+        fprintf(output, "    jz %s\n", falseLabel);
+        return;
+    }
+
+    struct parseTree rightTree = getLastChild(tree, "expression");
+    generateAsmExpression(generator, getChild(tree, "expression"), 0);
+    char *right = asmOperand(generator, rightTree);
+    if (right == NULL) {
+        generateAsmExpression(generator, rightTree, 1);
+        right = asmTemporary(generator, 1);
+    }
+    fprintf(output, "    cmpl %s, %s\n", right, left);
+
+    // Jump if the comparison is false.
+    char *operator = getToken(getChild(tree, "rel-op"));
+    char *jump = NULL;
+    if (strcmp(operator, "=") == 0) jump = "jne";
+    else if (strcmp(operator, "<>") == 0) jump = "je";
+    else if (strcmp(operator, "<") == 0) jump = "jge";
+    else if (strcmp(operator, "<=") == 0) jump = "jg";
+    else if (strcmp(operator, ">") == 0) jump = "jle";
+    else if (strcmp(operator, ">=") == 0) jump = "jl";
+    else assert(0 /* Invalid relational operator. */);
+    fprintf(output, "    %s %s\n", jump, falseLabel);
+}
+
+char *asmOperand(struct asmGenerator *generator, struct parseTree tree) {
+    int is(char *name) {
+        return (strcmp(tree.name, name) == 0);
+    }
+
+    // Look through expressions and terms without an operator, and
+    // parentheses.
+    if (is("expression") && !hasChild(tree, "add-or-subtract"))
+        return asmOperand(generator, getChild(tree, "term"));
+    if (is("term") && !hasChild(tree, "multiply-or-divide"))
+        return asmOperand(generator, getChild(tree, "factor"));
+    if (is("factor") && hasChild(tree, "expression"))
+        return asmOperand(generator, getChild(tree, "expression"));
+    if (is("factor") && hasChild(tree, "identifier"))
+        return asmOperand(generator, getChild(tree, "identifier"));
+
+    if (is("factor") && hasChild(tree, "number")) {
+        // Print the number with %d, since a leading 0 would make the
+        // assembler read it as octal.
+        char *number = getToken(getChild(tree, "number"));
+        assert(isInteger(number));
+        int value = atoi(number);
+
+        struct parseTree sign = getChild(tree, "sign");
+        if (!isParseTreeError(sign) && isOperator(sign, "-"))
+            value = -value;
+        return format("$%d", value);
+    }
+
+    if (is("identifier")) {
+        struct symbol symbol = getSymbol(generator->state, getToken(tree));
+        if (symbol.type == PROCEDURE)
+            addGeneratorError("Cannot take value of procedure.");
+        else if (symbol.type == VARIABLE)
+            return format("%d(%%rbp)", -4 * (symbol.address + 1));
+        else if (symbol.type == CONSTANT)
+            return format("$%d", symbol.constantValue);
+        return NULL;
+    }
+
+    return NULL;
+}
+
+char *asmTemporary(struct asmGenerator *generator, int depth) {
+    if (depth < NUM_TEMPORARY_REGISTERS)
+        return TEMPORARY_REGISTERS[depth];
+
+    int slot = depth - NUM_TEMPORARY_REGISTERS;
+    if (slot >= generator->numSpillSlots)
+        generator->numSpillSlots = slot + 1;
+    return format("%d(%%rbp)", -4 * (generator->numVariables + slot + 1));
+}
@@ -0,0 +1,50 @@
+#ifndef ASMGENERATOR_H
+#define ASMGENERATOR_H
+
+#include "src/parser.h"
+#include "src/generator.h"
+#include <stdio.h>
+
+// A backend that translates a program into x86-64 assembly in AT&T syntax,
+// which `as` and `ld` turn into a static Linux executable without needing a C
+// compiler or library:
+//
+//     ./compiler --backend=asm program.pl0 > program.s
+//     as -o program.o program.s && ld -o program program.o
+//
+// Variables live in the stack frame of _start. Expression temporaries are
+// given registers by how deep they are in the expression, so the temporary
+// at depth d is in TEMPORARY_REGISTERS[d], and only temporaries deeper than
+// that are spilled to the frame. The program does its I/O with system calls
+// through a small runtime that is written out with it, and behaves like the
+// VM: arithmetic wraps around, dividing by zero prints "Division by zero." to
+// stderr and exits with status 1, and read gives 0 when there is no number.
+
+// Returns the assembly for a whole program, or NULL if the tree is invalid.
+// Check generatorHasErrors() afterwards, like with generateInstructions.
+char *generateAsm(struct parseTree tree);
+
+struct asmGenerator {
+    FILE *output;
+    struct generatorState *state;   // The symbol table.
+    int numLabels;        // Number of local labels used so far.
+    int numVariables;
+    int numSpillSlots;    // Frame slots needed for spilled temporaries.
+};
+
+// Write the code for a statement tree.
+void generateAsmStatement(struct asmGenerator *generator, struct parseTree tree);
+// Write code that evaluates an expression, term or factor tree into the
+// temporary at the given depth.
+void generateAsmExpression(struct asmGenerator *generator, struct parseTree tree, int depth);
+// Write code that evaluates a condition tree and jumps to the label if it's
+// false.
+void generateAsmCondition(struct asmGenerator *generator, struct parseTree tree, char *falseLabel);
+
+// Returns the operand (an immediate or a frame slot) for an expression that is
+// just a number, a constant or a variable, or NULL if it has to be computed.
+char *asmOperand(struct asmGenerator *generator, struct parseTree tree);
+// Returns the register or frame slot of the temporary at the given depth.
+char *asmTemporary(struct asmGenerator *generator, int depth);
+
+#endif
@@ -0,0 +1,351 @@
+#include "src/batch.h"
+#include "src/compile.h"
+#include "src/grammar.h"
+#include "src/lexer.h"
+#include "src/object.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+struct batch;
+
+// A compiling thread.
+struct batchWorker {
+    struct batch *batch;
+    int index;
+    pthread_t thread;
+    struct workQueue queue;
+    long long steals;
+};
+
+struct batch {
+    struct vector *files;
+    int options;
+    struct compileCache *cache;
+    struct grammar grammar;
+    struct batchWorker *workers;
+    int numWorkers;
+};
+
+uint64_t batchNanoseconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+int endsWith(char *string, char *suffix) {
+    size_t length = strlen(string), suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
+
+void addBatchFile(struct vector *files, char *inputPath, char *outputDirectory) {
+    // Replace a .pl0 extension with .obj, or add .obj.
+    char *name = inputPath;
+    if (outputDirectory != NULL && strrchr(inputPath, '/') != NULL)
+        name = strrchr(inputPath, '/') + 1;
+    int stemLength = strlen(name) - (endsWith(name, ".pl0") ? 4 : 0);
+    char *outputPath = (outputDirectory != NULL)
+        ? format("%s/%.*s.obj", outputDirectory, stemLength, name)
+        : format("%.*s.obj", stemLength, name);
+    pushLiteral(files, struct batchFile, {strdup(inputPath), outputPath, NULL, 0, 0, 0, 0});
+}
+
+// Add the .pl0 files in the directory and its subdirectories, in
+// alphabetical order.
+int addDirectory(struct vector *files, char *path, char *outputDirectory) {
+    struct dirent **entries;
+    int numEntries = scandir(path, &entries, NULL, alphasort);
+    if (numEntries < 0) {
+        setBatchError(format("Could not read %s: %s", path, strerror(errno)));
+        return 0;
+    }
+
+    int succeeded = 1;
+    int i;
+    for (i = 0; i < numEntries; i++) {
+        char *name = entries[i]->d_name;
+        char *entryPath = format("%s/%s", path, name);
+        struct stat status;
+        if (name[0] == '.' || stat(entryPath, &status) != 0) {
+            // Skip hidden files, and ., .. and broken links.
+        } else if (S_ISDIR(status.st_mode)) {
+            if (succeeded)
+                succeeded = addDirectory(files, entryPath, outputDirectory);
+        } else if (S_ISREG(status.st_mode) && endsWith(name, ".pl0")) {
+            addBatchFile(files, entryPath, outputDirectory);
+        }
+        free(entryPath);
+        free(entries[i]);
+    }
+    free(entries);
+    return succeeded;
+}
+
+// Returns the file's contents, null-terminated, and puts the size in *size,
+// or returns NULL if it can't be read. The file is read until the end, so it
+// can also be a pipe.
+char *readWholeFile(char *path, long long *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    size_t length = 0, capacity = 4096;
+    char *contents = (char*)malloc(capacity + 1);
+    while (contents != NULL) {
+        length += fread(contents + length, 1, capacity - length, file);
+        if (length < capacity)
+            break;
+        capacity *= 2;
+        char *grown = (char*)realloc(contents, capacity + 1);
+        if (grown == NULL)
+            free(contents);
+        contents = grown;
+    }
+    if (contents == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (ferror(file)) {
+        int error = errno;
+        free(contents);
+        fclose(file);
+        errno = error;
+        return NULL;
+    }
+    contents[length] = '\0';
+    fclose(file);
+    if (size != NULL)
+        *size = length;
+    return contents;
+}
+
+int addBatchInputs(struct vector *files, char *path, char *outputDirectory) {
+    struct stat status;
+    if (stat(path, &status) != 0) {
+        setBatchError(format("Could not read %s: %s", path, strerror(errno)));
+        return 0;
+    }
+    if (S_ISDIR(status.st_mode))
+        return addDirectory(files, path, outputDirectory);
+    if (endsWith(path, ".pl0")) {
+        addBatchFile(files, path, outputDirectory);
+        return 1;
+    }
+
+    char *list = readWholeFile(path, NULL);
+    if (list == NULL) {
+        setBatchError(format("Could not read %s: %s", path, strerror(errno)));
+        return 0;
+    }
+    char *line = list;
+    while (*line != '\0') {
+        char *end = line + strcspn(line, "\r\n");
+        char *next = end + strspn(end, "\r\n");
+        *end = '\0';
+        if (*line != '\0')
+            addBatchFile(files, line, outputDirectory);
+        line = next;
+    }
+    free(list);
+    return 1;
+}
+
+// Orders files by their output path.
+int compareOutputPaths(const void *a, const void *b) {
+    return strcmp(((struct batchFile*)a)->outputPath, ((struct batchFile*)b)->outputPath);
+}
+
+int checkBatchOutputs(struct vector *files) {
+    struct batchFile *sorted = (struct batchFile*)malloc(
+            sizeof(struct batchFile) * (files->length + 1));
+    memcpy(sorted, files->items, sizeof(struct batchFile) * files->length);
+    qsort(sorted, files->length, sizeof(struct batchFile), compareOutputPaths);
+
+    int i;
+    for (i = 1; i < files->length; i++) {
+        if (strcmp(sorted[i - 1].outputPath, sorted[i].outputPath) == 0) {
+            setBatchError(format("Both %s and %s would be compiled to %s.",
+                        sorted[i - 1].inputPath, sorted[i].inputPath, sorted[i].outputPath));
+            free(sorted);
+            return 0;
+        }
+    }
+    free(sorted);
+    return 1;
+}
+
+// Write the object file of a file, or set its error.
+int writeBatchOutput(struct batchFile *file, unsigned char *bytes, int size) {
+    FILE *output = fopen(file->outputPath, "wb");
+    int written = (output != NULL && fwrite(bytes, 1, size, output) == size);
+    if (output != NULL && fclose(output) != 0)
+        written = 0;
+    if (!written)
+        file->error = format("Could not write %s.", file->outputPath);
+    return written;
+}
+
+void compileBatchFile(struct batch *batch, struct batchFile *file) {
+    uint64_t start = batchNanoseconds();
+    // A list can name anything, such as a directory or a device.
+    struct stat status;
+    if (stat(file->inputPath, &status) == 0 && !S_ISREG(status.st_mode)) {
+        file->error = format("Could not read the file: it isn't a regular file.");
+        file->nanoseconds = batchNanoseconds() - start;
+        return;
+    }
+    char *source = readWholeFile(file->inputPath, &file->sourceBytes);
+    if (source == NULL) {
+        file->error = format("Could not read the file: %s", strerror(errno));
+        file->nanoseconds = batchNanoseconds() - start;
+        return;
+    }
+
+    char key[CACHE_KEY_SIZE];
+    struct cacheEntry entry;
+    if (batch->cache != NULL) {
+        makeCacheKey(source, file->sourceBytes, batch->options, key);
+        if (lookupCompileCache(batch->cache, key, &entry)) {
+            free(source);
+            file->cached = 1;
+            file->numInstructions = readWord(&entry.bytes[8]);
+            writeBatchOutput(file, entry.bytes, entry.size);
+            releaseCacheEntry(&entry);
+            file->nanoseconds = batchNanoseconds() - start;
+            return;
+        }
+    }
+
+    struct vector *lines;
+    struct vector *instructions = compileSource(source, batch->grammar, batch->options, &lines,
+            &file->error);
+    free(source);
+    if (instructions != NULL) {
+        file->numInstructions = instructions->length;
+        int size;
+        unsigned char *bytes = encodeObjectFile(instructions, lines, &size);
+        if (writeBatchOutput(file, bytes, size) && batch->cache != NULL)
+            storeCompileCache(batch->cache, key, bytes, size);
+        free(bytes);
+        freeVector(instructions);
+        freeVector(lines);
+    }
+    file->nanoseconds = batchNanoseconds() - start;
+}
+
+// Take the next file from the worker's own queue, or steal one from another
+// worker's. Returns -1 once every queue is empty. Files are never added to
+// the queues, so an empty queue stays empty.
+int takeWork(struct batchWorker *worker) {
+    struct workQueue *queue = &worker->queue;
+    int item = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->top < queue->bottom)
+        item = queue->items[--queue->bottom];
+    pthread_mutex_unlock(&queue->lock);
+    if (item >= 0)
+        return item;
+
+    struct batch *batch = worker->batch;
+    int i;
+    for (i = 1; i < batch->numWorkers && item < 0; i++) {
+        struct workQueue *victim = &batch->workers[(worker->index + i) % batch->numWorkers].queue;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom)
+            item = victim->items[victim->top++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    if (item >= 0)
+        worker->steals++;
+    return item;
+}
+
+void *runBatchWorker(void *argument) {
+    struct batchWorker *worker = (struct batchWorker*)argument;
+    int item;
+    while ((item = takeWork(worker)) >= 0)
+        compileBatchFile(worker->batch, &get(struct batchFile, worker->batch->files, item));
+    freeLexer();
+    return NULL;
+}
+
+int compileBatch(struct vector *files, int options, struct compileCache *cache,
+        int numThreads, struct batchStats *stats) {
+    struct batch batch = {files, options, cache, PL0Grammar(), NULL, numThreads};
+    batch.workers = (struct batchWorker*)calloc(numThreads, sizeof(struct batchWorker));
+    uint64_t start = batchNanoseconds();
+
+    int i;
+    for (i = 0; i < numThreads; i++) {
+        struct batchWorker *worker = &batch.workers[i];
+        int first = (long long)files->length * i / numThreads;
+        int last = (long long)files->length * (i + 1) / numThreads;
+        worker->batch = &batch;
+        worker->index = i;
+        worker->queue.items = (int*)malloc(sizeof(int) * (last - first + 1));
+        worker->queue.top = 0;
+        worker->queue.bottom = last - first;
+        int j;
+        for (j = first; j < last; j++)
+            worker->queue.items[j - first] = j;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+    }
+    // The queues are all filled before any worker starts stealing.
+    for (i = 0; i < numThreads; i++)
+        pthread_create(&batch.workers[i].thread, NULL, runBatchWorker, &batch.workers[i]);
+
+    *stats = (struct batchStats){numThreads, files->length, 0, 0, 0, 0, 0, 0};
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+        stats->steals += batch.workers[i].steals;
+        free(batch.workers[i].queue.items);
+        pthread_mutex_destroy(&batch.workers[i].queue.lock);
+    }
+    stats->seconds = (batchNanoseconds() - start) / 1e9;
+    free(batch.workers);
+
+    forVector(files, i, struct batchFile, file,
+        stats->sourceBytes += file.sourceBytes;
+        stats->instructions += file.numInstructions;
+        if (file.error != NULL)
+            stats->failedFiles++;
+        if (file.cached)
+            stats->cachedFiles++;);
+    return (stats->failedFiles == 0);
+}
+
+void printBatchStats(FILE *file, struct batchStats *stats) {
+    fprintf(file, "Compiled %d files, %d of which failed, in %.3f s on %d thread%s.\n",
+            stats->numFiles, stats->failedFiles, stats->seconds, stats->numThreads,
+            (stats->numThreads == 1) ? "" : "s");
+    if (stats->seconds > 0)
+        fprintf(file, "Throughput: %.1f files/s, %.2f MB/s of source code, "
+                "%.1f thousand instructions/s.\n", stats->numFiles / stats->seconds,
+                stats->sourceBytes / stats->seconds / 1e6,
+                stats->instructions / stats->seconds / 1e3);
+    if (stats->cachedFiles > 0)
+        fprintf(file, "%d files came from the cache.\n", stats->cachedFiles);
+    fprintf(file, "%lld files were stolen from another thread's queue.\n", stats->steals);
+}
+
+void freeBatchFiles(struct vector *files) {
+    forVector(files, i, struct batchFile, file,
+        free(file.inputPath);
+        free(file.outputPath);
+        free(file.error););
+    freeVector(files);
+}
+
+char *batchError = NULL;
+
+char *setBatchError(char *message) {
+    batchError = message;
+    return message;
+}
+char *getBatchError() {
+    return batchError;
+}
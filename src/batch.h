@@ -0,0 +1,69 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "src/cache.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Compiles many PL/0 files to object files on a number of threads, for
+// compiler --batch. Every thread starts out with an equal share of the files
+// in its own queue, and takes them from the back of it. A thread whose queue
+// is empty steals from the front of another thread's queue, so that threads
+// that got the small files help the ones that got the large ones. The
+// compiler's state is per thread (see compile.h), so the only things the
+// threads share are the grammar and the queues.
+
+struct batchFile {
+    char *inputPath;
+    char *outputPath;
+    char *error;            // Why it didn't compile, or NULL.
+    long long sourceBytes;
+    int numInstructions;
+    int cached;             // Whether its object file came from the cache.
+    uint64_t nanoseconds;   // Reading, compiling and writing it.
+};
+
+struct batchStats {
+    int numThreads;
+    int numFiles;
+    int failedFiles;
+    int cachedFiles;
+    long long sourceBytes;
+    long long instructions;
+    long long steals;       // Files that a thread took from another's queue.
+    double seconds;
+};
+
+// A thread's files, as indices into the batch's files, from top to
+// bottom - 1. The owner takes them from the bottom and thieves from the top.
+struct workQueue {
+    int *items;
+    int top, bottom;
+    pthread_mutex_t lock;
+};
+
+// Add the files to compile for a path to the files: a directory is searched
+// for .pl0 files, a .pl0 file is compiled, and any other file is a list of
+// paths to compile, one per line. The output goes next to the input, with
+// .obj instead of .pl0, or into outputDirectory if it isn't NULL. Returns
+// false and sets the batch error if the path can't be read.
+int addBatchInputs(struct vector *files, char *path, char *outputDirectory);
+// Returns false and sets the batch error if two files have the same output.
+int checkBatchOutputs(struct vector *files);
+
+// Compile the files with the options for compileSource, filling in their
+// errors, and put the totals in the stats. Returns true if every file
+// compiled. Object files are taken from and added to the cache if it isn't
+// NULL.
+int compileBatch(struct vector *files, int options, struct compileCache *cache,
+        int numThreads, struct batchStats *stats);
+void printBatchStats(FILE *file, struct batchStats *stats);
+// Free the paths and errors of the files.
+void freeBatchFiles(struct vector *files);
+
+char *setBatchError(char *message);
+char *getBatchError();
+
+#endif
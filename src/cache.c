@@ -0,0 +1,318 @@
+#include "src/cache.h"
+#include "src/compile.h"
+#include "src/object.h"
+#include "src/lib/util.h"
+#include "src/lib/vector.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Temporary files older than this are left over from a compiler that died
+// while writing them, and are removed when entries are evicted.
+#define STALE_TEMPORARY_SECONDS 3600
+
+struct compileCache *openCompileCache(char *directory, long long maxBytes) {
+    struct stat status;
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        setCacheError(format("Could not make the cache directory %s: %s", directory,
+                    strerror(errno)));
+        return NULL;
+    }
+    if (stat(directory, &status) != 0 || !S_ISDIR(status.st_mode)) {
+        setCacheError(format("The cache %s is not a directory.", directory));
+        return NULL;
+    }
+
+    struct compileCache *cache = make(struct compileCache);
+    cache->directory = strdup(directory);
+    cache->maxBytes = maxBytes;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->stats = (struct cacheStats){0, 0, 0, 0, 0};
+    cache->pending = (struct cacheStats){0, 0, 0, 0, 0};
+    struct cacheStats totals;
+    getCacheTotals(cache, &totals);
+    cache->knownBytes = totals.bytes;
+    cache->stats.bytes = totals.bytes;
+    return cache;
+}
+
+void makeCacheKey(char *source, int size, int options, char *key) {
+    // 64-bit FNV-1a of the versions, the options and the source code. The
+    // size is part of the key too, so that a collision would need two
+    // sources of the same size with the same hash.
+    unsigned char header[12];
+    writeWord(&header[0], COMPILER_VERSION);
+    writeWord(&header[4], OBJECT_VERSION);
+    writeWord(&header[8], options);
+    uint64_t hash = 14695981039346656037ull;
+    int i;
+    for (i = 0; i < 12; i++) {
+        hash ^= header[i];
+        hash *= 1099511628211ull;
+    }
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)source[i];
+        hash *= 1099511628211ull;
+    }
+    snprintf(key, CACHE_KEY_SIZE, "%016llx-%x", (unsigned long long)hash, size);
+}
+
+// Returns true if the bytes are a whole object file of the current version,
+// going by the sizes in its header. Entries can only be cut short by a crash
+// between writing and syncing them, but that's cheap to check.
+int isWholeObjectFile(unsigned char *bytes, int size) {
+    if (size < OBJECT_HEADER_SIZE || !isObjectFile(bytes, size)
+            || readWord(&bytes[4]) != OBJECT_VERSION)
+        return 0;
+    long long expectedSize = OBJECT_HEADER_SIZE + 4 * (long long)readWord(&bytes[8])
+        + 12 * (long long)readWord(&bytes[20]);
+    return (size == expectedSize);
+}
+
+int lookupCompileCache(struct compileCache *cache, char *key, struct cacheEntry *entry) {
+    char *path = format("%s/%s.obj", cache->directory, key);
+    int fd = open(path, O_RDONLY);
+    int found = 0;
+    long long removedBytes = 0;
+    if (fd >= 0) {
+        struct stat status;
+        void *mapping = MAP_FAILED;
+        if (fstat(fd, &status) == 0 && status.st_size >= OBJECT_HEADER_SIZE
+                && status.st_size < INT32_MAX)
+            mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED && isWholeObjectFile(mapping, status.st_size)) {
+            *entry = (struct cacheEntry){(unsigned char*)mapping, status.st_size};
+            found = 1;
+            // Mark it as used for eviction.
+            futimens(fd, NULL);
+        } else {
+            if (mapping != MAP_FAILED)
+                munmap(mapping, status.st_size);
+            if (unlink(path) == 0 && fstat(fd, &status) == 0)
+                removedBytes = status.st_size;
+        }
+        close(fd);
+    }
+    free(path);
+
+    pthread_mutex_lock(&cache->lock);
+    if (found) {
+        cache->stats.hits++;
+        cache->pending.hits++;
+    } else {
+        cache->stats.misses++;
+        cache->pending.misses++;
+        cache->pending.bytes -= removedBytes;
+        cache->knownBytes -= removedBytes;
+        cache->stats.bytes = cache->knownBytes;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+void releaseCacheEntry(struct cacheEntry *entry) {
+    munmap(entry->bytes, entry->size);
+    entry->bytes = NULL;
+    entry->size = 0;
+}
+
+void syncCacheStats(struct compileCache *cache);
+
+int storeCompileCache(struct compileCache *cache, char *key, unsigned char *bytes, int size) {
+    // Every thread of every process writes to its own temporary file.
+    char *temporaryPath = format("%s/tmp-%d-%lx", cache->directory, (int)getpid(),
+            (unsigned long)pthread_self());
+    char *path = format("%s/%s.obj", cache->directory, key);
+    int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int written = 0;
+    long long replacedBytes = 0;
+    if (fd >= 0) {
+        written = (write(fd, bytes, size) == size);
+        if (close(fd) != 0)
+            written = 0;
+        // Another thread or process can have stored the same entry since the
+        // lookup, and it only counts once.
+        struct stat status;
+        if (written && stat(path, &status) == 0)
+            replacedBytes = status.st_size;
+        if (written)
+            written = (rename(temporaryPath, path) == 0);
+        if (!written)
+            unlink(temporaryPath);
+    }
+    free(temporaryPath);
+    free(path);
+    if (!written)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.writes++;
+    cache->pending.writes++;
+    cache->pending.bytes += size - replacedBytes;
+    cache->knownBytes += size - replacedBytes;
+    cache->stats.bytes = cache->knownBytes;
+    if (cache->maxBytes > 0 && cache->knownBytes > cache->maxBytes)
+        syncCacheStats(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+void closeCompileCache(struct compileCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    syncCacheStats(cache);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->directory);
+    free(cache);
+}
+
+void readStats(FILE *file, struct cacheStats *stats) {
+    *stats = (struct cacheStats){0, 0, 0, 0, 0};
+    if (fscanf(file, "hits %lld\nmisses %lld\nwrites %lld\nevictions %lld\nbytes %lld\n",
+                &stats->hits, &stats->misses, &stats->writes, &stats->evictions,
+                &stats->bytes) != 5)
+        *stats = (struct cacheStats){0, 0, 0, 0, 0};
+}
+
+void getCacheTotals(struct compileCache *cache, struct cacheStats *stats) {
+    char *path = format("%s/stats", cache->directory);
+    FILE *file = fopen(path, "r");
+    free(path);
+    *stats = (struct cacheStats){0, 0, 0, 0, 0};
+    if (file != NULL) {
+        flock(fileno(file), LOCK_SH);
+        readStats(file, stats);
+        fclose(file);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    stats->hits += cache->pending.hits;
+    stats->misses += cache->pending.misses;
+    stats->writes += cache->pending.writes;
+    stats->evictions += cache->pending.evictions;
+    stats->bytes += cache->pending.bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// An entry, for eviction.
+struct cacheFile {
+    char *path;
+    struct timespec lastUse;
+    long long size;
+};
+
+// Orders entries from the least to the most recently used.
+int compareLastUse(const void *a, const void *b) {
+    struct timespec x = ((struct cacheFile*)a)->lastUse, y = ((struct cacheFile*)b)->lastUse;
+    if (x.tv_sec != y.tv_sec)
+        return (x.tv_sec < y.tv_sec) ? -1 : 1;
+    return (x.tv_nsec < y.tv_nsec) ? -1 : (x.tv_nsec > y.tv_nsec);
+}
+
+// Remove the least recently used entries until they take up 90% of the
+// cache's limit, and put their actual size in the totals.
+void evictEntries(struct compileCache *cache, struct cacheStats *totals) {
+    struct dirent **names;
+    int numNames = scandir(cache->directory, &names, NULL, NULL);
+    if (numNames < 0)
+        return;
+
+    struct vector *files = makeVector(struct cacheFile);
+    long long bytes = 0;
+    time_t now = time(NULL);
+    int i;
+    for (i = 0; i < numNames; i++) {
+        char *name = names[i]->d_name;
+        char *path = format("%s/%s", cache->directory, name);
+        struct stat status;
+        int length = strlen(name);
+        if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+            free(path);
+        } else if (length > 4 && strcmp(name + length - 4, ".obj") == 0) {
+            pushLiteral(files, struct cacheFile, {path, status.st_mtim, status.st_size});
+            bytes += status.st_size;
+        } else {
+            if (strncmp(name, "tmp-", 4) == 0 && now - status.st_mtime > STALE_TEMPORARY_SECONDS)
+                unlink(path);
+            free(path);
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    qsort(files->items, files->length, sizeof(struct cacheFile), compareLastUse);
+    long long targetBytes = cache->maxBytes / 10 * 9;
+    forVector(files, i, struct cacheFile, file,
+        if (bytes > targetBytes && unlink(file.path) == 0) {
+            bytes -= file.size;
+            totals->evictions++;
+            cache->stats.evictions++;
+        }
+        free(file.path););
+    freeVector(files);
+    totals->bytes = bytes;
+}
+
+// Add the pending counts to the stats file, and evict entries if the cache is
+// too big. Called with the cache's lock held. The stats file is locked while
+// it's updated, so that only one process evicts at a time.
+void syncCacheStats(struct compileCache *cache) {
+    char *path = format("%s/stats", cache->directory);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0)
+        return;
+    flock(fd, LOCK_EX);
+    FILE *file = fdopen(fd, "r+");
+
+    struct cacheStats totals;
+    readStats(file, &totals);
+    totals.hits += cache->pending.hits;
+    totals.misses += cache->pending.misses;
+    totals.writes += cache->pending.writes;
+    totals.evictions += cache->pending.evictions;
+    totals.bytes += cache->pending.bytes;
+    if (totals.bytes < 0)
+        totals.bytes = 0;
+    cache->pending = (struct cacheStats){0, 0, 0, 0, 0};
+    if (cache->maxBytes > 0 && totals.bytes > cache->maxBytes)
+        evictEntries(cache, &totals);
+    cache->knownBytes = totals.bytes;
+    cache->stats.bytes = totals.bytes;
+
+    rewind(file);
+    if (ftruncate(fd, 0) == 0)
+        fprintf(file, "hits %lld\nmisses %lld\nwrites %lld\nevictions %lld\nbytes %lld\n",
+                totals.hits, totals.misses, totals.writes, totals.evictions, totals.bytes);
+    // Closing the file releases the lock.
+    fclose(file);
+}
+
+void printCacheStats(FILE *file, struct cacheStats *stats) {
+    long long lookups = stats->hits + stats->misses;
+    fprintf(file, "Cache: %lld hit%s and %lld miss%s", stats->hits,
+            (stats->hits == 1) ? "" : "s", stats->misses, (stats->misses == 1) ? "" : "es");
+    if (lookups > 0)
+        fprintf(file, " (%.1f%% hits)", 100.0 * stats->hits / lookups);
+    fprintf(file, ", %lld write%s and %lld eviction%s, %.2f MB of entries.\n", stats->writes,
+            (stats->writes == 1) ? "" : "s", stats->evictions,
+            (stats->evictions == 1) ? "" : "s", stats->bytes / 1e6);
+}
+
+char *cacheError = NULL;
+
+char *setCacheError(char *message) {
+    cacheError = message;
+    return message;
+}
+char *getCacheError() {
+    return cacheError;
+}
@@ -0,0 +1,82 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// An on-disk cache of object files, for the compiler, so that compiling the
+// same source code with the same options again just reads the object file it
+// made the first time. Entries are named by a hash of the source code, the
+// options and the compiler and object file versions, so they never have to be
+// invalidated, only evicted.
+//
+// The cache directory holds:
+//   <key>.obj   An object file. Entries are written to a temporary file and
+//               renamed, so a reader never sees half of one, and processes
+//               can share the cache. A hit updates the entry's modification
+//               time, which is its last use for eviction.
+//   stats       The totals of the counters below over every process that
+//               used the cache, and the size of the entries, as text.
+//               Processes add their counts under a lock when they close the
+//               cache.
+//
+// When the entries get bigger than the cache's size limit, the least
+// recently used are removed until they take up 90% of it.
+
+// "<16 hex digits of hash>-<source size in hex>" and a terminating null.
+#define CACHE_KEY_SIZE 32
+
+struct cacheStats {
+    long long hits;
+    long long misses;
+    long long writes;
+    long long evictions;
+    long long bytes;    // The size of the entries.
+};
+
+struct compileCache {
+    char *directory;
+    long long maxBytes;         // 0 for no limit.
+    pthread_mutex_t lock;       // Threads can share a cache.
+    struct cacheStats stats;    // This process's counts.
+    struct cacheStats pending;  // Counts that aren't in the stats file yet.
+                                // Its bytes are a change, which can be
+                                // negative.
+    long long knownBytes;       // The size of the entries as far as this
+                                // process knows.
+};
+
+// A cache hit: the object file, mapped into memory.
+struct cacheEntry {
+    unsigned char *bytes;
+    int size;
+};
+
+// Open the cache in a directory, making the directory if it doesn't exist.
+// Returns NULL and sets the cache error if it can't be made.
+struct compileCache *openCompileCache(char *directory, long long maxBytes);
+// Add this process's counts to the stats file, evict entries if the cache is
+// too big, and free the cache.
+void closeCompileCache(struct compileCache *cache);
+
+// Put the key for the source code compiled with the options for compileSource
+// in key, which has room for CACHE_KEY_SIZE characters.
+void makeCacheKey(char *source, int size, int options, char *key);
+// Returns true and maps the object file for the key into *entry if it's in
+// the cache. The entry stays valid, even if it's evicted, until it's
+// released.
+int lookupCompileCache(struct compileCache *cache, char *key, struct cacheEntry *entry);
+void releaseCacheEntry(struct cacheEntry *entry);
+// Add an object file to the cache. Returns false if it couldn't be written,
+// which isn't an error for the compile.
+int storeCompileCache(struct compileCache *cache, char *key, unsigned char *bytes, int size);
+
+// Put the totals from the stats file, with this process's counts that aren't
+// in it yet, in *stats.
+void getCacheTotals(struct compileCache *cache, struct cacheStats *stats);
+void printCacheStats(FILE *file, struct cacheStats *stats);
+
+char *setCacheError(char *message);
+char *getCacheError();
+
+#endif
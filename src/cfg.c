@@ -0,0 +1,297 @@
+#include "src/cfg.h"
+#include "src/generator.h"
+#include "src/fusion.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Algorithm outline:
+ * - Mark the leaders: the first instruction, every jmp/jpc target, and every
+ *   instruction after a jmp, jpc or return.
+ * - Each leader starts a basic block that runs up to the next leader.
+ * - A block falls through to the next block unless it ends with a jmp or a
+ *   return, and a block ending with a jmp/jpc also flows to the jump target.
+ * - Liveness is the usual backwards dataflow problem over frame variables:
+ *   liveIn = use + (liveOut - def), liveOut = union of successors' liveIn.
+ */
+
+int isJumpInstruction(struct instruction instruction) {
+    return instruction.opcode == JMP
+        || instruction.opcode == JPC;
+}
+
+int isReturnInstruction(struct instruction instruction) {
+    return instruction.opcode == OPR && instruction.modifier == RET;
+}
+
+int endsBlock(struct instruction instruction) {
+    return instruction.opcode == JMP || isReturnInstruction(instruction);
+}
+
+// Returns the number of frame slots that the liveness analysis has to track,
+// which is the larger of the space reserved with inc and the highest address
+// that is loaded from or stored to.
+int countVariables(struct vector *instructions) {
+    int reserved = 0;
+    int highest = 0;
+
+    forVector(instructions, i, struct instruction, instruction,
+        if (instruction.opcode == INC && instruction.modifier > 0)
+            reserved += instruction.modifier;
+        if ((instruction.opcode == LOD || instruction.opcode == STO)
+                && instruction.lexicalLevel == 0 && instruction.modifier + 1 > highest)
+            highest = instruction.modifier + 1;);
+
+    return (reserved > highest) ? reserved : highest;
+}
+
+void addEdge(struct controlFlowGraph *cfg, int from, int to) {
+    struct basicBlock *fromBlock = (struct basicBlock*)vector_get(cfg->blocks, from);
+    struct basicBlock *toBlock = (struct basicBlock*)vector_get(cfg->blocks, to);
+
+    // Don't add the same edge twice, e.g. for a jpc to the next instruction.
+    if (vector_find(fromBlock->successors, &to) >= 0)
+        return;
+
+    push(fromBlock->successors, to);
+    push(toBlock->predecessors, from);
+}
+
+struct controlFlowGraph *buildControlFlowGraph(struct vector *instructions) {
+    assert(instructions != NULL);
+
+    struct controlFlowGraph *cfg = make(struct controlFlowGraph);
+    int length = instructions->length;
+
+    cfg->instructions = instructions;
+    cfg->blocks = makeVector(struct basicBlock);
+    cfg->blockOf = (int*)malloc(sizeof(int) * (length + 1));
+    cfg->numVariables = countVariables(instructions);
+
+    // Find the leaders.
+    char *isLeader = (char*)calloc(length + 1, sizeof(char));
+    isLeader[0] = 1;
+    forVector(instructions, i, struct instruction, instruction,
+        if (isJumpInstruction(instruction)) {
+            // Jumps out of the code are exits, they don't start a block.
+            if (instruction.modifier >= 0 && instruction.modifier < length)
+                isLeader[instruction.modifier] = 1;
+            isLeader[i + 1] = 1;
+        } else if (isReturnInstruction(instruction)) {
+            isLeader[i + 1] = 1;
+        });
+
+    // Split the instructions into blocks.
+    int i;
+    for (i = 0; i < length; i++) {
+        if (isLeader[i]) {
+            struct basicBlock block = {i, i + 1, makeVector(int), makeVector(int),
+                NULL, NULL};
+            push(cfg->blocks, block);
+        } else {
+            struct basicBlock *block = (struct basicBlock*)vector_get(cfg->blocks,
+                    cfg->blocks->length - 1);
+            block->end = i + 1;
+        }
+        cfg->blockOf[i] = cfg->blocks->length - 1;
+    }
+    // Instruction index `length` is where code runs off the end, which belongs
+    // to no block.
+    cfg->blockOf[length] = -1;
+    free(isLeader);
+
+    // Connect the blocks.
+    int b;
+    for (b = 0; b < cfg->blocks->length; b++) {
+        struct basicBlock block = get(struct basicBlock, cfg->blocks, b);
+        struct instruction last = get(struct instruction, instructions, block.end - 1);
+
+        if (isJumpInstruction(last) && last.modifier >= 0 && last.modifier < length)
+            addEdge(cfg, b, cfg->blockOf[last.modifier]);
+        if (!endsBlock(last) && block.end < length)
+            addEdge(cfg, b, b + 1);
+    }
+
+    return cfg;
+}
+
+void computeLiveness(struct controlFlowGraph *cfg) {
+    int numBlocks = cfg->blocks->length;
+    int numVariables = cfg->numVariables;
+
+    // Use and def sets of each block, stored as rows of one big array.
+    char *use = (char*)calloc(numBlocks * numVariables + 1, sizeof(char));
+    char *def = (char*)calloc(numBlocks * numVariables + 1, sizeof(char));
+
+    int b, a, i;
+    for (b = 0; b < numBlocks; b++) {
+        struct basicBlock *block = (struct basicBlock*)vector_get(cfg->blocks, b);
+        char *blockUse = &use[b * numVariables];
+        char *blockDef = &def[b * numVariables];
+
+        for (i = block->start; i < block->end; i++) {
+            struct instruction instruction = get(struct instruction, cfg->instructions, i);
+            int address = instruction.modifier;
+            int isLocal = (instruction.lexicalLevel == 0
+                    && address >= 0 && address < numVariables);
+
+            if (instruction.opcode == LOD && isLocal) {
+                if (!blockDef[address])
+                    blockUse[address] = 1;
+            } else if (instruction.opcode == STO && isLocal) {
+                blockDef[address] = 1;
+            } else if (instruction.opcode == CAL) {
+                // A called procedure can read any variable of an enclosing
+                // frame, so assume that everything not yet written is used.
+                for (a = 0; a < numVariables; a++)
+                    if (!blockDef[a])
+                        blockUse[a] = 1;
+            }
+        }
+
+        free(block->liveIn);
+        free(block->liveOut);
+        block->liveIn = (char*)calloc(numVariables + 1, sizeof(char));
+        block->liveOut = (char*)calloc(numVariables + 1, sizeof(char));
+    }
+
+    // Iterate to a fixed point. Going through the blocks backwards makes this
+    // converge in a couple of passes for structured code.
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (b = numBlocks - 1; b >= 0; b--) {
+            struct basicBlock *block = (struct basicBlock*)vector_get(cfg->blocks, b);
+
+            forVector(block->successors, s, int, successor,
+                struct basicBlock *next = (struct basicBlock*)vector_get(cfg->blocks, successor);
+                for (a = 0; a < numVariables; a++)
+                    if (next->liveIn[a])
+                        block->liveOut[a] = 1;);
+
+            for (a = 0; a < numVariables; a++) {
+                char liveIn = use[b * numVariables + a]
+                    || (block->liveOut[a] && !def[b * numVariables + a]);
+                if (liveIn != block->liveIn[a]) {
+                    block->liveIn[a] = liveIn;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    free(use);
+    free(def);
+}
+
+int stackEffect(struct instruction instruction) {
+    // The rest of a fused instruction's sequence follows it, so it only
+    // counts as its first instruction.
+    instruction = unfuseInstruction(instruction);
+    int opcode = instruction.opcode;
+
+    if (opcode == LIT || opcode == LOD || opcode == READ)
+        return 1;
+    if (opcode == STO || opcode == JPC || opcode == SIO)
+        return -1;
+    if (opcode == INC)
+        return instruction.modifier;
+    if (opcode == OPR) {
+        // neg and odd replace the top of the stack, return doesn't matter
+        // because nothing runs after it, and the rest are binary operators.
+        int modifier = instruction.modifier;
+        return (modifier == RET || modifier == NEG || modifier == ODD) ? 0 : -1;
+    }
+
+    return 0;
+}
+
+int computeMaxStackDepth(struct vector *instructions) {
+    if (instructions->length == 0)
+        return 0;
+
+    struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+    int numBlocks = cfg->blocks->length;
+
+    // The stack height on entry to each block, or -1 if it hasn't been
+    // reached yet.
+    int *entryHeight = (int*)malloc(sizeof(int) * numBlocks);
+    int b;
+    for (b = 0; b < numBlocks; b++)
+        entryHeight[b] = -1;
+    entryHeight[0] = 0;
+
+    struct vector *worklist = makeVector(int);
+    pushLiteral(worklist, int, 0);
+    int maxDepth = 0;
+
+    while (worklist->length > 0) {
+        b = get(int, worklist, worklist->length - 1);
+        worklist->length -= 1;
+        struct basicBlock block = get(struct basicBlock, cfg->blocks, b);
+
+        int height = entryHeight[b];
+        int i;
+        for (i = block.start; i < block.end; i++) {
+            height += stackEffect(get(struct instruction, instructions, i));
+            if (height > maxDepth)
+                maxDepth = height;
+        }
+
+        forVector(block.successors, s, int, successor,
+            if (height > entryHeight[successor]) {
+                entryHeight[successor] = height;
+                push(worklist, successor);
+            });
+    }
+
+    free(entryHeight);
+    freeVector(worklist);
+    freeControlFlowGraph(cfg);
+
+    return maxDepth;
+}
+
+void freeControlFlowGraph(struct controlFlowGraph *cfg) {
+    forVector(cfg->blocks, b, struct basicBlock, block,
+        freeVector(block.successors);
+        freeVector(block.predecessors);
+        free(block.liveIn);
+        free(block.liveOut););
+    freeVector(cfg->blocks);
+    free(cfg->blockOf);
+    free(cfg);
+}
+
+void printControlFlowGraph(FILE *file, struct controlFlowGraph *cfg) {
+    fprintf(file, "digraph cfg {\n");
+    fprintf(file, "    node [shape=box, fontname=\"monospace\"];\n");
+
+    forVector(cfg->blocks, b, struct basicBlock, block,
+        fprintf(file, "    B%d [label=\"B%d\\l", b, b);
+
+        int i;
+        for (i = block.start; i < block.end; i++) {
+            struct instruction instruction = get(struct instruction, cfg->instructions, i);
+            fprintf(file, "%d: %s %d %d\\l", i, getOpcodeName(instruction.opcode),
+                    instruction.lexicalLevel, instruction.modifier);
+        }
+
+        // Show the live variables if computeLiveness has been run.
+        if (block.liveIn != NULL) {
+            int a;
+            fprintf(file, "live in:");
+            for (a = 0; a < cfg->numVariables; a++)
+                if (block.liveIn[a])
+                    fprintf(file, " %d", a);
+            fprintf(file, "\\l");
+        }
+        fprintf(file, "\"];\n");
+
+        forVector(block.successors, s, int, successor,
+            fprintf(file, "    B%d -> B%d;\n", b, successor););
+    );
+
+    fprintf(file, "}\n");
+}
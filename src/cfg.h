@@ -0,0 +1,54 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "src/generator.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+
+// A basic block is a run of instructions that can only be entered at its first
+// instruction and that only transfers control at its last instruction.
+struct basicBlock {
+    int start;   // Index of the first instruction in the block.
+    int end;     // Index one past the last instruction in the block.
+    struct vector *successors;     // Indices of the successor blocks (ints).
+    struct vector *predecessors;   // Indices of the predecessor blocks (ints).
+    // liveIn[a]/liveOut[a] are true if the frame variable at address a may be
+    // read before it is written again, on entry to/exit from the block. Only
+    // filled in by computeLiveness.
+    char *liveIn;
+    char *liveOut;
+};
+
+// The control flow graph of a flat vector of VM instructions. Block 0 is
+// always the entry block.
+struct controlFlowGraph {
+    struct vector *instructions;
+    struct vector *blocks;   // The basic blocks, in instruction order.
+    int *blockOf;            // Maps an instruction index to its block index.
+    int numVariables;        // Number of frame slots tracked by liveness.
+};
+
+// Split the instructions into basic blocks at jmp/jpc targets and after every
+// jmp, jpc and return, and connect the blocks.
+struct controlFlowGraph *buildControlFlowGraph(struct vector *instructions);
+// Fill in liveIn/liveOut for every block of the graph.
+void computeLiveness(struct controlFlowGraph *cfg);
+void freeControlFlowGraph(struct controlFlowGraph *cfg);
+
+// Returns the largest number of stack slots (frame variables included) that
+// the instructions use on any path through the program. If paths meet with
+// different stack heights, the larger one is used.
+int computeMaxStackDepth(struct vector *instructions);
+// Returns how much the instruction changes the height of the stack.
+int stackEffect(struct instruction instruction);
+
+// Print the graph in Graphviz DOT format, for inspection with `dot -Tpng`.
+void printControlFlowGraph(FILE *file, struct controlFlowGraph *cfg);
+
+// Instruction classification helpers shared by the analyses and passes.
+int isJumpInstruction(struct instruction instruction);
+int isReturnInstruction(struct instruction instruction);
+// True if the instruction never falls through to the next one.
+int endsBlock(struct instruction instruction);
+
+#endif
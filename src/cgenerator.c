@@ -0,0 +1,213 @@
+#include "src/cgenerator.h"
+#include "src/parser.h"
+#include "src/lib/util.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+// Functions that every generated program starts with. The arithmetic is done
+// on unsigned ints so that overflow wraps around like it does in the VM
+// instead of being undefined behavior.
+static const char *C_RUNTIME =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "static int add(int a, int b) { return (int)((unsigned)a + (unsigned)b); }\n"
+    "static int subtract(int a, int b) { return (int)((unsigned)a - (unsigned)b); }\n"
+    "static int multiply(int a, int b) { return (int)((unsigned)a * (unsigned)b); }\n"
+    "static int negate(int a) { return (int)-(unsigned)a; }\n"
+    "\n"
+    "static int divide(int a, int b) {\n"
+    "    if (b == 0) {\n"
+    "        fflush(stdout);\n"
+    "        fprintf(stderr, \"Division by zero.\\n\");\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    return (b == -1) ? negate(a) : a / b;\n"
+    "}\n"
+    "\n"
+    "static int readNumber(void) {\n"
+    "    int number;\n"
+    "    if (scanf(\"%d\", &number) != 1)\n"
+    "        number = 0;\n"
+    "    return number;\n"
+    "}\n"
+    "\n"
+    "static void writeNumber(int number) {\n"
+    "    printf(\"%d\\n\", number);\n"
+    "}\n"
+    "\n";
+
+char *generateC(struct parseTree tree) {
+    clearGeneratorErrors();
+
+    if (isParseTreeError(tree))
+        return NULL;
+    assert(strcmp(tree.name, "program") == 0 && hasChild(tree, "block"));
+    struct parseTree block = getChild(tree, "block");
+
+    char *source;
+    size_t size;
+    FILE *output = open_memstream(&source, &size);
+    struct generatorState *state = makeGeneratorState();
+
+    fputs(C_RUNTIME, output);
+    fprintf(output, "int main(void) {\n");
+    generateCDeclarations(output, block, state);
+    generateCStatement(output, getChild(block, "statement"), state, 1);
+    fprintf(output, "    return 0;\n");
+    fprintf(output, "}\n");
+
+    fclose(output);
+    return source;
+}
+
+void generateCDeclarations(FILE *output, struct parseTree block,
+        struct generatorState *state) {
+    // Walk the right-recursive lists of declarations.
+    struct parseTree vars = getChild(getChild(block, "var-declaration"), "vars");
+    while (!isParseTreeError(vars)) {
+        struct parseTree identifier = getChild(getChild(vars, "var"), "identifier");
+        addVariable(state, identifier);
+        fprintf(output, "    int %s = 0;\n", cVariableName(getToken(identifier)));
+
+        vars = getChild(vars, "vars");
+    }
+
+    struct parseTree constants = getChild(getChild(block, "const-declaration"), "constants");
+    while (!isParseTreeError(constants)) {
+        struct parseTree constant = getChild(constants, "constant");
+        addConstant(state, getChild(constant, "identifier"), getChild(constant, "number"));
+
+        constants = getChild(constants, "constants");
+    }
+
+    fprintf(output, "\n");
+}
+
+void generateCStatement(FILE *output, struct parseTree tree,
+        struct generatorState *state, int indentation) {
+    if (isParseTreeError(tree))
+        return;
+
+    void line(char *text) {
+        fprintf(output, "%*s%s\n", indentation * 4, "", text);
+    }
+    int is(char *name) {
+        return (strcmp(tree.name, name) == 0);
+    }
+
+    // A variable that can be stored into, or NULL after adding an error.
+    char *storeTarget(struct parseTree identifier) {
+        struct symbol symbol = getSymbol(state, getToken(identifier));
+        if (symbol.type == PROCEDURE || symbol.type == CONSTANT)
+            addGeneratorError("Cannot store into a constant or procedure.");
+        if (symbol.type != VARIABLE)
+            return NULL;
+        return cVariableName(symbol.name);
+    }
+
+    if (is("statement")) {
+        // An empty statement has no children.
+        generateCStatement(output, getFirstChild(tree), state, indentation);
+    } else if (is("begin-block")) {
+        generateCStatement(output, getChild(tree, "statements"), state, indentation);
+    } else if (is("statements")) {
+        generateCStatement(output, getChild(tree, "statement"), state, indentation);
+        generateCStatement(output, getChild(tree, "statements"), state, indentation);
+    } else if (is("assignment")) {
+        char *value = generateCExpression(getChild(tree, "expression"), state);
+        char *variable = storeTarget(getChild(tree, "identifier"));
+        if (variable != NULL)
+            line(format("%s = %s;", variable, value));
+    } else if (is("read-statement")) {
+        char *variable = storeTarget(getChild(tree, "identifier"));
+        if (variable != NULL)
+            line(format("%s = readNumber();", variable));
+    } else if (is("write-statement")) {
+        line(format("writeNumber(%s);",
+                    generateCExpression(getChild(tree, "identifier"), state)));
+    } else if (is("if-statement") || is("while-statement")) {
+        line(format("%s (%s) {", is("if-statement") ? "if" : "while",
+                    generateCExpression(getChild(tree, "condition"), state)));
+        generateCStatement(output, getChild(tree, "statement"), state, indentation + 1);
+        line("}");
+    } else {
+        assert(0 /* Expected a statement. */);
+    }
+}
+
+char *generateCExpression(struct parseTree tree, struct generatorState *state) {
+    // The operands are evaluated in whatever order the C compiler likes, which
+    // is fine since the only side effect an expression can have is to divide
+    // by zero.
+    char *binary(char *function, struct parseTree left, struct parseTree right) {
+        return format("%s(%s, %s)", function, generateCExpression(left, state),
+                generateCExpression(right, state));
+    }
+    int is(char *name) {
+        return (strcmp(tree.name, name) == 0);
+    }
+
+    if (is("expression") && hasChild(tree, "add-or-subtract")) {
+        int isAdd = isOperator(getChild(tree, "add-or-subtract"), "+");
+        return binary(isAdd ? "add" : "subtract",
+                getChild(tree, "term"), getChild(tree, "expression"));
+    } else if (is("expression")) {
+        return generateCExpression(getChild(tree, "term"), state);
+    } else if (is("term") && hasChild(tree, "multiply-or-divide")) {
+        int isMultiply = isOperator(getChild(tree, "multiply-or-divide"), "*");
+        return binary(isMultiply ? "multiply" : "divide",
+                getChild(tree, "factor"), getChild(tree, "term"));
+    } else if (is("term")) {
+        return generateCExpression(getChild(tree, "factor"), state);
+    } else if (is("factor") && hasChild(tree, "number")) {
+        // Print the number with %d, since a leading 0 would make C read it as
+        // octal.
+        char *number = getToken(getChild(tree, "number"));
+        assert(isInteger(number));
+        int value = atoi(number);
+
+        struct parseTree sign = getChild(tree, "sign");
+        if (!isParseTreeError(sign) && isOperator(sign, "-"))
+            value = -value;
+        return format("%d", value);
+    } else if (is("factor")) {
+        // The operators are function calls, so a parenthesized expression
+        // doesn't need parentheses in C.
+        if (hasChild(tree, "expression"))
+            return generateCExpression(getChild(tree, "expression"), state);
+        return generateCExpression(getChild(tree, "identifier"), state);
+    } else if (is("identifier")) {
+        struct symbol symbol = getSymbol(state, getToken(tree));
+        if (symbol.type == PROCEDURE)
+            addGeneratorError("Cannot take value of procedure.");
+        else if (symbol.type == VARIABLE)
+            return cVariableName(symbol.name);
+        else if (symbol.type == CONSTANT)
+            return format("%d", symbol.constantValue);
+        return "0";
+    } else if (is("condition") && hasChild(tree, "odd")) {
+        return format("%s %% 2 != 0",
+                generateCExpression(getChild(tree, "expression"), state));
+    } else if (is("condition")) {
+        char *operator = getToken(getChild(tree, "rel-op"));
+        if (strcmp(operator, "=") == 0)
+            operator = "==";
+        else if (strcmp(operator, "<>") == 0)
+            operator = "!=";
+
+        return format("%s %s %s",
+                generateCExpression(getChild(tree, "expression"), state),
+                operator,
+                generateCExpression(getLastChild(tree, "expression"), state));
+    }
+
+    assert(0 /* Expected an expression, term, factor or condition. */);
+    return NULL;
+}
+
+char *cVariableName(char *name) {
+    return format("pl0_%s", name);
+}
@@ -0,0 +1,38 @@
+#ifndef CGENERATOR_H
+#define CGENERATOR_H
+
+#include "src/parser.h"
+#include "src/generator.h"
+#include <stdio.h>
+
+// A second backend that translates a program into a standalone C translation
+// unit instead of VM instructions, so that it can be built into a native
+// binary with a C compiler. It uses the same parse tree and symbol table as
+// the code generator, and reports errors with addGeneratorError.
+//
+// The C code behaves like the VM: arithmetic wraps around on overflow,
+// dividing by zero prints "Division by zero." to stderr and exits with status
+// 1, write prints a number per line and read gives 0 when there is no number
+// to read. The only difference is that there is no stack limit.
+
+// Returns the C source code for a whole program, or NULL if the tree is
+// invalid. Check generatorHasErrors() afterwards, like with
+// generateInstructions.
+char *generateC(struct parseTree tree);
+
+// Write the C code for a statement tree, indented by the given number of
+// levels.
+void generateCStatement(FILE *output, struct parseTree tree,
+        struct generatorState *state, int indentation);
+// Add the variables and constants of a block to the symbol table, writing a
+// declaration for each variable.
+void generateCDeclarations(FILE *output, struct parseTree block,
+        struct generatorState *state);
+// Returns a C expression for an expression, term, factor or condition tree.
+char *generateCExpression(struct parseTree tree, struct generatorState *state);
+
+// Returns the C name of a PL/0 variable. Every name gets a prefix so that
+// variables can't clash with C keywords or the runtime functions.
+char *cVariableName(char *name);
+
+#endif
@@ -0,0 +1,106 @@
+#include "src/compile.h"
+#include "src/lexer.h"
+#include "src/generator.h"
+#include "src/optimizer.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct vector *compileWithDiagnostics(char *source, regex_t *tokenRegexes,
+        struct grammar grammar, int options, struct vector **lines,
+        struct vector *diagnostics) {
+    struct vector *lexemes = (tokenRegexes != NULL)
+        ? readLexemesWith(tokenRegexes, source) : readLexemes(source);
+    struct parseTree tree = parseProgram(lexemes, grammar);
+    int errorIndex;
+    char *parseError = getFurthestParseError(&errorIndex);
+    struct vector *instructions = NULL;
+    *lines = NULL;
+
+    if (isParseTreeError(tree)) {
+        // The error tree only has the rules that failed outright, so report
+        // the failure that got the furthest instead.
+        struct diagnostic diagnostic = {PARSER_DIAGNOSTIC, 0, 0,
+            strdup((parseError != NULL) ? parseError : tree.name)};
+        if (parseError != NULL && errorIndex < lexemes->length) {
+            struct lexeme lexeme = get(struct lexeme, lexemes, errorIndex);
+            diagnostic.line = lexeme.line;
+            diagnostic.column = lexeme.column;
+        }
+        push(diagnostics, diagnostic);
+    } else {
+        instructions = generateInstructionsWithLines(tree, lines);
+        struct vector *errors = getGeneratorErrors();
+        if (errors != NULL) {
+            forVector(errors, i, struct generatorError, error,
+                pushLiteral(diagnostics, struct diagnostic,
+                    {GENERATOR_DIAGNOSTIC, error.line, error.column, strdup(error.message)}););
+            clearGeneratorErrors();
+            if (instructions != NULL)
+                freeVector(instructions);
+            freeVector(*lines);
+            instructions = NULL;
+            *lines = NULL;
+        }
+    }
+
+    clearFurthestParseError();
+
+    if (instructions != NULL && (options & COMPILE_OPTIMIZE)) {
+        struct vector *optimized = optimizeInstructionsWithLines(instructions, lines);
+        if (optimized != instructions)
+            freeVector(instructions);
+        instructions = optimized;
+    }
+    if (instructions != NULL && (options & COMPILE_FUSE)) {
+        struct vector *fused = fuseInstructions(instructions);
+        freeVector(instructions);
+        instructions = fused;
+    }
+
+    if (isParseTreeError(tree))
+        freeFailedParseTree(tree);
+    else
+        freeParseTreeVectors(tree);
+    forVector(lexemes, i, struct lexeme, lexeme,
+        free(lexeme.token););
+    freeVector(lexemes);
+    return instructions;
+}
+
+struct vector *compileSource(char *source, struct grammar grammar, int options,
+        struct vector **lines, char **error) {
+    struct vector *diagnostics = makeVector(struct diagnostic);
+    struct vector *instructions = compileWithDiagnostics(source, NULL, grammar, options, lines,
+            diagnostics);
+    *error = NULL;
+
+    // A parse error is on its own, and generator errors go one per line.
+    forVector(diagnostics, i, struct diagnostic, diagnostic,
+        char *message;
+        if (diagnostic.phase == PARSER_DIAGNOSTIC && diagnostic.line > 0)
+            message = format("Error while parsing program at line %d, column %d: %s",
+                    diagnostic.line, diagnostic.column, diagnostic.message);
+        else if (diagnostic.phase == PARSER_DIAGNOSTIC)
+            message = format("Error while parsing program: %s", diagnostic.message);
+        else if (diagnostic.line > 0)
+            message = format("%s\nLine %d, column %d: %s",
+                    (*error != NULL) ? *error : "The generator encountered errors:",
+                    diagnostic.line, diagnostic.column, diagnostic.message);
+        else
+            message = format("%s\n%s",
+                    (*error != NULL) ? *error : "The generator encountered errors:",
+                    diagnostic.message);
+        free(*error);
+        *error = message;);
+
+    freeDiagnostics(diagnostics);
+    return instructions;
+}
+
+void freeDiagnostics(struct vector *diagnostics) {
+    forVector(diagnostics, i, struct diagnostic, diagnostic,
+        free(diagnostic.message););
+    freeVector(diagnostics);
+}
@@ -0,0 +1,48 @@
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include "src/parser.h"
+#include "src/lib/vector.h"
+#include <regex.h>
+
+// The whole pipeline from PL/0 source code to VM instructions, for the
+// programs that compile many sources: the lexer, the parser, the generator,
+// and optionally the optimizer and fusion. Everything it keeps between the
+// phases is per thread (see the errors in parser.h and generator.h), so
+// threads can compile at the same time with a shared grammar.
+
+// Options for compileSource.
+enum { COMPILE_OPTIMIZE = 1, COMPILE_FUSE = 2 };
+
+// The version of the code that the compiler generates, which is part of the
+// keys of the compile cache (see cache.h). Change it whenever the compiler
+// generates different code for the same source code and options, or cached
+// object files from before the change would still be used.
+#define COMPILER_VERSION 1
+
+// What found an error.
+enum { PARSER_DIAGNOSTIC = 1, GENERATOR_DIAGNOSTIC };
+
+// An error in the source code.
+struct diagnostic {
+    int phase;          // PARSER_DIAGNOSTIC or GENERATOR_DIAGNOSTIC.
+    int line, column;   // Where it is, or a line of 0 if that isn't known,
+                        // e.g. at the end of the file.
+    char *message;
+};
+
+// Compile the source code with the grammar from PL0Grammar. Returns the
+// instructions and puts their line table in *lines, or returns NULL and puts
+// an error message, which has to be freed, in *error.
+struct vector *compileSource(char *source, struct grammar grammar, int options,
+        struct vector **lines, char **error);
+// Like compileSource, but lexes with the given regexes (see lexer.h), or the
+// thread's if they're NULL, and adds a struct diagnostic for each error to
+// the diagnostics instead of making a message.
+struct vector *compileWithDiagnostics(char *source, regex_t *tokenRegexes,
+        struct grammar grammar, int options, struct vector **lines,
+        struct vector *diagnostics);
+// Free the diagnostics' messages and the vector.
+void freeDiagnostics(struct vector *diagnostics);
+
+#endif
@@ -1,42 +1,157 @@
 #include "src/lexer.h"
 #include "src/parser.h"
+#include "src/grammar.h"
 #include "src/generator.h"
+#include "src/cgenerator.h"
+#include "src/asmgenerator.h"
+#include "src/optimizer.h"
+#include "src/cfg.h"
+#include "src/object.h"
+#include "src/compile.h"
+#include "src/batch.h"
+#include "src/cache.h"
+#include "src/stats.h"
+#include "src/fusion.h"
+#include "src/vm/vm.h"
 #include "src/lib/vector.h"
+#include "src/lib/util.h"
 #include "test/lib/parser.h"
 #include "test/lib/generator.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Command line options. Arguments that start with "-" are flags, the others
+// are the source code filename followed by the verbosity level, or with
+// --batch the files, directories and file lists to compile.
+struct compilerOptions {
+    char *filename;
+    int verbose;
+    int optimize;   // Run the optimizer on the generated instructions.
+    int dumpCfg;    // Print the control flow graph instead of the code.
+    int text;       // Print the code as text instead of as an object file.
+    int backend;    // What to generate, VM_BACKEND by default.
+    int run;        // Run the code in this process instead of printing it.
+    int fuse;       // Use fused opcodes in object files and with --run.
+    int batch;      // Compile many files to object files.
+    struct vector *batchInputs;   // The arguments that aren't flags.
+    int numThreads;           // For --batch, one per processor by default.
+    char *outputDirectory;    // For --batch, or NULL to write next to the inputs.
+    char *cacheDirectory;     // The compile cache, or NULL to not use one.
+    long long cacheSize;      // Its size limit in bytes.
+    int cacheStats;           // Print the cache's stats instead of compiling.
+    int stats;                // Print what each phase cost, as TEXT_STATS or
+                              // JSON_STATS, or 0 to not.
+};
+
+enum { TEXT_STATS = 1, JSON_STATS };
+
+// The cache's size limit if there's no --cache-size.
+#define DEFAULT_CACHE_MEGABYTES 256
+
+enum { VM_BACKEND, C_BACKEND, ASM_BACKEND };
 
-struct grammar PL0Grammar();
 char *readContents(char *filename);
+int parseOptions(int argc, char **argv, struct compilerOptions *options);
+void printUsage(char *programName);
+int runInstructions(struct vector *instructions, struct vector *lines);
+int runBatch(struct compilerOptions *options, struct compileCache *cache);
+int compileOptionsFor(struct compilerOptions *options);
+int compileFile(struct compilerOptions options, struct compileCache *cache,
+        struct vector *phases);
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        assert(argc >= 1);
-        printf("Usage: %s <PL/0 source code filename> [<verbosity level>]\n", argv[0]);
+    struct compilerOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
         return 1;
     }
 
-    int verbose = 0;
-    if (argc >= 3)
-        verbose = atoi(argv[2]);
+    struct compileCache *cache = NULL;
+    if (options.cacheDirectory != NULL) {
+        cache = openCompileCache(options.cacheDirectory, options.cacheSize);
+        if (cache == NULL) {
+            fprintf(stderr, "%s\n", getCacheError());
+            return 1;
+        }
+    }
+    if (options.cacheStats) {
+        struct cacheStats totals;
+        getCacheTotals(cache, &totals);
+        printCacheStats(stdout, &totals);
+        closeCompileCache(cache);
+        return 0;
+    }
+    if (options.batch) {
+        int status = runBatch(&options, cache);
+        if (cache != NULL)
+            closeCompileCache(cache);
+        return status;
+    }
+
+    // The cache stays open for the whole compile, and is closed whether it
+    // compiled or not, so that a miss is counted either way.
+    struct vector *phases = makeVector(struct phaseStats);
+    int status = compileFile(options, cache, phases);
+    if (cache != NULL)
+        closeCompileCache(cache);
+    if (options.stats)
+        printPhaseStats(stderr, phases, options.stats == JSON_STATS);
+    return status;
+}
+
+// Compile the source code file and print or run the code, recording what
+// each phase cost in the phases. Object files are looked up in and added to
+// the cache, if there is one, which the caller closes. Returns the exit
+// status.
+int compileFile(struct compilerOptions options, struct compileCache *cache,
+        struct vector *phases) {
+    int verbose = options.verbose;
 
     // Initialize compiler.
     initLexer();
     struct grammar grammar = PL0Grammar();
 
     // Read in source code.
-    char *sourceCode = readContents(argv[1]);
+    struct phaseTimer timer = startPhase();
+    char *sourceCode = readContents(options.filename);
     assert(sourceCode != NULL);
-
+    endPhase(phases, timer, "readContents", "bytes", strlen(sourceCode));
+
+    // Only plain object files are cached, and a hit is written out without
+    // compiling anything.
+    int cacheObjectFile = (cache != NULL && verbose == 0 && options.backend == VM_BACKEND
+            && !options.run && !options.dumpCfg && !options.text);
+    char cacheKey[CACHE_KEY_SIZE];
+    if (cacheObjectFile) {
+        struct cacheEntry entry;
+        timer = startPhase();
+        makeCacheKey(sourceCode, strlen(sourceCode), compileOptionsFor(&options), cacheKey);
+        int hit = lookupCompileCache(cache, cacheKey, &entry);
+        endPhase(phases, timer, "lookupCompileCache", "bytes", hit ? entry.size : 0);
+        if (hit) {
+            int written = (fwrite(entry.bytes, 1, entry.size, stdout) == entry.size
+                    && fflush(stdout) == 0);
+            releaseCacheEntry(&entry);
+            if (!written) {
+                fprintf(stderr, "Could not write the object file.\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
     // Print source code.
     if (verbose >= 2)
         printf("Source code:\n%s\n", sourceCode);
 
     // Read tokens.
+    timer = startPhase();
     struct vector *lexemes = readLexemes(sourceCode);
     assert(lexemes != NULL);
+    endPhase(phases, timer, "readLexemes", "tokens", lexemes->length);
 
     // Print tokens.
     if (verbose >= 3) {
@@ -54,7 +169,9 @@ int main(int argc, char **argv) {
     }
 
     // Parse tokens.
+    timer = startPhase();
     struct parseTree tree = parseProgram(lexemes, grammar);
+    endPhase(phases, timer, "parseProgram", "nodes", countParseTreeNodes(tree));
     if (isParseTreeError(tree)) {
         printf("Error while parsing program. This is what the parser was able to parse:\n");
         printParseTree(tree);
@@ -72,8 +189,30 @@ int main(int argc, char **argv) {
         printf("\n");
     }
 
-    // Generate code.
-    struct vector *instructions = generateInstructions(tree);
+    // Translate the program to C or assembly instead of generating VM code if
+    // asked to.
+    if (options.backend != VM_BACKEND) {
+        timer = startPhase();
+        char *source = (options.backend == C_BACKEND) ? generateC(tree) : generateAsm(tree);
+        endPhase(phases, timer, (options.backend == C_BACKEND) ? "generateC" : "generateAsm",
+                "bytes", strlen(source));
+        if (generatorHasErrors()) {
+            printf("The generator encountered errors:\n");
+            printGeneratorErrors();
+            return 1;
+        }
+
+        fputs(source, stdout);
+        return 0;
+    }
+
+    // Generate code, along with the line table that maps it back to the
+    // source code.
+    struct vector *lines;
+    timer = startPhase();
+    struct vector *instructions = generateInstructionsWithLines(tree, &lines);
+    endPhase(phases, timer, "generateInstructions", "instructions",
+            (instructions != NULL) ? instructions->length : 0);
     if (generatorHasErrors()) {
         printf("The generator encountered errors:\n");
         printGeneratorErrors();
@@ -84,112 +223,226 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Print generated code.
+    // Optimize generated code.
     assert(instructions != NULL);
+    if (options.optimize) {
+        timer = startPhase();
+        instructions = optimizeInstructionsWithLines(instructions, &lines);
+        endPhase(phases, timer, "optimizeInstructions", "instructions", instructions->length);
+    }
+
+    // Hand the code straight to the VM, without writing an object file and
+    // starting pl0vm.
+    if (options.run)
+        return runInstructions(options.fuse ? fuseInstructions(instructions) : instructions,
+                lines);
+
+    // Print the control flow graph instead of the code if asked to.
+    if (options.dumpCfg) {
+        struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+        computeLiveness(cfg);
+        printControlFlowGraph(stdout, cfg);
+        freeControlFlowGraph(cfg);
+        return 0;
+    }
+
+    // Print generated code.
     if (verbose >= 1) {
+        printf("Maximum stack depth: %d\n\n", computeMaxStackDepth(instructions));
         printf("Generated instructions:\n");
         // Print code with nice opcode names.
         printInstructions(instructions);
-    } else {
-        // Print code suitable for the VM.
+    } else if (options.text) {
+        // Print code in the text format of the VM.
         forVector(instructions, i, struct instruction, instruction,
                 printf("%d %d %d\n",
                     instruction.opcode,
                     instruction.lexicalLevel,
                     instruction.modifier););
+    } else {
+        // Write an object file for the VM. The text format stays basic, since
+        // the old vm reads it too.
+        if (options.fuse) {
+            timer = startPhase();
+            instructions = fuseInstructions(instructions);
+            endPhase(phases, timer, "fuseInstructions", "instructions", instructions->length);
+        }
+        int size;
+        timer = startPhase();
+        unsigned char *bytes = encodeObjectFile(instructions, lines, &size);
+        int written = (fwrite(bytes, 1, size, stdout) == size && fflush(stdout) == 0);
+        endPhase(phases, timer, "writeObjectFile", "bytes", size);
+        if (!written) {
+            fprintf(stderr, "Could not write the object file.\n");
+            return 1;
+        }
+        if (cacheObjectFile)
+            storeCompileCache(cache, cacheKey, bytes, size);
+        free(bytes);
     }
 
     return 0;
 }
 
-struct grammar PL0Grammar() {
-    // Define full PL/0 grammar
-    struct grammar grammar = (struct grammar){makeVector(struct rule)};
-    addRule(grammar, "program", "block periodsym");
-
-    addRule(grammar, "block", "const-declaration var-declaration statement");
-
-    addRule(grammar, "const-declaration", "constsym constants semicolonsym");
-    addRule(grammar, "const-declaration", "nothing");
-    addRule(grammar, "constants", "constant commasym constants");
-    addRule(grammar, "constants", "constant");
-    addRule(grammar, "constant", "identifier eqsym number");
-
-    addRule(grammar, "var-declaration", "intsym vars semicolonsym");
-    addRule(grammar, "var-declaration", "nothing");
-    addRule(grammar, "vars", "var commasym vars");
-    addRule(grammar, "vars", "var");
-    addRule(grammar, "var", "identifier");
-
-    addRule(grammar, "statement", "read-statement");
-    addRule(grammar, "statement", "write-statement");
-    addRule(grammar, "statement", "assignment");
-    addRule(grammar, "statement", "if-statement");
-    addRule(grammar, "statement", "while-statement");
-    addRule(grammar, "statement", "begin-block");
-    addRule(grammar, "statement", "nothing");
-
-    addRule(grammar, "assignment", "identifier becomessym expression");
-
-    addRule(grammar, "begin-block", "beginsym statements endsym");
-    addRule(grammar, "statements", "statement semicolonsym statements");
-    addRule(grammar, "statements", "statement");
-
-    addRule(grammar, "if-statement", "ifsym condition thensym statement");
-    addRule(grammar, "condition", "expression rel-op expression");
-    addRule(grammar, "condition", "oddsym expression");
-    addRule(grammar, "rel-op", "eqsym");
-    addRule(grammar, "rel-op", "neqsym");
-    addRule(grammar, "rel-op", "lessym");
-    addRule(grammar, "rel-op", "leqsym");
-    addRule(grammar, "rel-op", "gtrsym");
-    addRule(grammar, "rel-op", "geqsym");
-
-    // This is the grammar for expressions included in the assignment.
-    /*addRule(grammar, "expression", "sign term add-or-substract term");
-    addRule(grammar, "expression", "sign term");
-    addRule(grammar, "sign", "plussym");
-    addRule(grammar, "sign", "minussym");
-    addRule(grammar, "sign", "nothing");
-    addRule(grammar, "add-or-substract", "plussym");
-    addRule(grammar, "add-or-substract", "minussym");
-    addRule(grammar, "term", "factor multiply-or-divide factor");
-    addRule(grammar, "term", "factor");
-    addRule(grammar, "multiply-or-divide", "multsym");
-    addRule(grammar, "multiply-or-divide", "slashsym");
-    addRule(grammar, "factor", "lparentsym expression rparentsym");
-    addRule(grammar, "factor", "identifier");
-    addRule(grammar, "factor", "number");*/
-
-    // This is an improved grammar for expressions that behaves more like you
-    // would intuitively expeted expressions to behave. For example, 1 + 2 + 3
-    // is not a valid expression in the other grammar, you would have to do
-    // something like 1 + (2 + 3) instead, but it works with this grammar.
-    addRule(grammar, "expression", "term add-or-subtract expression");
-    addRule(grammar, "expression", "term");
-    addRule(grammar, "add-or-subtract", "plussym");
-    addRule(grammar, "add-or-subtract", "minussym");
-    addRule(grammar, "term", "factor multiply-or-divide term");
-    addRule(grammar, "term", "factor");
-    addRule(grammar, "multiply-or-divide", "multsym");
-    addRule(grammar, "multiply-or-divide", "slashsym");
-    addRule(grammar, "factor", "lparentsym expression rparentsym");
-    addRule(grammar, "factor", "sign number");
-    addRule(grammar, "factor", "identifier");
-    addRule(grammar, "sign", "plussym");
-    addRule(grammar, "sign", "minussym");
-    addRule(grammar, "sign", "nothing");
-    addRule(grammar, "number", "numbersym");
-
-    addRule(grammar, "while-statement", "whilesym condition dosym statement");
-
-    addRule(grammar, "read-statement", "readsym identifier");
-    addRule(grammar, "write-statement", "writesym identifier");
-
-    addRule(grammar, "identifier", "identsym");
-    addRule(grammar, "number", "numbersym");
-
-    return grammar;
+// The options for compileSource and the compile cache.
+int compileOptionsFor(struct compilerOptions *options) {
+    return (options->optimize ? COMPILE_OPTIMIZE : 0) | (options->fuse ? COMPILE_FUSE : 0);
+}
+
+// Run the code like pl0vm runs an object file, returning the exit status.
+int runInstructions(struct vector *instructions, struct vector *lines) {
+    int requiredStackSize = computeMaxStackDepth(instructions);
+    struct vm *vm = makeVM(instructions, (requiredStackSize > DEFAULT_STACK_SIZE)
+            ? requiredStackSize : DEFAULT_STACK_SIZE);
+
+    int succeeded = runVM(vm);
+    fflush(stdout);
+    if (!succeeded)
+        printVMError(stderr, vm, lines);
+
+    freeVM(vm);
+    return succeeded ? 0 : 1;
+}
+
+// Compile every file that the batch inputs name, printing the errors and the
+// throughput, and return the exit status.
+int runBatch(struct compilerOptions *options, struct compileCache *cache) {
+    struct vector *files = makeVector(struct batchFile);
+    forVector(options->batchInputs, i, char*, input,
+        if (!addBatchInputs(files, input, options->outputDirectory)) {
+            fprintf(stderr, "%s\n", getBatchError());
+            return 1;
+        });
+    if (!checkBatchOutputs(files)) {
+        fprintf(stderr, "%s\n", getBatchError());
+        return 1;
+    }
+
+    struct batchStats stats;
+    int succeeded = compileBatch(files, compileOptionsFor(options), cache,
+            options->numThreads, &stats);
+    forVector(files, i, struct batchFile, file,
+        if (file.error != NULL)
+            fprintf(stderr, "%s: %s\n", file.inputPath, file.error););
+    printBatchStats(stderr, &stats);
+    if (cache != NULL)
+        printCacheStats(stderr, &cache->stats);
+
+    freeBatchFiles(files);
+    return succeeded ? 0 : 1;
+}
+
+int parseOptions(int argc, char **argv, struct compilerOptions *options) {
+    *options = (struct compilerOptions){NULL, 0, 0, 0, 0, 0, 0, 1, 0, makeVector(char*),
+        sysconf(_SC_NPROCESSORS_ONLN), NULL, NULL, DEFAULT_CACHE_MEGABYTES * 1000000LL, 0, 0};
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (strcmp(argument, "-O") == 0 || strcmp(argument, "--optimize") == 0) {
+            options->optimize = 1;
+        } else if (strcmp(argument, "--dump-cfg") == 0) {
+            options->dumpCfg = 1;
+        } else if (strcmp(argument, "--text") == 0) {
+            options->text = 1;
+        } else if (strcmp(argument, "--run") == 0) {
+            options->run = 1;
+        } else if (strcmp(argument, "--no-fuse") == 0) {
+            options->fuse = 0;
+        } else if (strcmp(argument, "--backend=vm") == 0) {
+            options->backend = VM_BACKEND;
+        } else if (strcmp(argument, "--backend=c") == 0) {
+            options->backend = C_BACKEND;
+        } else if (strcmp(argument, "--backend=asm") == 0) {
+            options->backend = ASM_BACKEND;
+        } else if (strcmp(argument, "--batch") == 0) {
+            options->batch = 1;
+        } else if (strcmp(argument, "--threads") == 0 && i + 1 < argc) {
+            options->numThreads = atoi(argv[++i]);
+            if (options->numThreads <= 0)
+                return 0;
+        } else if (strcmp(argument, "--output-dir") == 0 && i + 1 < argc) {
+            options->outputDirectory = argv[++i];
+        } else if (strcmp(argument, "--cache") == 0 && i + 1 < argc) {
+            options->cacheDirectory = argv[++i];
+        } else if (strcmp(argument, "--cache-size") == 0 && i + 1 < argc) {
+            if (!isInteger(argv[++i]) || atoll(argv[i]) < 0)
+                return 0;
+            options->cacheSize = atoll(argv[i]) * 1000000LL;
+        } else if (strcmp(argument, "--cache-stats") == 0) {
+            options->cacheStats = 1;
+        } else if (strcmp(argument, "--stats") == 0 || strcmp(argument, "--stats=text") == 0) {
+            options->stats = TEXT_STATS;
+        } else if (strcmp(argument, "--stats=json") == 0) {
+            options->stats = JSON_STATS;
+        } else if (argument[0] == '-') {
+            return 0;
+        } else {
+            push(options->batchInputs, argument);
+        }
+    }
+
+    if (options->cacheStats)
+        return (options->cacheDirectory != NULL && options->batchInputs->length == 0);
+
+    // --batch compiles every file, and only to object files.
+    if (options->batch)
+        return (options->batchInputs->length > 0 && options->numThreads > 0
+                && options->backend == VM_BACKEND && !options->run && !options->dumpCfg
+                && !options->text);
+    if (options->batchInputs->length > 2)
+        return 0;
+    if (options->batchInputs->length >= 1)
+        options->filename = get(char*, options->batchInputs, 0);
+    if (options->batchInputs->length == 2)
+        options->verbose = atoi(get(char*, options->batchInputs, 1));
+
+    // Only VM code can be run.
+    if (options->run && (options->backend != VM_BACKEND || options->dumpCfg))
+        return 0;
+
+    return (options->filename != NULL);
+}
+
+void printUsage(char *programName) {
+    printf("Usage: %s [<options>] <PL/0 source code filename> [<verbosity level>]\n", programName);
+    printf("       %s --batch [<options>] <file, directory or file list>...\n", programName);
+    printf("Options:\n");
+    printf("  -O, --optimize   Optimize the generated instructions.\n");
+    printf("  --dump-cfg       Print the control flow graph in DOT format instead of the code.\n");
+    printf("  --text           Print the code as text instead of as a binary object file.\n");
+    printf("  --run            Run the code in the VM right away, reading from stdin and\n"
+           "                   writing to stdout like pl0vm, instead of printing it.\n");
+    printf("  --no-fuse        Only use the basic opcodes in object files and with --run.\n"
+           "                   By default, common sequences of instructions are fused into\n"
+           "                   single opcodes that pl0vm runs faster. --text never fuses.\n");
+    printf("  --backend=<vm|c|asm>\n"
+           "                   Generate VM code (the default), a C program, or x86-64\n"
+           "                   assembly that as and ld turn into a static executable.\n"
+           "                   -O and --dump-cfg only apply to VM code.\n");
+    printf("  --batch          Compile many files to object files at once, on several\n"
+           "                   threads, and print the throughput. Directories are\n"
+           "                   searched for .pl0 files, and files that don't end in .pl0\n"
+           "                   list the files to compile, one per line. x.pl0 is\n"
+           "                   compiled to x.obj. Only -O and --no-fuse apply.\n");
+    printf("  --threads <n>    Number of threads for --batch (default: one per processor).\n");
+    printf("  --output-dir <directory>\n"
+           "                   Where --batch writes the object files, instead of next to\n"
+           "                   the source files.\n");
+    printf("  --cache <directory>\n"
+           "                   Keep the object files in a cache, and use the cached one\n"
+           "                   instead of compiling source code that was compiled before\n"
+           "                   with the same options. Only object files are cached.\n");
+    printf("  --cache-size <megabytes>\n"
+           "                   Remove the least recently used object files when the cache\n"
+           "                   gets bigger than this (default: %d, or 0 for no limit).\n",
+           DEFAULT_CACHE_MEGABYTES);
+    printf("  --cache-stats    Print the hits, misses and size of the --cache and exit.\n");
+    printf("  --stats[=<text|json>]\n"
+           "                   Print the wall time, output, heap allocations and peak\n"
+           "                   memory use of each phase to stderr, as a table or as JSON.\n"
+           "                   Doesn't apply to --batch.\n");
 }
 
 char *readContents(char *filename) {
@@ -215,3 +468,40 @@ char *readContents(char *filename) {
 
 }
 
+// The compiler counts the heap allocations of its own code for --stats. It's
+// linked with -Wl,--wrap for each of these functions (see build.sh), which
+// sends its calls to them to the __wrap_ functions below, and makes the
+// __real_ ones the C library's. What the C library allocates for itself, e.g.
+// in regcomp or open_memstream, isn't counted.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+char *__real_strdup(const char *string);
+char *__real_strndup(const char *string, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    countAllocation(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    // calloc fails if count * size overflows, and then nothing is allocated.
+    if (size == 0 || count <= SIZE_MAX / size)
+        countAllocation(count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    countAllocation(size);
+    return __real_realloc(pointer, size);
+}
+
+char *__wrap_strdup(const char *string) {
+    countAllocation(strlen(string) + 1);
+    return __real_strdup(string);
+}
+
+char *__wrap_strndup(const char *string, size_t size) {
+    countAllocation(strnlen(string, size) + 1);
+    return __real_strndup(string, size);
+}
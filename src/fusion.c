@@ -0,0 +1,118 @@
+#include "src/fusion.h"
+#include <stdlib.h>
+
+// The sequences were picked by counting the sequences of basic instructions
+// in the unoptimized code of test/programs and bench with pl0sequences, and
+// keeping the ones that occur at least 10 times there, with the parts that
+// runVM can run without extra checks: arithmetic is add, sub and mul, and
+// comparisons are eql to geq. The counts are from pl0sequences too.
+struct fusedPattern FUSED_PATTERNS[] = {
+
+    {LOD_LIT_OPR_STO, 4, {LOD, LIT, OPR, STO}, ARITHMETIC_OPERATION},   // 16
+    {LOD_LIT_OPR_JPC, 4, {LOD, LIT, OPR, JPC}, COMPARISON_OPERATION},   // 10
+    {LIT_OPR_STO, 3, {LIT, OPR, STO}, ARITHMETIC_OPERATION},            // 21
+    {LOD_LIT_OPR, 3, {LOD, LIT, OPR}, ARITHMETIC_OPERATION},            // 19
+    {LIT_OPR, 2, {LIT, OPR}, ARITHMETIC_OPERATION},                     // 35
+    {LOD_OPR, 2, {LOD, OPR}, ARITHMETIC_OPERATION},                     // 16
+    {OPR_STO, 2, {OPR, STO}, ARITHMETIC_OPERATION},                     // 32
+    {OPR_JPC, 2, {OPR, JPC}, COMPARISON_OPERATION},                     // 21
+    {LIT_STO, 2, {LIT, STO}, NO_OPERATION},                             // 20
+    {LIT_LIT, 2, {LIT, LIT}, NO_OPERATION},                             // 15
+    {LOD_SIO, 2, {LOD, SIO}, NO_OPERATION},                             // 32
+    {LOD_LOD, 2, {LOD, LOD}, NO_OPERATION},                             // 49
+    {STO_LOD, 2, {STO, LOD}, NO_OPERATION}                              // 52
+
+};
+
+int isFusedOpcode(int opcode) {
+    return opcode >= NUM_OPCODES && opcode < NUM_ALL_OPCODES;
+}
+
+int fusedLength(int opcode) {
+    return isFusedOpcode(opcode) ? FUSED_PATTERNS[opcode - NUM_OPCODES].length : 1;
+}
+
+int matchesFusedPattern(struct vector *instructions, int index, int opcode) {
+    if (!isFusedOpcode(opcode))
+        return 0;
+    struct fusedPattern pattern = FUSED_PATTERNS[opcode - NUM_OPCODES];
+    if (index < 0 || index + pattern.length > instructions->length)
+        return 0;
+
+    int i;
+    for (i = 0; i < pattern.length; i++) {
+        struct instruction instruction = get(struct instruction, instructions, index + i);
+        if (i == 0)
+            instruction = unfuseInstruction(instruction);
+        if (instruction.opcode != pattern.opcodes[i])
+            return 0;
+
+        int operation = instruction.modifier;
+        if (instruction.opcode == OPR && pattern.operations == ARITHMETIC_OPERATION
+                && operation != ADD && operation != SUB && operation != MUL)
+            return 0;
+        if (instruction.opcode == OPR && pattern.operations == COMPARISON_OPERATION
+                && (operation < EQL || operation > GEQ))
+            return 0;
+    }
+
+    return 1;
+}
+
+struct instruction unfuseInstruction(struct instruction instruction) {
+    if (isFusedOpcode(instruction.opcode))
+        instruction.opcode = FUSED_PATTERNS[instruction.opcode - NUM_OPCODES].opcodes[0];
+    return instruction;
+}
+
+struct vector *fuseInstructions(struct vector *instructions) {
+    int length = instructions->length;
+    int numPatterns = NUM_ALL_OPCODES - NUM_OPCODES;
+
+    // Sequences can overlap, e.g. sto lod lit opr sto, so pick them from the
+    // back: saved[i] is the most dispatches that fusing can save from i on,
+    // and choice[i] the fused opcode to put at i for that, or 0.
+    int *saved = (int*)calloc(length + 1, sizeof(int));
+    int *choice = (int*)calloc(length + 1, sizeof(int));
+    int i, p;
+    for (i = length - 1; i >= 0; i--) {
+        saved[i] = saved[i + 1];
+        for (p = 0; p < numPatterns; p++) {
+            struct fusedPattern pattern = FUSED_PATTERNS[p];
+            if (!matchesFusedPattern(instructions, i, pattern.opcode))
+                continue;
+            int total = pattern.length - 1 + saved[i + pattern.length];
+            if (total > saved[i]) {
+                saved[i] = total;
+                choice[i] = pattern.opcode;
+            }
+        }
+    }
+
+    struct vector *fused = makeVector(struct instruction);
+    for (i = 0; i < length; i++) {
+        struct instruction instruction = get(struct instruction, instructions, i);
+        if (choice[i] != 0) {
+            instruction.opcode = choice[i];
+            push(fused, instruction);
+            // The rest of the sequence stays basic.
+            for (p = 1; p < fusedLength(choice[i]); p++)
+                push(fused, get(struct instruction, instructions, i + p));
+            i += fusedLength(choice[i]) - 1;
+        } else {
+            push(fused, instruction);
+        }
+    }
+
+    free(saved);
+    free(choice);
+    return fused;
+}
+
+struct vector *unfuseInstructions(struct vector *instructions) {
+    struct vector *basic = makeVector(struct instruction);
+    forVector(instructions, i, struct instruction, instruction,
+        struct instruction unfused = unfuseInstruction(instruction);
+        push(basic, unfused););
+    return basic;
+}
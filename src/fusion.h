@@ -0,0 +1,54 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include "src/instruction.h"
+#include "src/lib/vector.h"
+
+// Fused instructions ("superinstructions"). A fused opcode stands for a common
+// sequence of basic instructions, such as lod lit opr sto for x := x + 1, which
+// runVM then executes with a single dispatch instead of one per instruction.
+//
+// Only the first instruction of a sequence is changed: its opcode becomes the
+// fused opcode, and its level and modifier stay the same. The rest of the
+// sequence is left as it is, and the VM reads the other operands from there.
+// So fused code has the same length, jump targets and line table as the basic
+// code, jumps into the middle of a sequence still work, and unfusing only
+// takes changing the first opcode back. A fused opcode whose sequence doesn't
+// follow it means the same as its first basic opcode.
+//
+// Only runVM runs fused code. Everything else (the text format, traces, the
+// profiler, the JIT and the optimizer) works on basic code.
+
+// The opr operations that a fused sequence can contain.
+enum { NO_OPERATION, ARITHMETIC_OPERATION, COMPARISON_OPERATION };
+
+struct fusedPattern {
+    int opcode;         // The fused opcode.
+    int length;         // Number of basic instructions it stands for.
+    int opcodes[4];     // The basic opcodes of the sequence.
+    int operations;     // What the sequence's opr can be, if it has one.
+};
+
+// The fused opcodes' patterns, indexed by fused opcode - NUM_OPCODES.
+extern struct fusedPattern FUSED_PATTERNS[];
+
+// Returns true if the opcode is a fused one.
+int isFusedOpcode(int opcode);
+// Returns the number of basic instructions that an opcode stands for, 1 for
+// basic opcodes.
+int fusedLength(int opcode);
+// Returns true if the instructions starting at index are the sequence that
+// the fused opcode stands for. The first instruction can be fused or basic,
+// the others have to be basic.
+int matchesFusedPattern(struct vector *instructions, int index, int opcode);
+// Returns the basic instruction that an instruction starts with, which is the
+// instruction itself unless it's fused.
+struct instruction unfuseInstruction(struct instruction instruction);
+
+// Returns a copy of basic instructions with sequences replaced by fused
+// opcodes, picking the sequences that save the most dispatches.
+struct vector *fuseInstructions(struct vector *instructions);
+// Returns a copy of the instructions with only basic opcodes.
+struct vector *unfuseInstructions(struct vector *instructions);
+
+#endif
@@ -7,12 +7,30 @@
 #include <stdio.h>
 
 struct vector *generateInstructions(struct parseTree tree) {
-    extern struct vector *generatorErrors;
-    generatorErrors = NULL;
+    clearGeneratorErrors();
+
+    annotateStackDepths(&tree);
+    struct generatorState *state = makeGeneratorState();
+    generate(tree, state);
+    struct vector *instructions = state->instructions;
+    state->instructions = NULL;
+    freeGeneratorState(state);
+    return instructions;
+}
+
+struct vector *generateInstructionsWithLines(struct parseTree tree, struct vector **lines) {
+    clearGeneratorErrors();
 
+    annotateStackDepths(&tree);
     struct generatorState *state = makeGeneratorState();
+    state->lines = makeLineTable();
     generate(tree, state);
-    return state->instructions;
+    struct vector *instructions = state->instructions;
+    *lines = state->lines;
+    state->instructions = NULL;
+    state->lines = NULL;
+    freeGeneratorState(state);
+    return instructions;
 }
 
 void generate(struct parseTree tree, struct generatorState *state) {
@@ -26,8 +44,17 @@ void generate(struct parseTree tree, struct generatorState *state) {
     int is(char *name) {
         return (strcmp(tree.name, name) == 0);
     }
+    // Instructions get the position of the innermost tree that generates
+    // them, e.g. the / for a division and the assignment for its sto.
     void call(void (*generateFunction)(struct parseTree, struct generatorState*)) {
+        int line = state->line, column = state->column;
+        if (tree.line > 0) {
+            state->line = tree.line;
+            state->column = tree.column;
+        }
         (*generateFunction)(tree, state);
+        state->line = line;
+        state->column = column;
     }
 
     if (is("program")) call(generate_program);
@@ -62,8 +89,14 @@ void generate_program(struct parseTree tree, struct generatorState *state) {
     assert(hasChild(tree, "block"));
 
     generate(getChild(tree, "block"), state);
-    // Add a return instruction at the end of the program.
-    addInstruction(state, "opr", 0, 0);
+    // Add a return instruction at the end of the program, at the period that
+    // ends it.
+    struct parseTree period = getLastChild(tree, ".");
+    if (!isParseTreeError(period)) {
+        state->line = period.line;
+        state->column = period.column;
+    }
+    addInstruction(state, OPR, 0, RET);
 }
 
 void generate_block(struct parseTree tree, struct generatorState *state) {
@@ -83,10 +116,13 @@ void generate_varDeclaration(struct parseTree tree, struct generatorState *state
         int numVariables = fakeState->instructions->length - state->instructions->length;
 
         // Allocate space for the variables.
-        addInstruction(state, "inc", 0, numVariables);
+        addInstruction(state, INC, 0, numVariables);
         // Ignore the instructions that the vars generate, but keep the symbols
         // that they added.
+        freeVector(state->symbols);
         state->symbols = fakeState->symbols;
+        fakeState->symbols = NULL;
+        freeGeneratorState(fakeState);
     }
 }
 
@@ -105,7 +141,7 @@ void generate_var(struct parseTree tree, struct generatorState *state) {
     addVariable(state, getChild(tree, "identifier"));
     // Add a fake instruction so that generate_varDeclaration can count the
     // number of variables added and add its own inc instruction.
-    addInstruction(state, "inc", -1, -1);
+    addInstruction(state, INC, -1, -1);
 }
 
 void generate_constDeclaration(struct parseTree tree, struct generatorState *state) {
@@ -149,7 +185,7 @@ void generate_beginBlock(struct parseTree tree, struct generatorState *state) {
 void generate_readStatement(struct parseTree tree, struct generatorState *state) {
     assert(hasChild(tree, "identifier"));
 
-    addInstruction(state, "read", 0, 2);
+    addInstruction(state, READ, 0, 2);
     addStoreInstruction(state, getChild(tree, "identifier"));
 }
 
@@ -157,7 +193,7 @@ void generate_writeStatement(struct parseTree tree, struct generatorState *state
     assert(hasChild(tree, "identifier"));
 
     addLoadInstruction(state, getChild(tree, "identifier"));
-    addInstruction(state, "sio", 0, 1);
+    addInstruction(state, SIO, 0, 1);
 }
 
 void generate_assignment(struct parseTree tree, struct generatorState *state) {
@@ -174,13 +210,14 @@ void generate_ifStatement(struct parseTree tree, struct generatorState *state) {
     // instruction we need to jump to.
     struct generatorState *fakeState = copyGeneratorState(state);
     generate(getChild(tree, "condition"), fakeState);
-    addInstruction(fakeState, "jpc", -1, -1);
+    addInstruction(fakeState, JPC, -1, -1);
     generate(getChild(tree, "statement"), fakeState);
     int afterIfStatement = fakeState->instructions->length;
+    freeGeneratorState(fakeState);
 
     // Generate the real instructions.
     generate(getChild(tree, "condition"), state);
-    addInstruction(state, "jpc", 0, afterIfStatement);
+    addInstruction(state, JPC, 0, afterIfStatement);
     generate(getChild(tree, "statement"), state);
 }
 
@@ -192,16 +229,17 @@ void generate_whileStatement(struct parseTree tree, struct generatorState *state
     int beginning = state->instructions->length;
     struct generatorState *fakeState = copyGeneratorState(state);
     generate(getChild(tree, "condition"), fakeState);
-    addInstruction(fakeState, "jpc", -1, -1);
+    addInstruction(fakeState, JPC, -1, -1);
     generate(getChild(tree, "statement"), fakeState);
-    addInstruction(fakeState, "jmp", 0, beginning);
+    addInstruction(fakeState, JMP, 0, beginning);
     int afterWhileLoop = fakeState->instructions->length;
+    freeGeneratorState(fakeState);
 
     // Generate the real instructions.
     generate(getChild(tree, "condition"), state);
-    addInstruction(state, "jpc", 0, afterWhileLoop);
+    addInstruction(state, JPC, 0, afterWhileLoop);
     generate(getChild(tree, "statement"), state);
-    addInstruction(state, "jmp", 0, beginning);
+    addInstruction(state, JMP, 0, beginning);
 }
 
 void generate_condition(struct parseTree tree, struct generatorState *state) {
@@ -211,7 +249,7 @@ void generate_condition(struct parseTree tree, struct generatorState *state) {
     if (hasChild(tree, "odd")) {
         generate(getChild(tree, "expression"), state);
         // Add the instruction that checks for oddity.
-        addInstruction(state, "opr", 0, 6);
+        addInstruction(state, OPR, 0, ODD);
     } else {
         generate(getChild(tree, "expression"), state);
         generate(getLastChild(tree, "expression"), state);
@@ -222,13 +260,14 @@ void generate_condition(struct parseTree tree, struct generatorState *state) {
 void generate_expression(struct parseTree tree, struct generatorState *state) {
     assert(hasChild(tree, "term"));
 
-    generate(getChild(tree, "term"), state);
-
     if (hasChild(tree, "add-or-subtract")) {
         assert(hasChild(tree, "expression"));
 
-        generate(getChild(tree, "expression"), state);
+        generateOperands(getChild(tree, "term"), getChild(tree, "expression"),
+                isOperator(getChild(tree, "add-or-subtract"), "+"), state);
         generate(getChild(tree, "add-or-subtract"), state);
+    } else {
+        generate(getChild(tree, "term"), state);
     }
 }
 
@@ -236,9 +275,9 @@ void generate_addOrSubtract(struct parseTree tree, struct generatorState *state)
     char *plusOrMinus = getFirstChild(tree).name;
 
     if (strcmp(plusOrMinus, "+") == 0)
-        addInstruction(state, "opr", 0, 2);
+        addInstruction(state, OPR, 0, ADD);
     else if (strcmp(plusOrMinus, "-") == 0)
-        addInstruction(state, "opr", 0, 3);
+        addInstruction(state, OPR, 0, SUB);
     else
         assert(0 /* Expected + or - inside add-or-subtract. */);
 }
@@ -246,13 +285,14 @@ void generate_addOrSubtract(struct parseTree tree, struct generatorState *state)
 void generate_term(struct parseTree tree, struct generatorState *state) {
     assert(hasChild(tree, "factor"));
 
-    generate(getChild(tree, "factor"), state);
-
     if (hasChild(tree, "multiply-or-divide")) {
         assert(hasChild(tree, "term"));
 
-        generate(getChild(tree, "term"), state);
+        generateOperands(getChild(tree, "factor"), getChild(tree, "term"),
+                isOperator(getChild(tree, "multiply-or-divide"), "*"), state);
         generate(getChild(tree, "multiply-or-divide"), state);
+    } else {
+        generate(getChild(tree, "factor"), state);
     }
 }
 
@@ -260,9 +300,9 @@ void generate_multiplyOrDivide(struct parseTree tree, struct generatorState *sta
     char *starOrSlash = getFirstChild(tree).name;
 
     if (strcmp(starOrSlash, "*") == 0)
-        addInstruction(state, "opr", 0, 4);
+        addInstruction(state, OPR, 0, MUL);
     else if (strcmp(starOrSlash, "/") == 0)
-        addInstruction(state, "opr", 0, 5);
+        addInstruction(state, OPR, 0, DIV);
     else
         assert(0 /* Expected * or / inside multiply-or-divide. */);
 }
@@ -288,7 +328,7 @@ void generate_sign(struct parseTree tree, struct generatorState *state) {
     char *sign = getFirstChild(tree).name;
 
     if (strcmp(sign, "-") == 0)
-        addInstruction(state, "opr", 0, 1);
+        addInstruction(state, OPR, 0, NEG);
 }
 
 void generate_number(struct parseTree tree, struct generatorState *state) {
@@ -296,7 +336,7 @@ void generate_number(struct parseTree tree, struct generatorState *state) {
     assert(isInteger(number));
     int value = atoi(number);
 
-    addInstruction(state, "lit", 0, value);
+    addLiteral(state, value);
 }
 
 void generate_identifier(struct parseTree tree, struct generatorState *state) {
@@ -307,34 +347,93 @@ void generate_relationalOperator(struct parseTree tree, struct generatorState *s
     char *operator = getFirstChild(tree).name;
 
     if (strcmp(operator, "=") == 0)
-        addInstruction(state, "opr", 0, 8);
+        addInstruction(state, OPR, 0, EQL);
     else if (strcmp(operator, "<>") == 0)
-        addInstruction(state, "opr", 0, 9);
+        addInstruction(state, OPR, 0, NEQ);
     else if (strcmp(operator, "<") == 0)
-        addInstruction(state, "opr", 0, 10);
+        addInstruction(state, OPR, 0, LSS);
     else if (strcmp(operator, "<=") == 0)
-        addInstruction(state, "opr", 0, 11);
+        addInstruction(state, OPR, 0, LEQ);
     else if (strcmp(operator, ">") == 0)
-        addInstruction(state, "opr", 0, 12);
+        addInstruction(state, OPR, 0, GTR);
     else if (strcmp(operator, ">=") == 0)
-        addInstruction(state, "opr", 0, 13);
+        addInstruction(state, OPR, 0, GEQ);
     else
         assert(0 /* Invalid relational operator. */);
 }
 
-int getOpcode(char *instruction) {
-    if (strcmp(instruction, "lit") == 0) return 1;
-    if (strcmp(instruction, "opr") == 0) return 2;
-    if (strcmp(instruction, "lod") == 0) return 3;
-    if (strcmp(instruction, "sto") == 0) return 4;
-    if (strcmp(instruction, "cal") == 0) return 5;
-    if (strcmp(instruction, "inc") == 0) return 6;
-    if (strcmp(instruction, "jmp") == 0) return 7;
-    if (strcmp(instruction, "jpc") == 0) return 8;
-    if (strcmp(instruction, "sio") == 0) return 9;
-    if (strcmp(instruction, "read") == 0) return 10;
+void generateOperands(struct parseTree left, struct parseTree right, int isCommutative,
+        struct generatorState *state) {
+    // Evaluating the operand that needs more stack space first means that it
+    // doesn't have to sit on top of the other operand's value.
+    if (isCommutative && stackDepth(right) > stackDepth(left)) {
+        generate(right, state);
+        generate(left, state);
+    } else {
+        generate(left, state);
+        generate(right, state);
+    }
+}
 
-    return 0;
+int isOperator(struct parseTree tree, char *operator) {
+    return (strcmp(getFirstChild(tree).name, operator) == 0);
+}
+
+int stackDepth(struct parseTree tree) {
+    if (tree.stackDepth > 0)
+        return tree.stackDepth;
+
+    // Number of stack slots needed to evaluate a binary operator whose left
+    // and right operands need left and right slots, when the operands can be
+    // evaluated in either order or only left to right.
+    int eitherOrder(int left, int right) {
+        return (left == right) ? left + 1 : (left > right ? left : right);
+    }
+    int leftToRight(int left, int right) {
+        return (left > right + 1) ? left : right + 1;
+    }
+
+    if (strcmp(tree.name, "expression") == 0 && hasChild(tree, "add-or-subtract")) {
+        int left = stackDepth(getChild(tree, "term"));
+        int right = stackDepth(getChild(tree, "expression"));
+        if (isOperator(getChild(tree, "add-or-subtract"), "+"))
+            return eitherOrder(left, right);
+        else
+            return leftToRight(left, right);
+    } else if (strcmp(tree.name, "term") == 0 && hasChild(tree, "multiply-or-divide")) {
+        int left = stackDepth(getChild(tree, "factor"));
+        int right = stackDepth(getChild(tree, "term"));
+        if (isOperator(getChild(tree, "multiply-or-divide"), "*"))
+            return eitherOrder(left, right);
+        else
+            return leftToRight(left, right);
+    } else if (strcmp(tree.name, "expression") == 0) {
+        return stackDepth(getChild(tree, "term"));
+    } else if (strcmp(tree.name, "term") == 0) {
+        return stackDepth(getChild(tree, "factor"));
+    } else if (strcmp(tree.name, "factor") == 0 && hasChild(tree, "expression")) {
+        return stackDepth(getChild(tree, "expression"));
+    } else if (strcmp(tree.name, "factor") == 0 && hasChild(tree, "number")) {
+        return literalStackDepth(atoi(getFirstChild(getChild(tree, "number")).name));
+    }
+
+    // Identifiers push a single value, or two for constants that addLiteral
+    // splits, but the symbols aren't known here.
+    return 1;
+}
+
+void annotateStackDepths(struct parseTree *tree) {
+    if (isParseTreeError(*tree))
+        return;
+    // The children first, so that stackDepth only looks one level down.
+    if (tree->children != NULL) {
+        int i;
+        for (i = 0; i < tree->children->length; i++)
+            annotateStackDepths(&((struct parseTree*)tree->children->items)[i]);
+    }
+    // Not the depth from an earlier annotation, in case the tree changed.
+    tree->stackDepth = 0;
+    tree->stackDepth = stackDepth(*tree);
 }
 
 struct generatorState *makeGeneratorState() {
@@ -343,6 +442,9 @@ struct generatorState *makeGeneratorState() {
     state->symbols = makeVector(struct symbol);
     state->currentLevel = 0;
     state->instructions = makeVector(struct instruction);
+    state->lines = NULL;
+    state->line = 0;
+    state->column = 0;
 
     return state;
 }
@@ -352,17 +454,56 @@ struct generatorState *copyGeneratorState(struct generatorState *state) {
     copy->symbols = vector_copy(state->symbols);
     copy->currentLevel = state->currentLevel;
     copy->instructions = vector_copy(state->instructions);
+    // Copies are only used to find out how much code something generates, so
+    // they don't need a line table.
+    copy->lines = NULL;
+    copy->line = state->line;
+    copy->column = state->column;
 
     return copy;
 }
 
-struct instruction makeInstruction(char *instruction, int lexicalLevel, int modifier) {
-    return (struct instruction){getOpcode(instruction), instruction, lexicalLevel, modifier};
+void freeGeneratorState(struct generatorState *state) {
+    if (state->symbols != NULL)
+        freeVector(state->symbols);
+    if (state->instructions != NULL)
+        freeVector(state->instructions);
+    if (state->lines != NULL)
+        freeVector(state->lines);
+    free(state);
 }
 
-void addInstruction(struct generatorState *state, char *instruction, int lexicalLevel, int modifier) {
+void addInstruction(struct generatorState *state, int opcode, int lexicalLevel, int modifier) {
+    if (!instructionFits(lexicalLevel, modifier)) {
+        char *message = format("Instruction %s %d %d is out of range.",
+                getOpcodeName(opcode), lexicalLevel, modifier);
+        addGeneratorErrorAt(state, message);
+        free(message);
+        return;
+    }
+
+    if (state->lines != NULL)
+        addLinePosition(state->lines, state->instructions->length, state->line, state->column);
     pushLiteral(state->instructions, struct instruction,
-            makeInstruction(instruction, lexicalLevel, modifier));
+            makeInstruction(opcode, lexicalLevel, modifier));
+}
+
+void addLiteral(struct generatorState *state, int value) {
+    if (instructionFits(0, value)) {
+        addInstruction(state, LIT, 0, value);
+        return;
+    }
+    // The high half is shifted arithmetically, so that it keeps the sign and
+    // high * 2^LITERAL_SPLIT_BITS + low is the value.
+    addInstruction(state, LIT, 0, value >> LITERAL_SPLIT_BITS);
+    addInstruction(state, LIT, 0, 1 << LITERAL_SPLIT_BITS);
+    addInstruction(state, OPR, 0, MUL);
+    addInstruction(state, LIT, 0, value & ((1 << LITERAL_SPLIT_BITS) - 1));
+    addInstruction(state, OPR, 0, ADD);
+}
+
+int literalStackDepth(int value) {
+    return instructionFits(0, value) ? 1 : 2;
 }
 
 void addLoadInstruction(struct generatorState *state, struct parseTree identifier) {
@@ -370,19 +511,19 @@ void addLoadInstruction(struct generatorState *state, struct parseTree identifie
     struct symbol symbol = getSymbol(state, name);
 
     if (symbol.type == PROCEDURE)
-        addGeneratorError("Cannot take value of procedure.");
+        addGeneratorErrorAt(state, "Cannot take value of procedure.");
     else if (symbol.type == VARIABLE)
-        addInstruction(state, "lod", symbol.level, symbol.address);
+        addInstruction(state, LOD, symbol.level, symbol.address);
     else if (symbol.type == CONSTANT)
-        addInstruction(state, "lit", 0, symbol.constantValue);
+        addLiteral(state, symbol.constantValue);
 }
 void addStoreInstruction(struct generatorState *state, struct parseTree identifier) {
     char *name = getToken(identifier);
     struct symbol symbol = getSymbol(state, name);
     if (symbol.type == PROCEDURE || symbol.type == CONSTANT)
-        addGeneratorError("Cannot store into a constant or procedure.");
+        addGeneratorErrorAt(state, "Cannot store into a constant or procedure.");
     else if (symbol.type == VARIABLE)
-        addInstruction(state, "sto", symbol.level, symbol.address);
+        addInstruction(state, STO, symbol.level, symbol.address);
 }
 
 void addVariable(struct generatorState *state, struct parseTree identifierTree) {
@@ -412,24 +553,44 @@ struct symbol getSymbol(struct generatorState *state, char *name) {
             if (strcmp(symbol.name, name) == 0)
                 return symbol;);
 
-    addGeneratorError(format("Could not find symbol '%s'.", name));
+    char *message = format("Could not find symbol '%s'.", name);
+    addGeneratorErrorAt(state, message);
+    free(message);
 
     return (struct symbol){NULL, 0, 0, 0, 0};
 }
 
-struct vector *generatorErrors = NULL;
+__thread struct vector *generatorErrors = NULL;
 
 void addGeneratorError(char *errorMessage) {
     if (generatorErrors == NULL)
-        generatorErrors = makeVector(char*);
+        generatorErrors = makeVector(struct generatorError);
 
-    push(generatorErrors, errorMessage);
+    pushLiteral(generatorErrors, struct generatorError, {strdup(errorMessage), 0, 0});
+}
+void addGeneratorErrorAt(struct generatorState *state, char *errorMessage) {
+    addGeneratorError(errorMessage);
+    struct generatorError *error = (struct generatorError*)vector_get(generatorErrors,
+            generatorErrors->length - 1);
+    error->line = state->line;
+    error->column = state->column;
 }
 int generatorHasErrors() {
     return (generatorErrors != NULL);
 }
 char *printGeneratorErrors() {
-    forVector(generatorErrors, i, char*, message,
-            puts(message););
+    forVector(generatorErrors, i, struct generatorError, error,
+            puts(error.message););
+}
+struct vector *getGeneratorErrors() {
+    return generatorErrors;
+}
+void clearGeneratorErrors() {
+    if (generatorErrors != NULL) {
+        forVector(generatorErrors, i, struct generatorError, error,
+                free(error.message););
+        freeVector(generatorErrors);
+    }
+    generatorErrors = NULL;
 }
 
@@ -4,16 +4,10 @@
 // Include parse for the parse tree type
 // which is referenced in this file
 #include "src/parser.h"
+#include "src/instruction.h"
+#include "src/linetable.h"
 #include "src/lib/vector.h"
 
-// Represents a VM instruction.
-struct instruction {
-    int opcode;
-    char *opcodeName;
-    int lexicalLevel;
-    int modifier;
-};
-
 // A symbol can be a variable name or a procedure name. We need to keep track
 // of its lexical level so we know what code can access it, and we need to keep
 // track of its address so we can load its value.
@@ -28,17 +22,27 @@ struct symbol {
 // Symbol types
 enum { VARIABLE = 1, CONSTANT, PROCEDURE };
 
+// The bits of the low half of a literal that doesn't fit in a lit
+// instruction, see addLiteral. Both halves of any int fit.
+#define LITERAL_SPLIT_BITS 16
+
 // Used in the generate function to keep track of the current state.
 struct generatorState {
     struct vector *symbols;   // The symbol table.
     int currentAddress;   // The current code address.
     int currentLevel;     // The current lexical level.
     struct vector *instructions;   // The instructions that have been generated so far.
+    struct vector *lines;   // The line table of the instructions, or NULL to
+                            // not keep one.
+    int line, column;       // The source position of the tree being generated.
 };
 
 // generateInstructions is just a wrapper for generate that initializes the
 // generatorState for you. Use it instead of using generate directly.
 struct vector *generateInstructions(struct parseTree tree);
+// Like generateInstructions, but also puts a line table that maps the
+// instructions to their positions in the source code in *lines.
+struct vector *generateInstructionsWithLines(struct parseTree tree, struct vector **lines);
 
 // Given a parse tree, generate a list of VM instructions.
 void generate(struct parseTree tree, struct generatorState *state);
@@ -69,28 +73,64 @@ void generate_sign(struct parseTree tree, struct generatorState *state);
 void generate_number(struct parseTree tree, struct generatorState *state);
 void generate_identifier(struct parseTree tree, struct generatorState *state);
 
+// Generate the two operands of a binary operator. If the operator is
+// commutative, the operand that needs the most stack space is generated first
+// (Sethi-Ullman ordering), which keeps right-leaning expressions such as
+// 1 + (2 + (3 + ...)) from piling up values on the stack.
+void generateOperands(struct parseTree left, struct parseTree right, int isCommutative,
+        struct generatorState *state);
+// Returns the number of stack slots needed to evaluate an expression, term or
+// factor tree, with commutative operands evaluated in the best order. It's
+// read from the tree if it's been annotated.
+int stackDepth(struct parseTree tree);
+// The stack slots that addLiteral needs for the value.
+int literalStackDepth(int value);
+// Put the stack depth of every node of the tree in it, from the leaves up, so
+// that generating a long chain of operators doesn't recompute the depth of
+// the rest of the chain at every one. generateInstructions and generateAsm
+// call this.
+void annotateStackDepths(struct parseTree *tree);
+// Returns true if an add-or-subtract or multiply-or-divide tree holds the
+// given operator.
+int isOperator(struct parseTree tree, char *operator);
+
 struct generatorState *makeGeneratorState();
 struct generatorState *copyGeneratorState(struct generatorState *state);
-void addInstruction(struct generatorState *state, char *instruction, int level, int modifier);
+// Free the state along with the vectors it still points to.
+void freeGeneratorState(struct generatorState *state);
+// Add an instruction, such as addInstruction(state, OPR, 0, ADD). Adds a
+// generator error instead if the level or modifier doesn't fit.
+void addInstruction(struct generatorState *state, int opcode, int level, int modifier);
+// Add the instructions that push a value. A value that doesn't fit in a lit's
+// modifier is pushed in two halves of LITERAL_SPLIT_BITS bits, as
+// lit high, lit 2^LITERAL_SPLIT_BITS, opr mul, lit low, opr add.
+void addLiteral(struct generatorState *state, int value);
 void addLoadInstruction(struct generatorState *state, struct parseTree identifierTree);
 void addStoreInstruction(struct generatorState *state, struct parseTree identifierTree);
 
-// Given a string represtation of an instruction, such as "lit" or "sto",
-// return the corresponding integer opcode.
-int getOpcode(char *instruction);
-
-// Utility function to initialize a struct instruction.
-struct instruction makeInstruction(char *instruction, int lexicalLevel, int modifier);
-
 // Add and get a symbol from the symbol table.
 void addVariable(struct generatorState *state, struct parseTree identifierTree);
 void addConstant(struct generatorState *state, struct parseTree identifierTree,
         struct parseTree numberTree);
 struct symbol getSymbol(struct generatorState *state, char *name);
 
-// Get and set an error in case a function returns a failure value.
+// A generator error, with the source position of the tree that was being
+// generated, or a line of 0 if it isn't known.
+struct generatorError {
+    char *message;
+    int line, column;
+};
+
+// Get and set an error in case a function returns a failure value. Every
+// thread has its own errors. The message is copied.
 void addGeneratorError(char *errorMessage);
+// Add an error at the position of the tree that the state is generating.
+void addGeneratorErrorAt(struct generatorState *state, char *errorMessage);
 int generatorHasErrors();
 char *printGeneratorErrors();
+// Returns the errors, as struct generatorError, or NULL if there are none.
+struct vector *getGeneratorErrors();
+// Forget the errors, before generating code for another program.
+void clearGeneratorErrors();
 
 #endif
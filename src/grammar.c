@@ -0,0 +1,91 @@
+#include "src/grammar.h"
+
+struct grammar PL0Grammar() {
+    // Define full PL/0 grammar
+    struct grammar grammar = (struct grammar){makeVector(struct rule)};
+    addRule(grammar, "program", "block periodsym");
+
+    addRule(grammar, "block", "const-declaration var-declaration statement");
+
+    addRule(grammar, "const-declaration", "constsym constants semicolonsym");
+    addRule(grammar, "const-declaration", "nothing");
+    addRule(grammar, "constants", "constant commasym constants");
+    addRule(grammar, "constants", "constant");
+    addRule(grammar, "constant", "identifier eqsym number");
+
+    addRule(grammar, "var-declaration", "intsym vars semicolonsym");
+    addRule(grammar, "var-declaration", "nothing");
+    addRule(grammar, "vars", "var commasym vars");
+    addRule(grammar, "vars", "var");
+    addRule(grammar, "var", "identifier");
+
+    addRule(grammar, "statement", "read-statement");
+    addRule(grammar, "statement", "write-statement");
+    addRule(grammar, "statement", "assignment");
+    addRule(grammar, "statement", "if-statement");
+    addRule(grammar, "statement", "while-statement");
+    addRule(grammar, "statement", "begin-block");
+    addRule(grammar, "statement", "nothing");
+
+    addRule(grammar, "assignment", "identifier becomessym expression");
+
+    addRule(grammar, "begin-block", "beginsym statements endsym");
+    addRule(grammar, "statements", "statement semicolonsym statements");
+    addRule(grammar, "statements", "statement");
+
+    addRule(grammar, "if-statement", "ifsym condition thensym statement");
+    addRule(grammar, "condition", "expression rel-op expression");
+    addRule(grammar, "condition", "oddsym expression");
+    addRule(grammar, "rel-op", "eqsym");
+    addRule(grammar, "rel-op", "neqsym");
+    addRule(grammar, "rel-op", "lessym");
+    addRule(grammar, "rel-op", "leqsym");
+    addRule(grammar, "rel-op", "gtrsym");
+    addRule(grammar, "rel-op", "geqsym");
+
+    // This is the grammar for expressions included in the assignment.
+    /*addRule(grammar, "expression", "sign term add-or-substract term");
+    addRule(grammar, "expression", "sign term");
+    addRule(grammar, "sign", "plussym");
+    addRule(grammar, "sign", "minussym");
+    addRule(grammar, "sign", "nothing");
+    addRule(grammar, "add-or-substract", "plussym");
+    addRule(grammar, "add-or-substract", "minussym");
+    addRule(grammar, "term", "factor multiply-or-divide factor");
+    addRule(grammar, "term", "factor");
+    addRule(grammar, "multiply-or-divide", "multsym");
+    addRule(grammar, "multiply-or-divide", "slashsym");
+    addRule(grammar, "factor", "lparentsym expression rparentsym");
+    addRule(grammar, "factor", "identifier");
+    addRule(grammar, "factor", "number");*/
+
+    // This is an improved grammar for expressions that behaves more like you
+    // would intuitively expeted expressions to behave. For example, 1 + 2 + 3
+    // is not a valid expression in the other grammar, you would have to do
+    // something like 1 + (2 + 3) instead, but it works with this grammar.
+    addRule(grammar, "expression", "term add-or-subtract expression");
+    addRule(grammar, "expression", "term");
+    addRule(grammar, "add-or-subtract", "plussym");
+    addRule(grammar, "add-or-subtract", "minussym");
+    addRule(grammar, "term", "factor multiply-or-divide term");
+    addRule(grammar, "term", "factor");
+    addRule(grammar, "multiply-or-divide", "multsym");
+    addRule(grammar, "multiply-or-divide", "slashsym");
+    addRule(grammar, "factor", "lparentsym expression rparentsym");
+    addRule(grammar, "factor", "sign number");
+    addRule(grammar, "factor", "identifier");
+    addRule(grammar, "sign", "plussym");
+    addRule(grammar, "sign", "minussym");
+    addRule(grammar, "sign", "nothing");
+    addRule(grammar, "number", "numbersym");
+
+    addRule(grammar, "while-statement", "whilesym condition dosym statement");
+
+    addRule(grammar, "read-statement", "readsym identifier");
+    addRule(grammar, "write-statement", "writesym identifier");
+
+    addRule(grammar, "identifier", "identsym");
+    addRule(grammar, "number", "numbersym");
+
+    return grammar;
+}
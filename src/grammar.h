@@ -0,0 +1,11 @@
+#ifndef GRAMMAR_H
+#define GRAMMAR_H
+
+#include "src/parser.h"
+
+// Returns the grammar of the full PL/0 language, for parseProgram. The
+// grammar isn't changed by parsing, so one grammar can be shared by every
+// parse.
+struct grammar PL0Grammar();
+
+#endif
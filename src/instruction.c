@@ -0,0 +1,36 @@
+#include "src/instruction.h"
+#include <string.h>
+
+char *OPCODE_NAMES[] = {
+
+    NULL, "lit", "opr", "lod", "sto", "cal", "inc", "jmp", "jpc", "sio", "read",
+
+    "lod+lit+opr+sto", "lod+lit+opr+jpc", "lit+opr+sto", "lod+lit+opr", "lit+opr",
+    "lod+opr", "opr+sto", "opr+jpc", "lit+sto", "lit+lit", "lod+sio", "lod+lod", "sto+lod"
+
+};
+
+struct instruction makeInstruction(int opcode, int lexicalLevel, int modifier) {
+    return (struct instruction){opcode, lexicalLevel, modifier};
+}
+
+int instructionFits(int lexicalLevel, int modifier) {
+    return lexicalLevel >= MIN_LEXICAL_LEVEL && lexicalLevel <= MAX_LEXICAL_LEVEL
+        && modifier >= MIN_MODIFIER && modifier <= MAX_MODIFIER;
+}
+
+int getOpcode(char *instruction) {
+    int opcode;
+    for (opcode = LIT; opcode < NUM_OPCODES; opcode++)
+        if (strcmp(instruction, OPCODE_NAMES[opcode]) == 0)
+            return opcode;
+
+    return 0;
+}
+
+char *getOpcodeName(int opcode) {
+    if (opcode < LIT || opcode >= NUM_ALL_OPCODES)
+        return "???";
+
+    return OPCODE_NAMES[opcode];
+}
@@ -0,0 +1,62 @@
+#ifndef INSTRUCTION_H
+#define INSTRUCTION_H
+
+// VM opcodes.
+enum {
+
+    LIT = 1, OPR, LOD, STO, CAL, INC, JMP, JPC, SIO, READ,
+
+    NUM_OPCODES
+
+};
+
+// Fused opcodes, which stand for a whole sequence of the opcodes above, e.g.
+// lod lit opr sto. See fusion.h.
+enum {
+
+    LOD_LIT_OPR_STO = NUM_OPCODES, LOD_LIT_OPR_JPC, LIT_OPR_STO, LOD_LIT_OPR, LIT_OPR,
+    LOD_OPR, OPR_STO, OPR_JPC, LIT_STO, LIT_LIT, LOD_SIO, LOD_LOD, STO_LOD,
+
+    NUM_ALL_OPCODES
+
+};
+
+// Modifiers of the opr instruction.
+enum {
+
+    RET = 0, NEG, ADD, SUB, MUL, DIV, ODD, MOD, EQL, NEQ, LSS, LEQ, GTR, GEQ
+
+};
+
+// Opcode names, indexed by opcode. Only used when printing instructions.
+extern char *OPCODE_NAMES[];
+
+// Represents a VM instruction, packed into a single 32-bit word.
+struct instruction {
+    unsigned int opcode : 5;
+    signed int lexicalLevel : 3;
+    signed int modifier : 24;
+};
+
+// The ranges of lexical levels and modifiers that fit in an instruction.
+#define MIN_LEXICAL_LEVEL (-(1 << 2))
+#define MAX_LEXICAL_LEVEL ((1 << 2) - 1)
+#define MIN_MODIFIER (-(1 << 23))
+#define MAX_MODIFIER ((1 << 23) - 1)
+
+// Utility function to initialize a struct instruction. The lexical level and
+// modifier are truncated if they don't fit, so check them with
+// instructionFits first if they could be out of range.
+struct instruction makeInstruction(int opcode, int lexicalLevel, int modifier);
+// Returns true if the lexical level and modifier fit in an instruction.
+int instructionFits(int lexicalLevel, int modifier);
+
+// Given a string represtation of an instruction, such as "lit" or "sto",
+// return the corresponding opcode, or 0 if there is no such instruction. Only
+// knows the basic opcodes.
+int getOpcode(char *instruction);
+// Returns the name of an opcode, such as "lit" or "lod+lit+opr+sto", or "???"
+// for an invalid one.
+char *getOpcodeName(int opcode);
+
+#endif
@@ -32,7 +32,6 @@ struct tokenDefinition {
 
     char *regexString;
     int tokenType;
-    regex_t *regex;
 
 };
 
@@ -42,68 +41,74 @@ struct tokenDefinition {
 struct tokenDefinition tokenDefinitions[] = {
 
     // Whitespace
-    {"\\s+", WHITESPACESYM, NULL},
+    {"\\s+", WHITESPACESYM},
     // The comment regex is based off of http://ostermiller.org/findcomment.html
     // [*] matches a single * character, and looks slightely nicer than \\*
     // (\\* instead of \* because it needs to be escaped twice: once for the C
     // string and another time for the regex.)
-    {"/[*]([^*]|[*]+[^*/])*[*]+/", COMMENTSYM, NULL},
+    {"/[*]([^*]|[*]+[^*/])*[*]+/", COMMENTSYM},
     // Keywords
     // \\b = \b and matches the empty string, but only along a word boundary,
     // where words anything that contains [a-zA-Z0-9_].
-    {"begin\\b", BEGINSYM, NULL},
-    {"while\\b", WHILESYM, NULL},
-    {"const\\b", CONSTSYM, NULL},
-    {"write\\b", WRITESYM, NULL},
-    {"call\\b", CALLSYM, NULL},
-    {"then\\b", THENSYM, NULL},
-    {"procedure\\b", PROCSYM, NULL},
-    {"read\\b", READSYM, NULL},
-    {"else\\b", ELSESYM, NULL},
-    {"odd\\b", ODDSYM, NULL},
-    {"end\\b", ENDSYM, NULL},
-    {"int\\b", INTSYM, NULL},
-    {"if\\b", IFSYM, NULL},
-    {"do\\b", DOSYM, NULL},
+    {"begin\\b", BEGINSYM},
+    {"while\\b", WHILESYM},
+    {"const\\b", CONSTSYM},
+    {"write\\b", WRITESYM},
+    {"call\\b", CALLSYM},
+    {"then\\b", THENSYM},
+    {"procedure\\b", PROCSYM},
+    {"read\\b", READSYM},
+    {"else\\b", ELSESYM},
+    {"odd\\b", ODDSYM},
+    {"end\\b", ENDSYM},
+    {"int\\b", INTSYM},
+    {"if\\b", IFSYM},
+    {"do\\b", DOSYM},
     // Identifiers
-    {"[a-zA-Z]\\w*", IDENTSYM, NULL},
+    {"[a-zA-Z]\\w*", IDENTSYM},
     // Numbers
-    {"[0-9]+", NUMBERSYM, NULL},
+    {"[0-9]+", NUMBERSYM},
     // Special symbols
-    {">=", GEQSYM, NULL},
-    {"<=", LEQSYM, NULL},
-    {"<>", NEQSYM, NULL},
-    {":=", BECOMESSYM, NULL},
-    {"[+]", PLUSSYM, NULL},
-    {"-", MINUSSYM, NULL},
-    {"[*]", MULTSYM, NULL},
-    {"/", SLASHSYM, NULL},
-    {"=", EQSYM, NULL},
-    {"<", LESSYM, NULL},
-    {">", GTRSYM, NULL},
-    {"[(]", LPARENTSYM, NULL},
-    {"[)]", RPARENTSYM, NULL},
-    {",", COMMASYM, NULL},
-    {";", SEMICOLONSYM, NULL},
-    {"[.]", PERIODSYM, NULL},
+    {">=", GEQSYM},
+    {"<=", LEQSYM},
+    {"<>", NEQSYM},
+    {":=", BECOMESSYM},
+    {"[+]", PLUSSYM},
+    {"-", MINUSSYM},
+    {"[*]", MULTSYM},
+    {"/", SLASHSYM},
+    {"=", EQSYM},
+    {"<", LESSYM},
+    {">", GTRSYM},
+    {"[(]", LPARENTSYM},
+    {"[)]", RPARENTSYM},
+    {",", COMMASYM},
+    {";", SEMICOLONSYM},
+    {"[.]", PERIODSYM},
     // Indicates the end of token definitions.
-    {NULL, 0, NULL}
+    {NULL, 0}
 
 };
 
-// Compile all of the regexes in tokenDefinitions.
-void initLexer() {
+#define NUM_TOKEN_DEFINITIONS (sizeof(tokenDefinitions) / sizeof(tokenDefinitions[0]) - 1)
+
+// The thread's compiled regexes, for readLexemes and readLexeme. Every thread
+// compiles its own, since glibc's regexec locks the regex it runs, which
+// would make threads that lex at the same time take turns.
+__thread regex_t *tokenRegexes = NULL;
 
+regex_t *compileTokenRegexes() {
+
+    regex_t *regexes = (regex_t*)malloc(sizeof(regex_t) * NUM_TOKEN_DEFINITIONS);
     int i;
     for (i = 0; tokenDefinitions[i].regexString != NULL; i++) {
 
         // Prepend ^ to all of the regexes so that it only matches tokens at the
         // current position in the source code.
-        char *regexString = (char*)malloc(sizeof(char) * (1 + strlen(tokenDefinitions[i].regexString)));
+        char *regexString = (char*)malloc(sizeof(char) * (2 + strlen(tokenDefinitions[i].regexString)));
         regexString[0] = '^';
         strcpy(regexString + 1, tokenDefinitions[i].regexString);
-        tokenDefinitions[i].regex = (regex_t*)malloc(sizeof(regex_t));
-        int error = regcomp(tokenDefinitions[i].regex, regexString, REG_EXTENDED);
+        int error = regcomp(&regexes[i], regexString, REG_EXTENDED);
         free(regexString);
 
         // TODO: add getLexerError() function
@@ -111,7 +116,7 @@ void initLexer() {
 
           int errorStringLength = 1000;
           char *errorString = (char*)malloc(sizeof(char) * errorStringLength);
-          regerror(error, tokenDefinitions[i].regex, errorString, errorStringLength);
+          regerror(error, &regexes[i], errorString, errorStringLength);
           printError("Error compiling regex '%s': %s", tokenDefinitions[i].regexString, errorString);
           free(errorString);
 
@@ -119,23 +124,75 @@ void initLexer() {
 
     }
 
+    return regexes;
+
+}
+
+void freeTokenRegexes(regex_t *regexes) {
+
+    int i;
+    for (i = 0; tokenDefinitions[i].regexString != NULL; i++)
+        regfree(&regexes[i]);
+    free(regexes);
+
+}
+
+void initLexer() {
+
+    if (tokenRegexes == NULL)
+        tokenRegexes = compileTokenRegexes();
+
+}
+
+void freeLexer() {
+
+    if (tokenRegexes != NULL)
+        freeTokenRegexes(tokenRegexes);
+    tokenRegexes = NULL;
+
 }
 
 struct vector *readLexemes(char *source) {
 
+    initLexer();
+    return readLexemesWith(tokenRegexes, source);
+
+}
+
+struct vector *readLexemesWith(regex_t *regexes, char *source) {
+
     int i = 0;
     struct vector *lexemes = vector_init(sizeof(struct lexeme));
 
+    // The position of source[i].
+    int line = 1;
+    int column = 1;
+    void advance(int length) {
+        for (; length > 0 && source[i] != '\0'; length--, i++) {
+            if (source[i] == '\n') {
+                line++;
+                column = 1;
+            } else {
+                column++;
+            }
+        }
+    }
+
     while (source[i] != '\0') {
 
-        struct lexeme lexeme = readLexeme(&source[i]);
+        struct lexeme lexeme = readLexemeWith(regexes, &source[i]);
 
         if (lexeme.token != NULL) {
 
+            lexeme.line = line;
+            lexeme.column = column;
+
+            advance(strlen(lexeme.token));
+
             if (lexeme.tokenType != WHITESPACESYM && lexeme.tokenType != COMMENTSYM)
                 vector_push(lexemes, &lexeme);
-
-            i += strlen(lexeme.token);
+            else
+                free(lexeme.token);
 
         }
         else {
@@ -143,7 +200,7 @@ struct vector *readLexemes(char *source) {
             // TODO: add getLexerError() function
             //printError("Unrecognized symbol starting at '%.10s...'.", &source[i]);
 
-            i += 1;
+            advance(1);
 
         }
 
@@ -155,19 +212,26 @@ struct vector *readLexemes(char *source) {
 
 struct lexeme readLexeme(char *source) {
 
+    initLexer();
+    return readLexemeWith(tokenRegexes, source);
+
+}
+
+struct lexeme readLexemeWith(regex_t *regexes, char *source) {
+
     int i;
     for (i = 0; tokenDefinitions[i].regexString != NULL; i++) {
 
         struct tokenDefinition definition = tokenDefinitions[i];
 
-        char *match = getMatch(definition.regex, source);
+        char *match = getMatch(&regexes[i], source);
 
         if (match != NULL)
-            return (struct lexeme){definition.tokenType, match};
+            return (struct lexeme){definition.tokenType, match, 0, 0};
 
     }
 
-    return (struct lexeme){0, NULL};
+    return (struct lexeme){0, NULL, 0, 0};
 
 }
 
@@ -29,21 +29,34 @@ struct lexeme {
 
    int tokenType;
    char *token;
+   int line;     // Where the token starts in the source code, counting
+   int column;   // both from 1.
 
 };
 
-// Call once to compile the regular expressions used by the lexer, before using
-// the other lexer functions.
+// Compile the regular expressions used by the lexer. Every thread has its own,
+// which the other lexer functions compile the first time the thread uses
+// them if it didn't call initLexer. Calling it again does nothing.
 void initLexer();
+// Free the thread's regular expressions, e.g. before it exits.
+void freeLexer();
 
 // Given a string of PL/0 source code, return a vector of lexemes representing
-// the source code.
+// the source code, with the line and column of each one.
 struct vector *readLexemes(char *source);
 // Try to read a single lexeme at the beginning of the given string of PL/0
 // source code, returning an empty lexeme (i.e. (struct lexeme){0, NULL}) if
-// there is no valid token at the beginning of the string.
+// there is no valid token at the beginning of the string. The position of the
+// lexeme is left at 0.
 struct lexeme readLexeme(char *source);
 
+// Like readLexemes and readLexeme, but with regular expressions that the
+// caller compiled and owns, instead of the thread's.
+regex_t *compileTokenRegexes();
+void freeTokenRegexes(regex_t *regexes);
+struct vector *readLexemesWith(regex_t *regexes, char *source);
+struct lexeme readLexemeWith(regex_t *regexes, char *source);
+
 // Given a compiled regex and a string, return the first substring that matches
 // the regex, or NULL if there is no match.
 char *getMatch(regex_t *regex, char *string);
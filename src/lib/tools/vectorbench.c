@@ -0,0 +1,105 @@
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// Compares the generic vector, the generic vector growing by a fixed step
+// like it used to, and a typed vector (see DEFINE_VECTOR) at pushing and
+// reading many ints, and at making many short vectors like the parser and the
+// optimizer do. Prints nanoseconds per item.
+
+// The old growth policy of the generic vector.
+#define OLD_INITIAL_CAPACITY 20
+#define OLD_CAPACITY_STEP 20
+
+DEFINE_VECTOR(intVector, int, 8)
+
+uint64_t benchNanoseconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Keeps the compiler from optimizing the loops away.
+volatile long long sink;
+
+int main(int argc, char **argv) {
+    int numItems = (argc > 1) ? atoi(argv[1]) : 1000000;
+    if (numItems <= 0) {
+        printf("Usage: %s [<number of items>]\n", argv[0]);
+        return 1;
+    }
+
+    void report(char *name, char *kind, uint64_t start, long long operations) {
+        printf("%-34s %-10s %8.2f ns\n", name, kind,
+                (double)(benchNanoseconds() - start) / operations);
+    }
+
+    printf("%-34s %-10s %11s\n", "", "", "per item");
+
+    uint64_t start = benchNanoseconds();
+    struct vector *old = vector_init(sizeof(int));
+    vector_resize(old, OLD_INITIAL_CAPACITY);
+    int i;
+    for (i = 0; i < numItems; i++) {
+        if (old->length == old->capacity)
+            vector_resize(old, old->capacity + OLD_CAPACITY_STEP);
+        vector_push(old, &i);
+    }
+    report("generic, fixed step (before)", "push", start, numItems);
+    freeVector(old);
+
+    start = benchNanoseconds();
+    struct vector *generic = makeVector(int);
+    for (i = 0; i < numItems; i++)
+        push(generic, i);
+    report("generic, geometric", "push", start, numItems);
+
+    struct intVector typed;
+    start = benchNanoseconds();
+    intVectorInit(&typed);
+    for (i = 0; i < numItems; i++)
+        intVectorPush(&typed, i);
+    report("typed", "push", start, numItems);
+
+    long long sum = 0;
+    start = benchNanoseconds();
+    for (i = 0; i < generic->length; i++)
+        sum += get(int, generic, i);
+    report("generic", "get", start, numItems);
+    start = benchNanoseconds();
+    for (i = 0; i < typed.length; i++)
+        sum += intVectorGet(&typed, i);
+    report("typed", "get", start, numItems);
+    sink = sum;
+    freeVector(generic);
+    intVectorFree(&typed);
+
+    // Short vectors, of 4 items.
+    int numVectors = numItems / 4;
+    start = benchNanoseconds();
+    for (i = 0; i < numVectors; i++) {
+        struct vector *vector = makeVector(int);
+        int j;
+        for (j = 0; j < 4; j++)
+            push(vector, j);
+        sum += get(int, vector, 3);
+        freeVector(vector);
+    }
+    report("generic, 4 items per vector", "make+push", start, numItems);
+    start = benchNanoseconds();
+    for (i = 0; i < numVectors; i++) {
+        struct intVector vector;
+        intVectorInit(&vector);
+        int j;
+        for (j = 0; j < 4; j++)
+            intVectorPush(&vector, j);
+        sum += intVectorGet(&vector, 3);
+        intVectorFree(&vector);
+    }
+    report("typed, 4 items per vector", "make+push", start, numItems);
+    sink = sum;
+
+    return 0;
+}
@@ -22,16 +22,27 @@ struct vector* vector_copy(struct vector *vector) {
 
     struct vector *newVector = (struct vector*)malloc(sizeof (struct vector));
 
+    // Only the items are copied, not the unused capacity.
     newVector->itemSize = vector->itemSize;
     newVector->length = vector->length;
-    newVector->capacity = vector->capacity;
+    newVector->capacity = (vector->length > INITIAL_CAPACITY) ? vector->length : INITIAL_CAPACITY;
     newVector->items = malloc(newVector->itemSize * newVector->capacity);
 
-    memcpy(newVector->items, vector->items, newVector->itemSize * newVector->capacity);
+    memcpy(newVector->items, vector->items, newVector->itemSize * newVector->length);
 
     return newVector;
 }
 
+struct vector* vector_fromArray(void *items, int length, int itemSize) {
+    struct vector *vector = vector_init(itemSize);
+    if (length > vector->capacity)
+        vector_resize(vector, length);
+    memcpy(vector->items, items, itemSize * length);
+    vector->length = length;
+
+    return vector;
+}
+
 void vector_push(struct vector *vector, void *item) {
     assert(vector != NULL);
 
@@ -49,12 +60,16 @@ void* vector_get(struct vector *vector, int index) {
 void vector_set(struct vector *vector, int index, void *item) {
     assert(vector != NULL && item != NULL && index >= 0);
 
+    if (index >= vector->capacity) {
+        int newCapacity = vector->capacity * GROWTH_FACTOR;
+        if (newCapacity <= index)
+            newCapacity = (index + 1 > INITIAL_CAPACITY) ? index + 1 : INITIAL_CAPACITY;
+        vector_resize(vector, newCapacity);
+    }
+
     if (index + 1 > vector->length)
         vector->length = index + 1;
 
-    if (vector->length > vector->capacity)
-        vector_resize(vector, vector->capacity + CAPACITY_STEP);
-
     int offset = index * vector->itemSize;
     memcpy((char*)(vector->items) + offset, item, vector->itemSize);
 }
@@ -86,11 +101,12 @@ struct vector *vector_concat(struct vector *toVector, struct vector *fromVector)
     assert(toVector != NULL && fromVector != NULL);
     assert(toVector->itemSize == fromVector->itemSize);
 
-    int i;
-    for (i = 0; i < fromVector->length; i++) {
-        void *item = vector_get(fromVector, i);
-        vector_push(toVector, item);
-    }
+    int length = toVector->length + fromVector->length;
+    if (length > toVector->capacity)
+        vector_resize(toVector, length);
+    memcpy((char*)toVector->items + toVector->length * toVector->itemSize, fromVector->items,
+            fromVector->length * fromVector->itemSize);
+    toVector->length = length;
 
     return toVector;
 }
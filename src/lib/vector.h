@@ -1,6 +1,10 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
 // A vector is an array that automatically expands as you add items to it. Use
 // the functions/macros below to operate on vectors.
 //
@@ -42,9 +46,10 @@ struct vector
 };
 
 // Number of spaces to initialize when calling vector_init.
-#define INITIAL_CAPACITY 20
-// Number of spaces to add when capacity is exceeded.
-#define CAPACITY_STEP 20
+#define INITIAL_CAPACITY 8
+// The capacity is multiplied by this when it's exceeded, so that pushing n
+// items copies them O(1) times on average instead of O(n) times.
+#define GROWTH_FACTOR 2
 
 // Use these macros in preference to the functions below so that you don't have
 // to reference/dereference anything when using vector_get and
@@ -65,6 +70,8 @@ struct vector
 
 struct vector* vector_init(int itemSize);
 struct vector* vector_copy(struct vector *vector);
+// Make a vector with a copy of length items of itemSize bytes.
+struct vector* vector_fromArray(void *items, int length, int itemSize);
 void vector_push(struct vector *vector, void *item);
 void *vector_get(struct vector *vector, int index);
 void vector_set(struct vector *vector, int index, void *item);
@@ -83,4 +90,86 @@ int vector_find(struct vector *vector, void *value);
 }
 #define make(type) (type*)malloc(sizeof (type))
 
+// Typed vectors
+// -------------
+//
+// For vectors that stay inside of a module, where the generic vector's
+// memcpy of a runtime item size on every get and push is measurable.
+// DEFINE_VECTOR(name, type, smallCapacity) defines struct name, which holds
+// its first smallCapacity items inside of itself and only allocates when it
+// outgrows them, and these functions, which the compiler can inline:
+//
+// void nameInit(struct name *vector);
+// void nameReserve(struct name *vector, int capacity);
+// void namePush(struct name *vector, type item);
+// type namePop(struct name *vector);
+// type nameGet(struct name *vector, int index);
+// void nameSet(struct name *vector, int index, type item);
+// struct vector *nameToVector(struct name *vector);   // A generic copy.
+// void nameFree(struct name *vector);
+//
+// Since the items can be inside of the struct, a typed vector can't be
+// copied by value, only passed by pointer. For example:
+//
+// DEFINE_VECTOR(intVector, int, 16)
+// struct intVector worklist;
+// intVectorInit(&worklist);
+// intVectorPush(&worklist, 0);
+// while (worklist.length > 0) {
+//     int item = intVectorPop(&worklist);
+//     ...
+// }
+// intVectorFree(&worklist);
+#define DEFINE_VECTOR(name, type, smallCapacity) \
+struct name { \
+    type *items;   /* The small buffer, or an allocation. */ \
+    int length; \
+    int capacity; \
+    type small[smallCapacity]; \
+}; \
+__attribute__((unused)) static inline void name##Init(struct name *vector) { \
+    vector->items = vector->small; \
+    vector->length = 0; \
+    vector->capacity = smallCapacity; \
+} \
+__attribute__((unused)) static void name##Reserve(struct name *vector, int capacity) { \
+    if (capacity <= vector->capacity) \
+        return; \
+    int newCapacity = vector->capacity * GROWTH_FACTOR; \
+    if (newCapacity < capacity) \
+        newCapacity = capacity; \
+    if (vector->items == vector->small) { \
+        vector->items = (type*)malloc(sizeof (type) * newCapacity); \
+        memcpy(vector->items, vector->small, sizeof (type) * vector->length); \
+    } else { \
+        vector->items = (type*)realloc(vector->items, sizeof (type) * newCapacity); \
+    } \
+    vector->capacity = newCapacity; \
+} \
+__attribute__((unused)) static inline void name##Push(struct name *vector, type item) { \
+    if (vector->length == vector->capacity) \
+        name##Reserve(vector, vector->length + 1); \
+    vector->items[vector->length++] = item; \
+} \
+__attribute__((unused)) static inline type name##Pop(struct name *vector) { \
+    assert(vector->length > 0); \
+    return vector->items[--vector->length]; \
+} \
+__attribute__((unused)) static inline type name##Get(struct name *vector, int index) { \
+    assert(index >= 0 && index < vector->length); \
+    return vector->items[index]; \
+} \
+__attribute__((unused)) static inline void name##Set(struct name *vector, int index, \
+        type item) { \
+    assert(index >= 0 && index < vector->length); \
+    vector->items[index] = item; \
+} \
+__attribute__((unused)) static struct vector *name##ToVector(struct name *vector) { \
+    return vector_fromArray(vector->items, vector->length, sizeof (type)); \
+} \
+__attribute__((unused)) static inline void name##Free(struct name *vector) { \
+    if (vector->items != vector->small) \
+        free(vector->items); \
+}
+
 #endif
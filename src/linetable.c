@@ -0,0 +1,62 @@
+#include "src/linetable.h"
+#include <stdlib.h>
+
+struct vector *makeLineTable() {
+    return makeVector(struct lineEntry);
+}
+
+void addLinePosition(struct vector *table, int pc, int line, int column) {
+    if (table->length > 0) {
+        struct lineEntry last = get(struct lineEntry, table, table->length - 1);
+        if (last.line == line && last.column == column)
+            return;
+    } else if (line == 0) {
+        return;
+    }
+
+    pushLiteral(table, struct lineEntry, {pc, line, column});
+}
+
+struct lineEntry findLinePosition(struct vector *table, int pc) {
+    struct lineEntry unknown = {pc, 0, 0};
+    if (table == NULL || table->length == 0)
+        return unknown;
+
+    // Find the last entry that starts at or before pc.
+    int low = 0, high = table->length - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (get(struct lineEntry, table, middle).pc <= pc)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    struct lineEntry entry = get(struct lineEntry, table, low);
+    return (entry.pc <= pc) ? entry : unknown;
+}
+
+struct lineEntry *expandLineTable(struct vector *table, int length) {
+    struct lineEntry *positions = (struct lineEntry*)malloc(
+            sizeof(struct lineEntry) * (length + 1));
+    struct lineEntry current = {0, 0, 0};
+    int next = 0;
+    int pc;
+    for (pc = 0; pc < length; pc++) {
+        while (table != NULL && next < table->length
+                && get(struct lineEntry, table, next).pc <= pc)
+            current = get(struct lineEntry, table, next++);
+        positions[pc] = (struct lineEntry){pc, current.line, current.column};
+    }
+
+    return positions;
+}
+
+struct vector *compressLineTable(struct lineEntry *positions, int length) {
+    struct vector *table = makeLineTable();
+    int pc;
+    for (pc = 0; pc < length; pc++)
+        addLinePosition(table, pc, positions[pc].line, positions[pc].column);
+
+    return table;
+}
@@ -0,0 +1,32 @@
+#ifndef LINETABLE_H
+#define LINETABLE_H
+
+#include "src/lib/vector.h"
+
+// A line table maps instructions back to the position in the source code that
+// they were generated from. It's run-length encoded: it's a vector of entries
+// sorted by pc, and each entry covers the instructions from its pc up to the
+// next entry's pc. Instructions before the first entry have no position.
+struct lineEntry {
+    int pc;       // The first instruction of the run.
+    int line;     // The source position of the run, counting from 1, or 0 if
+    int column;   // the instructions don't come from any source code.
+};
+
+struct vector *makeLineTable();
+
+// Record that the instruction at pc comes from the given position. Only adds
+// an entry if the position differs from the one of the previous instruction,
+// so pc has to be past the pc of the last entry.
+void addLinePosition(struct vector *table, int pc, int line, int column);
+
+// Returns the entry that covers pc, which has a line of 0 if the table doesn't
+// know where it comes from.
+struct lineEntry findLinePosition(struct vector *table, int pc);
+
+// Convert between a line table and an array with the position of each of the
+// length instructions, which is easier to rearrange along with the code.
+struct lineEntry *expandLineTable(struct vector *table, int length);
+struct vector *compressLineTable(struct lineEntry *positions, int length);
+
+#endif
@@ -0,0 +1,277 @@
+#include "src/object.h"
+#include "src/cfg.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void writeWord(unsigned char *bytes, uint32_t word) {
+    bytes[0] = word & 0xff;
+    bytes[1] = (word >> 8) & 0xff;
+    bytes[2] = (word >> 16) & 0xff;
+    bytes[3] = (word >> 24) & 0xff;
+}
+
+uint32_t readWord(unsigned char *bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8)
+        | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+uint32_t encodeInstruction(struct instruction instruction) {
+    return (instruction.opcode & 0x1f)
+        | (((uint32_t)instruction.lexicalLevel & 0x7) << 5)
+        | (((uint32_t)instruction.modifier & 0xffffff) << 8);
+}
+
+struct instruction decodeInstruction(uint32_t word) {
+    // Sign extend the level and modifier.
+    int lexicalLevel = (word >> 5) & 0x7;
+    if (lexicalLevel > MAX_LEXICAL_LEVEL)
+        lexicalLevel -= 1 << 3;
+    int modifier = (word >> 8) & 0xffffff;
+    if (modifier > MAX_MODIFIER)
+        modifier -= 1 << 24;
+
+    return makeInstruction(word & 0x1f, lexicalLevel, modifier);
+}
+
+uint32_t objectChecksum(unsigned char *bytes, int size) {
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+unsigned char *encodeObjectFile(struct vector *instructions, struct vector *lines, int *size) {
+    int lineCount = (lines != NULL) ? lines->length : 0;
+    int codeSize = 4 * instructions->length;
+    *size = OBJECT_HEADER_SIZE + codeSize + 12 * lineCount;
+    unsigned char *bytes = (unsigned char*)malloc(*size);
+    unsigned char *code = bytes + OBJECT_HEADER_SIZE;
+    unsigned char *lineTable = code + codeSize;
+
+    forVector(instructions, i, struct instruction, instruction,
+        writeWord(&code[4 * i], encodeInstruction(instruction)););
+    int i;
+    for (i = 0; i < lineCount; i++) {
+        struct lineEntry entry = get(struct lineEntry, lines, i);
+        writeWord(&lineTable[12 * i], entry.pc);
+        writeWord(&lineTable[12 * i + 4], entry.line);
+        writeWord(&lineTable[12 * i + 8], entry.column);
+    }
+
+    memcpy(bytes, OBJECT_MAGIC, 4);
+    writeWord(&bytes[4], OBJECT_VERSION);
+    writeWord(&bytes[8], instructions->length);
+    writeWord(&bytes[12], computeMaxStackDepth(instructions));
+    writeWord(&bytes[16], objectChecksum(code, codeSize + 12 * lineCount));
+    writeWord(&bytes[20], lineCount);
+
+    return bytes;
+}
+
+int isObjectFile(unsigned char *bytes, int size) {
+    return size >= 4 && memcmp(bytes, OBJECT_MAGIC, 4) == 0;
+}
+
+struct objectFile *decodeObjectFile(unsigned char *bytes, int size) {
+    if (size < OBJECT_V1_HEADER_SIZE || !isObjectFile(bytes, size)) {
+        setObjectFileError("Not a PL/0 object file.");
+        return NULL;
+    }
+
+    int version = readWord(&bytes[4]);
+    if (version != OBJECT_VERSION && version != 1) {
+        setObjectFileError(format("Unsupported object file version %d.", version));
+        return NULL;
+    }
+
+    int headerSize = (version == 1) ? OBJECT_V1_HEADER_SIZE : OBJECT_HEADER_SIZE;
+    if (size < headerSize) {
+        setObjectFileError("Object file is truncated.");
+        return NULL;
+    }
+
+    uint32_t codeLength = readWord(&bytes[8]);
+    uint32_t lineCount = (version == 1) ? 0 : readWord(&bytes[20]);
+    if (codeLength > (uint32_t)(size - headerSize) / 4) {
+        setObjectFileError(format("Object file is truncated: expected %u instructions.",
+                    codeLength));
+        return NULL;
+    }
+    if (lineCount > (uint32_t)(size - headerSize - 4 * codeLength) / 12) {
+        setObjectFileError(format("Object file is truncated: expected %u line table entries.",
+                    lineCount));
+        return NULL;
+    }
+
+    unsigned char *code = bytes + headerSize;
+    unsigned char *lineTable = code + 4 * codeLength;
+    uint32_t checksum = readWord(&bytes[16]);
+    if (objectChecksum(code, 4 * codeLength + 12 * lineCount) != checksum) {
+        setObjectFileError("Object file checksum mismatch.");
+        return NULL;
+    }
+
+    struct objectFile *object = make(struct objectFile);
+    object->version = version;
+    object->codeLength = codeLength;
+    object->stackSize = readWord(&bytes[12]);
+    object->checksum = checksum;
+    object->instructions = makeVector(struct instruction);
+    vector_resize(object->instructions, codeLength);
+    object->lines = makeLineTable();
+    if (lineCount > 0)
+        vector_resize(object->lines, lineCount);
+
+    int i;
+    for (i = 0; i < codeLength; i++) {
+        struct instruction instruction = decodeInstruction(readWord(&code[4 * i]));
+        if (instruction.opcode < LIT || instruction.opcode >= NUM_ALL_OPCODES) {
+            setObjectFileError(format("Invalid opcode %d at instruction %d.",
+                        instruction.opcode, i));
+            freeObjectFile(object);
+            return NULL;
+        }
+        push(object->instructions, instruction);
+    }
+
+    for (i = 0; i < lineCount; i++) {
+        struct lineEntry entry = {readWord(&lineTable[12 * i]),
+            readWord(&lineTable[12 * i + 4]), readWord(&lineTable[12 * i + 8])};
+        int previousPc = (i > 0) ? get(struct lineEntry, object->lines, i - 1).pc : -1;
+        if (entry.pc <= previousPc || entry.pc >= codeLength
+                || entry.line < 0 || entry.column < 0) {
+            setObjectFileError(format("Invalid line table entry %d.", i));
+            freeObjectFile(object);
+            return NULL;
+        }
+        push(object->lines, entry);
+    }
+
+    return object;
+}
+
+int writeObjectFile(FILE *file, struct vector *instructions, struct vector *lines) {
+    int size;
+    unsigned char *bytes = encodeObjectFile(instructions, lines, &size);
+    int written = fwrite(bytes, 1, size, file);
+    free(bytes);
+
+    return (written == size && fflush(file) == 0);
+}
+
+struct objectFile *loadObjectFile(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        setObjectFileError(format("Could not open '%s'.", filename));
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < OBJECT_V1_HEADER_SIZE) {
+        close(fd);
+        setObjectFileError("Not a PL/0 object file.");
+        return NULL;
+    }
+
+    unsigned char *bytes = (unsigned char*)mmap(NULL, info.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        setObjectFileError(format("Could not map '%s'.", filename));
+        return NULL;
+    }
+
+    struct objectFile *object = decodeObjectFile(bytes, info.st_size);
+    munmap(bytes, info.st_size);
+
+    return object;
+}
+
+void freeObjectFile(struct objectFile *object) {
+    freeVector(object->instructions);
+    freeVector(object->lines);
+    free(object);
+}
+
+struct vector *readTextInstructions(FILE *file) {
+    struct vector *instructions = makeVector(struct instruction);
+    int opcode, lexicalLevel, modifier;
+    int read;
+
+    while ((read = fscanf(file, "%d %d %d", &opcode, &lexicalLevel, &modifier)) == 3) {
+        if (opcode < LIT || opcode >= NUM_OPCODES || !instructionFits(lexicalLevel, modifier)) {
+            setObjectFileError(format("Invalid instruction %d %d %d at line %d.",
+                        opcode, lexicalLevel, modifier, instructions->length + 1));
+            freeVector(instructions);
+            return NULL;
+        }
+        pushLiteral(instructions, struct instruction,
+                makeInstruction(opcode, lexicalLevel, modifier));
+    }
+
+    if (read != EOF) {
+        setObjectFileError(format("Expected an instruction at line %d.",
+                    instructions->length + 1));
+        freeVector(instructions);
+        return NULL;
+    }
+
+    return instructions;
+}
+
+struct vector *loadProgram(char *filename, int *stackSize, struct vector **lines) {
+    *stackSize = 0;
+    if (lines != NULL)
+        *lines = NULL;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        setObjectFileError("Could not open the program file.");
+        return NULL;
+    }
+
+    unsigned char magic[4];
+    int isObject = isObjectFile(magic, fread(magic, 1, sizeof(magic), file));
+
+    if (!isObject) {
+        rewind(file);
+        struct vector *instructions = readTextInstructions(file);
+        fclose(file);
+        if (instructions != NULL && lines != NULL)
+            *lines = makeLineTable();
+        return instructions;
+    }
+
+    fclose(file);
+    struct objectFile *object = loadObjectFile(filename);
+    if (object == NULL)
+        return NULL;
+
+    struct vector *instructions = object->instructions;
+    *stackSize = object->stackSize;
+    if (lines != NULL)
+        *lines = object->lines;
+    else
+        freeVector(object->lines);
+    free(object);
+
+    return instructions;
+}
+
+__thread char *objectFileError = NULL;
+
+char *setObjectFileError(char *message) {
+    objectFileError = message;
+    return message;
+}
+char *getObjectFileError() {
+    return objectFileError;
+}
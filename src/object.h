@@ -0,0 +1,85 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "src/instruction.h"
+#include "src/linetable.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Binary object file format, written by the compiler and read by the VM. All
+// fields are little endian 32-bit words:
+//
+//   magic        "PL0O"
+//   version      OBJECT_VERSION
+//   codeLength   Number of instructions.
+//   stackSize    Stack slots the code needs, from computeMaxStackDepth.
+//   checksum     FNV-1a hash of the code and line table bytes.
+//   lineCount    Number of line table entries.
+//   code         codeLength encoded instructions, see encodeInstruction. They
+//                can include fused opcodes (see fusion.h).
+//   lines        lineCount (pc, line, column) triples, the line table of the
+//                code (see linetable.h), sorted by pc.
+//
+// Version 1 files have no lineCount and no line table, and are still read.
+
+#define OBJECT_MAGIC "PL0O"
+#define OBJECT_VERSION 2
+#define OBJECT_HEADER_SIZE 24
+#define OBJECT_V1_HEADER_SIZE 20
+
+struct objectFile {
+    int version;
+    int codeLength;
+    int stackSize;
+    uint32_t checksum;
+    struct vector *instructions;
+    struct vector *lines;   // The line table, which is empty if the file
+                            // doesn't have one.
+};
+
+// Encode the instructions and their line table (which can be NULL) as an
+// object file. Returns a malloc'ed buffer and puts its size in *size.
+unsigned char *encodeObjectFile(struct vector *instructions, struct vector *lines, int *size);
+// Decode and check an object file. Returns NULL and sets the object file error
+// if the bytes aren't a valid object file.
+struct objectFile *decodeObjectFile(unsigned char *bytes, int size);
+// Returns true if the bytes start with the object file magic number.
+int isObjectFile(unsigned char *bytes, int size);
+
+// Write the instructions and their line table (which can be NULL) to a file
+// as an object file, in a single write. Returns false if the write failed.
+int writeObjectFile(FILE *file, struct vector *instructions, struct vector *lines);
+// Map an object file into memory and decode it. Returns NULL and sets the
+// object file error if it can't be read or isn't a valid object file.
+struct objectFile *loadObjectFile(char *filename);
+void freeObjectFile(struct objectFile *object);
+
+// Instructions are stored as one word each: the opcode in bits 0-4, the
+// lexical level in bits 5-7 and the modifier in bits 8-31, with the level and
+// modifier in two's complement.
+uint32_t encodeInstruction(struct instruction instruction);
+struct instruction decodeInstruction(uint32_t word);
+// Write or read one of the little endian words of an object file.
+void writeWord(unsigned char *bytes, uint32_t word);
+uint32_t readWord(unsigned char *bytes);
+
+// Read instructions in the text format printed by `compiler --text`, one
+// "opcode level modifier" triple per line. The text format is also what the
+// old vm reads, so it only has basic opcodes. Returns NULL and sets the object
+// file error if the file doesn't hold valid instructions.
+struct vector *readTextInstructions(FILE *file);
+
+// Load an object file, or a text file as printed by `compiler --text`. Puts
+// the stack size that an object file asks for in *stackSize, or 0 for a text
+// file. If lines isn't NULL, puts the line table in *lines, which is empty if
+// the file doesn't have one. Returns NULL and sets the object file error on
+// failure.
+struct vector *loadProgram(char *filename, int *stackSize, struct vector **lines);
+
+uint32_t objectChecksum(unsigned char *bytes, int size);
+
+char *setObjectFileError(char *message);
+char *getObjectFileError();
+
+#endif
@@ -0,0 +1,793 @@
+#include "src/optimizer.h"
+#include "src/cfg.h"
+#include "src/generator.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Maximum number of times optimizeInstructions runs all of the passes. Each
+// round removes or retargets something, so this is only a safety net.
+#define MAX_OPTIMIZATION_ROUNDS 50
+
+DEFINE_VECTOR(intVector, int, 16)
+
+// When optimizeInstructionsWithLines is keeping track of positions, the index
+// of the old instruction that each instruction in the result of the last
+// rewrite came from. NULL otherwise. Per thread, since every thread that
+// optimizes has its own.
+__thread struct vector *rewriteOrigins = NULL;
+
+struct vector *optimizeInstructions(struct vector *instructions) {
+    return optimizeInstructionsWithLines(instructions, NULL);
+}
+
+struct vector *optimizeInstructionsWithLines(struct vector *instructions, struct vector **lines) {
+    assert(instructions != NULL);
+
+    struct vector *original = instructions;
+    struct lineEntry *positions = NULL;
+    if (lines != NULL) {
+        positions = expandLineTable(*lines, instructions->length);
+        rewriteOrigins = makeVector(int);
+    }
+
+    // Replaces instructions with the result of a pass, freeing the old vector
+    // unless it's the one that we were given, and moves the positions along.
+    void update(struct vector *result) {
+        if (positions != NULL && result != instructions) {
+            assert(rewriteOrigins->length == result->length);
+            struct lineEntry *newPositions = (struct lineEntry*)malloc(
+                    sizeof(struct lineEntry) * (result->length + 1));
+            forVector(rewriteOrigins, i, int, origin,
+                newPositions[i] = positions[origin];);
+            free(positions);
+            positions = newPositions;
+        }
+        if (rewriteOrigins != NULL)
+            rewriteOrigins->length = 0;
+
+        if (result != instructions && instructions != original)
+            freeVector(instructions);
+        instructions = result;
+    }
+
+    int round;
+    for (round = 0; round < MAX_OPTIMIZATION_ROUNDS; round++) {
+        int changed = 0;
+
+        update(threadJumps(instructions, &changed));
+        update(removeUnreachableCode(instructions, &changed));
+        update(eliminateDeadStores(instructions, &changed));
+        update(hoistLoopInvariants(instructions, &changed));
+        update(eliminateCommonSubexpressions(instructions, &changed));
+
+        if (!changed)
+            break;
+    }
+
+    if (positions != NULL) {
+        freeVector(*lines);
+        *lines = compressLineTable(positions, instructions->length);
+        free(positions);
+        freeVector(rewriteOrigins);
+        rewriteOrigins = NULL;
+    }
+
+    return instructions;
+}
+
+// Allocate an array of replacements in which every instruction is kept.
+struct vector **makeReplacements(int length) {
+    return (struct vector**)calloc(length + 1, sizeof(struct vector*));
+}
+
+void freeReplacements(struct vector **replacements, int length) {
+    int i;
+    for (i = 0; i < length; i++)
+        if (replacements[i] != NULL)
+            freeVector(replacements[i]);
+    free(replacements);
+}
+
+struct vector *rewriteInstructions(struct vector *instructions, struct vector **replacements) {
+    return rewriteInstructionsWithInsertions(instructions, replacements, NULL);
+}
+
+struct vector *rewriteInstructionsWithInsertions(struct vector *instructions,
+        struct vector **replacements, struct vector **insertions) {
+    int length = instructions->length;
+
+    // Find out where each old instruction ends up, both including
+    // (entryIndex) and excluding (bodyIndex) the instructions inserted in
+    // front of it.
+    int *entryIndex = (int*)malloc(sizeof(int) * (length + 1));
+    int *bodyIndex = (int*)malloc(sizeof(int) * (length + 1));
+    int position = 0;
+    int i;
+    for (i = 0; i < length; i++) {
+        entryIndex[i] = position;
+        if (insertions != NULL && insertions[i] != NULL)
+            position += insertions[i]->length;
+        bodyIndex[i] = position;
+        position += (replacements[i] != NULL) ? replacements[i]->length : 1;
+    }
+    entryIndex[length] = bodyIndex[length] = position;
+
+    struct vector *result = makeVector(struct instruction);
+
+    // Emit an instruction that came from the old instruction at index origin.
+    // Its jumps are translated as if it were at index from.
+    void emit(struct instruction instruction, int from, int origin) {
+        int isCodeAddress = isJumpInstruction(instruction)
+            || instruction.opcode == CAL;
+        int target = instruction.modifier;
+        if (isCodeAddress && target >= 0 && target <= length)
+            instruction.modifier = (target <= from) ? bodyIndex[target] : entryIndex[target];
+        push(result, instruction);
+        if (rewriteOrigins != NULL)
+            push(rewriteOrigins, origin);
+    }
+
+    if (rewriteOrigins != NULL)
+        rewriteOrigins->length = 0;
+    for (i = 0; i < length; i++) {
+        if (insertions != NULL && insertions[i] != NULL) {
+            forVector(insertions[i], j, struct instruction, instruction,
+                emit(instruction, i - 1, i););
+        }
+
+        if (replacements[i] == NULL) {
+            emit(get(struct instruction, instructions, i), i, i);
+        } else {
+            forVector(replacements[i], j, struct instruction, instruction,
+                emit(instruction, i, i););
+        }
+    }
+
+    free(entryIndex);
+    free(bodyIndex);
+    return result;
+}
+
+// Returns how many values a side effect free instruction pops off the stack,
+// or -1 if the instruction has side effects or can trap. Division and modulo
+// count as having side effects because removing them could remove a division
+// by zero.
+int pureOperandCount(struct instruction instruction) {
+    if (instruction.opcode == LIT || instruction.opcode == LOD)
+        return 0;
+
+    if (instruction.opcode == OPR) {
+        switch (instruction.modifier) {
+            case NEG: case ODD:
+                return 1;
+            case ADD: case SUB: case MUL:
+            case EQL: case NEQ: case LSS: case LEQ: case GTR: case GEQ:
+                return 2;
+        }
+    }
+
+    return -1;
+}
+
+int findExpressionStart(struct vector *instructions, int end, int limit) {
+    // The number of values that still have to be pushed by the instructions
+    // before the current one.
+    int needed = 1;
+
+    int i;
+    for (i = end; i >= limit && i >= 0; i--) {
+        int consumed = pureOperandCount(get(struct instruction, instructions, i));
+        if (consumed < 0)
+            return -1;
+
+        needed += consumed - 1;
+        if (needed == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+struct vector *eliminateDeadStores(struct vector *instructions, int *changed) {
+    struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+    computeLiveness(cfg);
+
+    int length = instructions->length;
+    int numVariables = cfg->numVariables;
+    struct vector **replacements = makeReplacements(length);
+    char *live = (char*)malloc(sizeof(char) * (numVariables + 1));
+    int removedAny = 0;
+
+    // Walk each block backwards, keeping track of which variables are live
+    // after the current instruction.
+    forVector(cfg->blocks, b, struct basicBlock, block,
+        memcpy(live, block.liveOut, numVariables);
+
+        int i;
+        for (i = block.end - 1; i >= block.start; i--) {
+            struct instruction instruction = get(struct instruction, instructions, i);
+            int address = instruction.modifier;
+            int isLocal = (instruction.lexicalLevel == 0
+                    && address >= 0 && address < numVariables);
+
+            if (instruction.opcode == STO && isLocal) {
+                // There is no instruction that just pops the stack, so a dead
+                // store can only be removed along with the code that pushed
+                // the value it stores.
+                int start = live[address] ? -1
+                    : findExpressionStart(instructions, i - 1, block.start);
+                if (start >= 0) {
+                    int j;
+                    for (j = start; j <= i; j++)
+                        replacements[j] = makeVector(struct instruction);
+                    removedAny = 1;
+                    // Skip the removed instructions, their loads don't count
+                    // as uses any more.
+                    i = start;
+                    continue;
+                }
+                live[address] = 0;
+            } else if (instruction.opcode == LOD && isLocal) {
+                live[address] = 1;
+            } else if (instruction.opcode == CAL) {
+                memset(live, 1, numVariables);
+            }
+        }
+    );
+
+    struct vector *result = instructions;
+    if (removedAny) {
+        result = rewriteInstructions(instructions, replacements);
+        *changed = 1;
+    }
+
+    free(live);
+    freeReplacements(replacements, length);
+    freeControlFlowGraph(cfg);
+
+    return result;
+}
+
+struct vector *threadJumps(struct vector *instructions, int *changed) {
+    int length = instructions->length;
+    struct vector **replacements = makeReplacements(length);
+    int threadedAny = 0;
+
+    forVector(instructions, i, struct instruction, instruction,
+        if (!isJumpInstruction(instruction))
+            continue;
+
+        // Follow chains of unconditional jumps. Give up after length steps,
+        // which can only happen if the jumps form an infinite loop.
+        int target = instruction.modifier;
+        int steps = 0;
+        while (target >= 0 && target < length && steps < length) {
+            struct instruction next = get(struct instruction, instructions, target);
+            if (next.opcode != JMP)
+                break;
+            target = next.modifier;
+            steps += 1;
+        }
+
+        int isJmp = (instruction.opcode == JMP);
+        int targetsReturn = (target >= 0 && target < length
+                && isReturnInstruction(get(struct instruction, instructions, target)));
+
+        if (isJmp && targetsReturn) {
+            // Jumping to a return is the same as returning right away.
+            replacements[i] = makeVector(struct instruction);
+            pushLiteral(replacements[i], struct instruction,
+                    get(struct instruction, instructions, target));
+        } else if (isJmp && target == i + 1) {
+            // A jmp to the next instruction does nothing.
+            replacements[i] = makeVector(struct instruction);
+        } else if (target != instruction.modifier) {
+            replacements[i] = makeVector(struct instruction);
+            instruction.modifier = target;
+            push(replacements[i], instruction);
+        } else {
+            continue;
+        }
+        threadedAny = 1;
+    );
+
+    struct vector *result = instructions;
+    if (threadedAny) {
+        result = rewriteInstructions(instructions, replacements);
+        *changed = 1;
+    }
+
+    freeReplacements(replacements, length);
+
+    return result;
+}
+
+struct vector *removeUnreachableCode(struct vector *instructions, int *changed) {
+    if (instructions->length == 0)
+        return instructions;
+
+    struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+    int numBlocks = cfg->blocks->length;
+
+    // Do a depth first search from the entry block.
+    char *reachable = (char*)calloc(numBlocks, sizeof(char));
+    struct intVector worklist;
+    intVectorInit(&worklist);
+    intVectorPush(&worklist, 0);
+    reachable[0] = 1;
+    while (worklist.length > 0) {
+        int b = intVectorPop(&worklist);
+
+        struct basicBlock block = get(struct basicBlock, cfg->blocks, b);
+        forVector(block.successors, s, int, successor,
+            if (!reachable[successor]) {
+                reachable[successor] = 1;
+                intVectorPush(&worklist, successor);
+            });
+    }
+
+    int length = instructions->length;
+    struct vector **replacements = makeReplacements(length);
+    int removedAny = 0;
+    forVector(cfg->blocks, b, struct basicBlock, block,
+        if (!reachable[b]) {
+            int i;
+            for (i = block.start; i < block.end; i++)
+                replacements[i] = makeVector(struct instruction);
+            removedAny = 1;
+        });
+
+    struct vector *result = instructions;
+    if (removedAny) {
+        result = rewriteInstructions(instructions, replacements);
+        *changed = 1;
+    }
+
+    free(reachable);
+    intVectorFree(&worklist);
+    freeReplacements(replacements, length);
+    freeControlFlowGraph(cfg);
+
+    return result;
+}
+
+// A value number identifies the value computed by an expression: two
+// expressions get the same value number if they're guaranteed to compute the
+// same value.
+struct valueKey {
+    int kind;   // The opcode that computes the value, or UNKNOWN_VALUE.
+    int a, b, c;
+};
+#define UNKNOWN_VALUE -1
+
+// A value on the simulated stack.
+struct stackValue {
+    int number;   // Value number.
+    int start;    // Index of the first instruction of the code that computed
+                  // the value, or -1 if that code can't be recomputed.
+};
+
+// An instance of a pure expression with at least one operator.
+struct occurrence {
+    int number;
+    int start;
+    int end;   // Index of the instruction that pushes the value.
+};
+
+DEFINE_VECTOR(valueKeyVector, struct valueKey, 64)
+DEFINE_VECTOR(stackValueVector, struct stackValue, 32)
+DEFINE_VECTOR(occurrenceVector, struct occurrence, 32)
+
+// Returns true if the operator gives the same result with its operands
+// swapped (add, mul, eql, neq).
+int isCommutative(int operator) {
+    return operator == ADD || operator == MUL || operator == EQL || operator == NEQ;
+}
+
+int canAddTemporaries(struct vector *instructions) {
+    // The temporaries are allocated by growing the inc at the start of the
+    // program, so there has to be one, and nothing else can touch the frame
+    // layout.
+    if (instructions->length == 0)
+        return 0;
+    struct instruction first = get(struct instruction, instructions, 0);
+    if (first.opcode != INC || first.lexicalLevel != 0)
+        return 0;
+    forVector(instructions, i, struct instruction, instruction,
+        if (instruction.opcode == CAL
+                || (isJumpInstruction(instruction) && instruction.modifier == 0))
+            return 0;);
+
+    return 1;
+}
+
+void growFrame(struct vector **replacements, int frameSize) {
+    // Instruction 0 is the inc, which is never part of an expression, so this
+    // doesn't clobber another replacement.
+    assert(replacements[0] == NULL);
+    replacements[0] = makeVector(struct instruction);
+    pushLiteral(replacements[0], struct instruction, makeInstruction(INC, 0, frameSize));
+}
+
+// qsort comparators for occurrences. These can't be nested functions because
+// taking the address of one needs an executable stack.
+int compareOccurrenceLengths(const void *x, const void *y) {
+    const struct occurrence *a = x, *b = y;
+    int difference = (b->end - b->start) - (a->end - a->start);
+    return (difference != 0) ? difference : (a->start - b->start);
+}
+int compareOccurrenceStarts(const void *x, const void *y) {
+    return ((const struct occurrence*)x)->start - ((const struct occurrence*)y)->start;
+}
+
+// Find the repeated expressions in a single block, adding replacements that
+// compute each chosen expression into a temporary at the given frame
+// addresses. Returns the number of temporaries used.
+int numberValuesInBlock(struct vector *instructions, struct basicBlock block,
+        struct vector **replacements, int firstTemporary) {
+    struct valueKeyVector keys;
+    struct stackValueVector stack;
+    struct occurrenceVector occurrences;
+    // The number of stores to each variable so far, so that loads before and
+    // after a store get different value numbers. Grown on demand.
+    struct intVector versions;
+    valueKeyVectorInit(&keys);
+    stackValueVectorInit(&stack);
+    occurrenceVectorInit(&occurrences);
+    intVectorInit(&versions);
+    int epoch = 0;   // Bumped by calls, which can store to any variable.
+
+    int valueNumber(struct valueKey key) {
+        if (key.kind != UNKNOWN_VALUE) {
+            int j;
+            for (j = 0; j < keys.length; j++) {
+                struct valueKey other = keys.items[j];
+                if (other.kind == key.kind && other.a == key.a && other.b == key.b
+                        && other.c == key.c)
+                    return j;
+            }
+        }
+        valueKeyVectorPush(&keys, key);
+        return keys.length - 1;
+    }
+    int version(int address) {
+        while (versions.length <= address)
+            intVectorPush(&versions, 0);
+        return intVectorGet(&versions, address) + epoch;
+    }
+    void pushValue(int number, int start) {
+        stackValueVectorPush(&stack, (struct stackValue){number, start});
+    }
+    // Pops a value, or returns an unknown value if the block started with
+    // values on the stack.
+    struct stackValue popValue() {
+        if (stack.length == 0)
+            return (struct stackValue){valueNumber((struct valueKey){UNKNOWN_VALUE}), -1};
+        return stackValueVectorPop(&stack);
+    }
+    void pushUnknown() {
+        pushValue(valueNumber((struct valueKey){UNKNOWN_VALUE}), -1);
+    }
+
+    int i;
+    for (i = block.start; i < block.end; i++) {
+        struct instruction instruction = get(struct instruction, instructions, i);
+        int opcode = instruction.opcode;
+
+        if (opcode == LIT) {
+            pushValue(valueNumber((struct valueKey){LIT, instruction.modifier}), i);
+        } else if (opcode == LOD) {
+            int address = instruction.modifier;
+            int loadVersion = (instruction.lexicalLevel == 0 && address >= 0)
+                ? version(address) : epoch;
+            pushValue(valueNumber((struct valueKey){LOD, instruction.lexicalLevel,
+                        address, loadVersion}), i);
+        } else if (opcode == STO) {
+            popValue();
+            int address = instruction.modifier;
+            if (instruction.lexicalLevel == 0 && address >= 0) {
+                version(address);
+                intVectorSet(&versions, address, intVectorGet(&versions, address) + 1);
+            } else {
+                epoch += 1;
+            }
+        } else if (opcode == OPR && instruction.modifier != RET) {
+            int operator = instruction.modifier;
+            int isUnary = (operator == NEG || operator == ODD);
+            struct stackValue right = popValue();
+            struct stackValue left = isUnary ? right : popValue();
+            int x = isUnary ? -1 : left.number;
+            int y = right.number;
+            if (isCommutative(operator) && x > y) {
+                int swap = x;
+                x = y;
+                y = swap;
+            }
+
+            int number = valueNumber((struct valueKey){OPR, operator, x, y});
+            int start = (left.start >= 0 && right.start >= 0) ? left.start : -1;
+            pushValue(number, start);
+            if (start >= 0)
+                occurrenceVectorPush(&occurrences, (struct occurrence){number, start, i});
+        } else if (opcode == READ) {
+            pushUnknown();
+        } else if (opcode == JPC || opcode == SIO) {
+            popValue();
+        } else if (opcode == INC) {
+            int k;
+            for (k = 0; k < instruction.modifier; k++)
+                pushUnknown();
+            for (k = 0; k > instruction.modifier; k--)
+                popValue();
+        } else if (opcode == CAL) {
+            epoch += 1;
+        }
+    }
+
+    // Instructions that are deleted by one of the chosen expressions.
+    char *claimed = (char*)calloc(block.end - block.start, sizeof(char));
+    int isClaimed(struct occurrence occurrence) {
+        int j;
+        for (j = occurrence.start; j <= occurrence.end; j++)
+            if (claimed[j - block.start])
+                return 1;
+        return 0;
+    }
+
+    // Try the longest expressions first, since they save the most.
+    qsort(occurrences.items, occurrences.length, sizeof(struct occurrence),
+            compareOccurrenceLengths);
+
+    char *done = (char*)calloc(keys.length + 1, sizeof(char));
+    int numTemporaries = 0;
+    int k;
+    for (k = 0; k < occurrences.length; k++) {
+        struct occurrence candidate = occurrences.items[k];
+        if (done[candidate.number])
+            continue;
+        done[candidate.number] = 1;
+
+        // Collect the instances of this expression that are still intact, in
+        // code order.
+        struct occurrenceVector instances;
+        occurrenceVectorInit(&instances);
+        int m;
+        for (m = 0; m < occurrences.length; m++) {
+            struct occurrence other = occurrences.items[m];
+            if (other.number == candidate.number && !isClaimed(other))
+                occurrenceVectorPush(&instances, other);
+        }
+        qsort(instances.items, instances.length, sizeof(struct occurrence),
+                compareOccurrenceStarts);
+
+        // Cost model: storing the first instance and loading it back costs two
+        // instructions, and every later instance shrinks to a single load.
+        int saved = -2;
+        for (m = 1; m < instances.length; m++)
+            saved += instances.items[m].end - instances.items[m].start;
+
+        if (instances.length >= 2 && saved > 0) {
+            int temporary = firstTemporary + numTemporaries;
+            numTemporaries += 1;
+
+            struct occurrence first = instances.items[0];
+            replacements[first.end] = makeVector(struct instruction);
+            pushLiteral(replacements[first.end], struct instruction,
+                    get(struct instruction, instructions, first.end));
+            pushLiteral(replacements[first.end], struct instruction,
+                    makeInstruction(STO, 0, temporary));
+            pushLiteral(replacements[first.end], struct instruction,
+                    makeInstruction(LOD, 0, temporary));
+
+            for (m = 1; m < instances.length; m++) {
+                struct occurrence instance = instances.items[m];
+                int j;
+                for (j = instance.start; j <= instance.end; j++) {
+                    claimed[j - block.start] = 1;
+                    replacements[j] = makeVector(struct instruction);
+                }
+                pushLiteral(replacements[instance.start], struct instruction,
+                        makeInstruction(LOD, 0, temporary));
+            }
+        }
+
+        occurrenceVectorFree(&instances);
+    }
+
+    free(done);
+    free(claimed);
+    valueKeyVectorFree(&keys);
+    stackValueVectorFree(&stack);
+    occurrenceVectorFree(&occurrences);
+    intVectorFree(&versions);
+
+    return numTemporaries;
+}
+
+struct vector *eliminateCommonSubexpressions(struct vector *instructions, int *changed) {
+    if (!canAddTemporaries(instructions))
+        return instructions;
+
+    int length = instructions->length;
+    struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+    struct vector **replacements = makeReplacements(length);
+
+    // Temporaries only live within a block, so every block can reuse the
+    // same slots.
+    int firstTemporary = cfg->numVariables;
+    int numTemporaries = 0;
+    forVector(cfg->blocks, b, struct basicBlock, block,
+        int used = numberValuesInBlock(instructions, block, replacements, firstTemporary);
+        if (used > numTemporaries)
+            numTemporaries = used;);
+
+    struct vector *result = instructions;
+    if (numTemporaries > 0) {
+        growFrame(replacements, firstTemporary + numTemporaries);
+        result = rewriteInstructions(instructions, replacements);
+        *changed = 1;
+    }
+
+    freeReplacements(replacements, length);
+    freeControlFlowGraph(cfg);
+
+    return result;
+}
+
+// A loop is the instructions from a jump target up to a jmp back to it.
+struct loop {
+    int header;   // Index of the first instruction of the loop.
+    int end;      // Index of the jmp back to the header.
+};
+
+int compareLoopSizes(const void *x, const void *y) {
+    const struct loop *a = x, *b = y;
+    return (a->end - a->header) - (b->end - b->header);
+}
+
+// Returns true if the loop can only be entered through its header, and only
+// jumps from inside the loop go back to the header. Jumping backwards to the
+// header skips the pre-header, which would be wrong when coming from outside.
+int isSingleEntryLoop(struct vector *instructions, struct loop loop) {
+    forVector(instructions, i, struct instruction, instruction,
+        int isInside = (i >= loop.header && i <= loop.end);
+        int target = instruction.modifier;
+        if (isJumpInstruction(instruction) && !isInside) {
+            if (target > loop.header && target <= loop.end)
+                return 0;
+            if (target == loop.header && i > loop.end)
+                return 0;
+        });
+
+    return 1;
+}
+
+struct vector *hoistLoopInvariants(struct vector *instructions, int *changed) {
+    if (!canAddTemporaries(instructions))
+        return instructions;
+
+    int length = instructions->length;
+    struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+    int numVariables = cfg->numVariables;
+
+    // Find the loops, innermost (smallest) first.
+    struct vector *loops = makeVector(struct loop);
+    forVector(instructions, i, struct instruction, instruction,
+        if (instruction.opcode == JMP
+                && instruction.modifier >= 0 && instruction.modifier <= i)
+            pushLiteral(loops, struct loop, {instruction.modifier, i}););
+    qsort(loops->items, loops->length, sizeof(struct loop), compareLoopSizes);
+
+    struct vector **replacements = makeReplacements(length);
+    struct vector **insertions = makeReplacements(length);
+    // Instructions in loops that have already been changed. Loops around them
+    // are handled in the next round, after the pre-header has been added.
+    char *changedLoop = (char*)calloc(length, sizeof(char));
+    char *stored = (char*)malloc(sizeof(char) * (numVariables + 1));
+    int numTemporaries = 0;
+
+    forVector(loops, l, struct loop, loop,
+        int i, j;
+        int isSafe = isSingleEntryLoop(instructions, loop);
+        for (i = loop.header; i <= loop.end; i++)
+            if (changedLoop[i])
+                isSafe = 0;
+        if (!isSafe)
+            continue;
+
+        // Find the variables that the loop stores to. Calls and stores to
+        // other frames could store to anything.
+        memset(stored, 0, numVariables);
+        for (i = loop.header; i <= loop.end; i++) {
+            struct instruction instruction = get(struct instruction, instructions, i);
+            if (instruction.opcode == STO) {
+                if (instruction.lexicalLevel == 0 && instruction.modifier >= 0
+                        && instruction.modifier < numVariables)
+                    stored[instruction.modifier] = 1;
+                else
+                    isSafe = 0;
+            } else if (instruction.opcode == CAL) {
+                isSafe = 0;
+            }
+        }
+        if (!isSafe)
+            continue;
+
+        int isInvariant(int start, int end) {
+            for (j = start; j <= end; j++) {
+                struct instruction instruction = get(struct instruction, instructions, j);
+                if (instruction.opcode == LOD
+                        && (instruction.lexicalLevel != 0 || instruction.modifier < 0
+                            || instruction.modifier >= numVariables
+                            || stored[instruction.modifier]))
+                    return 0;
+            }
+            return 1;
+        }
+
+        // Find the largest invariant expressions, going backwards so that
+        // the subexpressions of an expression that has been hoisted are
+        // skipped.
+        struct vector *hoisted = makeVector(struct loop);
+        for (i = loop.end; i >= loop.header; i--) {
+            struct instruction instruction = get(struct instruction, instructions, i);
+            // Hoisting a single lit or lod wouldn't save anything.
+            if (instruction.opcode != OPR || pureOperandCount(instruction) < 0)
+                continue;
+
+            int start = findExpressionStart(instructions, i, loop.header);
+            if (start < 0 || cfg->blockOf[start] != cfg->blockOf[i]
+                    || !isInvariant(start, i))
+                continue;
+
+            pushLiteral(hoisted, struct loop, {start, i});
+            i = start;
+        }
+        if (hoisted->length == 0) {
+            freeVector(hoisted);
+            continue;
+        }
+
+        // Compute the expressions into temporaries in the pre-header, in the
+        // order that they appear in the loop, and load the temporaries in the
+        // loop.
+        struct vector *preheader = makeVector(struct instruction);
+        int k;
+        for (k = hoisted->length - 1; k >= 0; k--) {
+            struct loop expression = get(struct loop, hoisted, k);
+            int temporary = numVariables + numTemporaries;
+            numTemporaries += 1;
+
+            for (j = expression.header; j <= expression.end; j++) {
+                pushLiteral(preheader, struct instruction,
+                        get(struct instruction, instructions, j));
+                replacements[j] = makeVector(struct instruction);
+            }
+            pushLiteral(preheader, struct instruction, makeInstruction(STO, 0, temporary));
+            pushLiteral(replacements[expression.header], struct instruction,
+                    makeInstruction(LOD, 0, temporary));
+        }
+        insertions[loop.header] = preheader;
+        freeVector(hoisted);
+
+        for (i = loop.header; i <= loop.end; i++)
+            changedLoop[i] = 1;
+    );
+
+    struct vector *result = instructions;
+    if (numTemporaries > 0) {
+        growFrame(replacements, numVariables + numTemporaries);
+        result = rewriteInstructionsWithInsertions(instructions, replacements, insertions);
+        *changed = 1;
+    }
+
+    free(stored);
+    free(changedLoop);
+    freeVector(loops);
+    freeReplacements(replacements, length);
+    freeReplacements(insertions, length);
+    freeControlFlowGraph(cfg);
+
+    return result;
+}
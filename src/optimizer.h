@@ -0,0 +1,62 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "src/generator.h"
+#include "src/lib/vector.h"
+
+// The optimizer works on the flat instruction vector produced by
+// generateInstructions. Every pass takes a vector of instructions and returns
+// a new, equivalent vector, setting *changed to true if it changed anything.
+
+// Run all of the passes until none of them changes anything. Use this instead
+// of calling the passes directly.
+struct vector *optimizeInstructions(struct vector *instructions);
+// Like optimizeInstructions, but also updates the line table in *lines to
+// match the optimized code. Every instruction keeps the position of the
+// instruction it came from, and instructions that a pass inserts get the
+// position of the instruction they're inserted in front of.
+struct vector *optimizeInstructionsWithLines(struct vector *instructions, struct vector **lines);
+
+// Remove stores to frame variables that are never read afterwards, together
+// with the side effect free code that computed the stored value.
+struct vector *eliminateDeadStores(struct vector *instructions, int *changed);
+// Redirect jumps that land on an unconditional jmp straight to its target,
+// turn jumps to a return into a return, and drop jumps to the next
+// instruction.
+struct vector *threadJumps(struct vector *instructions, int *changed);
+// Remove blocks that can't be reached from the entry block.
+struct vector *removeUnreachableCode(struct vector *instructions, int *changed);
+
+// Local value numbering: find pure expressions that are computed more than
+// once in a basic block without any of their variables being stored to in
+// between, and compute them only once into a temporary slot in the frame. Only
+// done when that makes the code shorter.
+struct vector *eliminateCommonSubexpressions(struct vector *instructions, int *changed);
+
+// Loop-invariant code motion: find pure expressions in while loops that only
+// read variables that aren't stored to anywhere in the loop, compute them once
+// into a temporary slot in a pre-header in front of the loop, and load the
+// temporary inside the loop instead.
+struct vector *hoistLoopInvariants(struct vector *instructions, int *changed);
+
+// Build a new instruction vector in which instruction i is replaced with the
+// instructions in replacements[i] (which can be empty), or kept as is if
+// replacements[i] is NULL. The jmp/jpc targets of all instructions, including
+// the replacements, are given as indices into the old vector and are
+// translated to the new one; a target that was removed moves to the next
+// instruction that was kept.
+struct vector *rewriteInstructions(struct vector *instructions, struct vector **replacements);
+// Like rewriteInstructions, but also puts the instructions in insertions[i]
+// (if it isn't NULL) in front of instruction i. Falling through to i or
+// jumping forwards to i runs the inserted instructions, while jumping
+// backwards to i (e.g. the jmp at the end of a loop) skips them.
+struct vector *rewriteInstructionsWithInsertions(struct vector *instructions,
+        struct vector **replacements, struct vector **insertions);
+
+// Returns the index of the first instruction of the side effect free
+// expression whose value is pushed by the instruction at index end, without
+// going back past the instruction at index limit. Returns -1 if there is no
+// such expression.
+int findExpressionStart(struct vector *instructions, int end, int limit);
+
+#endif
@@ -6,18 +6,57 @@
 #include <stdlib.h>
 #include <assert.h>
 
+extern __thread char *parserError;
+// Enough for the alternatives of every variable in the PL/0 grammar.
+DEFINE_VECTOR(parseTreeVector, struct parseTree, 8)
+
+// The failure that got the furthest, see getFurthestParseError.
+__thread char *furthestError = NULL;
+__thread int furthestErrorIndex = -1;
+
+// Remember the failure at the index if it's the furthest so far.
+void noteParseFailure(int index, char *message) {
+    if (index > furthestErrorIndex) {
+        free(furthestError);
+        furthestError = strdup(message);
+        furthestErrorIndex = index;
+    }
+}
+
+char *getFurthestParseError(int *index) {
+    *index = furthestErrorIndex;
+    return furthestError;
+}
+
+void clearFurthestParseError() {
+    free(furthestError);
+    furthestError = NULL;
+    furthestErrorIndex = -1;
+}
+
 struct parseTree parseProgram(struct vector *lexemes, struct grammar grammar) {
+    clearFurthestParseError();
     struct parseTree result = parse(lexemes, 0, "program", grammar);
     assert(!(result.numTokens > lexemes->length));   // This should never happen.
     if (result.numTokens == lexemes->length)
         return result;
     else {
+        // Tokens after a whole program are what's wrong even when a rule
+        // inside of it got as far before failing.
+        if (!isParseTreeError(result) && result.numTokens >= furthestErrorIndex) {
+            struct lexeme trailing = get(struct lexeme, lexemes, result.numTokens);
+            char *message = format("Expected end of file but got '%s' after the program.",
+                    trailing.token);
+            clearFurthestParseError();
+            noteParseFailure(result.numTokens, message);
+            free(message);
+        }
         struct vector *children = makeVector(struct parseTree);
         push(children, result);
         /*struct lexeme lastLexeme = get(struct lexeme, lexemes, result.numTokens - 1);
         return errorTree(format("Trailing tokens after program, starting at '%s'.",
                     lastLexeme.token), children);*/
-        return errorTree("Trailing tokens after program.", children);
+        return errorTree(strdup("Trailing tokens after program."), children);
     }
 }
 
@@ -25,15 +64,20 @@ struct parseTree parse(struct vector *lexemes, int index, char *currentVariable,
     if (index >= lexemes->length) {
         setParserError(format("Expected %s but got end of file.",
                     currentVariable));
+        noteParseFailure(index, getParserError());
         return errorTree(getParserError(), NULL);
     }
 
     struct lexeme currentLexeme = get(struct lexeme, lexemes, index);
 
-    struct vector *children = makeVector(struct parseTree);
+    // The rules that failed, which only become the children of an error tree
+    // if every rule fails, so they usually don't need a generic vector.
+    struct parseTreeVector failures;
+    parseTreeVectorInit(&failures);
     // Holds a list of what variables or terminals we expected to find, if we
     // can't find any matches.
     char *expected = NULL;
+    int expectedIsFormatted = 0;
 
     // For each production rule in the grammar.
     int i;
@@ -42,26 +86,42 @@ struct parseTree parse(struct vector *lexemes, int index, char *currentVariable,
         // If it's a production rule for the current variable.
         if (strcmp(rule.variable, currentVariable) == 0) {
             struct parseTree result = parseRule(rule, lexemes, index, currentVariable, grammar);
-            push(children, result);
             if (!isParseTreeError(result)) {
-                // Return on the first production rule that succeeds.
+                // Return on the first production rule that succeeds. The
+                // rules that failed are only kept to explain errors.
+                int j;
+                for (j = 0; j < failures.length; j++)
+                    freeFailedParseTree(failures.items[j]);
+                parseTreeVectorFree(&failures);
+                if (expectedIsFormatted)
+                    free(expected);
                 return result;
             } else {
-                if (expected == NULL)
+                parseTreeVectorPush(&failures, result);
+                if (expected == NULL) {
                     expected = rule.variable;
-                else
+                } else {
+                    char *previous = expected;
                     expected = format("%s or %s", expected, rule.variable);
+                    if (expectedIsFormatted)
+                        free(previous);
+                    expectedIsFormatted = 1;
+                }
             }
         }
     }
 
     // If we didn't find any production rules that succeeded.
+    struct vector *children = parseTreeVectorToVector(&failures);
+    parseTreeVectorFree(&failures);
     if (expected == NULL)
         return errorTree(format("No rules found for variable %s.",
                     currentVariable), children);
-    else
-        return errorTree(format("Expected %s starting at '%s'.",
-                    expected, currentLexeme.token), children);
+
+    char *error = format("Expected %s starting at '%s'.", expected, currentLexeme.token);
+    if (expectedIsFormatted)
+        free(expected);
+    return errorTree(error, children);
 }
 
 struct parseTree parseRule(struct rule rule, struct vector *lexemes, int index,
@@ -83,6 +143,7 @@ struct parseTree parseRule(struct rule rule, struct vector *lexemes, int index,
         if (index >= lexemes->length) {
             setParserError(format("Expected '%s' but got end of file while parsing %s.",
                     varOrTerminal, currentVariable));
+            noteParseFailure(index, getParserError());
             return errorTree(getParserError(), children);
         }
 
@@ -93,11 +154,13 @@ struct parseTree parseRule(struct rule rule, struct vector *lexemes, int index,
         if (isTerminal) {
             if (tokenType == currentLexeme.tokenType) {
                 // Go to next token if this token matches the terminal.
-                pushLiteral(children, struct parseTree, {currentLexeme.token, NULL, 1});
+                pushLiteral(children, struct parseTree, {currentLexeme.token, NULL, 1,
+                        currentLexeme.line, currentLexeme.column});
                 index += 1;
             } else {
                 setParserError(format("Expected '%s' but got '%s' while parsing %s.",
                         varOrTerminal, currentLexeme.token, currentVariable));
+                noteParseFailure(index, getParserError());
                 return errorTree(getParserError(), children);
             }
         } else {
@@ -114,11 +177,17 @@ struct parseTree parseRule(struct rule rule, struct vector *lexemes, int index,
     }
 
     int numTokens = index - startIndex;
-    return (struct parseTree){currentVariable, children, numTokens};
+    struct parseTree tree = {currentVariable, children, numTokens, 0, 0};
+    if (numTokens > 0) {
+        struct lexeme firstLexeme = get(struct lexeme, lexemes, startIndex);
+        tree.line = firstLexeme.line;
+        tree.column = firstLexeme.column;
+    }
+    return tree;
 }
 
 struct parseTree errorTree(char *error, struct vector *children) {
-    return (struct parseTree){error, children, -1};
+    return (struct parseTree){error, children, -1, 0, 0};
 }
 
 int isParseTreeError(struct parseTree tree) {
@@ -166,8 +235,9 @@ struct parseTree getChild(struct parseTree parent, char *childName) {
         if (strcmp(child.name, childName) == 0)
             return child;);
 
-    return errorTree(format("Could not find child with name '%s'.", childName),
-            parent.children);
+    // Not formatted with the name, since generators look up children that
+    // are often missing and don't free the error.
+    return errorTree("Could not find a child with that name.", parent.children);
 }
 
 struct parseTree getLastChild(struct parseTree parent, char *childName) {
@@ -180,14 +250,19 @@ struct parseTree getLastChild(struct parseTree parent, char *childName) {
             return child;
     }
 
-    return errorTree(format("Could not find child with name '%s'.", childName),
-            parent.children);
+    // Not formatted with the name, since generators look up children that
+    // are often missing and don't free the error.
+    return errorTree("Could not find a child with that name.", parent.children);
 }
 
 int hasChild(struct parseTree parent, char *childName) {
-    struct parseTree child = getChild(parent, childName);
+    assert(parent.children != NULL);
 
-    return !isParseTreeError(child);
+    // Not getChild, which allocates an error message for missing children.
+    forVector(parent.children, i, struct parseTree, child,
+        if (strcmp(child.name, childName) == 0)
+            return 1;);
+    return 0;
 }
 
 struct parseTree getFirstChild(struct parseTree tree) {
@@ -210,6 +285,22 @@ void addRule(struct grammar grammar, char *variable, char *productionString) {
     pushLiteral(grammar.rules, struct rule, {variable, production});
 }
 
+void freeGrammar(struct grammar grammar) {
+    forVector(grammar.rules, i, struct rule, rule,
+        forVector(rule.production, j, char*, symbol,
+            free(symbol););
+        freeVector(rule.production););
+    freeVector(grammar.rules);
+}
+
+int countParseTreeNodes(struct parseTree tree) {
+    int count = 1;
+    if (tree.children != NULL)
+        forVector(tree.children, i, struct parseTree, child,
+            count += countParseTreeNodes(child););
+    return count;
+}
+
 void freeParseTree(struct parseTree tree) {
     free(tree.name);
 
@@ -220,7 +311,30 @@ void freeParseTree(struct parseTree tree) {
     }
 }
 
-char *parserError = NULL;
+void freeParseTreeVectors(struct parseTree tree) {
+    if (tree.children != NULL) {
+        forVector(tree.children, i, struct parseTree, child,
+                freeParseTreeVectors(child););
+        freeVector(tree.children);
+    }
+}
+
+void freeFailedParseTree(struct parseTree tree) {
+    if (isParseTreeError(tree)) {
+        if (tree.name == parserError)
+            parserError = NULL;
+        free(tree.name);
+    }
+    if (tree.children != NULL) {
+        forVector(tree.children, i, struct parseTree, child,
+                freeFailedParseTree(child););
+        freeVector(tree.children);
+    }
+}
+
+// Per thread, like the other compiler errors, so that threads can compile at
+// the same time.
+__thread char *parserError = NULL;
 
 char *setParserError(char *message) {
     parserError = message;
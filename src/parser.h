@@ -9,6 +9,10 @@ struct parseTree {
     char *name;
     struct vector *children;
     int numTokens;   // The number of tokens that this parse tree represents.
+    int line;        // The position of the first token, or 0 if the tree
+    int column;      // has no tokens or didn't come from source code.
+    int stackDepth;  // For the generators, see annotateStackDepths. 0 until
+                     // it's known.
 };
 
 struct grammar {
@@ -37,6 +41,16 @@ struct parseTree errorTree(char *error, struct vector *children);
 // Returns tree if the given tree is a tree that was produced by errorTree().
 int isParseTreeError(struct parseTree tree);
 
+// Returns the error of the rule that got the furthest into the lexemes before
+// failing during the thread's last parseProgram, which usually says best
+// what's wrong, since the error tree only has the rules that failed without
+// an alternative that succeeded. Puts the index of the lexeme it failed at in
+// *index, which is the number of lexemes if it got to the end of the file.
+// Returns NULL if no rule failed. The message belongs to the parser and is
+// freed by the next parseProgram or by clearFurthestParseError.
+char *getFurthestParseError(int *index);
+void clearFurthestParseError();
+
 // Converts "semicolonsym", "readsym", etc. into integers that represent the
 // token type.
 int getTokenType(char *token);
@@ -57,9 +71,21 @@ char *getToken(struct parseTree parent);
 // variable -> productionString, where production string is a space-separated
 // list of other variables and terminals that the variable should produce.
 void addRule(struct grammar grammar, char *variable, char *productionString);
+// Free the rules of a grammar made with addRule.
+void freeGrammar(struct grammar grammar);
+
+// The number of nodes in a parse tree, including the tokens.
+int countParseTreeNodes(struct parseTree tree);
 
 // Recursively free a parse tree and all of its children.
 void freeParseTree(struct parseTree tree);
+// Free the vectors of a tree that the parser made, but not the names, which
+// belong to the grammar and the lexemes.
+void freeParseTreeVectors(struct parseTree tree);
+// Free a tree that parseProgram returned as an error, or a tree of a rule
+// that failed to parse. Error messages are allocated for the tree, unlike
+// the other names.
+void freeFailedParseTree(struct parseTree tree);
 
 char *setParserError(char *message);
 char *getParserError();
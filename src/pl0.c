@@ -0,0 +1,98 @@
+#include "src/pl0.h"
+#include "src/compile.h"
+#include "src/grammar.h"
+#include "src/lexer.h"
+#include "src/object.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct pl0Context {
+    regex_t *tokenRegexes;
+    struct grammar grammar;
+    // The results of the last compile.
+    struct vector *instructions;
+    struct vector *lines;
+    struct vector *diagnostics;     // Of struct pl0Diagnostic.
+    unsigned char *objectFile;
+    int objectFileSize;
+};
+
+struct pl0Context *makePL0Context() {
+    struct pl0Context *context = make(struct pl0Context);
+    context->tokenRegexes = compileTokenRegexes();
+    context->grammar = PL0Grammar();
+    context->instructions = NULL;
+    context->lines = NULL;
+    context->diagnostics = makeVector(struct pl0Diagnostic);
+    context->objectFile = NULL;
+    context->objectFileSize = 0;
+    return context;
+}
+
+void freePL0Context(struct pl0Context *context) {
+    resetPL0Context(context);
+    freeVector(context->diagnostics);
+    freeGrammar(context->grammar);
+    freeTokenRegexes(context->tokenRegexes);
+    free(context);
+}
+
+void resetPL0Context(struct pl0Context *context) {
+    if (context->instructions != NULL)
+        freeVector(context->instructions);
+    if (context->lines != NULL)
+        freeVector(context->lines);
+    forVector(context->diagnostics, i, struct pl0Diagnostic, diagnostic,
+        free(diagnostic.message););
+    context->diagnostics->length = 0;
+    free(context->objectFile);
+    context->instructions = NULL;
+    context->lines = NULL;
+    context->objectFile = NULL;
+    context->objectFileSize = 0;
+}
+
+int compilePL0(struct pl0Context *context, const char *source, int size, int options) {
+    resetPL0Context(context);
+    // The lexer needs the source code to be null-terminated.
+    char *terminated = (char*)malloc(size + 1);
+    memcpy(terminated, source, size);
+    terminated[size] = '\0';
+    int compileOptions = ((options & PL0_OPTIMIZE) ? COMPILE_OPTIMIZE : 0)
+        | ((options & PL0_FUSE) ? COMPILE_FUSE : 0);
+    struct vector *diagnostics = makeVector(struct diagnostic);
+    context->instructions = compileWithDiagnostics(terminated, context->tokenRegexes,
+            context->grammar, compileOptions, &context->lines, diagnostics);
+    free(terminated);
+
+    // The messages move to the context's diagnostics.
+    forVector(diagnostics, i, struct diagnostic, diagnostic,
+        int phase = (diagnostic.phase == PARSER_DIAGNOSTIC)
+            ? PL0_PARSER_DIAGNOSTIC : PL0_GENERATOR_DIAGNOSTIC;
+        pushLiteral(context->diagnostics, struct pl0Diagnostic,
+            {phase, diagnostic.line, diagnostic.column, diagnostic.message}););
+    freeVector(diagnostics);
+    return (context->instructions != NULL);
+}
+
+struct instruction *getPL0Instructions(struct pl0Context *context, int *count) {
+    if (context->instructions == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = context->instructions->length;
+    return (struct instruction*)context->instructions->items;
+}
+
+struct pl0Diagnostic *getPL0Diagnostics(struct pl0Context *context, int *count) {
+    *count = context->diagnostics->length;
+    return (struct pl0Diagnostic*)context->diagnostics->items;
+}
+
+unsigned char *getPL0ObjectFile(struct pl0Context *context, int *size) {
+    if (context->objectFile == NULL && context->instructions != NULL)
+        context->objectFile = encodeObjectFile(context->instructions, context->lines,
+                &context->objectFileSize);
+    *size = context->objectFileSize;
+    return context->objectFile;
+}
@@ -0,0 +1,71 @@
+#ifndef PL0_H
+#define PL0_H
+
+#include "src/instruction.h"
+
+// libpl0, the compiler as a library (libpl0.a and libpl0.so), for programs
+// that want to compile PL/0 without running ./compiler. Everything a compile
+// needs lives in a context: the lexer's regular expressions, the grammar and
+// the results of the last compile. Nothing is shared between contexts, so
+// every thread can compile with its own context at the same time. A context
+// must only be used by one thread at a time.
+//
+// This header is all that programs that use the library include, besides
+// instruction.h for the instructions it returns. libpl0.so only exports the
+// functions below, which are marked with PL0_API, since the rest of the
+// compiler is built with hidden visibility.
+//
+// struct pl0Context *context = makePL0Context();
+// if (compilePL0(context, source, strlen(source), PL0_OPTIMIZE)) {
+//     int count;
+//     struct instruction *instructions = getPL0Instructions(context, &count);
+//     ...
+// } else {
+//     int count, i;
+//     struct pl0Diagnostic *diagnostics = getPL0Diagnostics(context, &count);
+//     for (i = 0; i < count; i++)
+//         printf("%d:%d: %s\n", diagnostics[i].line, diagnostics[i].column,
+//                 diagnostics[i].message);
+// }
+// freePL0Context(context);
+
+#define PL0_API __attribute__((visibility("default")))
+
+// Options for compilePL0: optimize the instructions, and fuse common
+// sequences of them into single opcodes (see fusion.h).
+enum { PL0_OPTIMIZE = 1, PL0_FUSE = 2 };
+
+// What found an error.
+enum { PL0_PARSER_DIAGNOSTIC = 1, PL0_GENERATOR_DIAGNOSTIC };
+
+// An error in the source code.
+struct pl0Diagnostic {
+    int phase;          // PL0_PARSER_DIAGNOSTIC or PL0_GENERATOR_DIAGNOSTIC.
+    int line, column;   // Where it is, or a line of 0 if that isn't known,
+                        // e.g. at the end of the file.
+    char *message;
+};
+
+struct pl0Context;
+
+PL0_API struct pl0Context *makePL0Context();
+// Free the context and everything it returned.
+PL0_API void freePL0Context(struct pl0Context *context);
+
+// Compile size bytes of source code, which doesn't have to be null-terminated,
+// with the options. Returns true if it compiled, and false if there are
+// diagnostics. Replaces the results of the last compile.
+PL0_API int compilePL0(struct pl0Context *context, const char *source, int size, int options);
+// Forget the results of the last compile, but keep the regular expressions
+// and the grammar for the next one.
+PL0_API void resetPL0Context(struct pl0Context *context);
+
+// The results of the last compile, which belong to the context and are valid
+// until the next compile or reset. The instructions and the object file are
+// NULL if it didn't compile, and there are no diagnostics if it did.
+PL0_API struct instruction *getPL0Instructions(struct pl0Context *context, int *count);
+PL0_API struct pl0Diagnostic *getPL0Diagnostics(struct pl0Context *context, int *count);
+// The instructions as an object file for pl0vm, made when it's first asked for.
+PL0_API unsigned char *getPL0ObjectFile(struct pl0Context *context, int *size);
+
+#endif
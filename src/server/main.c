@@ -0,0 +1,126 @@
+#include "src/server/server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Command line options. Arguments that start with "-" are flags.
+struct serverOptions {
+    char *socketPath;
+    int numWorkers;   // Worker threads, one per processor by default.
+    int quiet;        // Don't print the stats when stopping.
+    struct contextLimits limits;
+};
+
+int parseOptions(int argc, char **argv, struct serverOptions *options);
+void printUsage(char *programName);
+void stopOnSignal(int signalNumber);
+
+// The server to stop, for the signal handler.
+struct server *runningServer = NULL;
+
+int main(int argc, char **argv) {
+    struct serverOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Clients that hang up early make writes fail instead of killing the
+    // server. SIGINT and SIGTERM are blocked while the workers start, so
+    // that they only go to this thread.
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stopSignals, oldMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+
+    struct server *server = startServer(options.socketPath, options.numWorkers,
+            options.limits);
+    if (server == NULL) {
+        fprintf(stderr, "%s\n", getServerError());
+        return 1;
+    }
+    runningServer = server;
+    signal(SIGINT, stopOnSignal);
+    signal(SIGTERM, stopOnSignal);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if (!options.quiet)
+        fprintf(stderr, "Listening on %s with %d workers.\n", options.socketPath,
+                options.numWorkers);
+
+    serveConnections(server);
+    finishServer(server);
+    if (!options.quiet)
+        printServerStats(stderr, &server->stats,
+                (server->stopTime - server->startTime) / 1e9);
+    freeServer(server);
+    return 0;
+}
+
+// SIGINT and SIGTERM stop accepting connections, and the server exits once
+// the jobs that are running have been abandoned.
+void stopOnSignal(int signalNumber) {
+    stopServer(runningServer);
+}
+
+int parseOptions(int argc, char **argv, struct serverOptions *options) {
+    *options = (struct serverOptions){NULL, sysconf(_SC_NPROCESSORS_ONLN), 0,
+        {DEFAULT_JOB_MAX_INSTRUCTIONS, DEFAULT_JOB_MAX_NANOSECONDS, DEFAULT_JOB_MAX_OUTPUT}};
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (strcmp(argument, "--socket") == 0 && i + 1 < argc) {
+            options->socketPath = argv[++i];
+        } else if (strcmp(argument, "--threads") == 0 && i + 1 < argc) {
+            options->numWorkers = atoi(argv[++i]);
+            if (options->numWorkers <= 0)
+                return 0;
+        } else if (strcmp(argument, "--max-instructions") == 0 && i + 1 < argc) {
+            options->limits.maxInstructions = atoll(argv[++i]);
+            if (options->limits.maxInstructions < 0)
+                return 0;
+        } else if (strcmp(argument, "--max-seconds") == 0 && i + 1 < argc) {
+            double seconds = atof(argv[++i]);
+            if (seconds < 0)
+                return 0;
+            options->limits.maxNanoseconds = seconds * 1e9;
+        } else if (strcmp(argument, "--max-output") == 0 && i + 1 < argc) {
+            options->limits.maxOutput = atoi(argv[++i]);
+            if (options->limits.maxOutput < 0 || options->limits.maxOutput > MAX_JOB_DATA_SIZE)
+                return 0;
+        } else if (strcmp(argument, "--quiet") == 0) {
+            options->quiet = 1;
+        } else {
+            return 0;
+        }
+    }
+
+    if (options->numWorkers <= 0)
+        options->numWorkers = 1;
+    return (options->socketPath != NULL);
+}
+
+void printUsage(char *programName) {
+    printf("Usage: %s --socket <path> [<options>]\n", programName);
+    printf("Compiles and runs the PL/0 programs that clients send to the Unix domain\n"
+           "socket, see src/server/protocol.h. SIGINT or SIGTERM stop the server, which\n"
+           "then prints how many jobs it ran, its throughput and the job latencies.\n");
+    printf("Options:\n");
+    printf("  --socket <path>     The socket to listen on. A socket that is already there\n"
+           "                      is replaced.\n");
+    printf("  --threads <n>       Number of worker threads (default: one per processor).\n");
+    printf("  --max-instructions <n>\n"
+           "                      Fail jobs that run more than n instructions\n"
+           "                      (default %lld, 0 for no limit).\n", DEFAULT_JOB_MAX_INSTRUCTIONS);
+    printf("  --max-seconds <n>   Fail jobs that run for more than n seconds (default %lld,\n"
+           "                      0 for no limit).\n", DEFAULT_JOB_MAX_NANOSECONDS / 1000000000);
+    printf("  --max-output <n>    Fail jobs that print more than n bytes (default %d,\n"
+           "                      the most that a result can hold, 0 for no limit).\n",
+           DEFAULT_JOB_MAX_OUTPUT);
+    printf("  --quiet             Don't print anything unless there's an error.\n");
+}
@@ -0,0 +1,237 @@
+#include "src/server/protocol.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+int readFully(int fd, void *buffer, size_t size) {
+    return readFullyBefore(fd, buffer, size, 0);
+}
+
+int readFullyBefore(int fd, void *buffer, size_t size, uint64_t deadline) {
+    char *bytes = (char*)buffer;
+    while (size > 0) {
+        if (deadline != 0) {
+            uint64_t now = monotonicNanoseconds();
+            if (now >= deadline)
+                return 0;
+            // Rounded up, so that it doesn't spin for the last millisecond.
+            struct pollfd connection = {fd, POLLIN, 0};
+            int ready = poll(&connection, 1, (deadline - now + 999999) / 1000000);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                return 0;
+        }
+        ssize_t count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return 0;
+        bytes += count;
+        size -= count;
+    }
+    return 1;
+}
+
+int writeFully(int fd, void *buffer, size_t size) {
+    char *bytes = (char*)buffer;
+    while (size > 0) {
+        ssize_t count = write(fd, bytes, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return 0;
+        bytes += count;
+        size -= count;
+    }
+    return 1;
+}
+
+// Read size bytes into a new buffer with a null terminator after them.
+char *readString(int fd, size_t size, uint64_t deadline) {
+    char *string = (char*)malloc(size + 1);
+    if (!readFullyBefore(fd, string, size, deadline)) {
+        free(string);
+        return NULL;
+    }
+    string[size] = '\0';
+    return string;
+}
+
+int sendJob(int fd, int flags, char *source, char *input, int inputSize) {
+    struct jobHeader header;
+    memcpy(header.magic, JOB_MAGIC, 4);
+    header.flags = flags;
+    header.sourceSize = strlen(source);
+    header.inputSize = inputSize;
+    return writeFully(fd, &header, sizeof(header))
+        && writeFully(fd, source, header.sourceSize)
+        && writeFully(fd, input, inputSize);
+}
+
+struct job *receiveJob(int fd) {
+    return receiveJobBefore(fd, 0);
+}
+
+struct job *receiveJobBefore(int fd, uint64_t deadline) {
+    struct jobHeader header;
+    if (!readFullyBefore(fd, &header, sizeof(header), deadline))
+        return NULL;
+
+    struct job *job = make(struct job);
+    job->flags = header.flags;
+    job->source = NULL;
+    job->input = NULL;
+    job->inputSize = 0;
+    // The rest of the connection can't be trusted after a bad header, since
+    // where the next job starts isn't known.
+    if (memcmp(header.magic, JOB_MAGIC, 4) != 0 || header.sourceSize > MAX_JOB_DATA_SIZE
+            || header.inputSize > MAX_JOB_DATA_SIZE)
+        return job;
+
+    job->source = readString(fd, header.sourceSize, deadline);
+    job->input = readString(fd, header.inputSize, deadline);
+    if (job->source == NULL || job->input == NULL) {
+        freeJob(job);
+        return NULL;
+    }
+    job->inputSize = header.inputSize;
+    return job;
+}
+
+void freeJob(struct job *job) {
+    free(job->source);
+    free(job->input);
+    free(job);
+}
+
+int sendJobResult(int fd, struct jobResult *result) {
+    struct jobResultHeader header = result->header;
+    header.outputSize = (result->output != NULL) ? strlen(result->output) : 0;
+    header.errorSize = (result->error != NULL) ? strlen(result->error) : 0;
+    if (header.outputSize > MAX_JOB_DATA_SIZE)
+        header.outputSize = MAX_JOB_DATA_SIZE;
+    if (header.errorSize > MAX_JOB_DATA_SIZE)
+        header.errorSize = MAX_JOB_DATA_SIZE;
+    return writeFully(fd, &header, sizeof(header))
+        && writeFully(fd, result->output, header.outputSize)
+        && writeFully(fd, result->error, header.errorSize);
+}
+
+struct jobResult *receiveJobResult(int fd) {
+    struct jobResult *result = make(struct jobResult);
+    if (!readFully(fd, &result->header, sizeof(result->header))
+            || result->header.outputSize > MAX_JOB_DATA_SIZE
+            || result->header.errorSize > MAX_JOB_DATA_SIZE) {
+        free(result);
+        return NULL;
+    }
+
+    result->output = readString(fd, result->header.outputSize, 0);
+    result->error = readString(fd, result->header.errorSize, 0);
+    if (result->output == NULL || result->error == NULL) {
+        freeJobResult(result);
+        return NULL;
+    }
+    if (result->header.errorSize == 0) {
+        free(result->error);
+        result->error = NULL;
+    }
+    return result;
+}
+
+void freeJobResult(struct jobResult *result) {
+    free(result->output);
+    free(result->error);
+    free(result);
+}
+
+uint64_t monotonicNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Latencies below LATENCY_SUB_BUCKETS get a bucket each. From there on,
+// each power of two is split into LATENCY_SUB_BUCKETS buckets by the bits
+// after the highest one.
+int latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < LATENCY_SUB_BUCKETS)
+        return nanoseconds;
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    return (exponent - 3) * LATENCY_SUB_BUCKETS
+        + ((nanoseconds >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// The middle of the latencies that fall in the bucket.
+long long latencyBucketMiddle(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS)
+        << (exponent - 4);
+    return low + ((1ULL << (exponent - 4)) - 1) / 2;
+}
+
+void addLatency(struct latencyHistogram *histogram, long long nanoseconds) {
+    if (nanoseconds < 0)
+        nanoseconds = 0;
+    histogram->counts[latencyBucket(nanoseconds)]++;
+    if (histogram->count == 0 || nanoseconds < histogram->min)
+        histogram->min = nanoseconds;
+    if (histogram->count == 0 || nanoseconds > histogram->max)
+        histogram->max = nanoseconds;
+    histogram->count++;
+    histogram->total += nanoseconds;
+}
+
+void mergeLatencies(struct latencyHistogram *into, struct latencyHistogram *from) {
+    if (from->count == 0)
+        return;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    if (into->count == 0 || from->min < into->min)
+        into->min = from->min;
+    if (into->count == 0 || from->max > into->max)
+        into->max = from->max;
+    into->count += from->count;
+    into->total += from->total;
+}
+
+long long latencyPercentile(struct latencyHistogram *histogram, int p) {
+    long long rank = (histogram->count * p + 99) / 100;
+    if (rank <= 0)
+        return histogram->min;
+    if (rank >= histogram->count)
+        return histogram->max;
+    long long seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+            break;
+    }
+    // The exact ends are known, so a bucket's middle never goes past them.
+    long long latency = latencyBucketMiddle(i);
+    if (latency < histogram->min)
+        return histogram->min;
+    return (latency > histogram->max) ? histogram->max : latency;
+}
+
+void printLatencies(FILE *file, struct latencyHistogram *histogram) {
+    if (histogram->count == 0)
+        return;
+    // In microseconds.
+    double percentile(int p) {
+        return latencyPercentile(histogram, p) / 1e3;
+    }
+    fprintf(file, "Latency: mean %.1f us, min %.1f us, p50 %.1f us, p90 %.1f us, "
+            "p99 %.1f us, max %.1f us.\n", (double)histogram->total / histogram->count / 1e3,
+            percentile(0), percentile(50), percentile(90), percentile(99), percentile(100));
+}
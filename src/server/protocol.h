@@ -0,0 +1,104 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "src/lib/vector.h"
+
+// The protocol between pl0server and its clients, over a Unix domain stream
+// socket. A client sends jobs, each a jobHeader followed by the PL/0 source
+// code and the program's input, and gets back a jobResultHeader followed by
+// what the program printed and the error message, if any. A connection can
+// carry any number of jobs, one after the other. Numbers are in the byte
+// order of the machine, since both ends are on it.
+
+#define JOB_MAGIC "PL0J"
+// The largest source code, input or output that a job can have.
+#define MAX_JOB_DATA_SIZE (1 << 24)
+
+// Job flags.
+enum { JOB_OPTIMIZE = 1 };
+
+// Job statuses.
+enum { JOB_SUCCEEDED, JOB_COMPILE_ERROR, JOB_RUNTIME_ERROR, JOB_BAD_REQUEST };
+
+struct jobHeader {
+    char magic[4];          // JOB_MAGIC
+    uint32_t flags;
+    uint32_t sourceSize;
+    uint32_t inputSize;
+};
+
+struct jobResultHeader {
+    uint32_t status;
+    uint32_t outputSize;
+    uint32_t errorSize;
+    uint32_t reserved;
+    uint64_t instructionCount;
+    uint64_t compileNanoseconds;
+    uint64_t runNanoseconds;
+};
+
+struct job {
+    int flags;
+    char *source;       // Null-terminated, like the input.
+    char *input;
+    int inputSize;
+};
+
+struct jobResult {
+    struct jobResultHeader header;
+    char *output;       // What the program printed.
+    char *error;        // Why it failed, or NULL.
+};
+
+// Read or write exactly size bytes, retrying short reads and writes. Return
+// false on an error or the end of the file.
+int readFully(int fd, void *buffer, size_t size);
+int writeFully(int fd, void *buffer, size_t size);
+// Like readFully, but also fails if the bytes haven't all arrived by the
+// deadline on the monotonic clock, unless it's 0.
+int readFullyBefore(int fd, void *buffer, size_t size, uint64_t deadline);
+
+// Send a job, and receive one on the other end. receiveJob returns NULL when
+// the connection is closed, and a job with a NULL source if the request is
+// invalid.
+int sendJob(int fd, int flags, char *source, char *input, int inputSize);
+struct job *receiveJob(int fd);
+// Like receiveJob, but returns NULL if the whole job hasn't arrived by the
+// deadline (see readFullyBefore).
+struct job *receiveJobBefore(int fd, uint64_t deadline);
+void freeJob(struct job *job);
+
+// Send a job's result, and receive it on the other end. receiveJobResult
+// returns NULL if the connection fails.
+int sendJobResult(int fd, struct jobResult *result);
+struct jobResult *receiveJobResult(int fd);
+void freeJobResult(struct jobResult *result);
+
+// The time on the monotonic clock, which both ends time jobs with.
+uint64_t monotonicNanoseconds();
+
+// Latencies in nanoseconds, counted in buckets so that a long-running server
+// keeps a fixed amount of them. Each power of two is split into
+// LATENCY_SUB_BUCKETS buckets, so a percentile is within 1/32 of the real
+// latency. Zeroed memory is an empty histogram.
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (61 * LATENCY_SUB_BUCKETS)
+struct latencyHistogram {
+    long long counts[LATENCY_BUCKETS];
+    long long count;
+    long long total;
+    long long min;
+    long long max;
+};
+
+void addLatency(struct latencyHistogram *histogram, long long nanoseconds);
+void mergeLatencies(struct latencyHistogram *into, struct latencyHistogram *from);
+// The latency that p percent of them are at most, by the nearest rank.
+long long latencyPercentile(struct latencyHistogram *histogram, int p);
+// Print the mean and the percentiles. Both ends report latencies like this.
+void printLatencies(FILE *file, struct latencyHistogram *histogram);
+
+#endif
@@ -0,0 +1,368 @@
+#include "src/server/server.h"
+#include "src/lexer.h"
+#include "src/grammar.h"
+#include "src/compile.h"
+#include "src/cfg.h"
+#include "src/vm/vm.h"
+#include "src/vm/io.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+void *runWorker(void *argument);
+
+struct server *startServer(char *socketPath, int numWorkers, struct contextLimits limits) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        setServerError(format("The socket path %s is too long.", socketPath));
+        return NULL;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        setServerError(format("Could not create a socket: %s", strerror(errno)));
+        return NULL;
+    }
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0
+            || listen(listenFd, SOMAXCONN) != 0) {
+        setServerError(format("Could not listen on %s: %s", socketPath, strerror(errno)));
+        close(listenFd);
+        return NULL;
+    }
+
+    struct server *server = make(struct server);
+    memset(server, 0, sizeof(*server));
+    server->socketPath = socketPath;
+    server->listenFd = listenFd;
+    server->grammar = PL0Grammar();
+    server->limits = limits;
+    pthread_mutex_init(&server->queueLock, NULL);
+    pthread_cond_init(&server->queueNotEmpty, NULL);
+    pthread_cond_init(&server->queueNotFull, NULL);
+    pthread_mutex_init(&server->statsLock, NULL);
+    server->returned = makeVector(int);
+    if (pipe(server->wakeFds) == 0) {
+        fcntl(server->wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(server->wakeFds[1], F_SETFL, O_NONBLOCK);
+    }
+    server->startTime = monotonicNanoseconds();
+
+    server->numWorkers = numWorkers;
+    server->workers = (pthread_t*)malloc(sizeof(pthread_t) * numWorkers);
+    int i;
+    for (i = 0; i < numWorkers; i++)
+        pthread_create(&server->workers[i], NULL, runWorker, server);
+    return server;
+}
+
+// A connection that's waiting for its client's next job.
+struct idleConnection {
+    int fd;
+    uint64_t since;
+};
+
+// Queue a connection for the workers, waiting for room in the queue.
+void queueConnection(struct server *server, int fd) {
+    pthread_mutex_lock(&server->queueLock);
+    while (server->queueLength == CONNECTION_QUEUE_SIZE)
+        pthread_cond_wait(&server->queueNotFull, &server->queueLock);
+    server->connections[(server->queueStart + server->queueLength)
+        % CONNECTION_QUEUE_SIZE] = fd;
+    server->queueLength++;
+    pthread_cond_signal(&server->queueNotEmpty);
+    pthread_mutex_unlock(&server->queueLock);
+}
+
+void serveConnections(struct server *server) {
+    // The idle connections are polled along with the socket and the wake-up
+    // pipe, and the ones that have something to read are queued for the
+    // workers.
+    struct vector *idle = makeVector(struct idleConnection);
+    struct vector *polled = makeVector(struct pollfd);
+    while (!server->stopping) {
+        polled->length = 0;
+        pushLiteral(polled, struct pollfd, {server->listenFd, POLLIN, 0});
+        pushLiteral(polled, struct pollfd, {server->wakeFds[0], POLLIN, 0});
+        forVector(idle, i, struct idleConnection, connection,
+            pushLiteral(polled, struct pollfd, {connection.fd, POLLIN, 0}););
+        // Wake up now and then to see if the server was stopped, in case the
+        // signal that stopped it went to another thread.
+        if (poll((struct pollfd*)polled->items, polled->length, 100) < 0)
+            continue;
+        struct pollfd *ready = (struct pollfd*)polled->items;
+        uint64_t now = monotonicNanoseconds();
+
+        // A connection that the client closed is readable too, and the
+        // worker closes it when it reads the end of the file.
+        int numIdle = 0;
+        forVector(idle, i, struct idleConnection, connection,
+            if (ready[i + 2].revents != 0)
+                queueConnection(server, connection.fd);
+            else if (now - connection.since > CONNECTION_IDLE_SECONDS * 1000000000ULL)
+                close(connection.fd);
+            else
+                set(idle, numIdle++, connection););
+        idle->length = numIdle;
+
+        if (ready[1].revents & POLLIN) {
+            char wakeUps[64];
+            while (read(server->wakeFds[0], wakeUps, sizeof(wakeUps)) > 0)
+                continue;
+            pthread_mutex_lock(&server->queueLock);
+            forVector(server->returned, i, int, fd,
+                pushLiteral(idle, struct idleConnection, {fd, now}););
+            server->returned->length = 0;
+            pthread_mutex_unlock(&server->queueLock);
+        }
+
+        if (ready[0].revents & POLLIN) {
+            int fd = accept(server->listenFd, NULL, NULL);
+            if (fd >= 0) {
+                // A client that doesn't read its results can't hold up a
+                // worker for long.
+                struct timeval timeout = {JOB_TRANSFER_SECONDS, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                pushLiteral(idle, struct idleConnection, {fd, now});
+            }
+        }
+    }
+
+    forVector(idle, i, struct idleConnection, connection,
+        close(connection.fd););
+    freeVector(idle);
+    freeVector(polled);
+}
+
+void stopServer(struct server *server) {
+    server->stopping = 1;
+}
+
+void finishServer(struct server *server) {
+    close(server->listenFd);
+    unlink(server->socketPath);
+
+    pthread_mutex_lock(&server->queueLock);
+    server->closed = 1;
+    pthread_cond_broadcast(&server->queueNotEmpty);
+    pthread_mutex_unlock(&server->queueLock);
+    int i;
+    for (i = 0; i < server->numWorkers; i++)
+        pthread_join(server->workers[i], NULL);
+    // The connections that workers gave back after the acceptor stopped.
+    forVector(server->returned, i, int, fd,
+        close(fd););
+    server->returned->length = 0;
+    close(server->wakeFds[0]);
+    close(server->wakeFds[1]);
+    server->stopTime = monotonicNanoseconds();
+}
+
+void freeServer(struct server *server) {
+    pthread_mutex_destroy(&server->queueLock);
+    pthread_cond_destroy(&server->queueNotEmpty);
+    pthread_cond_destroy(&server->queueNotFull);
+    pthread_mutex_destroy(&server->statsLock);
+    freeVector(server->returned);
+    free(server->workers);
+    free(server);
+}
+
+// Give a connection back to the acceptor, to wait for the client's next job.
+void returnConnection(struct server *server, int fd) {
+    pthread_mutex_lock(&server->queueLock);
+    push(server->returned, fd);
+    pthread_mutex_unlock(&server->queueLock);
+    // If the pipe is full, the acceptor has a wake-up waiting already.
+    char wakeUp = 0;
+    write(server->wakeFds[1], &wakeUp, 1);
+}
+
+// Serve the job that the client is sending on the connection. Then give the
+// connection back, or close it if the client closed it, sent a bad request
+// or took too long to send the job or read the result.
+void serveJob(struct server *server, int fd) {
+    struct job *job = receiveJobBefore(fd,
+            monotonicNanoseconds() + JOB_TRANSFER_SECONDS * 1000000000ULL);
+    if (job == NULL) {
+        close(fd);
+        return;
+    }
+
+    uint64_t start = monotonicNanoseconds();
+    struct jobResult result;
+    memset(&result, 0, sizeof(result));
+    if (job->source == NULL) {
+        result.header.status = JOB_BAD_REQUEST;
+        result.error = format("Invalid job header.");
+    } else {
+        runJob(server, job, &result);
+    }
+    int sent = sendJobResult(fd, &result);
+    uint64_t latency = monotonicNanoseconds() - start;
+
+    pthread_mutex_lock(&server->statsLock);
+    struct serverStats *stats = &server->stats;
+    if (result.header.status == JOB_BAD_REQUEST) {
+        stats->badRequests++;
+    } else {
+        stats->jobs++;
+        stats->failedJobs += (result.header.status != JOB_SUCCEEDED);
+        stats->instructions += result.header.instructionCount;
+        stats->compileNanoseconds += result.header.compileNanoseconds;
+        stats->runNanoseconds += result.header.runNanoseconds;
+        addLatency(&stats->latencies, latency);
+    }
+    pthread_mutex_unlock(&server->statsLock);
+
+    int badRequest = (job->source == NULL);
+    free(result.output);
+    free(result.error);
+    freeJob(job);
+    if (!sent || badRequest || server->stopping)
+        close(fd);
+    else
+        returnConnection(server, fd);
+}
+
+void *runWorker(void *argument) {
+    struct server *server = (struct server*)argument;
+    while (1) {
+        pthread_mutex_lock(&server->queueLock);
+        while (server->queueLength == 0 && !server->closed)
+            pthread_cond_wait(&server->queueNotEmpty, &server->queueLock);
+        // Connections that had a job waiting when the server stopped are
+        // still served.
+        if (server->queueLength == 0) {
+            pthread_mutex_unlock(&server->queueLock);
+            freeLexer();
+            return NULL;
+        }
+        int fd = server->connections[server->queueStart];
+        server->queueStart = (server->queueStart + 1) % CONNECTION_QUEUE_SIZE;
+        server->queueLength--;
+        pthread_cond_signal(&server->queueNotFull);
+        pthread_mutex_unlock(&server->queueLock);
+
+        serveJob(server, fd);
+    }
+}
+
+// Run the program until it halts or fails, which it does if it goes over a
+// limit or the server is stopped. The program started at the time start.
+// Returns false if it failed, with vm->error set.
+int runJobSlices(struct server *server, struct vm *vm, uint64_t start) {
+    struct contextLimits *limits = &server->limits;
+    while (1) {
+        long long fuel = JOB_SLICE_INSTRUCTIONS;
+        if (limits->maxInstructions > 0 && limits->maxInstructions - vm->instructionCount < fuel)
+            fuel = limits->maxInstructions - vm->instructionCount;
+        int state = runSlice(vm, fuel);
+
+        // Like checkLimits in the scheduler, the output limit applies even
+        // if the program halted, since a slice can print a lot.
+        char *error = NULL;
+        if (limits->maxOutput > 0 && vm->outputBuffer.end > limits->maxOutput)
+            error = "Output limit exceeded.";
+        else if (state == SLICE_HALTED || state == SLICE_FAILED)
+            return (state == SLICE_HALTED);
+        else if (limits->maxInstructions > 0 && vm->instructionCount >= limits->maxInstructions)
+            error = "Instruction limit exceeded.";
+        else if (limits->maxNanoseconds > 0
+                && monotonicNanoseconds() - start >= limits->maxNanoseconds)
+            error = "Time limit exceeded.";
+        else if (server->stopping)
+            error = "The server stopped before the program finished.";
+
+        if (error != NULL) {
+            vm->error = error;
+            vm->errorPc = vm->pc;
+            return 0;
+        }
+    }
+}
+
+void runJob(struct server *server, struct job *job, struct jobResult *result) {
+    uint64_t start = monotonicNanoseconds();
+    struct vector *lines;
+    int options = COMPILE_FUSE | ((job->flags & JOB_OPTIMIZE) ? COMPILE_OPTIMIZE : 0);
+    struct vector *instructions = compileSource(job->source, server->grammar, options, &lines,
+            &result->error);
+    struct vm *vm = NULL;
+    if (instructions != NULL) {
+        int requiredStackSize = computeMaxStackDepth(instructions);
+        vm = makeVM(instructions, (requiredStackSize > DEFAULT_STACK_SIZE)
+                ? requiredStackSize : DEFAULT_STACK_SIZE);
+    }
+    uint64_t compiled = monotonicNanoseconds();
+    result->header.compileNanoseconds = compiled - start;
+
+    if (vm == NULL) {
+        result->header.status = JOB_COMPILE_ERROR;
+        return;
+    }
+
+    // The input and output are in memory, and the program runs a slice at a
+    // time so that the limits can be checked between slices.
+    openMemoryBuffer(&vm->inputBuffer, 0, TEXT_IO);
+    appendInput(&vm->inputBuffer, job->input, job->inputSize);
+    endInput(&vm->inputBuffer);
+    openMemoryBuffer(&vm->outputBuffer, 1, TEXT_IO);
+    int succeeded = runJobSlices(server, vm, compiled);
+    int outputSize = vm->outputBuffer.end;
+    if (server->limits.maxOutput > 0 && outputSize > server->limits.maxOutput)
+        outputSize = server->limits.maxOutput;
+    result->output = strndup(vm->outputBuffer.data, outputSize);
+    closeIOBuffer(&vm->inputBuffer);
+    closeIOBuffer(&vm->outputBuffer);
+    result->header.runNanoseconds = monotonicNanoseconds() - compiled;
+    result->header.instructionCount = vm->instructionCount;
+    result->header.status = succeeded ? JOB_SUCCEEDED : JOB_RUNTIME_ERROR;
+
+    if (!succeeded) {
+        // The same message that pl0vm prints, with the line it failed at.
+        size_t size;
+        FILE *error = open_memstream(&result->error, &size);
+        printVMError(error, vm, lines);
+        fclose(error);
+        if (size > 0 && result->error[size - 1] == '\n')
+            result->error[size - 1] = '\0';
+    }
+
+    freeVM(vm);
+    freeVector(instructions);
+    freeVector(lines);
+}
+
+void printServerStats(FILE *file, struct serverStats *stats, double seconds) {
+    fprintf(file, "%lld jobs, %lld of them failed, and %lld bad requests in %.2f s.\n",
+            stats->jobs, stats->failedJobs, stats->badRequests, seconds);
+    if (stats->jobs == 0)
+        return;
+
+    fprintf(file, "Throughput: %.1f jobs/s, %.1f million instructions/s.\n",
+            stats->jobs / seconds, stats->instructions / seconds / 1e6);
+    fprintf(file, "Mean compile time: %.1f us, mean run time: %.1f us.\n",
+            stats->compileNanoseconds / 1e3 / stats->jobs,
+            stats->runNanoseconds / 1e3 / stats->jobs);
+    printLatencies(file, &stats->latencies);
+}
+
+char *serverError = NULL;
+
+char *setServerError(char *message) {
+    serverError = message;
+    return message;
+}
+char *getServerError() {
+    return serverError;
+}
@@ -0,0 +1,103 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "src/server/protocol.h"
+#include "src/parser.h"
+#include "src/vm/scheduler.h"
+#include "src/lib/vector.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+
+// A server that compiles and runs PL/0 programs for clients on a Unix domain
+// socket (see protocol.h). One thread accepts connections and waits for jobs
+// on all of them at once. It queues the connections that have a job coming,
+// and a fixed pool of worker threads takes them off the queue, serves one job
+// each and gives them back, so that idle clients don't take up workers. The grammar is set up once,
+// when the server starts, and each worker's lexer the first time it compiles,
+// instead of once per job. The workers compile and run programs at the same
+// time, since the compiler's state is per thread (see compile.h).
+//
+// Programs run in slices (see runSlice in vm.h), and a program that goes over
+// one of the server's limits fails, so that a job that loops forever or
+// prints without end can't take a worker away from the other clients.
+
+// How many connections with a job coming can wait for a worker.
+#define CONNECTION_QUEUE_SIZE 256
+// A connection that doesn't send a job for this long is closed.
+#define CONNECTION_IDLE_SECONDS 300
+// How long a client has to send the rest of a job once it started, and to
+// read each part of the result, before its connection is closed.
+#define JOB_TRANSFER_SECONDS 10
+// Instructions that a job runs between checks of the limits and of whether
+// the server was stopped.
+#define JOB_SLICE_INSTRUCTIONS (1 << 20)
+// The limits of a job unless others are asked for.
+#define DEFAULT_JOB_MAX_INSTRUCTIONS (1LL << 32)
+#define DEFAULT_JOB_MAX_NANOSECONDS (10 * 1000000000LL)
+#define DEFAULT_JOB_MAX_OUTPUT MAX_JOB_DATA_SIZE
+
+struct serverStats {
+    long long jobs;
+    long long failedJobs;       // Jobs that didn't compile or failed at runtime.
+    long long badRequests;
+    long long instructions;     // Instructions that the jobs executed.
+    long long compileNanoseconds;
+    long long runNanoseconds;
+    struct latencyHistogram latencies;  // From receiving each job to having
+                                        // sent its result.
+};
+
+struct server {
+    char *socketPath;
+    int listenFd;
+    struct grammar grammar;
+    int numWorkers;
+    pthread_t *workers;
+    struct contextLimits limits;    // For every job, 0 for no limit. The time
+                                    // is the job's run time.
+    volatile sig_atomic_t stopping;
+
+    // Connections with a job coming, waiting for a worker.
+    int connections[CONNECTION_QUEUE_SIZE];
+    int queueStart, queueLength;
+    int closed;                 // No more connections will be queued.
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueNotEmpty, queueNotFull;
+    // Connections that workers are done with, for the acceptor to wait on
+    // again, under the queue's lock. Workers write to the pipe to wake the
+    // acceptor up.
+    struct vector *returned;
+    int wakeFds[2];
+
+    struct serverStats stats;
+    pthread_mutex_t statsLock;
+    uint64_t startTime, stopTime;
+};
+
+// Listen on the socket path, replacing a socket that is already there, and
+// start the workers, which run jobs with the limits. Returns NULL and sets the
+// server error if the socket can't be set up.
+struct server *startServer(char *socketPath, int numWorkers, struct contextLimits limits);
+// Accept connections and queue the ones with a job coming for the workers,
+// until stopServer is called. Closes the idle connections when it returns.
+void serveConnections(struct server *server);
+// Make serveConnections return, and make the jobs that are running fail at
+// the end of their slice. Safe to call from a signal handler.
+void stopServer(struct server *server);
+// Close and remove the socket, wait for the workers to finish or abandon the
+// jobs they have, and close the remaining connections.
+void finishServer(struct server *server);
+void freeServer(struct server *server);
+
+// Compile and run a job, filling in the result. A job that goes over a limit
+// or is abandoned fails with JOB_RUNTIME_ERROR.
+void runJob(struct server *server, struct job *job, struct jobResult *result);
+
+// Print the number of jobs, the throughput and the latency percentiles.
+void printServerStats(FILE *file, struct serverStats *stats, double seconds);
+
+char *setServerError(char *message);
+char *getServerError();
+
+#endif
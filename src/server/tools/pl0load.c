@@ -0,0 +1,236 @@
+#include "src/server/protocol.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Command line options. Arguments that start with "-" are flags, the others
+// are the PL/0 programs to send.
+struct loadOptions {
+    char *socketPath;
+    int numJobs;
+    int concurrency;   // Clients sending jobs at the same time.
+    int flags;         // Job flags, e.g. JOB_OPTIMIZE.
+    int reconnect;     // Open a connection per job instead of per client.
+    char *input;       // The input for every job.
+    int inputSize;
+    struct vector *sources;
+};
+
+// What a client saw.
+struct client {
+    struct loadOptions *options;
+    int first, last;                // The jobs to send, first to last - 1.
+    struct latencyHistogram latencies;
+    long long compileNanoseconds, runNanoseconds, instructions;
+    int failed, mismatched, lost;
+    char *firstError;
+};
+
+// The output of each program's first successful job, which the other jobs
+// for it have to match.
+char **expectedOutputs;
+pthread_mutex_t expectedLock = PTHREAD_MUTEX_INITIALIZER;
+
+int parseOptions(int argc, char **argv, struct loadOptions *options);
+void printUsage(char *programName);
+char *readFile(char *filename, int *size);
+
+int connectToServer(char *socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+void *runClient(void *argument) {
+    struct client *client = (struct client*)argument;
+    struct loadOptions *options = client->options;
+    int fd = -1;
+    int job;
+    for (job = client->first; job < client->last; job++) {
+        int program = job % options->sources->length;
+        uint64_t start = monotonicNanoseconds();
+        if (fd < 0)
+            fd = connectToServer(options->socketPath);
+        struct jobResult *result = NULL;
+        if (fd >= 0 && sendJob(fd, options->flags, get(char*, options->sources, program),
+                    options->input, options->inputSize))
+            result = receiveJobResult(fd);
+        long long latency = monotonicNanoseconds() - start;
+        if (result == NULL) {
+            client->lost++;
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            continue;
+        }
+        if (options->reconnect) {
+            close(fd);
+            fd = -1;
+        }
+
+        addLatency(&client->latencies, latency);
+        client->compileNanoseconds += result->header.compileNanoseconds;
+        client->runNanoseconds += result->header.runNanoseconds;
+        client->instructions += result->header.instructionCount;
+        if (result->header.status != JOB_SUCCEEDED) {
+            client->failed++;
+            if (client->firstError == NULL)
+                client->firstError = strdup((result->error != NULL) ? result->error : "");
+        } else {
+            pthread_mutex_lock(&expectedLock);
+            if (expectedOutputs[program] == NULL)
+                expectedOutputs[program] = strdup(result->output);
+            else if (strcmp(expectedOutputs[program], result->output) != 0)
+                client->mismatched++;
+            pthread_mutex_unlock(&expectedLock);
+        }
+        freeJobResult(result);
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+// Sends jobs to pl0server from a number of clients at once, and reports the
+// latency that the clients saw and the throughput. Jobs go round-robin over
+// the programs, and every job has to print what the program's first job
+// printed.
+int main(int argc, char **argv) {
+    struct loadOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    expectedOutputs = (char**)calloc(options.sources->length, sizeof(char*));
+
+    struct client *clients = (struct client*)calloc(options.concurrency, sizeof(struct client));
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * options.concurrency);
+    uint64_t start = monotonicNanoseconds();
+    int i;
+    for (i = 0; i < options.concurrency; i++) {
+        clients[i].options = &options;
+        clients[i].first = (long long)options.numJobs * i / options.concurrency;
+        clients[i].last = (long long)options.numJobs * (i + 1) / options.concurrency;
+        pthread_create(&threads[i], NULL, runClient, &clients[i]);
+    }
+
+    struct latencyHistogram *latencies = make(struct latencyHistogram);
+    memset(latencies, 0, sizeof(*latencies));
+    long long compileNanoseconds = 0, runNanoseconds = 0, instructions = 0;
+    int failed = 0, mismatched = 0, lost = 0;
+    char *firstError = NULL;
+    for (i = 0; i < options.concurrency; i++) {
+        pthread_join(threads[i], NULL);
+        struct client *client = &clients[i];
+        mergeLatencies(latencies, &client->latencies);
+        compileNanoseconds += client->compileNanoseconds;
+        runNanoseconds += client->runNanoseconds;
+        instructions += client->instructions;
+        failed += client->failed;
+        mismatched += client->mismatched;
+        lost += client->lost;
+        if (firstError == NULL)
+            firstError = client->firstError;
+    }
+    double seconds = (monotonicNanoseconds() - start) / 1e9;
+
+    int completed = latencies->count;
+    printf("%d jobs from %d clients in %.2f s: %d failed, %d printed something else "
+           "than the first run, %d got no answer.\n", options.numJobs, options.concurrency,
+           seconds, failed, mismatched, lost);
+    if (firstError != NULL)
+        printf("First error: %s\n", firstError);
+    if (completed > 0) {
+        printf("Throughput: %.1f jobs/s, %.1f million instructions/s.\n",
+                completed / seconds, instructions / seconds / 1e6);
+        printf("Mean compile time: %.1f us, mean run time: %.1f us (on the server).\n",
+                compileNanoseconds / 1e3 / completed, runNanoseconds / 1e3 / completed);
+        printLatencies(stdout, latencies);
+    }
+
+    free(latencies);
+    return (failed > 0 || mismatched > 0 || lost > 0) ? 1 : 0;
+}
+
+char *readFile(char *filename, int *size) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *contents = (char*)malloc(length + 1);
+    length = fread(contents, 1, length, file);
+    contents[length] = '\0';
+    fclose(file);
+    if (size != NULL)
+        *size = length;
+    return contents;
+}
+
+int parseOptions(int argc, char **argv, struct loadOptions *options) {
+    *options = (struct loadOptions){NULL, 1000, 4, 0, 0, "", 0, makeVector(char*)};
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (strcmp(argument, "--socket") == 0 && i + 1 < argc) {
+            options->socketPath = argv[++i];
+        } else if (strcmp(argument, "--jobs") == 0 && i + 1 < argc) {
+            options->numJobs = atoi(argv[++i]);
+            if (options->numJobs <= 0)
+                return 0;
+        } else if (strcmp(argument, "--concurrency") == 0 && i + 1 < argc) {
+            options->concurrency = atoi(argv[++i]);
+            if (options->concurrency <= 0)
+                return 0;
+        } else if (strcmp(argument, "-O") == 0 || strcmp(argument, "--optimize") == 0) {
+            options->flags |= JOB_OPTIMIZE;
+        } else if (strcmp(argument, "--reconnect") == 0) {
+            options->reconnect = 1;
+        } else if (strcmp(argument, "--input") == 0 && i + 1 < argc) {
+            char *filename = argv[++i];
+            options->input = readFile(filename, &options->inputSize);
+            if (options->input == NULL) {
+                fprintf(stderr, "Could not read %s.\n", filename);
+                return 0;
+            }
+        } else if (argument[0] == '-') {
+            return 0;
+        } else {
+            char *source = readFile(argument, NULL);
+            if (source == NULL) {
+                fprintf(stderr, "Could not read %s.\n", argument);
+                return 0;
+            }
+            push(options->sources, source);
+        }
+    }
+
+    return (options->socketPath != NULL && options->sources->length > 0);
+}
+
+void printUsage(char *programName) {
+    printf("Usage: %s --socket <path> [<options>] <PL/0 source file>...\n", programName);
+    printf("Options:\n");
+    printf("  --jobs <n>          Number of jobs to send (default 1000).\n");
+    printf("  --concurrency <n>   Number of clients sending jobs at once (default 4).\n");
+    printf("  -O, --optimize      Have the server optimize the programs.\n");
+    printf("  --reconnect         Connect for every job instead of once per client.\n");
+    printf("  --input <file>      What the programs read (default: nothing).\n");
+}
@@ -0,0 +1,69 @@
+#include "src/stats.h"
+#include <time.h>
+#include <sys/resource.h>
+
+// The thread's allocations, see countAllocation.
+__thread long long allocationCount = 0;
+__thread long long allocatedByteCount = 0;
+
+void countAllocation(size_t size) {
+    allocationCount++;
+    allocatedByteCount += size;
+}
+
+uint64_t phaseNanoseconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+struct phaseTimer startPhase() {
+    return (struct phaseTimer){phaseNanoseconds(), allocationCount, allocatedByteCount};
+}
+
+void endPhase(struct vector *phases, struct phaseTimer timer, char *name, char *unit,
+        long long produced) {
+    uint64_t nanoseconds = phaseNanoseconds() - timer.start;
+    // Taken before the push, so that it doesn't count.
+    long long phaseAllocations = allocationCount - timer.allocations;
+    long long phaseBytes = allocatedByteCount - timer.allocatedBytes;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    pushLiteral(phases, struct phaseStats, {name, unit, produced, nanoseconds,
+            phaseAllocations, phaseBytes, usage.ru_maxrss});
+}
+
+void printPhaseStats(FILE *file, struct vector *phases, int json) {
+    struct phaseStats total = {"total", NULL, 0, 0, 0, 0, 0};
+    forVector(phases, i, struct phaseStats, phase,
+        total.nanoseconds += phase.nanoseconds;
+        total.allocations += phase.allocations;
+        total.allocatedBytes += phase.allocatedBytes;
+        if (phase.peakKilobytes > total.peakKilobytes)
+            total.peakKilobytes = phase.peakKilobytes;);
+
+    if (json) {
+        fprintf(file, "{\"phases\": [");
+        forVector(phases, i, struct phaseStats, phase,
+            fprintf(file, "%s\n  {\"name\": \"%s\", \"seconds\": %.9f, \"produced\": %lld, "
+                    "\"unit\": \"%s\", \"allocations\": %lld, \"allocatedBytes\": %lld, "
+                    "\"peakKilobytes\": %ld}", (i > 0) ? "," : "", phase.name,
+                    phase.nanoseconds / 1e9, phase.produced, phase.unit, phase.allocations,
+                    phase.allocatedBytes, phase.peakKilobytes););
+        fprintf(file, "\n], \"total\": {\"seconds\": %.9f, \"allocations\": %lld, "
+                "\"allocatedBytes\": %lld, \"peakKilobytes\": %ld}}\n", total.nanoseconds / 1e9,
+                total.allocations, total.allocatedBytes, total.peakKilobytes);
+        return;
+    }
+
+    fprintf(file, "%-22s %10s %22s %12s %14s %15s\n", "Phase", "Time (ms)", "Produced",
+            "Allocations", "Bytes", "Peak RSS (kB)");
+    forVector(phases, i, struct phaseStats, phase,
+        char produced[32];
+        snprintf(produced, sizeof produced, "%lld %s", phase.produced, phase.unit);
+        fprintf(file, "%-22s %10.3f %22s %12lld %14lld %15ld\n", phase.name,
+                phase.nanoseconds / 1e6, produced, phase.allocations, phase.allocatedBytes,
+                phase.peakKilobytes););
+    fprintf(file, "%-22s %10.3f %22s %12lld %14lld %15ld\n", "Total", total.nanoseconds / 1e6,
+            "", total.allocations, total.allocatedBytes, total.peakKilobytes);
+}
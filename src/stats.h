@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// What each phase of a compile cost, for compiler --stats: the wall time, how
+// much it produced, the heap allocations it made and the peak memory use of
+// the process after it.
+//
+// struct vector *phases = makeVector(struct phaseStats);
+// struct phaseTimer timer = startPhase();
+// struct vector *lexemes = readLexemes(source);
+// endPhase(phases, timer, "readLexemes", "tokens", lexemes->length);
+// printPhaseStats(stderr, phases, 0);
+
+struct phaseStats {
+    char *name;
+    char *unit;                 // What the phase produced, e.g. "tokens".
+    long long produced;
+    uint64_t nanoseconds;
+    long long allocations;      // Calls to malloc, calloc, realloc, strdup
+                                // and strndup from the program's own code.
+    long long allocatedBytes;   // The sizes asked for in them.
+    long peakKilobytes;         // The peak resident set size of the process
+                                // at the end of the phase.
+};
+
+struct phaseTimer {
+    uint64_t start;
+    long long allocations, allocatedBytes;
+};
+
+struct phaseTimer startPhase();
+// Add the stats of a phase that started with the timer. The name and unit
+// aren't copied.
+void endPhase(struct vector *phases, struct phaseTimer timer, char *name, char *unit,
+        long long produced);
+// Print the phases and their total as a table, or as JSON.
+void printPhaseStats(FILE *file, struct vector *phases, int json);
+
+// Count an allocation of the thread. Allocations are only counted in programs
+// that call this from wrappers of the allocation functions, like the compiler
+// (see compiler.c), and are 0 in the others.
+void countAllocation(size_t size);
+
+#endif
@@ -0,0 +1,452 @@
+// The body of the threaded interpreter loop, see the outline in vm.c. vm.c
+// includes it inside the functions that run a program, after defining these
+// hooks:
+//
+// - PROFILE_INSTRUCTION() runs before every instruction, with ip pointing at
+//   it and code at the first instruction.
+// - PROFILE_BRANCH(jumped) runs for every jpc, with jumped true if it jumps.
+// - FUSE_INSTRUCTIONS is true if fused instructions (see fusion.h) run their
+//   whole sequence at once. Otherwise they run like their first instruction,
+//   and the hooks see every instruction.
+// - CHECK_INSTRUCTIONS is false for verified programs (see verifier.h), which
+//   leaves out the checks that the verifier proved can't fail. Those programs
+//   have no procedures, so bp is always 1.
+// - PREEMPTIBLE is true for runSlice: the loop starts from the registers in
+//   the VM, stops at jumps, calls and returns once it has run fuel
+//   instructions, and stops at reads with nothing to read. The threaded code
+//   is kept in the VM for the next slice, and the I/O buffers stay open.
+//
+// The function's arguments have to be called vm and, if PREEMPTIBLE, fuel. It
+// returns the same as runVM.
+
+    // The opr operations that fused instructions can contain, as the name
+    // used in their labels and the operation's result. Do the arithmetic on
+    // unsigned ints so that overflow wraps around like it does in the old vm,
+    // instead of being undefined.
+    #define ARITHMETIC_OPERATIONS(X) \
+        X(ADD, Add, (unsigned)tos + (unsigned)value) \
+        X(SUB, Sub, (unsigned)tos - (unsigned)value) \
+        X(MUL, Mul, (unsigned)tos * (unsigned)value)
+    #define COMPARISON_OPERATIONS(X) \
+        X(EQL, Eql, tos == value) \
+        X(NEQ, Neq, tos != value) \
+        X(LSS, Lss, tos < value) \
+        X(LEQ, Leq, tos <= value) \
+        X(GTR, Gtr, tos > value) \
+        X(GEQ, Geq, tos >= value)
+
+    static void *opcodeHandlers[NUM_OPCODES] = {
+        NULL, &&lit, NULL, &&lod, &&sto, &&cal, &&inc, &&jmp, &&jpc, &&sio, &&read
+    };
+    static void *operationHandlers[] = {
+        &&ret, &&neg, &&add, &&sub, &&mul, &&div, &&odd, &&mod,
+        &&eql, &&neq, &&lss, &&leq, &&gtr, &&geq
+    };
+    int numOperations = sizeof(operationHandlers) / sizeof(void*);
+    // Indexed by fused opcode - NUM_OPCODES and the sequence's opr operation,
+    // or 0 if it has none.
+    #define ARITHMETIC_HANDLERS(OPERATION, Name, result) \
+        [LOD_LIT_OPR_STO - NUM_OPCODES][OPERATION] = &&lodLit##Name##Sto, \
+        [LIT_OPR_STO - NUM_OPCODES][OPERATION] = &&lit##Name##Sto, \
+        [LOD_LIT_OPR - NUM_OPCODES][OPERATION] = &&lodLit##Name, \
+        [LIT_OPR - NUM_OPCODES][OPERATION] = &&lit##Name, \
+        [LOD_OPR - NUM_OPCODES][OPERATION] = &&lod##Name, \
+        [OPR_STO - NUM_OPCODES][OPERATION] = &&opr##Name##Sto,
+    #define COMPARISON_HANDLERS(OPERATION, Name, result) \
+        [LOD_LIT_OPR_JPC - NUM_OPCODES][OPERATION] = &&lodLit##Name##Jpc, \
+        [OPR_JPC - NUM_OPCODES][OPERATION] = &&opr##Name##Jpc,
+    static void *fusedHandlers[NUM_ALL_OPCODES - NUM_OPCODES][GEQ + 1] = {
+        ARITHMETIC_OPERATIONS(ARITHMETIC_HANDLERS)
+        COMPARISON_OPERATIONS(COMPARISON_HANDLERS)
+        [LIT_STO - NUM_OPCODES][0] = &&litSto,
+        [LIT_LIT - NUM_OPCODES][0] = &&litLit,
+        [LOD_SIO - NUM_OPCODES][0] = &&lodSio,
+        [LOD_LOD - NUM_OPCODES][0] = &&lodLod,
+        [STO_LOD - NUM_OPCODES][0] = &&stoLod
+    };
+    #undef ARITHMETIC_HANDLERS
+    #undef COMPARISON_HANDLERS
+
+    // Translate the instructions into threaded code, unless an earlier slice
+    // did.
+    int length = vm->instructions->length;
+    struct threadedInstruction *code = PREEMPTIBLE ? vm->sliceCode : NULL;
+    if (code == NULL) {
+        code = (struct threadedInstruction*)malloc(
+                sizeof(struct threadedInstruction) * (length + 2));
+        forVector(vm->instructions, i, struct instruction, instruction,
+            void *handler = &&unknownOpcode;
+            int fusedOpcode = instruction.opcode;
+            instruction = unfuseInstruction(instruction);
+            int modifier = instruction.modifier;
+
+            if (instruction.opcode == OPR)
+                handler = (modifier >= 0 && modifier < numOperations)
+                    ? operationHandlers[modifier] : &&unknownOperation;
+            else if (instruction.opcode >= LIT && instruction.opcode < NUM_OPCODES)
+                handler = opcodeHandlers[instruction.opcode];
+
+            // Fused instructions read the rest of their sequence from the
+            // instructions after them, which are translated as usual.
+            if (FUSE_INSTRUCTIONS && matchesFusedPattern(vm->instructions, i, fusedOpcode)) {
+                int operation = 0, j;
+                for (j = 0; j < fusedLength(fusedOpcode); j++) {
+                    struct instruction part = get(struct instruction, vm->instructions, i + j);
+                    if (unfuseInstruction(part).opcode == OPR)
+                        operation = part.modifier;
+                }
+                if (fusedHandlers[fusedOpcode - NUM_OPCODES][operation] != NULL)
+                    handler = fusedHandlers[fusedOpcode - NUM_OPCODES][operation];
+            }
+
+            if ((instruction.opcode == JMP || instruction.opcode == JPC || instruction.opcode == CAL)
+                    && (modifier < 0 || modifier > length))
+                modifier = length + 1;
+
+            code[i] = (struct threadedInstruction){handler, instruction.lexicalLevel, modifier};);
+        code[length] = (struct threadedInstruction){&&ranOutOfCode, 0, 0};
+        code[length + 1] = (struct threadedInstruction){&&badJump, 0, 0};
+    }
+
+    // Catch stores into the guard page above the stack. The registers are
+    // lost when that happens, so only the error is reported.
+    struct stackGuard guard;
+    guard.guardStart = (char*)(vm->stack + vm->stackSize + 1);
+    guard.guardEnd = vm->stackMapping + vm->stackMappingSize;
+    struct stackGuard *outerGuard = currentStackGuard;
+    installStackFaultHandler();
+    if (!PREEMPTIBLE)
+        startIO(vm);
+    if (sigsetjmp(guard.overflow, 0) != 0) {
+        currentStackGuard = outerGuard;
+        if (PREEMPTIBLE) {
+            vm->sliceCode = code;
+        } else {
+            finishIO(vm);
+            free(code);
+        }
+        vm->error = "Maximum stack height exceeded.";
+        return 0;
+    }
+    currentStackGuard = &guard;
+
+    // The registers. tos is the value at stack[sp].
+    struct threadedInstruction *ip = code + (PREEMPTIBLE ? vm->pc : 0);
+    int *stack = vm->stack;
+    int stackSize = vm->stackSize;
+    int sp = PREEMPTIBLE ? vm->sp : 0;
+    int bp = PREEMPTIBLE ? vm->bp : 1;
+    int tos = PREEMPTIBLE ? stack[sp] : 0;
+    long long count = 0;
+    // Scratch variables for the instructions.
+    int address, level, value;
+
+    #define DISPATCH() do { count++; PROFILE_INSTRUCTION(); goto *ip->handler; } while (0)
+    #define NEXT() do { ip++; DISPATCH(); } while (0)
+    // Stop the slice if it's out of fuel, with ip at the next instruction.
+    #if PREEMPTIBLE
+    #define PREEMPT() if (__builtin_expect(count >= fuel, 0)) goto preempted
+    #else
+    #define PREEMPT()
+    #endif
+    // Make sure that there are at least n values on the stack, or that n more
+    // values fit on it. Only inc needs ROOM, the guard page catches pushes.
+    #if CHECK_INSTRUCTIONS
+    #define NEED(n) if (__builtin_expect(sp < (n), 0)) goto underflow
+    #define ROOM(n) if (__builtin_expect(sp > stackSize - (n), 0)) goto overflow
+    #else
+    #define NEED(n)
+    #define ROOM(n)
+    #endif
+    // Pop the top of the stack into tos's old slot.
+    #define POP() do { sp--; tos = stack[sp]; } while (0)
+    // Follow the static links to the base of the frame lexicalLevel levels
+    // down. The stack has to be spilled first.
+    #define BASE(result) \
+        result = bp; \
+        for (level = ip->lexicalLevel; level > 0; level--) { \
+            if ((unsigned)result >= (unsigned)sp) goto badAddress; \
+            result = stack[result + 1]; \
+        }
+    // The address of the variable that a lod or sto accesses. It has to be on
+    // the stack.
+    #if CHECK_INSTRUCTIONS
+    #define ADDRESS(result) \
+        BASE(result); \
+        result += ip->modifier; \
+        if ((unsigned)(result - 1) >= (unsigned)sp) goto badAddress
+    #else
+    #define ADDRESS(result) result = 1 + ip->modifier
+    #endif
+    // The instructions without going on to the next one, so that fused
+    // instructions can run several in a row. STEP() moves on to the next
+    // instruction of a fused sequence, so that errors point at the right one.
+    #define RUN_LIT() do { \
+        stack[sp++] = tos; \
+        tos = ip->modifier; \
+    } while (0)
+    #define RUN_LOD() do { \
+        stack[sp] = tos; \
+        ADDRESS(address); \
+        sp++; \
+        tos = stack[address]; \
+    } while (0)
+    #define RUN_STO() do { \
+        NEED(1); \
+        stack[sp] = tos; \
+        value = tos; \
+        sp--; \
+        ADDRESS(address); \
+        stack[address] = value; \
+        tos = stack[sp]; \
+    } while (0)
+    #define RUN_SIO() do { \
+        NEED(1); \
+        writeNumber(&vm->outputBuffer, tos); \
+        POP(); \
+    } while (0)
+    #define RUN_BINARY(expression) do { \
+        NEED(2); \
+        value = tos; \
+        POP(); \
+        tos = (expression); \
+    } while (0)
+    // jpc ends an instruction, since it has to dispatch to where it goes.
+    #define RUN_JPC() \
+        NEED(1); \
+        value = tos; \
+        POP(); \
+        if (value == 0) { \
+            PROFILE_BRANCH(1); \
+            ip = code + ip->modifier; \
+            PREEMPT(); \
+        } else { \
+            PROFILE_BRANCH(0); \
+            ip++; \
+        } \
+        DISPATCH()
+    #define STEP() do { ip++; count++; } while (0)
+    #define BINARY(expression) RUN_BINARY(expression); NEXT()
+
+    DISPATCH();
+
+lit:
+    RUN_LIT();
+    NEXT();
+lod:
+    RUN_LOD();
+    NEXT();
+sto:
+    RUN_STO();
+    NEXT();
+cal:
+    stack[sp] = tos;
+    BASE(address);
+    stack[sp + 1] = 0;          // Functional value.
+    stack[sp + 2] = address;    // Static link.
+    stack[sp + 3] = bp;         // Dynamic link.
+    stack[sp + 4] = ip - code + 1;   // Return address.
+    bp = sp + 1;
+    ip = code + ip->modifier;
+    PREEMPT();
+    DISPATCH();
+inc:
+    value = ip->modifier;
+    if (value > 0) {
+        ROOM(value);
+    } else {
+        NEED(-value);
+    }
+    stack[sp] = tos;
+    sp += value;
+    tos = stack[sp];
+    NEXT();
+jmp:
+    ip = code + ip->modifier;
+    PREEMPT();
+    DISPATCH();
+jpc:
+    RUN_JPC();
+sio:
+    RUN_SIO();
+    NEXT();
+read:
+    #if PREEMPTIBLE
+    // Wait for input with ip at the read, which isn't counted yet.
+    if (!hasNumber(&vm->inputBuffer)) {
+        count--;
+        goto blocked;
+    }
+    #endif
+    stack[sp++] = tos;
+    tos = readNumber(&vm->inputBuffer);
+    NEXT();
+
+ret:
+    // Returning from the main program halts.
+    if (bp == 1)
+        goto halt;
+    stack[sp] = tos;
+    sp = bp - 1;
+    address = stack[bp + 3];
+    bp = stack[bp + 2];
+    tos = stack[sp];
+    // The frame's activation record has to be on the stack for the next ret.
+    if ((unsigned)address > (unsigned)length || bp < 1 || bp > stackSize - 3)
+        goto badReturn;
+    ip = code + address;
+    PREEMPT();
+    DISPATCH();
+neg:
+    NEED(1);
+    tos = -(unsigned)tos;
+    NEXT();
+odd:
+    NEED(1);
+    tos = tos % 2;
+    NEXT();
+    // The binary operations compute the same results as the ones listed in
+    // ARITHMETIC_OPERATIONS and COMPARISON_OPERATIONS.
+add: BINARY((unsigned)tos + (unsigned)value);
+sub: BINARY((unsigned)tos - (unsigned)value);
+mul: BINARY((unsigned)tos * (unsigned)value);
+div:
+    if (tos == 0 && sp >= 2)
+        goto divisionByZero;
+    BINARY((value == -1) ? -(unsigned)tos : tos / value);
+mod:
+    if (tos == 0 && sp >= 2)
+        goto divisionByZero;
+    BINARY((value == -1) ? 0 : tos % value);
+eql: BINARY(tos == value);
+neq: BINARY(tos != value);
+lss: BINARY(tos < value);
+leq: BINARY(tos <= value);
+gtr: BINARY(tos > value);
+geq: BINARY(tos >= value);
+
+    // Fused instructions.
+    #define ARITHMETIC_HANDLERS(OPERATION, Name, result) \
+    lodLit##Name##Sto: \
+        RUN_LOD(); STEP(); RUN_LIT(); STEP(); RUN_BINARY(result); STEP(); RUN_STO(); \
+        NEXT(); \
+    lit##Name##Sto: \
+        RUN_LIT(); STEP(); RUN_BINARY(result); STEP(); RUN_STO(); \
+        NEXT(); \
+    lodLit##Name: \
+        RUN_LOD(); STEP(); RUN_LIT(); STEP(); RUN_BINARY(result); \
+        NEXT(); \
+    lit##Name: \
+        RUN_LIT(); STEP(); RUN_BINARY(result); \
+        NEXT(); \
+    lod##Name: \
+        RUN_LOD(); STEP(); RUN_BINARY(result); \
+        NEXT(); \
+    opr##Name##Sto: \
+        RUN_BINARY(result); STEP(); RUN_STO(); \
+        NEXT();
+    #define COMPARISON_HANDLERS(OPERATION, Name, result) \
+    lodLit##Name##Jpc: \
+        RUN_LOD(); STEP(); RUN_LIT(); STEP(); RUN_BINARY(result); STEP(); RUN_JPC(); \
+    opr##Name##Jpc: \
+        RUN_BINARY(result); STEP(); RUN_JPC();
+    ARITHMETIC_OPERATIONS(ARITHMETIC_HANDLERS)
+    COMPARISON_OPERATIONS(COMPARISON_HANDLERS)
+    #undef ARITHMETIC_HANDLERS
+    #undef COMPARISON_HANDLERS
+litSto:
+    RUN_LIT(); STEP(); RUN_STO();
+    NEXT();
+litLit:
+    RUN_LIT(); STEP(); RUN_LIT();
+    NEXT();
+lodSio:
+    RUN_LOD(); STEP(); RUN_SIO();
+    NEXT();
+lodLod:
+    RUN_LOD(); STEP(); RUN_LOD();
+    NEXT();
+stoLod:
+    RUN_STO(); STEP(); RUN_LOD();
+    NEXT();
+
+    #undef DISPATCH
+    #undef NEXT
+    #undef PREEMPT
+    #undef NEED
+    #undef ROOM
+    #undef POP
+    #undef BASE
+    #undef ADDRESS
+    #undef BINARY
+    #undef RUN_LIT
+    #undef RUN_LOD
+    #undef RUN_STO
+    #undef RUN_SIO
+    #undef RUN_BINARY
+    #undef RUN_JPC
+    #undef STEP
+    #undef ARITHMETIC_OPERATIONS
+    #undef COMPARISON_OPERATIONS
+
+unknownOpcode:
+    vm->error = format("Unknown opcode: %d.",
+            get(struct instruction, vm->instructions, ip - code).opcode);
+    goto finish;
+unknownOperation:
+    vm->error = format("Unknown operation: %d.", ip->modifier);
+    goto finish;
+ranOutOfCode:
+    count--;   // The sentinels aren't instructions.
+    vm->error = "Ran out of code before reaching RET instruction.";
+    goto finish;
+badJump:
+    count--;
+    vm->error = "Jump to an address outside of the code.";
+    goto finish;
+badReturn:
+    vm->error = "Return to an invalid address.";
+    goto finish;
+badAddress:
+    vm->error = "Access to an address outside of the stack.";
+    goto finish;
+underflow:
+    vm->error = "Stack underflow.";
+    goto finish;
+overflow:
+    vm->error = "Maximum stack height exceeded.";
+    goto finish;
+divisionByZero:
+    vm->error = "Division by zero.";
+    goto finish;
+
+    #if PREEMPTIBLE
+    // The slice stops with the registers saved, to go on from there.
+preempted:
+blocked:
+    goto finish;
+    #endif
+halt:
+    sp = 0;
+    bp = 0;
+    ip++;
+finish:
+    // Leave the registers and the stack as they would be without the cached
+    // top of the stack, so that they can be inspected.
+    if (sp >= 0 && sp <= stackSize)
+        stack[sp] = tos;
+    vm->pc = ip - code;
+    if (vm->error != NULL && vm->pc < length)
+        vm->errorPc = vm->pc;
+    vm->bp = bp;
+    vm->sp = sp;
+    vm->instructionCount += count;
+    currentStackGuard = outerGuard;
+    if (PREEMPTIBLE) {
+        vm->sliceCode = code;
+    } else {
+        finishIO(vm);
+        free(code);
+    }
+
+    return (vm->error == NULL);
@@ -0,0 +1,201 @@
+#include "src/vm/io.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Memory buffers start out small, since a scheduler can have thousands.
+#define MEMORY_BUFFER_SIZE 64
+
+void openInputBuffer(struct ioBuffer *buffer, FILE *file, int mode) {
+    *buffer = (struct ioBuffer){file, mode, 0, (char*)malloc(IO_BUFFER_SIZE), IO_BUFFER_SIZE,
+        0, 0, 0, 0};
+}
+
+void openOutputBuffer(struct ioBuffer *buffer, FILE *file, int mode) {
+    *buffer = (struct ioBuffer){file, mode, 1, (char*)malloc(IO_BUFFER_SIZE), IO_BUFFER_SIZE,
+        0, 0, 0, 0};
+}
+
+void openMemoryBuffer(struct ioBuffer *buffer, int isOutput, int mode) {
+    *buffer = (struct ioBuffer){NULL, mode, isOutput, (char*)malloc(MEMORY_BUFFER_SIZE),
+        MEMORY_BUFFER_SIZE, 0, 0, 0, 0};
+}
+
+// Make room for at least size more bytes after data[end].
+void growMemoryBuffer(struct ioBuffer *buffer, int size) {
+    int capacity = buffer->capacity;
+    while (capacity - buffer->end < size)
+        capacity *= 2;
+    if (capacity != buffer->capacity) {
+        buffer->data = (char*)realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+}
+
+void appendInput(struct ioBuffer *input, char *data, int size) {
+    int unread = input->end - input->start;
+    memmove(input->data, input->data + input->start, unread);
+    input->start = 0;
+    input->end = unread;
+    growMemoryBuffer(input, size);
+    memcpy(input->data + input->end, data, size);
+    input->end += size;
+}
+
+void endInput(struct ioBuffer *input) {
+    input->atEnd = 1;
+}
+
+int hasNumber(struct ioBuffer *input) {
+    if (input->atEnd)
+        return 1;
+    if (input->mode == BINARY_IO)
+        return input->end - input->start >= 4;
+
+    // Like readNumber: whitespace, a sign and digits, which have to be
+    // followed by something else to be a whole number.
+    char *c = input->data + input->start;
+    char *end = input->data + input->end;
+    while (c < end && (*c == ' ' || (*c >= '\t' && *c <= '\r')))
+        c++;
+    if (c < end && (*c == '-' || *c == '+'))
+        c++;
+    while (c < end && *c >= '0' && *c <= '9')
+        c++;
+    return c < end;
+}
+
+int closeIOBuffer(struct ioBuffer *buffer) {
+    if (buffer->data == NULL)
+        return 1;
+    int succeeded = buffer->isOutput ? flushOutputBuffer(buffer) : 1;
+    free(buffer->data);
+    buffer->data = NULL;
+    return succeeded;
+}
+
+// Move the unread input to the front of the buffer and read more after it.
+// Returns false once there's nothing left to read.
+int refillInputBuffer(struct ioBuffer *input) {
+    // Memory input only grows with appendInput.
+    if (input->atEnd || input->file == NULL)
+        return 0;
+
+    int unread = input->end - input->start;
+    memmove(input->data, input->data + input->start, unread);
+    input->start = 0;
+    input->end = unread;
+
+    // A read on the file descriptor returns whatever is available, while
+    // fread would wait until the whole buffer is full, which never happens
+    // with interactive input. Streams without a descriptor, like the memory
+    // streams in the tests, have to use fread. The VM is the only reader of
+    // its input, so stdio's own buffer is always empty.
+    int fd = fileno(input->file);
+    ssize_t count;
+    if (fd >= 0) {
+        do {
+            count = read(fd, input->data + unread, input->capacity - unread);
+        } while (count < 0 && errno == EINTR);
+    } else {
+        count = fread(input->data + unread, 1, input->capacity - unread, input->file);
+    }
+
+    if (count <= 0) {
+        input->atEnd = 1;
+        return 0;
+    }
+    input->end += count;
+    return 1;
+}
+
+int readNumber(struct ioBuffer *input) {
+    // The next byte, or -1 at the end of the input.
+    int peek() {
+        if (input->start == input->end && !refillInputBuffer(input))
+            return -1;
+        return (unsigned char)input->data[input->start];
+    }
+
+    if (input->mode == BINARY_IO) {
+        while (input->end - input->start < 4 && refillInputBuffer(input))
+            ;
+        if (input->end - input->start < 4) {
+            input->start = input->end;
+            return 0;
+        }
+        int number;
+        memcpy(&number, input->data + input->start, 4);
+        input->start += 4;
+        return number;
+    }
+
+    int c = peek();
+    while (c == ' ' || (c >= '\t' && c <= '\r')) {
+        input->start++;
+        c = peek();
+    }
+
+    // Like scanf, a sign without digits after it is still used up.
+    int negative = (c == '-');
+    if (c == '-' || c == '+') {
+        input->start++;
+        c = peek();
+    }
+    if (c < '0' || c > '9')
+        return 0;
+
+    unsigned int number = 0;
+    do {
+        number = number * 10 + (c - '0');
+        input->start++;
+        c = peek();
+    } while (c >= '0' && c <= '9');
+
+    return (int)(negative ? -number : number);
+}
+
+void writeNumber(struct ioBuffer *output, int number) {
+    // Text takes at most 12 bytes: a sign, 10 digits and a newline.
+    if (output->end > output->capacity - 12)
+        flushOutputBuffer(output);
+
+    if (output->mode == BINARY_IO) {
+        memcpy(output->data + output->end, &number, 4);
+        output->end += 4;
+        return;
+    }
+
+    char digits[12];
+    int length = 0;
+    unsigned int value = (number < 0) ? -(unsigned int)number : (unsigned int)number;
+    do {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    char *text = output->data + output->end;
+    if (number < 0)
+        *text++ = '-';
+    while (length > 0)
+        *text++ = digits[--length];
+    *text++ = '\n';
+    output->end = text - output->data;
+}
+
+int flushOutputBuffer(struct ioBuffer *output) {
+    // Memory output is kept, so make room for more instead.
+    if (output->file == NULL) {
+        growMemoryBuffer(output, output->capacity);
+        return 1;
+    }
+    if (output->end > 0
+            && fwrite(output->data, 1, output->end, output->file) != (size_t)output->end)
+        output->failed = 1;
+    output->end = 0;
+    if (fflush(output->file) != 0)
+        output->failed = 1;
+
+    return !output->failed;
+}
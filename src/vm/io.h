@@ -0,0 +1,57 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdio.h>
+
+// Buffered input and output for the read and sio instructions. Instead of a
+// stdio call per number, numbers are parsed from and formatted into large
+// buffers that are only refilled when they run out and only flushed when
+// they're full or the program stops.
+//
+// In text mode, numbers are read like scanf("%d") reads them and written one
+// per line. In binary mode they're 32-bit integers in the machine's byte
+// order, for passing numbers between programs without formatting them.
+
+#define IO_BUFFER_SIZE (1 << 16)
+
+enum { TEXT_IO, BINARY_IO };
+
+struct ioBuffer {
+    FILE *file;     // NULL for memory buffers.
+    int mode;       // TEXT_IO or BINARY_IO.
+    int isOutput;
+    char *data;     // capacity bytes.
+    int capacity;   // IO_BUFFER_SIZE, except for memory buffers, which grow.
+    int start;      // Input: the unread bytes are data[start] to data[end - 1].
+    int end;        // Output: the bytes to write are data[0] to data[end - 1].
+    int atEnd;      // Input: the file has no more bytes.
+    int failed;     // Output: a write failed.
+};
+
+// Start buffering input from or output to a file.
+void openInputBuffer(struct ioBuffer *buffer, FILE *file, int mode);
+void openOutputBuffer(struct ioBuffer *buffer, FILE *file, int mode);
+// Buffer input from or output to memory instead of a file, for programs that
+// run in a scheduler's contexts (see scheduler.h). Memory input is added with
+// appendInput and ends when endInput is called. Memory output grows to hold
+// everything that is written, in data[0] to data[end - 1].
+void openMemoryBuffer(struct ioBuffer *buffer, int isOutput, int mode);
+void appendInput(struct ioBuffer *input, char *data, int size);
+void endInput(struct ioBuffer *input);
+// Returns true if readNumber can return without waiting for more memory
+// input, because a whole number or the end of the input is buffered.
+int hasNumber(struct ioBuffer *input);
+// Flush the output (if it's an output buffer) and free the buffer's memory.
+// Input that was read ahead is lost. Returns false if a write failed.
+int closeIOBuffer(struct ioBuffer *buffer);
+
+// Read a number, or return 0 if there isn't one. In text mode, whitespace is
+// skipped, and the number has an optional sign and wraps around if it
+// doesn't fit in an int.
+int readNumber(struct ioBuffer *input);
+void writeNumber(struct ioBuffer *output, int number);
+// Write the buffered output to the file, or make room for more in a memory
+// buffer. Returns false if that failed.
+int flushOutputBuffer(struct ioBuffer *output);
+
+#endif
@@ -0,0 +1,329 @@
+#include "src/vm/jit.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* Code generation outline:
+ * - The verifier (see verifier.h) finds the stack height before every
+ *   reachable instruction and checks that it's the same on every path, that
+ *   the stack never overflows or underflows, and that every lod/sto address
+ *   is on the stack. Programs that fail the checks are left to the
+ *   interpreter, which reports the errors.
+ * - Registers: rbx points at the VM's stack, so the slot at height h is
+ *   [rbx + 4h], r12 holds the struct vm pointer for the I/O helpers, r13
+ *   counts the executed instructions, and eax caches the top of the stack.
+ *   Slots below the top are always up to date in memory, like in runVM.
+ * - Each instruction becomes a short fixed sequence. Jumps are emitted with
+ *   placeholder offsets and patched once every instruction's offset is known.
+ * - The first instruction of each basic block adds the block's length to the
+ *   instruction count, since a block always runs to its end once entered.
+ */
+
+// Status codes returned by the compiled code.
+enum { JIT_HALTED, JIT_DIVISION_BY_ZERO, JIT_RAN_OUT_OF_CODE };
+
+// Jump targets other than instructions.
+enum { DIVISION_BY_ZERO_TARGET = -1, EPILOGUE_TARGET = -2 };
+
+// A jump whose 32-bit offset at position has to be patched to go to target,
+// which is an instruction index or one of the targets above.
+struct jitFixup {
+    int position;
+    int target;
+};
+
+void jitWrite(struct vm *vm, int value) {
+    writeNumber(&vm->outputBuffer, value);
+}
+
+int jitRead(struct vm *vm) {
+    return readNumber(&vm->inputBuffer);
+}
+
+int canJIT(struct vm *vm) {
+    return (vm->verification != NULL);
+}
+
+// Translate the instructions into machine code. Returns the code as a vector
+// of bytes.
+struct vector *compileInstructions(struct vector *instructions, int *heights) {
+    int length = instructions->length;
+    struct vector *code = makeVector(unsigned char);
+    struct vector *fixups = makeVector(struct jitFixup);
+    int *offsets = (int*)malloc(sizeof(int) * (length + 1));
+
+    void emit(char *bytes, int count) {
+        int i;
+        for (i = 0; i < count; i++)
+            pushLiteral(code, unsigned char, bytes[i]);
+    }
+    #define EMIT(bytes) emit(bytes, sizeof(bytes) - 1)
+    void emitInt(int32_t value) {
+        int i;
+        for (i = 0; i < 4; i++)
+            pushLiteral(code, unsigned char, (value >> (8 * i)) & 0xff);
+    }
+    void emitPointer(void *pointer) {
+        uint64_t value = (uint64_t)(uintptr_t)pointer;
+        int i;
+        for (i = 0; i < 8; i++)
+            pushLiteral(code, unsigned char, (value >> (8 * i)) & 0xff);
+    }
+    // Emit the 32-bit offset of a jump to target.
+    void emitJumpTo(int target) {
+        pushLiteral(fixups, struct jitFixup, {code->length, target});
+        emitInt(0);
+    }
+    // Emit an instruction that uses the stack slot at the given height, e.g.
+    // emitSlot("\x8b\x83", height) for mov eax, [rbx + 4 * height].
+    void emitSlot(char *bytes, int height) {
+        emit(bytes, 2);
+        emitInt(4 * height);
+    }
+    void emitCall(void *function) {
+        EMIT("\x4c\x89\xe7");   // mov rdi, r12
+        EMIT("\x48\xb8");       // mov rax, function
+        emitPointer(function);
+        EMIT("\xff\xd0");       // call rax
+    }
+
+    // Prologue: save the callee-saved registers that are used, and load the
+    // stack pointer and vm arguments.
+    EMIT("\x53\x41\x54\x41\x55");   // push rbx; push r12; push r13
+    EMIT("\x48\x89\xfb");           // mov rbx, rdi
+    EMIT("\x49\x89\xf4");           // mov r12, rsi
+    EMIT("\x45\x31\xed");           // xor r13d, r13d
+
+    // Find the basic blocks for counting instructions.
+    char *isLeader = (char*)calloc(length + 1, sizeof(char));
+    isLeader[0] = 1;
+    forVector(instructions, i, struct instruction, instruction,
+        if (instruction.opcode == JMP || instruction.opcode == JPC) {
+            if (instruction.modifier >= 0 && instruction.modifier < length)
+                isLeader[instruction.modifier] = 1;
+            isLeader[i + 1] = 1;
+        } else if (instruction.opcode == OPR && instruction.modifier == RET) {
+            isLeader[i + 1] = 1;
+        });
+
+    int i;
+    for (i = 0; i < length; i++) {
+        struct instruction instruction =
+            unfuseInstruction(get(struct instruction, instructions, i));
+        int height = heights[i];
+        int modifier = instruction.modifier;
+        offsets[i] = code->length;
+
+        if (height < 0)
+            continue;
+
+        if (isLeader[i]) {
+            int end = i + 1;
+            while (end < length && !isLeader[end])
+                end++;
+            EMIT("\x49\x81\xc5");   // add r13, block length
+            emitInt(end - i);
+        }
+
+        // Spill the top of the stack before pushing something on top of it,
+        // and load the new top of the stack after popping.
+        void spill() {
+            if (height >= 1)
+                emitSlot("\x89\x83", height);   // mov [rbx + 4 * height], eax
+        }
+        void reload(int newHeight) {
+            if (newHeight >= 1)
+                emitSlot("\x8b\x83", newHeight);   // mov eax, [rbx + 4 * newHeight]
+        }
+        // Load the value under the top of the stack into ecx.
+        void loadLeftOperand() {
+            emitSlot("\x8b\x8b", height - 1);   // mov ecx, [rbx + 4 * (height - 1)]
+        }
+
+        switch (instruction.opcode) {
+        case LIT:
+            spill();
+            EMIT("\xb8");   // mov eax, modifier
+            emitInt(modifier);
+            break;
+        case LOD:
+            spill();
+            emitSlot("\x8b\x83", 1 + modifier);   // mov eax, [rbx + 4 * address]
+            break;
+        case STO:
+            emitSlot("\x89\x83", 1 + modifier);   // mov [rbx + 4 * address], eax
+            reload(height - 1);
+            break;
+        case INC:
+            spill();
+            reload(height + modifier);
+            break;
+        case JMP:
+            EMIT("\xe9");   // jmp target
+            emitJumpTo(modifier);
+            break;
+        case JPC:
+            EMIT("\x85\xc0");   // test eax, eax
+            reload(height - 1);   // mov doesn't change the flags.
+            EMIT("\x0f\x84");     // jz target
+            emitJumpTo(modifier);
+            break;
+        case SIO:
+            EMIT("\x89\xc6");   // mov esi, eax
+            emitCall(jitWrite);
+            reload(height - 1);
+            break;
+        case READ:
+            spill();
+            emitCall(jitRead);
+            break;
+        case OPR:
+            switch (modifier) {
+            case RET:
+                EMIT("\x31\xc0");   // xor eax, eax (JIT_HALTED)
+                EMIT("\xe9");       // jmp epilogue
+                emitJumpTo(EPILOGUE_TARGET);
+                break;
+            case NEG:
+                EMIT("\xf7\xd8");   // neg eax
+                break;
+            case ODD:
+                // eax % 2, rounding towards zero like C does.
+                EMIT("\x89\xc2");       // mov edx, eax
+                EMIT("\xc1\xea\x1f");   // shr edx, 31
+                EMIT("\x01\xc2");       // add edx, eax
+                EMIT("\x83\xe2\xfe");   // and edx, -2
+                EMIT("\x29\xd0");       // sub eax, edx
+                break;
+            case ADD:
+                emitSlot("\x03\x83", height - 1);   // add eax, [rbx + 4 * (height - 1)]
+                break;
+            case SUB:
+                loadLeftOperand();
+                EMIT("\x29\xc1");   // sub ecx, eax
+                EMIT("\x89\xc8");   // mov eax, ecx
+                break;
+            case MUL:
+                EMIT("\x0f\xaf\x83");   // imul eax, [rbx + 4 * (height - 1)]
+                emitInt(4 * (height - 1));
+                break;
+            case DIV:
+            case MOD:
+                EMIT("\x85\xc0");       // test eax, eax
+                EMIT("\x0f\x84");       // jz divisionByZero
+                emitJumpTo(DIVISION_BY_ZERO_TARGET);
+                EMIT("\x89\xc1");       // mov ecx, eax
+                emitSlot("\x8b\x83", height - 1);   // mov eax, [rbx + 4 * (height - 1)]
+                // Dividing INT_MIN by -1 traps, so handle -1 separately.
+                EMIT("\x83\xf9\xff");   // cmp ecx, -1
+                EMIT("\x75\x04");       // jne divide
+                if (modifier == DIV)
+                    EMIT("\xf7\xd8");   // neg eax
+                else
+                    EMIT("\x31\xc0");   // xor eax, eax
+                if (modifier == DIV) {
+                    EMIT("\xeb\x03");   // jmp done
+                    EMIT("\x99\xf7\xf9");   // divide: cdq; idiv ecx
+                } else {
+                    EMIT("\xeb\x05");   // jmp done
+                    EMIT("\x99\xf7\xf9");   // divide: cdq; idiv ecx
+                    EMIT("\x89\xd0");       // mov eax, edx
+                }
+                break;
+            default: {
+                // Comparisons: compare, then set al to the result.
+                unsigned char setcc[] = {
+                    [EQL] = 0x94, [NEQ] = 0x95, [LSS] = 0x9c,
+                    [LEQ] = 0x9e, [GTR] = 0x9f, [GEQ] = 0x9d
+                };
+                loadLeftOperand();
+                EMIT("\x39\xc1");   // cmp ecx, eax
+                char set[] = {0x0f, setcc[modifier], 0xc0};
+                emit(set, sizeof(set));   // setcc al
+                EMIT("\x0f\xb6\xc0");   // movzx eax, al
+                break;
+            }
+            }
+            break;
+        }
+    }
+
+    // Running off the end of the code, or jumping to the end.
+    offsets[length] = code->length;
+    EMIT("\xb8");
+    emitInt(JIT_RAN_OUT_OF_CODE);
+    EMIT("\xe9");
+    emitJumpTo(EPILOGUE_TARGET);
+
+    int divisionByZero = code->length;
+    EMIT("\xb8");
+    emitInt(JIT_DIVISION_BY_ZERO);
+
+    // Epilogue: add the instruction count to the vm and return the status in
+    // eax.
+    int epilogue = code->length;
+    EMIT("\x4d\x01\xac\x24");   // add [r12 + instructionCount], r13
+    emitInt(offsetof(struct vm, instructionCount));
+    EMIT("\x41\x5d\x41\x5c\x5b");   // pop r13; pop r12; pop rbx
+    EMIT("\xc3");                   // ret
+
+    #undef EMIT
+
+    // Patch the jumps.
+    forVector(fixups, f, struct jitFixup, fixup,
+        int target = (fixup.target == EPILOGUE_TARGET) ? epilogue
+            : (fixup.target == DIVISION_BY_ZERO_TARGET) ? divisionByZero
+            : offsets[fixup.target];
+        int32_t offset = target - (fixup.position + 4);
+        int b;
+        for (b = 0; b < 4; b++)
+            set(code, fixup.position + b, (unsigned char){(offset >> (8 * b)) & 0xff}););
+
+    free(isLeader);
+    free(offsets);
+    freeVector(fixups);
+
+    return code;
+}
+
+int runJIT(struct vm *vm) {
+    if (vm->verification == NULL)
+        return runVM(vm);
+
+    struct vector *code = compileInstructions(vm->instructions, vm->verification->heights);
+
+    // Copy the code into memory that is made executable once it has been
+    // written, so that it's never writable and executable at the same time.
+    int size = code->length;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        freeVector(code);
+        return runVM(vm);
+    }
+    memcpy(memory, code->items, size);
+    freeVector(code);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return runVM(vm);
+    }
+
+    int (*function)(int *stack, struct vm *vm) = (int (*)(int*, struct vm*))memory;
+    startIO(vm);
+    int status = function(vm->stack, vm);
+    finishIO(vm);
+    munmap(memory, size);
+
+    if (status == JIT_DIVISION_BY_ZERO)
+        vm->error = "Division by zero.";
+    else if (status == JIT_RAN_OUT_OF_CODE)
+        vm->error = "Ran out of code before reaching RET instruction.";
+    else
+        vm->sp = vm->bp = 0;
+
+    return (vm->error == NULL);
+}
@@ -0,0 +1,21 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "src/vm/vm.h"
+
+// A JIT compiler that translates the instructions into x86-64 code and runs
+// it. It handles the programs that the verifier accepts (see verifier.h):
+// programs without procedures whose stack height at every instruction is
+// known before running them, which covers everything the code generator
+// produces. That lets every stack slot, frame variables included, be
+// addressed at a fixed offset from the stack base register, without any
+// stack pointer or stack checks at runtime.
+
+// Returns true if runJIT can compile the VM's program instead of falling
+// back to the interpreter.
+int canJIT(struct vm *vm);
+// Compile and run the program. Works like runVM, and falls back to runVM if
+// canJIT is false. The instruction count is exact unless the program fails.
+int runJIT(struct vm *vm);
+
+#endif
@@ -0,0 +1,359 @@
+#include "src/vm/vm.h"
+#include "src/vm/jit.h"
+#include "src/vm/scheduler.h"
+#include "src/object.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Command line options. Arguments that start with "-" are flags, the other
+// one is the program filename.
+struct vmOptions {
+    char *filename;
+    int trace;       // Print a listing and a trace like the old vm.
+    int stats;       // Print how fast the program ran.
+    int jit;         // Compile the program to machine code and run that.
+    int stackSize;   // Maximum stack height, or 0 to pick one.
+    char *recordFilename;   // Where to write a binary trace, or NULL.
+    int recordSize;         // Number of records the ring buffer keeps.
+    int samplePeriod;       // Record every samplePeriod-th instruction.
+    int profile;            // Print a profile of the run.
+    char *collapsedFilename;   // Where to write the profile for flame graphs.
+    int ioMode;             // TEXT_IO, or BINARY_IO with --binary-io.
+    int verify;             // Run verified programs without runtime checks.
+    int numContexts;        // Run this many copies in a scheduler, or 0.
+    long long quantum;      // Instructions per slice in the scheduler.
+    long long maxInstructions;   // Per context in the scheduler, or 0.
+};
+
+int parseOptions(int argc, char **argv, struct vmOptions *options);
+void printUsage(char *programName);
+void dumpRecordingOnSignal(int signalNumber);
+int runContexts(struct vmOptions *options, struct vector *instructions, struct vector *lines,
+        int stackSize);
+
+// The run being recorded, for the signal handler.
+struct vm *recordingVM = NULL;
+struct traceBuffer *recordingBuffer = NULL;
+int recordingFd = -1;
+
+int main(int argc, char **argv) {
+    struct vmOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    int requiredStackSize = 0;
+    struct vector *lines;
+    struct vector *instructions = loadProgram(options.filename, &requiredStackSize, &lines);
+    if (instructions == NULL) {
+        fprintf(stderr, "%s\n", getObjectFileError());
+        return 1;
+    }
+
+    // Use the stack size that the object file asks for if it needs more than
+    // the default, which is the old vm's limit when tracing, and smaller for
+    // the scheduler's contexts.
+    int stackSize = options.stackSize;
+    int defaultStackSize = options.trace ? OLD_VM_STACK_SIZE : DEFAULT_STACK_SIZE;
+    if (options.numContexts > 0)
+        defaultStackSize = DEFAULT_CONTEXT_STACK_SIZE;
+    if (stackSize == 0)
+        stackSize = (requiredStackSize > defaultStackSize)
+            ? requiredStackSize : defaultStackSize;
+    if (options.numContexts > 0) {
+        int exitCode = runContexts(&options, instructions, lines, stackSize);
+        freeVector(instructions);
+        freeVector(lines);
+        return exitCode;
+    }
+    struct vm *vm = makeVM(instructions, stackSize);
+    vm->ioMode = options.ioMode;
+    char *verifierError = getVerifierError();
+    if (!options.verify) {
+        freeVerification(vm->verification);
+        vm->verification = NULL;
+        verifierError = "Turned off with --no-verify.";
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int succeeded;
+    struct profile *profile = NULL;
+    if (options.trace) {
+        // The old vm prints the trace after the program's output, so collect
+        // it first.
+        char *trace;
+        size_t traceSize;
+        FILE *traceFile = open_memstream(&trace, &traceSize);
+
+        printListing(stdout, instructions);
+        succeeded = traceVM(vm, traceFile);
+        fclose(traceFile);
+        if (succeeded)
+            fwrite(trace, 1, traceSize, stdout);
+        free(trace);
+    } else if (options.recordFilename != NULL) {
+        recordingFd = open(options.recordFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (recordingFd < 0) {
+            fprintf(stderr, "Could not open the trace file.\n");
+            return 1;
+        }
+        recordingBuffer = makeTraceBuffer(options.recordSize, options.samplePeriod);
+        recordingVM = vm;
+        signal(SIGUSR1, dumpRecordingOnSignal);
+        signal(SIGINT, dumpRecordingOnSignal);
+        signal(SIGTERM, dumpRecordingOnSignal);
+
+        succeeded = recordVM(vm, recordingBuffer);
+
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        if (!writeTraceFile(recordingFd, recordingBuffer, vm->instructionCount))
+            fprintf(stderr, "Could not write the trace file.\n");
+        close(recordingFd);
+        freeTraceBuffer(recordingBuffer);
+    } else if (options.profile || options.collapsedFilename != NULL) {
+        profile = makeProfile(instructions->length);
+        succeeded = profileVM(vm, profile);
+    } else if (options.jit) {
+        succeeded = runJIT(vm);
+    } else {
+        succeeded = runVM(vm);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    if (!succeeded)
+        printVMError(stderr, vm, lines);
+
+    if (profile != NULL) {
+        if (options.profile)
+            printProfile(stderr, profile, instructions, lines);
+        if (options.collapsedFilename != NULL) {
+            FILE *collapsedFile = fopen(options.collapsedFilename, "w");
+            if (collapsedFile == NULL) {
+                fprintf(stderr, "Could not open the collapsed stack file.\n");
+            } else {
+                printCollapsedStacks(collapsedFile, profile, instructions, lines);
+                fclose(collapsedFile);
+            }
+        }
+        freeProfile(profile);
+    }
+
+    if (options.stats) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "Executed %lld instructions in %.3f s (%.1f million instructions/s).\n",
+                vm->instructionCount, seconds,
+                (seconds > 0) ? vm->instructionCount / seconds / 1e6 : 0.0);
+        if (vm->verification != NULL)
+            fprintf(stderr, "Verified, with a maximum stack height of %d.\n",
+                    vm->verification->maxHeight);
+        else
+            fprintf(stderr, "Not verified: %s\n", verifierError);
+    }
+
+    freeVM(vm);
+    freeVector(instructions);
+    freeVector(lines);
+
+    return succeeded ? 0 : 1;
+}
+
+// Run copies of the program in a scheduler, each reading all of stdin. Prints
+// the first one's output and the first error.
+int runContexts(struct vmOptions *options, struct vector *instructions, struct vector *lines,
+        int stackSize) {
+    int inputSize = 0, inputCapacity = IO_BUFFER_SIZE;
+    char *input = (char*)malloc(inputCapacity);
+    size_t count;
+    while ((count = fread(input + inputSize, 1, inputCapacity - inputSize, stdin)) > 0) {
+        inputSize += count;
+        if (inputSize == inputCapacity) {
+            inputCapacity *= 2;
+            input = (char*)realloc(input, inputCapacity);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct contextLimits limits = {options->maxInstructions, 0, 0};
+    struct scheduler *scheduler = makeScheduler(options->quantum, stackSize, limits);
+    struct context **contexts = (struct context**)malloc(
+            sizeof(struct context*) * options->numContexts);
+    int i;
+    for (i = 0; i < options->numContexts; i++) {
+        contexts[i] = spawnContext(scheduler, instructions, options->ioMode);
+        if (!options->verify) {
+            freeVerification(contexts[i]->vm->verification);
+            contexts[i]->vm->verification = NULL;
+        }
+        addInput(scheduler, contexts[i], input, inputSize);
+        endContextInput(scheduler, contexts[i]);
+    }
+    runScheduler(scheduler);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int size;
+    char *output = getContextOutput(contexts[0], &size);
+    fwrite(output, 1, size, stdout);
+    fflush(stdout);
+
+    int failed = 0;
+    long long instructionCount = 0;
+    uint64_t maxNanoseconds = 0, totalNanoseconds = 0;
+    for (i = 0; i < options->numContexts; i++) {
+        struct context *context = contexts[i];
+        if (context->state == CONTEXT_FAILED && failed++ == 0) {
+            if (options->numContexts > 1)
+                fprintf(stderr, "Context %d: ", context->id);
+            printVMError(stderr, context->vm, lines);
+        }
+        instructionCount += context->vm->instructionCount;
+        totalNanoseconds += context->nanoseconds;
+        if (context->nanoseconds > maxNanoseconds)
+            maxNanoseconds = context->nanoseconds;
+    }
+
+    if (options->stats) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "Ran %d contexts in %.3f s, %d of which failed.\n",
+                options->numContexts, seconds, failed);
+        fprintf(stderr, "Executed %lld instructions in %lld slices (%.1f million "
+                "instructions/s).\n", instructionCount, scheduler->slices,
+                (seconds > 0) ? instructionCount / seconds / 1e6 : 0.0);
+        fprintf(stderr, "CPU time per context: %.1f us on average, %.1f us at most.\n",
+                totalNanoseconds / 1e3 / options->numContexts, maxNanoseconds / 1e3);
+    }
+
+    for (i = 0; i < options->numContexts; i++)
+        freeContext(scheduler, contexts[i]);
+    free(contexts);
+    freeScheduler(scheduler);
+    free(input);
+    return (failed > 0) ? 1 : 0;
+}
+
+// SIGUSR1 writes the trace so far and keeps going, SIGINT and SIGTERM write it
+// and exit.
+void dumpRecordingOnSignal(int signalNumber) {
+    writeTraceFile(recordingFd, recordingBuffer, recordingVM->instructionCount);
+    if (signalNumber != SIGUSR1)
+        _exit(128 + signalNumber);
+}
+
+int parseOptions(int argc, char **argv, struct vmOptions *options) {
+    *options = (struct vmOptions){NULL, 0, 0, 0, 0, NULL, 1 << 20, 1, 0, NULL, TEXT_IO, 1,
+        0, DEFAULT_QUANTUM, 0};
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (strcmp(argument, "--trace") == 0) {
+            options->trace = 1;
+        } else if (strcmp(argument, "--stats") == 0) {
+            options->stats = 1;
+        } else if (strcmp(argument, "--jit") == 0) {
+            options->jit = 1;
+        } else if (strcmp(argument, "--record") == 0 && i + 1 < argc) {
+            options->recordFilename = argv[++i];
+        } else if (strcmp(argument, "--record-size") == 0 && i + 1 < argc) {
+            options->recordSize = atoi(argv[++i]);
+            if (options->recordSize <= 0)
+                return 0;
+        } else if (strcmp(argument, "--sample") == 0 && i + 1 < argc) {
+            options->samplePeriod = atoi(argv[++i]);
+            if (options->samplePeriod <= 0)
+                return 0;
+        } else if (strcmp(argument, "--profile") == 0) {
+            options->profile = 1;
+        } else if (strcmp(argument, "--profile-collapsed") == 0 && i + 1 < argc) {
+            options->collapsedFilename = argv[++i];
+        } else if (strcmp(argument, "--binary-io") == 0) {
+            options->ioMode = BINARY_IO;
+        } else if (strcmp(argument, "--no-verify") == 0) {
+            options->verify = 0;
+        } else if (strcmp(argument, "--stack-size") == 0 && i + 1 < argc) {
+            options->stackSize = atoi(argv[++i]);
+            if (options->stackSize <= 0)
+                return 0;
+        } else if (strcmp(argument, "--contexts") == 0 && i + 1 < argc) {
+            options->numContexts = atoi(argv[++i]);
+            if (options->numContexts <= 0)
+                return 0;
+        } else if (strcmp(argument, "--quantum") == 0 && i + 1 < argc) {
+            options->quantum = atoll(argv[++i]);
+            if (options->quantum <= 0)
+                return 0;
+        } else if (strcmp(argument, "--max-instructions") == 0 && i + 1 < argc) {
+            options->maxInstructions = atoll(argv[++i]);
+            if (options->maxInstructions <= 0)
+                return 0;
+        } else if (argument[0] == '-') {
+            return 0;
+        } else if (options->filename == NULL) {
+            options->filename = argument;
+        } else {
+            return 0;
+        }
+    }
+
+    // --max-instructions needs the scheduler, and the scheduler only
+    // interprets, without tracing or profiling.
+    if (options->maxInstructions > 0 && options->numContexts == 0)
+        options->numContexts = 1;
+    if (options->numContexts > 0 && (options->trace || options->jit || options->profile
+                || options->recordFilename != NULL || options->collapsedFilename != NULL))
+        return 0;
+    return (options->filename != NULL);
+}
+
+void printUsage(char *programName) {
+    printf("Usage: %s [<options>] <object or text file>\n", programName);
+    printf("Options:\n");
+    printf("  --trace             Print a listing and a trace of the execution like the old vm.\n");
+    printf("  --stats             Print the number of instructions executed per second, and\n"
+           "                      whether the program passed the verifier.\n");
+    printf("  --jit               Compile the program to x86-64 code before running it. Programs\n"
+           "                      with procedures are interpreted instead.\n");
+    printf("  --profile           Print how often each instruction, opcode, branch and\n"
+           "                      loop ran to stderr.\n");
+    printf("  --profile-collapsed <file>\n"
+           "                      Write the profile in the collapsed stack format of\n"
+           "                      flame graph tools.\n");
+    printf("  --record <file>     Write a binary trace of the run to the file, to be read\n"
+           "                      with pl0trace. SIGUSR1 writes the trace so far, SIGINT\n"
+           "                      and SIGTERM write it and stop the program.\n");
+    printf("  --record-size <n>   Keep the last n records (default 1048576).\n");
+    printf("  --sample <n>        Record every n-th instruction (default 1).\n");
+    printf("  --binary-io         Read and write numbers as raw 32-bit integers instead of\n"
+           "                      as text, e.g. to pipe one program's output into another.\n");
+    printf("  --no-verify         Check every instruction as it runs even if the verifier\n"
+           "                      proved that the checks can't fail. Also turns off --jit.\n");
+    printf("  --stack-size <n>    Maximum stack height (default %d, or %d with --trace,\n"
+           "                      or what the object file asks for).\n",
+           DEFAULT_STACK_SIZE, OLD_VM_STACK_SIZE);
+    printf("  --contexts <n>      Run n copies of the program at once, taking turns on one\n"
+           "                      thread, with each of them reading all of the input. Prints\n"
+           "                      the first copy's output. Their stacks default to %d.\n",
+           DEFAULT_CONTEXT_STACK_SIZE);
+    printf("  --quantum <n>       Run a copy for about n instructions per turn (default %d).\n",
+           DEFAULT_QUANTUM);
+    printf("  --max-instructions <n>\n"
+           "                      Stop a program that runs more than n instructions. Implies\n"
+           "                      --contexts 1. Doesn't work with --trace, --jit, --record or\n"
+           "                      --profile.\n");
+}
@@ -0,0 +1,213 @@
+#include "src/vm/profile.h"
+#include "src/vm/vm.h"
+#include "src/linetable.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct profile *makeProfile(int length) {
+    struct profile *profile = make(struct profile);
+
+    // The interpreter also counts its two sentinels after the code.
+    profile->length = length;
+    profile->counts = (long long*)calloc(length + 2, sizeof(long long));
+    profile->taken = (long long*)calloc(length + 2, sizeof(long long));
+    profile->notTaken = (long long*)calloc(length + 2, sizeof(long long));
+
+    return profile;
+}
+
+void freeProfile(struct profile *profile) {
+    free(profile->counts);
+    free(profile->taken);
+    free(profile->notTaken);
+    free(profile);
+}
+
+// How often the instruction at pc ran.
+struct instructionCount {
+    int pc;
+    long long count;
+};
+
+// qsort comparators. These can't be nested functions because taking the
+// address of one needs an executable stack.
+int compareHotLoops(const void *x, const void *y) {
+    const struct hotLoop *a = x, *b = y;
+    if (a->instructions != b->instructions)
+        return (a->instructions < b->instructions) ? 1 : -1;
+    return a->start - b->start;
+}
+int compareLoopSpans(const void *x, const void *y) {
+    const struct hotLoop *a = x, *b = y;
+    int difference = (b->end - b->start) - (a->end - a->start);
+    return (difference != 0) ? difference : (a->start - b->start);
+}
+int compareInstructionCounts(const void *x, const void *y) {
+    const struct instructionCount *a = x, *b = y;
+    if (a->count != b->count)
+        return (a->count < b->count) ? 1 : -1;
+    return a->pc - b->pc;
+}
+
+struct vector *findLoops(struct profile *profile, struct vector *instructions) {
+    struct vector *loops = makeVector(struct hotLoop);
+
+    forVector(instructions, i, struct instruction, instruction,
+        int target = instruction.modifier;
+        if (instruction.opcode == JMP && target >= 0 && target <= i) {
+            struct hotLoop loop = {target, i, profile->counts[i], 0};
+            int j;
+            for (j = target; j <= i; j++)
+                loop.instructions += profile->counts[j];
+            push(loops, loop);
+        });
+
+    qsort(loops->items, loops->length, sizeof(struct hotLoop), compareHotLoops);
+    return loops;
+}
+
+char *sourceLines(struct vector *lines, int start, int end) {
+    int first = 0, last = 0;
+    int pc;
+    for (pc = start; pc <= end; pc++) {
+        int line = findLinePosition(lines, pc).line;
+        if (line > 0 && (first == 0 || line < first))
+            first = line;
+        if (line > last)
+            last = line;
+    }
+
+    if (first == 0)
+        return "?";
+    return (first == last) ? format("%d", first) : format("%d-%d", first, last);
+}
+
+void printProfile(FILE *file, struct profile *profile, struct vector *instructions,
+        struct vector *lines) {
+    int length = instructions->length;
+    long long total = 0;
+    int i;
+    for (i = 0; i < length; i++)
+        total += profile->counts[i];
+    double percent(long long count) {
+        return (total > 0) ? 100.0 * count / total : 0.0;
+    }
+    // profileVM runs fused instructions one instruction at a time.
+    struct instruction at(int pc) {
+        return unfuseInstruction(get(struct instruction, instructions, pc));
+    }
+    // Where an instruction comes from in the source code.
+    char *source(int pc) {
+        struct lineEntry position = findLinePosition(lines, pc);
+        return (position.line > 0) ? format("%d:%d", position.line, position.column) : "?";
+    }
+
+    fprintf(file, "Profile of %lld executed instructions.\n", total);
+
+    // The hottest instructions.
+    struct instructionCount *order = (struct instructionCount*)malloc(
+            sizeof(struct instructionCount) * (length + 1));
+    for (i = 0; i < length; i++)
+        order[i] = (struct instructionCount){i, profile->counts[i]};
+    qsort(order, length, sizeof(struct instructionCount), compareInstructionCounts);
+    fprintf(file, "\nHottest instructions:\n");
+    fprintf(file, "%-6s%-6s%-6s%-12s%14s%9s  %s\n", "Line", "OP", "L", "M", "count", "%",
+            "Source");
+    for (i = 0; i < length && i < 10 && order[i].count > 0; i++) {
+        struct instruction instruction = at(order[i].pc);
+        fprintf(file, "%-6d%-6s%-6d%-12d%14lld%8.1f%%  %s\n", order[i].pc,
+                listingName(instruction.opcode), instruction.lexicalLevel,
+                instruction.modifier, order[i].count, percent(order[i].count),
+                source(order[i].pc));
+    }
+    free(order);
+
+    // The counts per opcode, and per operation for opr.
+    long long opcodeCounts[NUM_OPCODES] = {0};
+    long long operationCounts[GEQ + 1] = {0};
+    for (i = 0; i < length; i++) {
+        struct instruction instruction = at(i);
+        if (instruction.opcode < NUM_OPCODES)
+            opcodeCounts[instruction.opcode] += profile->counts[i];
+        if (instruction.opcode == OPR && instruction.modifier >= RET
+                && instruction.modifier <= GEQ)
+            operationCounts[instruction.modifier] += profile->counts[i];
+    }
+    fprintf(file, "\nInstructions by opcode:\n");
+    fprintf(file, "%-12s%14s%9s\n", "OP", "count", "%");
+    int opcode;
+    for (opcode = LIT; opcode < NUM_OPCODES; opcode++) {
+        if (opcodeCounts[opcode] == 0)
+            continue;
+        fprintf(file, "%-12s%14lld%8.1f%%\n", getOpcodeName(opcode),
+                opcodeCounts[opcode], percent(opcodeCounts[opcode]));
+        int operation;
+        for (operation = RET; opcode == OPR && operation <= GEQ; operation++) {
+            if (operationCounts[operation] > 0)
+                fprintf(file, "  opr %-6d%14lld%8.1f%%\n", operation,
+                        operationCounts[operation], percent(operationCounts[operation]));
+        }
+    }
+
+    // Every jpc that ran.
+    fprintf(file, "\nBranches:\n");
+    fprintf(file, "%-6s%-8s%14s%14s%9s  %s\n", "Line", "target", "taken", "not taken",
+            "% taken", "Source");
+    for (i = 0; i < length; i++) {
+        long long runs = profile->taken[i] + profile->notTaken[i];
+        if (at(i).opcode != JPC || runs == 0)
+            continue;
+        fprintf(file, "%-6d%-8d%14lld%14lld%8.1f%%  %s\n", i, at(i).modifier,
+                profile->taken[i], profile->notTaken[i], 100.0 * profile->taken[i] / runs,
+                source(i));
+    }
+
+    // The loops that most of the time is spent in.
+    struct vector *loops = findLoops(profile, instructions);
+    fprintf(file, "\nHottest loops:\n");
+    fprintf(file, "%-14s%14s%14s%9s  %s\n", "Lines", "iterations", "instructions", "%",
+            "Source lines");
+    forVector(loops, l, struct hotLoop, loop,
+        if (l >= 10 || loop.instructions == 0)
+            break;
+        fprintf(file, "%-14s%14lld%14lld%8.1f%%  %s\n", format("%d-%d", loop.start, loop.end),
+                loop.iterations, loop.instructions, percent(loop.instructions),
+                sourceLines(lines, loop.start, loop.end)););
+    freeVector(loops);
+}
+
+void printCollapsedStacks(FILE *file, struct profile *profile, struct vector *instructions,
+        struct vector *lines) {
+    // Order the loops by size, so that outer loops come before the loops
+    // nested in them.
+    struct vector *loops = findLoops(profile, instructions);
+    qsort(loops->items, loops->length, sizeof(struct hotLoop), compareLoopSpans);
+    int length = instructions->length;
+    int pc;
+    for (pc = 0; pc < length; pc++) {
+        if (profile->counts[pc] == 0)
+            continue;
+
+        // With a line table, frames also say where they are in the source
+        // code, e.g. "loop 3-13 (lines 4-9)" and "4 jpc 0 14 (line 4)".
+        fprintf(file, "program");
+        forVector(loops, l, struct hotLoop, loop,
+            if (loop.start <= pc && pc <= loop.end) {
+                char *source = sourceLines(lines, loop.start, loop.end);
+                fprintf(file, ";loop %d-%d", loop.start, loop.end);
+                if (strcmp(source, "?") != 0)
+                    fprintf(file, " (lines %s)", source);
+            });
+        struct instruction instruction =
+            unfuseInstruction(get(struct instruction, instructions, pc));
+        fprintf(file, ";%d %s %d %d", pc, listingName(instruction.opcode),
+                instruction.lexicalLevel, instruction.modifier);
+        int line = findLinePosition(lines, pc).line;
+        if (line > 0)
+            fprintf(file, " (line %d)", line);
+        fprintf(file, " %lld\n", profile->counts[pc]);
+    }
+    freeVector(loops);
+}
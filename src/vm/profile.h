@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "src/lib/vector.h"
+#include <stdio.h>
+
+// Execution counts from profileVM, indexed by instruction.
+struct profile {
+    int length;           // Number of instructions in the program.
+    long long *counts;    // How often each instruction ran.
+    long long *taken;     // How often each jpc jumped.
+    long long *notTaken;  // How often each jpc fell through.
+};
+
+// A loop is the code between the target of a backwards jmp and the jmp.
+struct hotLoop {
+    int start;              // The jmp's target.
+    int end;                // The jmp.
+    long long iterations;   // How often the jmp ran.
+    long long instructions; // Instructions executed inside the loop.
+};
+
+struct profile *makeProfile(int length);
+void freeProfile(struct profile *profile);
+
+// Returns the loops in the program, hottest (most instructions executed)
+// first.
+struct vector *findLoops(struct profile *profile, struct vector *instructions);
+
+// Print a report of the hottest instructions, the counts per opcode, the
+// branches and the hottest loops. If the line table of the instructions isn't
+// NULL or empty, instructions and loops are also shown with their source
+// lines.
+void printProfile(FILE *file, struct profile *profile, struct vector *instructions,
+        struct vector *lines);
+// Print the profile in the collapsed stack format that flame graph tools read:
+// one line per instruction that ran, with the loops it's in as the stack.
+void printCollapsedStacks(FILE *file, struct profile *profile, struct vector *instructions,
+        struct vector *lines);
+
+// Returns the source lines of the instructions from start to end, such as
+// "4-9", or "?" if the line table doesn't know them.
+char *sourceLines(struct vector *lines, int start, int end);
+
+#endif
@@ -0,0 +1,206 @@
+#include "src/vm/scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+uint64_t schedulerNanoseconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void initStackPool(struct stackPool *pool, int stackSize) {
+    pool->stackSize = stackSize;
+    pool->stackBytes = getStackMappingSize(stackSize);
+    pool->chunks = makeVector(char*);
+    pool->free = makeVector(char*);
+}
+
+// Take a stack out of the pool, mapping another chunk of them if they're all
+// in use. Like makeVM's stacks, they only take up memory once they're used.
+char *takeStack(struct stackPool *pool) {
+    if (pool->free->length == 0) {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        char *chunk = (char*)mmap(NULL, pool->stackBytes * STACKS_PER_CHUNK,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(chunk != MAP_FAILED);
+        push(pool->chunks, chunk);
+        // Push them backwards, so that they're taken in order.
+        int i;
+        for (i = STACKS_PER_CHUNK - 1; i >= 0; i--) {
+            char *stack = chunk + pool->stackBytes * i;
+            mprotect(stack + pool->stackBytes - pageSize, pageSize, PROT_NONE);
+            push(pool->free, stack);
+        }
+    }
+    char *stack = get(char*, pool->free, pool->free->length - 1);
+    pool->free->length--;
+    return stack;
+}
+
+// Put a stack back, giving its memory back to the kernel, so that a context
+// with a deep stack doesn't keep it after it's gone.
+void releaseStack(struct stackPool *pool, char *stack) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    madvise(stack, pool->stackBytes - pageSize, MADV_DONTNEED);
+    push(pool->free, stack);
+}
+
+void freeStackPool(struct stackPool *pool) {
+    forVector(pool->chunks, i, char*, chunk,
+        munmap(chunk, pool->stackBytes * STACKS_PER_CHUNK););
+    freeVector(pool->chunks);
+    freeVector(pool->free);
+}
+
+struct scheduler *makeScheduler(long long quantum, int stackSize, struct contextLimits limits) {
+    struct scheduler *scheduler = make(struct scheduler);
+    scheduler->quantum = quantum;
+    scheduler->limits = limits;
+    initStackPool(&scheduler->stacks, stackSize);
+    scheduler->ready = makeVector(struct context*);
+    scheduler->readyStart = 0;
+    scheduler->nextId = 0;
+    scheduler->numContexts = 0;
+    scheduler->slices = 0;
+    return scheduler;
+}
+
+void freeScheduler(struct scheduler *scheduler) {
+    assert(scheduler->numContexts == 0);
+    freeStackPool(&scheduler->stacks);
+    freeVector(scheduler->ready);
+    free(scheduler);
+}
+
+void makeReady(struct scheduler *scheduler, struct context *context) {
+    context->state = CONTEXT_READY;
+    if (!context->queued) {
+        push(scheduler->ready, context);
+        context->queued = 1;
+    }
+}
+
+// Take the next context off the front of the ready queue, or return NULL if
+// there's none. The contexts before readyStart are moved out once they're
+// half of the queue, so that it doesn't keep growing.
+struct context *takeReady(struct scheduler *scheduler) {
+    struct vector *ready = scheduler->ready;
+    if (scheduler->readyStart == ready->length) {
+        ready->length = 0;
+        scheduler->readyStart = 0;
+        return NULL;
+    }
+    struct context *context = get(struct context*, ready, scheduler->readyStart++);
+    if (scheduler->readyStart >= 1024 && scheduler->readyStart * 2 >= ready->length) {
+        int remaining = ready->length - scheduler->readyStart;
+        memmove(ready->items, (struct context**)ready->items + scheduler->readyStart,
+                remaining * sizeof(struct context*));
+        ready->length = remaining;
+        scheduler->readyStart = 0;
+    }
+    context->queued = 0;
+    return context;
+}
+
+struct context *spawnContext(struct scheduler *scheduler, struct vector *instructions,
+        int ioMode) {
+    struct context *context = make(struct context);
+    context->id = scheduler->nextId++;
+    context->stack = takeStack(&scheduler->stacks);
+    context->vm = makeVMWithStack(instructions, scheduler->stacks.stackSize, context->stack,
+            scheduler->stacks.stackBytes);
+    context->vm->ioMode = ioMode;
+    openMemoryBuffer(&context->vm->inputBuffer, 0, ioMode);
+    openMemoryBuffer(&context->vm->outputBuffer, 1, ioMode);
+    context->slices = 0;
+    context->nanoseconds = 0;
+    context->queued = 0;
+    makeReady(scheduler, context);
+    scheduler->numContexts++;
+    return context;
+}
+
+void freeContext(struct scheduler *scheduler, struct context *context) {
+    assert(!context->queued);
+    closeIOBuffer(&context->vm->inputBuffer);
+    closeIOBuffer(&context->vm->outputBuffer);
+    freeVM(context->vm);
+    releaseStack(&scheduler->stacks, context->stack);
+    free(context);
+    scheduler->numContexts--;
+}
+
+void addInput(struct scheduler *scheduler, struct context *context, char *data, int size) {
+    appendInput(&context->vm->inputBuffer, data, size);
+    if (context->state == CONTEXT_BLOCKED)
+        makeReady(scheduler, context);
+}
+
+void endContextInput(struct scheduler *scheduler, struct context *context) {
+    endInput(&context->vm->inputBuffer);
+    if (context->state == CONTEXT_BLOCKED)
+        makeReady(scheduler, context);
+}
+
+char *getContextOutput(struct context *context, int *size) {
+    *size = context->vm->outputBuffer.end;
+    return context->vm->outputBuffer.data;
+}
+
+// Fail the context with the error if it went over a limit. Instructions and
+// time only count against contexts that haven't halted, since a slice can
+// run a little over the fuel it was given.
+void checkLimits(struct scheduler *scheduler, struct context *context) {
+    struct contextLimits *limits = &scheduler->limits;
+    struct vm *vm = context->vm;
+    char *error = NULL;
+    if (limits->maxOutput > 0 && vm->outputBuffer.end > limits->maxOutput)
+        error = "Output limit exceeded.";
+    else if (context->state == CONTEXT_HALTED)
+        return;
+    else if (limits->maxInstructions > 0 && vm->instructionCount >= limits->maxInstructions)
+        error = "Instruction limit exceeded.";
+    else if (limits->maxNanoseconds > 0 && context->nanoseconds >= limits->maxNanoseconds)
+        error = "Time limit exceeded.";
+
+    if (error != NULL) {
+        vm->error = error;
+        vm->errorPc = vm->pc;
+        context->state = CONTEXT_FAILED;
+    }
+}
+
+long long runScheduler(struct scheduler *scheduler) {
+    long long slices = 0;
+    struct context *context;
+    while ((context = takeReady(scheduler)) != NULL) {
+        struct vm *vm = context->vm;
+        long long fuel = scheduler->quantum;
+        long long maxInstructions = scheduler->limits.maxInstructions;
+        if (maxInstructions > 0 && maxInstructions - vm->instructionCount < fuel)
+            fuel = maxInstructions - vm->instructionCount;
+
+        uint64_t start = schedulerNanoseconds();
+        int result = runSlice(vm, fuel);
+        context->nanoseconds += schedulerNanoseconds() - start;
+        context->slices++;
+        slices++;
+
+        switch (result) {
+            case SLICE_HALTED: context->state = CONTEXT_HALTED; break;
+            case SLICE_FAILED: context->state = CONTEXT_FAILED; break;
+            case SLICE_BLOCKED: context->state = CONTEXT_BLOCKED; break;
+            case SLICE_PREEMPTED: context->state = CONTEXT_READY; break;
+        }
+        if (context->state != CONTEXT_FAILED)
+            checkLimits(scheduler, context);
+        if (context->state == CONTEXT_READY)
+            makeReady(scheduler, context);
+    }
+    scheduler->slices += slices;
+    return slices;
+}
@@ -0,0 +1,91 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "src/vm/vm.h"
+#include "src/lib/vector.h"
+#include <stdint.h>
+
+// A scheduler that runs many programs on one thread, each in its own context:
+// a VM with its registers, stack and in-memory input and output. Contexts take
+// turns in round-robin order, running a slice of about quantum instructions
+// each (see runSlice in vm.h), and a context that gets to a read with nothing
+// to read waits until input is added or ended. Every context's instructions,
+// CPU time and output are counted, and a context that goes over one of the
+// scheduler's limits fails.
+//
+// Stacks come from a pool of fixed-size stacks with guard pages, which are
+// mapped a chunk at a time and reused when contexts are freed, so that tens
+// of thousands of contexts don't each need their own mapping.
+
+// Stacks that the pool maps at once.
+#define STACKS_PER_CHUNK 64
+// The quantum and context stack size used unless others are asked for.
+#define DEFAULT_QUANTUM 10000
+#define DEFAULT_CONTEXT_STACK_SIZE (1 << 16)
+
+enum { CONTEXT_READY, CONTEXT_BLOCKED, CONTEXT_HALTED, CONTEXT_FAILED };
+
+// Limits for every context, or 0 for no limit.
+struct contextLimits {
+    long long maxInstructions;
+    long long maxNanoseconds;   // CPU time, i.e. the time its slices took.
+    int maxOutput;              // Bytes of output.
+};
+
+struct context {
+    int id;
+    int state;
+    struct vm *vm;          // Has the context's registers, counts the
+                            // instructions, and has the error if it failed.
+    long long slices;       // How often it ran.
+    uint64_t nanoseconds;   // How long its slices took.
+    char *stack;            // The memory of the VM's stack, from the pool.
+    int queued;             // It's in the ready queue.
+};
+
+struct stackPool {
+    int stackSize;          // Slots per stack.
+    size_t stackBytes;      // From getStackMappingSize.
+    struct vector *chunks;  // The mappings, STACKS_PER_CHUNK stacks each.
+    struct vector *free;    // Stacks that aren't in use.
+};
+
+struct scheduler {
+    long long quantum;
+    struct contextLimits limits;
+    struct stackPool stacks;
+    struct vector *ready;   // Contexts waiting for a slice, from readyStart on.
+    int readyStart;
+    int nextId;
+    int numContexts;        // Contexts that haven't been freed.
+    long long slices;       // Slices run, by all contexts.
+};
+
+// Make a scheduler that gives contexts quantum instructions per slice and
+// stacks of stackSize slots.
+struct scheduler *makeScheduler(long long quantum, int stackSize, struct contextLimits limits);
+// Free the scheduler, after all of its contexts.
+void freeScheduler(struct scheduler *scheduler);
+
+// Make a context that runs the instructions from the start, reading numbers in
+// the mode (TEXT_IO or BINARY_IO) from input that is added with addInput. The
+// instructions aren't copied, so contexts can share them.
+struct context *spawnContext(struct scheduler *scheduler, struct vector *instructions,
+        int ioMode);
+// Free a context that isn't ready to run, e.g. after runScheduler returned,
+// and put its stack back into the pool.
+void freeContext(struct scheduler *scheduler, struct context *context);
+
+// Add input for the context, or end its input, which wakes it up if it was
+// waiting for input.
+void addInput(struct scheduler *scheduler, struct context *context, char *data, int size);
+void endContextInput(struct scheduler *scheduler, struct context *context);
+// What the context wrote so far, which is size bytes long and not
+// null-terminated.
+char *getContextOutput(struct context *context, int *size);
+
+// Run slices until no context is ready: every context has halted, failed or
+// waits for input. Returns the number of slices that ran.
+long long runScheduler(struct scheduler *scheduler);
+
+#endif
@@ -0,0 +1,120 @@
+#include "src/fusion.h"
+#include "src/object.h"
+#include "src/lib/util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How often a sequence of instructions occurs.
+struct sequenceCount {
+    char *sequence;
+    int count;
+};
+
+// qsort comparator, most frequent first.
+int compareSequenceCounts(const void *x, const void *y) {
+    const struct sequenceCount *a = x, *b = y;
+    if (a->count != b->count)
+        return b->count - a->count;
+    return strcmp(a->sequence, b->sequence);
+}
+
+// Counts the sequences of two to four basic instructions in a corpus of
+// programs, which is what the fused opcodes in fusion.c are picked from, and
+// how much of the corpus the fused opcodes cover. opr is counted per
+// operation, e.g. "lod lit opr.add sto".
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <object or text file>...\n", argv[0]);
+        return 1;
+    }
+
+    char *OPERATION_NAMES[] = {"ret", "neg", "add", "sub", "mul", "div", "odd", "mod",
+        "eql", "neq", "lss", "leq", "gtr", "geq"};
+    char *name(struct instruction instruction) {
+        if (instruction.opcode == OPR && instruction.modifier >= RET
+                && instruction.modifier <= GEQ)
+            return format("opr.%s", OPERATION_NAMES[instruction.modifier]);
+        return getOpcodeName(instruction.opcode);
+    }
+
+    struct vector *counts[5];
+    int length;
+    for (length = 2; length <= 4; length++)
+        counts[length] = makeVector(struct sequenceCount);
+    void count(int length, char *sequence) {
+        int i;
+        for (i = 0; i < counts[length]->length; i++) {
+            struct sequenceCount *entry =
+                (struct sequenceCount*)vector_get(counts[length], i);
+            if (strcmp(entry->sequence, sequence) == 0) {
+                entry->count++;
+                return;
+            }
+        }
+        pushLiteral(counts[length], struct sequenceCount, {sequence, 1});
+    }
+
+    // How often each fused opcode's sequence occurs, overlaps included.
+    int numPatterns = NUM_ALL_OPCODES - NUM_OPCODES;
+    int *patternCounts = (int*)calloc(numPatterns, sizeof(int));
+    int total = 0, covered = 0, saved = 0;
+    int f, p;
+    for (f = 1; f < argc; f++) {
+        int stackSize;
+        struct vector *program = loadProgram(argv[f], &stackSize, NULL);
+        if (program == NULL) {
+            fprintf(stderr, "%s: %s\n", argv[f], getObjectFileError());
+            return 1;
+        }
+        struct vector *instructions = unfuseInstructions(program);
+
+        int i;
+        for (i = 0; i < instructions->length; i++) {
+            char *sequence = name(get(struct instruction, instructions, i));
+            for (length = 2; length <= 4 && i + length <= instructions->length; length++) {
+                sequence = format("%s %s", sequence,
+                        name(get(struct instruction, instructions, i + length - 1)));
+                count(length, sequence);
+            }
+            for (p = 0; p < numPatterns; p++)
+                if (matchesFusedPattern(instructions, i, FUSED_PATTERNS[p].opcode))
+                    patternCounts[p]++;
+        }
+
+        struct vector *fused = fuseInstructions(instructions);
+        total += fused->length;
+        forVector(fused, i, struct instruction, instruction,
+            if (isFusedOpcode(instruction.opcode)) {
+                covered += fusedLength(instruction.opcode);
+                saved += fusedLength(instruction.opcode) - 1;
+            });
+
+        freeVector(fused);
+        freeVector(instructions);
+        freeVector(program);
+    }
+
+    for (length = 2; length <= 4; length++) {
+        struct vector *sequences = counts[length];
+        qsort(sequences->items, sequences->length, sizeof(struct sequenceCount),
+                compareSequenceCounts);
+        printf("Most frequent sequences of %d instructions:\n", length);
+        forVector(sequences, i, struct sequenceCount, entry,
+            if (i >= 15)
+                break;
+            printf("%8d  %s\n", entry.count, entry.sequence););
+        printf("\n");
+        freeVector(sequences);
+    }
+
+    printf("Sequences of the fused opcodes:\n");
+    for (p = 0; p < numPatterns; p++)
+        printf("%8d  %s\n", patternCounts[p], getOpcodeName(FUSED_PATTERNS[p].opcode));
+    printf("\n");
+    free(patternCounts);
+
+    printf("The fused opcodes cover %d of %d instructions, which saves %d dispatches "
+           "(%.1f%%).\n", covered, total, saved, (total > 0) ? 100.0 * saved / total : 0.0);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#include "src/vm/trace.h"
+#include "src/vm/vm.h"
+#include "src/object.h"
+#include <stdio.h>
+
+// Prints a trace file written by `pl0vm --record` in the old vm's trace
+// format. The program is needed for the listing and to replay the stack.
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: %s <trace file> <object or text file>\n", argv[0]);
+        return 1;
+    }
+
+    struct traceFile *trace = readTraceFile(argv[1]);
+    if (trace == NULL) {
+        fprintf(stderr, "%s\n", getTraceError());
+        return 1;
+    }
+
+    int stackSize;
+    struct vector *instructions = loadProgram(argv[2], &stackSize, NULL);
+    if (instructions == NULL) {
+        fprintf(stderr, "%s\n", getObjectFileError());
+        return 1;
+    }
+
+    decodeTrace(stdout, trace, instructions);
+
+    freeTraceFile(trace);
+    freeVector(instructions);
+    return 0;
+}
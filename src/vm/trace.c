@@ -0,0 +1,212 @@
+#include "src/vm/trace.h"
+#include "src/vm/vm.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct traceBuffer *makeTraceBuffer(int capacity, int samplePeriod) {
+    struct traceBuffer *buffer = make(struct traceBuffer);
+
+    // Round the capacity up to a power of two so that the index of the next
+    // record is just a mask away from the number of records.
+    buffer->capacity = 1;
+    while (buffer->capacity < capacity)
+        buffer->capacity *= 2;
+    buffer->records = (struct traceRecord*)calloc(buffer->capacity, sizeof(struct traceRecord));
+    buffer->samplePeriod = (samplePeriod > 0) ? samplePeriod : 1;
+    buffer->untilSample = buffer->samplePeriod;
+    buffer->totalRecords = 0;
+
+    return buffer;
+}
+
+void freeTraceBuffer(struct traceBuffer *buffer) {
+    free(buffer->records);
+    free(buffer);
+}
+
+void addTraceRecord(struct traceBuffer *buffer, int pc, int opcode, int sp, int top) {
+    if (--buffer->untilSample > 0)
+        return;
+    buffer->untilSample = buffer->samplePeriod;
+
+    struct traceRecord *record =
+        &buffer->records[buffer->totalRecords & (buffer->capacity - 1)];
+    *record = (struct traceRecord){pc, opcode, {0, 0, 0}, sp, top};
+    buffer->totalRecords++;
+}
+
+int writeTraceFile(int fd, struct traceBuffer *buffer, long long instructionCount) {
+    int writeAll(void *data, size_t size) {
+        char *bytes = (char*)data;
+        while (size > 0) {
+            ssize_t written = write(fd, bytes, size);
+            if (written <= 0)
+                return 0;
+            bytes += written;
+            size -= written;
+        }
+        return 1;
+    }
+
+    uint64_t total = buffer->totalRecords;
+    uint64_t numRecords = (total < (uint64_t)buffer->capacity) ? total : buffer->capacity;
+    struct traceFileHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(struct traceRecord),
+        buffer->samplePeriod, instructionCount, total, numRecords};
+
+    // Once the buffer has wrapped around, the oldest record is the one that
+    // would be overwritten next.
+    size_t oldest = (total > numRecords) ? total & (buffer->capacity - 1) : 0;
+    size_t recordSize = sizeof(struct traceRecord);
+
+    return lseek(fd, 0, SEEK_SET) == 0
+        && ftruncate(fd, 0) == 0
+        && writeAll(&header, sizeof(header))
+        && writeAll(buffer->records + oldest, (numRecords - oldest) * recordSize)
+        && writeAll(buffer->records, oldest * recordSize);
+}
+
+struct traceFile *readTraceFile(char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        setTraceError("Could not open the trace file.");
+        return NULL;
+    }
+
+    struct traceFile *trace = make(struct traceFile);
+    struct traceFileHeader *header = &trace->header;
+    if (fread(header, sizeof(*header), 1, file) != 1
+            || memcmp(header->magic, TRACE_MAGIC, 4) != 0) {
+        setTraceError("Not a trace file.");
+    } else if (header->version != TRACE_VERSION
+            || header->recordSize != sizeof(struct traceRecord)) {
+        setTraceError(format("Unsupported trace file version %u.", header->version));
+    } else {
+        trace->records = (struct traceRecord*)malloc(
+                sizeof(struct traceRecord) * (header->numRecords + 1));
+        if (fread(trace->records, sizeof(struct traceRecord), header->numRecords, file)
+                == header->numRecords) {
+            fclose(file);
+            return trace;
+        }
+        setTraceError("The trace file is truncated.");
+        free(trace->records);
+    }
+
+    fclose(file);
+    free(trace);
+    return NULL;
+}
+
+void freeTraceFile(struct traceFile *trace) {
+    free(trace->records);
+    free(trace);
+}
+
+void decodeTrace(FILE *output, struct traceFile *trace, struct vector *instructions) {
+    struct traceFileHeader header = trace->header;
+    int length = instructions->length;
+    printListing(output, instructions);
+
+    // Records only hold the top of the stack, so the rest of it has to be
+    // rebuilt from the start of the run.
+    if (header.samplePeriod != 1 || header.totalRecords != header.numRecords) {
+        fprintf(output, "Partial trace: %llu of %llu instructions, every %u%s.\n\n",
+                (unsigned long long)header.numRecords,
+                (unsigned long long)header.instructionCount, header.samplePeriod,
+                (header.totalRecords != header.numRecords) ? ", most recent only" : "");
+        fprintf(output, "%-6s%-6s%-6s%-12s%-6s%s\n", "Line", "OP", "L", "M", "sp", "top");
+        uint64_t r;
+        for (r = 0; r < header.numRecords; r++) {
+            struct traceRecord record = trace->records[r];
+            struct instruction instruction = (record.pc >= 0 && record.pc < length)
+                ? unfuseInstruction(get(struct instruction, instructions, record.pc))
+                : makeInstruction(record.opcode, 0, 0);
+            fprintf(output, "%-6d%-6s%-6d%-12d%-6d%d\n", record.pc,
+                    listingName(record.opcode), instruction.lexicalLevel,
+                    instruction.modifier, record.sp, record.top);
+        }
+        return;
+    }
+
+    // Replay the instructions on a copy of the stack, using the records for
+    // the values that come from outside of the stack (constants, input and
+    // arithmetic results).
+    int capacity = 16;
+    int *stack = (int*)calloc(capacity, sizeof(int));
+    int bp = 1, sp = 0;
+    int *slot(int index) {
+        while (index + 5 >= capacity) {
+            stack = (int*)realloc(stack, sizeof(int) * capacity * 2);
+            memset(stack + capacity, 0, sizeof(int) * capacity);
+            capacity *= 2;
+        }
+        return &stack[(index > 0) ? index : 0];
+    }
+    int base(int level) {
+        int b = bp;
+        for (; level > 0 && b > 0; level--)
+            b = *slot(b + 1);
+        return b;
+    }
+
+    printTraceHeader(output);
+    uint64_t r;
+    for (r = 0; r < header.numRecords; r++) {
+        struct traceRecord record = trace->records[r];
+        if (record.pc < 0 || record.pc >= length) {
+            fprintf(output, "The trace doesn't match the program.\n");
+            break;
+        }
+        struct instruction instruction =
+            unfuseInstruction(get(struct instruction, instructions, record.pc));
+        int modifier = instruction.modifier;
+        int pc = record.pc + 1;
+
+        switch (instruction.opcode) {
+        case STO:
+            *slot(base(instruction.lexicalLevel) + modifier) = *slot(sp);
+            break;
+        case CAL:
+            *slot(sp + 1) = 0;
+            *slot(sp + 2) = base(instruction.lexicalLevel);
+            *slot(sp + 3) = bp;
+            *slot(sp + 4) = pc;
+            bp = sp + 1;
+            pc = modifier;
+            break;
+        case JMP:
+            pc = modifier;
+            break;
+        case JPC:
+            if (*slot(sp) == 0)
+                pc = modifier;
+            break;
+        case OPR:
+            if (modifier == RET) {
+                pc = *slot(bp + 3);
+                bp = (bp == 1) ? 0 : *slot(bp + 2);
+            }
+            break;
+        }
+
+        sp = record.sp;
+        if (sp > 0)
+            *slot(sp) = record.top;
+        printTraceLine(output, record.pc, instruction, pc, bp, sp, stack);
+    }
+
+    free(stack);
+}
+
+char *traceError = NULL;
+
+char *setTraceError(char *message) {
+    traceError = message;
+    return message;
+}
+char *getTraceError() {
+    return traceError;
+}
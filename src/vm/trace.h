@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "src/lib/vector.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// Binary traces of a VM run. Instead of printing a line per instruction like
+// traceVM, recordVM stores a fixed-size record per instruction in a ring
+// buffer, which only keeps the most recent records. The buffer is written to
+// a trace file when the run ends (or on a signal, see pl0vm), and pl0trace
+// turns the file back into the old vm's trace format.
+//
+// Trace files are the header followed by the records, oldest first, in the
+// byte order of the machine that wrote them.
+
+struct traceRecord {
+    int32_t pc;         // Index of the executed instruction.
+    uint8_t opcode;
+    uint8_t reserved[3];
+    int32_t sp;         // Stack pointer after the instruction.
+    int32_t top;        // stack[sp] after the instruction, or 0 if sp is 0.
+};
+
+struct traceFileHeader {
+    char magic[4];      // TRACE_MAGIC
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t samplePeriod;
+    uint64_t instructionCount;   // Number of instructions executed.
+    uint64_t totalRecords;       // Number of records made, including ones
+                                 // that the ring buffer dropped.
+    uint64_t numRecords;         // Number of records in the file.
+};
+
+#define TRACE_MAGIC "PL0T"
+#define TRACE_VERSION 1
+
+struct traceBuffer {
+    struct traceRecord *records;
+    int capacity;           // A power of two.
+    int samplePeriod;       // Record every samplePeriod-th instruction.
+    int untilSample;        // Instructions left until the next record.
+    uint64_t totalRecords;
+};
+
+// Make a ring buffer that holds at least capacity records and records every
+// samplePeriod-th instruction.
+struct traceBuffer *makeTraceBuffer(int capacity, int samplePeriod);
+void freeTraceBuffer(struct traceBuffer *buffer);
+
+// Record an instruction if it's the one to sample.
+void addTraceRecord(struct traceBuffer *buffer, int pc, int opcode, int sp, int top);
+
+// Write the buffer to a file descriptor as a trace file, starting at offset 0.
+// Only uses system calls that are safe in signal handlers. Returns false if
+// a write failed.
+int writeTraceFile(int fd, struct traceBuffer *buffer, long long instructionCount);
+
+struct traceFile {
+    struct traceFileHeader header;
+    struct traceRecord *records;   // header.numRecords records, oldest first.
+};
+
+// Read a trace file. Returns NULL and sets the trace error if it can't be
+// read or isn't a valid trace file.
+struct traceFile *readTraceFile(char *filename);
+void freeTraceFile(struct traceFile *trace);
+
+// Print the trace in the old vm's format, the same as `pl0vm --trace` minus
+// the program's output. This needs every instruction from the start of the
+// run, so that the stack can be rebuilt by replaying them. Sampled and
+// wrapped traces are printed with the columns that the records hold instead.
+void decodeTrace(FILE *output, struct traceFile *trace, struct vector *instructions);
+
+char *setTraceError(char *message);
+char *getTraceError();
+
+#endif
@@ -0,0 +1,145 @@
+#include "src/vm/verifier.h"
+#include "src/instruction.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+
+struct verification *verifyProgram(struct vector *instructions, int stackSize) {
+    int length = instructions->length;
+    int *heights = (int*)malloc(sizeof(int) * (length + 1));
+    int i;
+    for (i = 0; i <= length; i++)
+        heights[i] = -1;
+    int maxHeight = 0;
+    char *error = NULL;
+
+    struct vector *worklist = makeVector(int);
+    // Record that target is reached from the instruction at pc with the given
+    // height. Running into the end of the code is fine, it's an error at
+    // runtime.
+    void reach(int pc, int target, int height) {
+        if (target < 0 || target > length) {
+            error = format("Instruction %d jumps to %d, outside of the code.", pc, target);
+        } else if (target == length) {
+            return;
+        } else if (heights[target] == -1) {
+            heights[target] = height;
+            push(worklist, target);
+        } else if (heights[target] != height) {
+            error = format("Instruction %d is reached with stack heights %d and %d.",
+                    target, heights[target], height);
+        }
+    }
+
+    if (length > 0)
+        reach(0, 0, 0);
+    while (error == NULL && worklist->length > 0) {
+        i = get(int, worklist, worklist->length - 1);
+        worklist->length -= 1;
+
+        // Fused instructions are verified one instruction at a time, like the
+        // rest of their sequence.
+        struct instruction instruction =
+            unfuseInstruction(get(struct instruction, instructions, i));
+        int height = heights[i];
+        int modifier = instruction.modifier;
+        // The main program's frame starts at 1, so variables are at 1 + modifier.
+        int address = 1 + modifier;
+        int next = height;
+        int needed = 0;
+        int fallsThrough = 1;
+
+        switch (instruction.opcode) {
+        case LIT:
+        case READ:
+            next = height + 1;
+            break;
+        case LOD:
+        case STO:
+            next = (instruction.opcode == LOD) ? height + 1 : height - 1;
+            needed = (instruction.opcode == STO);
+            if (instruction.lexicalLevel != 0)
+                error = format("Instruction %d uses lexical level %d, only 0 is supported.",
+                        i, instruction.lexicalLevel);
+            else if (address < 1 || address > height - needed)
+                error = format("Instruction %d accesses address %d, outside of the stack "
+                        "of height %d.", i, address, height - needed);
+            break;
+        case INC:
+            next = height + modifier;
+            needed = (modifier < 0) ? -modifier : 0;
+            break;
+        case JMP:
+            reach(i, modifier, height);
+            fallsThrough = 0;
+            break;
+        case JPC:
+            next = height - 1;
+            needed = 1;
+            if (height >= 1)
+                reach(i, modifier, next);
+            break;
+        case SIO:
+            next = height - 1;
+            needed = 1;
+            break;
+        case OPR:
+            if (modifier == RET) {
+                fallsThrough = 0;
+            } else if (modifier == NEG || modifier == ODD) {
+                needed = 1;
+            } else if (modifier > RET && modifier <= GEQ) {
+                next = height - 1;
+                needed = 2;
+            } else {
+                error = format("Instruction %d has unknown operation %d.", i, modifier);
+            }
+            break;
+        case CAL:
+            error = format("Instruction %d calls a procedure, which isn't supported.", i);
+            break;
+        default:
+            error = format("Instruction %d has unknown opcode %d.", i, instruction.opcode);
+        }
+
+        if (error != NULL)
+            break;
+        if (height < needed)
+            error = format("Instruction %d underflows the stack.", i);
+        else if (next > stackSize)
+            error = format("Instruction %d overflows the stack of size %d.", i, stackSize);
+        else if (fallsThrough)
+            reach(i, i + 1, next);
+        if (next > maxHeight)
+            maxHeight = next;
+    }
+
+    freeVector(worklist);
+    if (error != NULL) {
+        setVerifierError(error);
+        free(heights);
+        return NULL;
+    }
+
+    struct verification *verification = make(struct verification);
+    verification->heights = heights;
+    verification->maxHeight = maxHeight;
+    return verification;
+}
+
+void freeVerification(struct verification *verification) {
+    if (verification == NULL)
+        return;
+    free(verification->heights);
+    free(verification);
+}
+
+__thread char *verifierError = NULL;
+
+char *setVerifierError(char *message) {
+    verifierError = message;
+    return message;
+}
+char *getVerifierError() {
+    return verifierError;
+}
@@ -0,0 +1,35 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "src/lib/vector.h"
+
+// A bytecode verifier, which proves before a program runs that none of the
+// checks that runVM makes on every instruction can fail: every reachable
+// instruction has a valid opcode and operation, jumps stay inside the code,
+// the stack height at every instruction is the same on every path to it and
+// never underflows or goes over the stack size, and every lod/sto address is
+// a slot of the frame that is on the stack. runVM runs verified programs in a
+// dispatch loop without those checks, and the JIT compiles them.
+//
+// Only division by zero and running off the end of the code are left to be
+// caught at runtime. Like the JIT, the verifier only handles programs without
+// procedures (no cal and no lexical levels other than 0), which covers
+// everything the code generator produces. Other programs still run, with
+// every check.
+
+struct verification {
+    int *heights;     // The stack height before each instruction, or -1 if
+                      // it can't be reached.
+    int maxHeight;    // The largest height anywhere in the program.
+};
+
+// Verify the program for a stack of stackSize slots. Fused instructions are
+// verified as the sequence they stand for. Returns NULL and sets the verifier
+// error if the program can't be verified.
+struct verification *verifyProgram(struct vector *instructions, int stackSize);
+void freeVerification(struct verification *verification);
+
+char *setVerifierError(char *message);
+char *getVerifierError();
+
+#endif
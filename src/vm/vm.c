@@ -0,0 +1,515 @@
+#include "src/vm/vm.h"
+#include "src/linetable.h"
+#include "src/fusion.h"
+#include "src/lib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Dispatch outline:
+ * - runVM translates the instructions into threaded code: every instruction
+ *   becomes the address of the label that executes it (with opr already
+ *   decoded into its operation), so dispatching is a single indirect jump
+ *   through a GCC computed goto.
+ * - The top of the stack is cached in the local variable tos, which GCC keeps
+ *   in a register. stack[1..sp-1] are always up to date in memory and
+ *   stack[sp] is only written ("spilled") when something is pushed on top of
+ *   it or when an instruction needs to read the stack through memory.
+ * - Fused instructions (see fusion.h) get a label that runs their whole
+ *   sequence, made of the same code as the basic instructions' labels, so
+ *   they behave exactly the same, errors and instruction counts included.
+ * - Programs that verifyProgram accepts run in a copy of the loop without the
+ *   stack underflow, stack limit and lod/sto address checks, which it
+ *   proved can't fail.
+ * - Two sentinels after the code catch running off the end and jumps to
+ *   addresses outside of the code, so jumps don't have to be checked.
+ * - The loop itself is in dispatch.h, so that profileVM can be a copy of
+ *   runVM with counters added, without runVM paying for them.
+ * - Pushes aren't checked either. The stack ends right at an inaccessible
+ *   guard page, so storing a value above the stack limit faults, and the
+ *   SIGSEGV handler jumps back into runVM to report the overflow. Since the
+ *   top of the stack lives in tos, the fault only happens once a value above
+ *   the limit is spilled, which is usually the next push. Only inc, which can
+ *   move sp past the guard page in one go, still checks.
+ */
+
+// The stack that the current thread's runVM is using, for the SIGSEGV
+// handler.
+struct stackGuard {
+    char *guardStart;
+    char *guardEnd;
+    sigjmp_buf overflow;
+};
+static __thread struct stackGuard *currentStackGuard = NULL;
+
+// The SIGSEGV action from before the handler was installed, which gets the
+// faults that aren't stack overflows.
+static struct sigaction previousSegvAction;
+static pthread_once_t stackFaultHandlerOnce = PTHREAD_ONCE_INIT;
+// The alternate signal stack that installStackFaultHandler allocated for the
+// thread, which is freed when the thread exits.
+static pthread_key_t alternateStackKey;
+
+void handleStackFault(int signalNumber, siginfo_t *info, void *context) {
+    struct stackGuard *guard = currentStackGuard;
+    char *address = (char*)info->si_addr;
+    if (guard != NULL && address >= guard->guardStart && address < guard->guardEnd)
+        siglongjmp(guard->overflow, 1);
+
+    // Not a stack overflow, so chain to the program's own handler, or crash
+    // like we would without the handler by returning to the faulting
+    // instruction with the default action in place.
+    if (previousSegvAction.sa_flags & SA_SIGINFO)
+        previousSegvAction.sa_sigaction(signalNumber, info, context);
+    else if (previousSegvAction.sa_handler != SIG_DFL && previousSegvAction.sa_handler != SIG_IGN)
+        previousSegvAction.sa_handler(signalNumber);
+    else
+        signal(SIGSEGV, SIG_DFL);
+}
+
+void freeAlternateStack(void *memory) {
+    stack_t disabled;
+    memset(&disabled, 0, sizeof(disabled));
+    disabled.ss_flags = SS_DISABLE;
+    sigaltstack(&disabled, NULL);
+    free(memory);
+}
+
+void installStackFaultHandlerOnce() {
+    pthread_key_create(&alternateStackKey, freeAlternateStack);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handleStackFault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousSegvAction);
+}
+
+// Install the SIGSEGV handler, and give the thread an alternate signal stack
+// so that the handler can run even if the C stack is what overflowed. A
+// thread that already has an alternate stack keeps it.
+void installStackFaultHandler() {
+    static __thread int checkedAlternateStack = 0;
+
+    pthread_once(&stackFaultHandlerOnce, installStackFaultHandlerOnce);
+    if (!checkedAlternateStack) {
+        stack_t alternateStack;
+        if (sigaltstack(NULL, &alternateStack) == 0 && (alternateStack.ss_flags & SS_DISABLE)) {
+            alternateStack.ss_sp = malloc(SIGSTKSZ);
+            alternateStack.ss_size = SIGSTKSZ;
+            alternateStack.ss_flags = 0;
+            sigaltstack(&alternateStack, NULL);
+            pthread_setspecific(alternateStackKey, alternateStack.ss_sp);
+        }
+        checkedAlternateStack = 1;
+    }
+}
+
+size_t getStackMappingSize(int stackSize) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t stackBytes = ((stackSize + 1) * sizeof(int) + pageSize - 1) / pageSize * pageSize;
+    return stackBytes + pageSize;
+}
+
+struct vm *makeVM(struct vector *instructions, int stackSize) {
+    // Reserve the stack's pages followed by a guard page. The kernel only
+    // backs the pages with memory once they are touched, so a large stack
+    // costs nothing until it's used.
+    size_t size = getStackMappingSize(stackSize);
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    char *memory = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(memory != MAP_FAILED);
+    mprotect(memory + size - pageSize, pageSize, PROT_NONE);
+
+    struct vm *vm = makeVMWithStack(instructions, stackSize, memory, size);
+    vm->ownsStack = 1;
+    return vm;
+}
+
+struct vm *makeVMWithStack(struct vector *instructions, int stackSize, char *memory,
+        size_t size) {
+    struct vm *vm = make(struct vm);
+
+    vm->instructions = instructions;
+    vm->stackSize = stackSize;
+
+    // The stack is placed so that the slot just above the limit is the guard
+    // page's first word.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    vm->stackMapping = memory;
+    vm->stackMappingSize = size;
+    vm->ownsStack = 0;
+    vm->stack = (int*)(memory + size - pageSize) - (stackSize + 1);
+    assert((char*)vm->stack >= memory);
+    vm->pc = 0;
+    vm->bp = 1;
+    vm->sp = 0;
+    vm->input = stdin;
+    vm->output = stdout;
+    vm->ioMode = TEXT_IO;
+    vm->instructionCount = 0;
+    vm->error = NULL;
+    vm->errorPc = -1;
+    vm->verification = verifyProgram(instructions, stackSize);
+    vm->sliceCode = NULL;
+
+    return vm;
+}
+
+void freeVM(struct vm *vm) {
+    if (vm->ownsStack)
+        munmap(vm->stackMapping, vm->stackMappingSize);
+    freeVerification(vm->verification);
+    free(vm->sliceCode);
+    free(vm);
+}
+
+struct threadedInstruction {
+    void *handler;   // Label of the code that executes the instruction.
+    int lexicalLevel;
+    int modifier;
+};
+
+// runVM for verified programs.
+int runVerified(struct vm *vm) {
+    #define PROFILE_INSTRUCTION()
+    #define PROFILE_BRANCH(jumped)
+    #define FUSE_INSTRUCTIONS 1
+    #define CHECK_INSTRUCTIONS 0
+    #define PREEMPTIBLE 0
+    #include "src/vm/dispatch.h"
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_BRANCH
+    #undef FUSE_INSTRUCTIONS
+    #undef CHECK_INSTRUCTIONS
+    #undef PREEMPTIBLE
+}
+
+int runVM(struct vm *vm) {
+    if (vm->verification != NULL)
+        return runVerified(vm);
+
+    #define PROFILE_INSTRUCTION()
+    #define PROFILE_BRANCH(jumped)
+    #define FUSE_INSTRUCTIONS 1
+    #define CHECK_INSTRUCTIONS 1
+    #define PREEMPTIBLE 0
+    #include "src/vm/dispatch.h"
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_BRANCH
+    #undef FUSE_INSTRUCTIONS
+    #undef CHECK_INSTRUCTIONS
+    #undef PREEMPTIBLE
+}
+
+// runSlice for verified programs.
+int runVerifiedSlice(struct vm *vm, long long fuel) {
+    #define PROFILE_INSTRUCTION()
+    #define PROFILE_BRANCH(jumped)
+    #define FUSE_INSTRUCTIONS 1
+    #define CHECK_INSTRUCTIONS 0
+    #define PREEMPTIBLE 1
+    #include "src/vm/dispatch.h"
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_BRANCH
+    #undef FUSE_INSTRUCTIONS
+    #undef CHECK_INSTRUCTIONS
+    #undef PREEMPTIBLE
+}
+
+// runSlice for other programs.
+int runCheckedSlice(struct vm *vm, long long fuel) {
+    #define PROFILE_INSTRUCTION()
+    #define PROFILE_BRANCH(jumped)
+    #define FUSE_INSTRUCTIONS 1
+    #define CHECK_INSTRUCTIONS 1
+    #define PREEMPTIBLE 1
+    #include "src/vm/dispatch.h"
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_BRANCH
+    #undef FUSE_INSTRUCTIONS
+    #undef CHECK_INSTRUCTIONS
+    #undef PREEMPTIBLE
+}
+
+int runSlice(struct vm *vm, long long fuel) {
+    if (vm->error != NULL)
+        return SLICE_FAILED;
+    if (vm->bp == 0)
+        return SLICE_HALTED;
+
+    int succeeded = (vm->verification != NULL)
+        ? runVerifiedSlice(vm, fuel) : runCheckedSlice(vm, fuel);
+    if (!succeeded)
+        return SLICE_FAILED;
+    if (vm->bp == 0)
+        return SLICE_HALTED;
+    if (vm->pc < vm->instructions->length
+            && unfuseInstruction(get(struct instruction, vm->instructions, vm->pc)).opcode == READ
+            && !hasNumber(&vm->inputBuffer))
+        return SLICE_BLOCKED;
+    return SLICE_PREEMPTED;
+}
+
+int profileVM(struct vm *vm, struct profile *profile) {
+    #define PROFILE_INSTRUCTION() profile->counts[ip - code]++
+    #define PROFILE_BRANCH(jumped) \
+        ((jumped) ? profile->taken : profile->notTaken)[ip - code]++
+    // Count every instruction of a fused sequence.
+    #define FUSE_INSTRUCTIONS 0
+    #define CHECK_INSTRUCTIONS 1
+    #define PREEMPTIBLE 0
+    #include "src/vm/dispatch.h"
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_BRANCH
+    #undef FUSE_INSTRUCTIONS
+    #undef CHECK_INSTRUCTIONS
+    #undef PREEMPTIBLE
+}
+
+// The name the old vm prints for an opcode.
+char *listingName(int opcode) {
+    return (opcode == READ) ? "sio" : getOpcodeName(opcode);
+}
+
+int traceVM(struct vm *vm, FILE *trace) {
+    return runTraced(vm, trace, NULL);
+}
+
+int recordVM(struct vm *vm, struct traceBuffer *buffer) {
+    return runTraced(vm, NULL, buffer);
+}
+
+void printTraceHeader(FILE *file) {
+    fprintf(file, "%30s%-6s%-6s%-6s%s\n", "", "pc", "bp", "sp", "stack");
+    fprintf(file, "%-30s%-6d%-6d%-6d\n", "Initial values", 0, 1, 0);
+}
+
+void printTraceLine(FILE *file, int line, struct instruction instruction,
+        int pc, int bp, int sp, int *stack) {
+    fprintf(file, "%-6d%-6s%-6d%-12d%-6d%-6d%-6d", line, listingName(instruction.opcode),
+            instruction.lexicalLevel, instruction.modifier, pc, bp, sp);
+    // Like the old vm, only the current activation record is marked.
+    int i;
+    for (i = 1; i <= sp; i++) {
+        if (i == bp && bp > 1)
+            fprintf(file, "| ");
+        fprintf(file, "%d ", stack[i]);
+    }
+    fprintf(file, "\n");
+}
+
+int runTraced(struct vm *vm, FILE *trace, struct traceBuffer *buffer) {
+    struct vector *instructions = vm->instructions;
+    int length = instructions->length;
+    int *stack = vm->stack;
+    int pc = 0, bp = 1, sp = 0;
+    int address, value, level;
+
+    int base(int lexicalLevel) {
+        int b = bp;
+        for (level = lexicalLevel; level > 0; level--) {
+            if (b < 0 || b >= sp)
+                return -1;
+            b = stack[b + 1];
+        }
+        return b;
+    }
+    int fail(char *message) {
+        vm->error = message;
+        return 0;
+    }
+
+    if (trace != NULL)
+        printTraceHeader(trace);
+
+    startIO(vm);
+    while (bp > 0 && vm->error == NULL) {
+        if (pc < 0 || pc >= length) {
+            fail((pc == length) ? "Ran out of code before reaching RET instruction."
+                    : "Jump to an address outside of the code.");
+            break;
+        }
+
+        int line = pc;
+        // Fused instructions run one instruction at a time here.
+        struct instruction instruction =
+            unfuseInstruction(get(struct instruction, instructions, pc));
+        int modifier = instruction.modifier;
+        pc++;
+        vm->instructionCount++;
+
+        #define NEED(n) if (sp < (n)) { fail("Stack underflow."); break; }
+        #define ROOM(n) if (sp > vm->stackSize - (n)) { fail("Maximum stack height exceeded."); break; }
+
+        switch (instruction.opcode) {
+        case LIT:
+            ROOM(1);
+            stack[++sp] = modifier;
+            break;
+        case LOD:
+            ROOM(1);
+            address = base(instruction.lexicalLevel);
+            if (address < 0 || address + modifier < 1 || address + modifier > sp) {
+                fail("Access to an address outside of the stack.");
+                break;
+            }
+            stack[sp + 1] = stack[address + modifier];
+            sp++;
+            break;
+        case STO:
+            NEED(1);
+            value = stack[sp--];
+            address = base(instruction.lexicalLevel);
+            if (address < 0 || address + modifier < 1 || address + modifier > sp) {
+                fail("Access to an address outside of the stack.");
+                break;
+            }
+            stack[address + modifier] = value;
+            break;
+        case CAL:
+            ROOM(4);
+            address = base(instruction.lexicalLevel);
+            if (address < 0) {
+                fail("Access to an address outside of the stack.");
+                break;
+            }
+            stack[sp + 1] = 0;
+            stack[sp + 2] = address;
+            stack[sp + 3] = bp;
+            stack[sp + 4] = pc;
+            bp = sp + 1;
+            pc = modifier;
+            break;
+        case INC:
+            if (modifier > 0) {
+                ROOM(modifier);
+            } else {
+                NEED(-modifier);
+            }
+            sp += modifier;
+            break;
+        case JMP:
+            pc = modifier;
+            break;
+        case JPC:
+            NEED(1);
+            if (stack[sp--] == 0)
+                pc = modifier;
+            break;
+        case SIO:
+            NEED(1);
+            writeNumber(&vm->outputBuffer, stack[sp--]);
+            break;
+        case READ:
+            ROOM(1);
+            stack[++sp] = readNumber(&vm->inputBuffer);
+            break;
+        case OPR:
+            if (modifier == RET) {
+                // Like the old vm, read the return address of the main program
+                // even though it doesn't have one. It only shows up in the
+                // trace.
+                sp = bp - 1;
+                pc = (bp + 3 <= vm->stackSize) ? stack[bp + 3] : 0;
+                if (bp == 1) {
+                    bp = 0;
+                } else {
+                    bp = stack[bp + 2];
+                    if (pc < 0 || pc > length || bp < 1 || bp > vm->stackSize - 3)
+                        fail("Return to an invalid address.");
+                }
+                break;
+            } else if (modifier == NEG || modifier == ODD) {
+                NEED(1);
+                stack[sp] = (modifier == NEG) ? -(unsigned)stack[sp] : stack[sp] % 2;
+                break;
+            } else if (modifier > GEQ) {
+                vm->error = format("Unknown operation: %d.", modifier);
+                break;
+            }
+
+            NEED(2);
+            int left = stack[sp - 1];
+            int right = stack[sp];
+            if ((modifier == DIV || modifier == MOD) && right == 0) {
+                fail("Division by zero.");
+                break;
+            }
+            switch (modifier) {
+                case ADD: value = (unsigned)left + (unsigned)right; break;
+                case SUB: value = (unsigned)left - (unsigned)right; break;
+                case MUL: value = (unsigned)left * (unsigned)right; break;
+                case DIV: value = (right == -1) ? -(unsigned)left : left / right; break;
+                case MOD: value = (right == -1) ? 0 : left % right; break;
+                case EQL: value = left == right; break;
+                case NEQ: value = left != right; break;
+                case LSS: value = left < right; break;
+                case LEQ: value = left <= right; break;
+                case GTR: value = left > right; break;
+                case GEQ: value = left >= right; break;
+            }
+            stack[--sp] = value;
+            break;
+        default:
+            vm->error = format("Unknown opcode: %d.", instruction.opcode);
+            break;
+        }
+
+        #undef NEED
+        #undef ROOM
+
+        if (vm->error != NULL) {
+            vm->errorPc = line;
+            break;
+        }
+
+        // Print or record the instruction and the registers and stack after
+        // it.
+        if (trace != NULL)
+            printTraceLine(trace, line, instruction, pc, bp, sp, stack);
+        if (buffer != NULL)
+            addTraceRecord(buffer, line, instruction.opcode, sp, (sp > 0) ? stack[sp] : 0);
+    }
+
+    finishIO(vm);
+
+    vm->pc = pc;
+    vm->bp = bp;
+    vm->sp = sp;
+
+    return (vm->error == NULL);
+}
+
+void startIO(struct vm *vm) {
+    openInputBuffer(&vm->inputBuffer, vm->input, vm->ioMode);
+    openOutputBuffer(&vm->outputBuffer, vm->output, vm->ioMode);
+}
+
+void finishIO(struct vm *vm) {
+    closeIOBuffer(&vm->inputBuffer);
+    closeIOBuffer(&vm->outputBuffer);
+}
+
+void printVMError(FILE *file, struct vm *vm, struct vector *lines) {
+    fprintf(file, "%s\n", vm->error);
+    struct lineEntry position = findLinePosition(lines, vm->errorPc);
+    if (vm->errorPc >= 0 && position.line > 0)
+        fprintf(file, "  at line %d, column %d\n", position.line, position.column);
+}
+
+void printListing(FILE *file, struct vector *instructions) {
+    fprintf(file, "%-6s%-6s%-6s%-6s\n", "Line", "OP", "L", "M");
+    forVector(instructions, i, struct instruction, instruction,
+        fprintf(file, "%-6d%-6s%-6d%-6d\n", i,
+            listingName(unfuseInstruction(instruction).opcode),
+            instruction.lexicalLevel, instruction.modifier););
+    fprintf(file, "\n");
+}
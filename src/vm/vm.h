@@ -0,0 +1,117 @@
+#ifndef VM_H
+#define VM_H
+
+#include "src/instruction.h"
+#include "src/vm/trace.h"
+#include "src/vm/profile.h"
+#include "src/vm/io.h"
+#include "src/vm/verifier.h"
+#include "src/lib/vector.h"
+#include <stdio.h>
+
+// The PL/0 virtual machine. It runs the same instructions as the old vm
+// binary, with the same stack layout:
+//
+// - The stack is 1-indexed and sp is the index of the top value, so the
+//   stack starts out empty with sp = 0. The main program's frame starts at
+//   bp = 1 and has no activation record, so its variables are at 1, 2, ...
+// - cal writes an activation record (functional value, static link, dynamic
+//   link, return address) above sp and points bp at it. The callee's inc
+//   reserves space for the record and its variables.
+// - opr 0 0 returns from a procedure, or halts in the main program.
+// - sio writes the top of the stack, read reads a number and pushes it.
+
+// The stack limit used unless a different size is asked for. The stack is
+// reserved as virtual memory and only takes up memory as it grows, so the
+// default is large.
+#define DEFAULT_STACK_SIZE (1 << 24)
+// The old vm's stack limit, used when tracing.
+#define OLD_VM_STACK_SIZE 2000
+
+struct vm {
+    struct vector *instructions;
+    int stackSize;        // Maximum number of values on the stack.
+    int *stack;           // stackSize + 1 slots, since index 0 is unused.
+    char *stackMapping;   // The memory that holds the stack and its guard page.
+    size_t stackMappingSize;
+    int pc, bp, sp;       // Registers. Only meaningful after a run.
+    FILE *input;          // Where read instructions read from.
+    FILE *output;         // Where sio instructions write to.
+    int ioMode;           // TEXT_IO, or BINARY_IO for raw 32-bit numbers.
+    struct ioBuffer inputBuffer, outputBuffer;   // Only used during a run.
+    long long instructionCount;   // Number of instructions executed.
+    char *error;          // Why the last run failed, or NULL.
+    int errorPc;          // The instruction that failed, or -1 if it isn't
+                          // known (e.g. with the JIT, or for a bad jump).
+    struct verification *verification;   // From verifyProgram, or NULL if the
+                                         // program has to be checked as it runs.
+    int ownsStack;        // freeVM unmaps the stack, which makeVM mapped.
+    void *sliceCode;      // runSlice's threaded code, kept between slices.
+};
+
+// What runSlice stopped for.
+enum { SLICE_HALTED, SLICE_FAILED, SLICE_PREEMPTED, SLICE_BLOCKED };
+
+// Make a VM that runs the instructions, reading from stdin and writing to
+// stdout. stackSize is the maximum stack height, e.g. DEFAULT_STACK_SIZE. The
+// program is verified here, see verifier.h.
+struct vm *makeVM(struct vector *instructions, int stackSize);
+// Like makeVM, but with the stack in memory that the caller owns: size bytes
+// from getStackMappingSize, of which the last page is inaccessible.
+struct vm *makeVMWithStack(struct vector *instructions, int stackSize, char *memory,
+        size_t size);
+void freeVM(struct vm *vm);
+// The bytes that a stack of stackSize slots takes up, guard page included.
+size_t getStackMappingSize(int stackSize);
+
+// Run the program from the start until it halts. Returns false and sets
+// vm->error if the program fails, e.g. by overflowing the stack or dividing by
+// zero. Stack overflows are caught with a SIGSEGV handler, after which the
+// registers and instruction count aren't updated. Only runVM runs a fused
+// instruction's sequence at once (see fusion.h), the other ways of running a
+// program treat fused instructions like their first basic instruction.
+// Verified programs run without the checks that the verifier proved
+// unnecessary.
+int runVM(struct vm *vm);
+// Run the program from where the last slice stopped, or from the start,
+// until it halts or fails, or until it has run out of fuel or is at a read
+// with no number to read. Fuel is a number of instructions, and is checked
+// at jumps, calls and returns, so a slice can run over by a stretch of code
+// without any. Slices read and write the VM's input and output buffers, which
+// have to be memory buffers (see io.h) that are opened before the first slice
+// and stay open, instead of the input and output files. Returns SLICE_HALTED,
+// SLICE_FAILED (with vm->error set), SLICE_PREEMPTED or SLICE_BLOCKED.
+int runSlice(struct vm *vm, long long fuel);
+// Like runVM, but uses a plain switch loop and prints a trace of every
+// instruction in the old vm's format. Much slower than runVM.
+int traceVM(struct vm *vm, FILE *trace);
+// Like runVM, but counts how often every instruction runs and every jpc
+// jumps in the profile, which has to be made for the VM's instructions.
+int profileVM(struct vm *vm, struct profile *profile);
+// Like traceVM, but stores a binary record of the instructions in the buffer
+// instead of printing them, which is much faster.
+int recordVM(struct vm *vm, struct traceBuffer *buffer);
+// The switch loop behind traceVM and recordVM. Either one can be NULL.
+int runTraced(struct vm *vm, FILE *trace, struct traceBuffer *buffer);
+
+// Print the header of the old vm's trace, and the line for an instruction
+// that ran at the given line and left the registers and stack as given.
+void printTraceHeader(FILE *file);
+void printTraceLine(FILE *file, int line, struct instruction instruction,
+        int pc, int bp, int sp, int *stack);
+
+// Set up the buffers for the program's input and output at the start of a
+// run, and flush the output at the end.
+void startIO(struct vm *vm);
+void finishIO(struct vm *vm);
+
+// Print why the last run failed, followed by where in the source code it
+// failed if the line table (which can be NULL) knows.
+void printVMError(FILE *file, struct vm *vm, struct vector *lines);
+
+// Print the instructions in the old vm's listing format.
+void printListing(FILE *file, struct vector *instructions);
+// The name the old vm prints for an opcode.
+char *listingName(int opcode);
+
+#endif
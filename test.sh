@@ -4,9 +4,12 @@ if [ -f "test/test" ]; then
     rm test/test
 fi
 
-gcc -g -o test/test test/*.c test/lib/*.c src/*.c src/lib/*.c -I.
+# compiler.c, src/vm/main.c and src/server/main.c have their own mains, so
+# leave them out of the test build.
+gcc -g -pthread -o test/test test/*.c test/lib/*.c $(ls src/*.c | grep -v compiler.c) \
+    $(ls src/vm/*.c | grep -v main.c) $(ls src/server/*.c | grep -v main.c) \
+    src/lib/*.c -I.
 
 if [ -f "test/test" ]; then
     ./test/test
 fi
-
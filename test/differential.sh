@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Runs every program in test/programs with each way of executing PL/0 code
+# and checks that they all print the same thing as the interpreter, including
+# the C backend's output built with gcc -O2 and the assembly backend's output
+# built with as and ld. A program reads its input from the .in file next to it,
+# if there is one. Run ./build.sh first.
+
+cd "$(dirname "$0")/.."
+
+failures=0
+output=$(mktemp -d)
+trap 'rm -rf "$output"' EXIT
+
+for program in test/programs/*.pl0; do
+    name=$(basename "$program" .pl0)
+    input="${program%.pl0}.in"
+    if [ ! -f "$input" ]; then
+        input=/dev/null
+    fi
+
+    ./compiler "$program" 0 > "$output/$name.o"
+    ./compiler -O "$program" 0 > "$output/$name.optimized.o"
+    ./compiler --no-fuse "$program" 0 > "$output/$name.basic.o"
+    ./compiler --backend=c "$program" > "$output/$name.c"
+    gcc -O2 -o "$output/$name.native" "$output/$name.c"
+    ./compiler --backend=asm "$program" > "$output/$name.s"
+    as -o "$output/$name.asm.o" "$output/$name.s"
+    ld -o "$output/$name.asm" "$output/$name.asm.o"
+    # Only the interpreter knows where in the source an error happened, so
+    # leave that line out of every comparison.
+    ./pl0vm "$output/$name.o" < "$input" 2>&1 | grep -v '^  at line ' > "$output/$name.expected"
+
+    check() {
+        local description=$1
+        shift
+        "$@" < "$input" 2>&1 | grep -v '^  at line ' > "$output/$name.actual"
+        if ! cmp -s "$output/$name.expected" "$output/$name.actual"; then
+            echo "$name: $description differs from the interpreter:"
+            diff "$output/$name.expected" "$output/$name.actual" | head -10
+            failures=$((failures + 1))
+        fi
+    }
+
+    check "the optimized program" ./pl0vm "$output/$name.optimized.o"
+    check "the program without fused opcodes" ./pl0vm "$output/$name.basic.o"
+    check "compiler --run" ./compiler --run "$program"
+    check "the JIT" ./pl0vm --jit "$output/$name.o"
+    check "the JIT on the optimized program" ./pl0vm --jit "$output/$name.optimized.o"
+    check "the C backend" "$output/$name.native"
+    check "the assembly backend" "$output/$name.asm"
+done
+
+if [ $failures -eq 0 ]; then
+    echo "All differential tests passed."
+else
+    exit 1
+fi
@@ -39,11 +39,31 @@ int instructionsEqual(struct vector *instructions, char *expectedInstructions) {
     return 1;
 }
 
+struct vector *parseInstructions(char *instructionsString) {
+    struct vector *parts = splitString(instructionsString, ", \n\r\t");
+    assert(parts->length % 3 == 0);
+
+    struct vector *instructions = makeVector(struct instruction);
+    int i;
+    for (i = 0; i < parts->length; i += 3) {
+        char *opcodeString = get(char*, parts, i);
+        char *lexicalLevelString = get(char*, parts, i + 1);
+        char *modifierString = get(char*, parts, i + 2);
+        assert(isInteger(lexicalLevelString));
+        assert(isInteger(modifierString));
+
+        pushLiteral(instructions, struct instruction,
+                makeInstruction(getOpcode(opcodeString), atoi(lexicalLevelString), atoi(modifierString)));
+    }
+
+    return instructions;
+}
+
 void printInstructions(struct vector *instructions) {
     int i;
     for (i = 0; i < instructions->length; i++) {
         struct instruction instruction = get(struct instruction, instructions, i);
-        printf("%s %d %d\n", instruction.opcodeName,
+        printf("%s %d %d\n", getOpcodeName(instruction.opcode),
                 instruction.lexicalLevel, instruction.modifier);
     }
 }
@@ -10,6 +10,10 @@
 // false if they don't.
 int instructionsEqual(struct vector *instructions, char *expectedInstructions);
 
+// Parses a string in the same format as instructionsEqual's, e.g.
+// "lit 0 5, sto 0 0", into a vector of instructions.
+struct vector *parseInstructions(char *instructionsString);
+
 // Print list of instructions, for debugging.
 void printInstructions(struct vector *instructions);
 
@@ -2,8 +2,33 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "src/lexer.h"
+#include "src/cfg.h"
+#include "src/optimizer.h"
+#include "src/object.h"
+#include "src/fusion.h"
+#include "src/cgenerator.h"
+#include "src/asmgenerator.h"
+#include "src/vm/vm.h"
+#include "src/vm/jit.h"
+#include "src/vm/trace.h"
+#include "src/vm/scheduler.h"
+#include "src/lib/util.h"
+#include "src/server/server.h"
+#include "src/batch.h"
+#include "src/compile.h"
+#include "src/grammar.h"
+#include "src/pl0.h"
+#include "src/cache.h"
+#include "src/stats.h"
 #include "test/lib/parser.h"
 #include "test/lib/generator.h"
 
@@ -53,6 +78,67 @@ void testTestUtil() {
     testInstructionsEqual();
 }
 
+DEFINE_VECTOR(testIntVector, int, 4)
+
+void testVector() {
+    void testGeneric() {
+        struct vector *vector = makeVector(int);
+        int i;
+        for (i = 0; i < 1000; i++)
+            push(vector, i);
+        assert(vector->length == 1000 && vector->capacity >= 1000);
+        assert(vector->capacity < 2000);
+
+        // Setting an index far past the end grows it enough at once.
+        set(vector, 5000, (int){7});
+        assert(vector->length == 5001 && get(int, vector, 5000) == 7);
+
+        // Copies only have room for the items.
+        vector->length = 10;
+        struct vector *copy = vector_copy(vector);
+        assert(copy->length == 10 && copy->capacity == 10);
+        assert(memcmp(copy->items, vector->items, sizeof(int) * 10) == 0);
+
+        vector_concat(copy, copy);
+        assert(copy->length == 20 && get(int, copy, 19) == 9);
+        struct vector *array = vector_fromArray(copy->items, 3, sizeof(int));
+        assert(array->length == 3 && get(int, array, 2) == 2);
+        freeVector(array);
+        freeVector(copy);
+        freeVector(vector);
+    }
+
+    void testTyped() {
+        struct testIntVector vector;
+        testIntVectorInit(&vector);
+        int i;
+        for (i = 0; i < 4; i++)
+            testIntVectorPush(&vector, i);
+        // The first items are inside of the struct.
+        assert(vector.items == vector.small && vector.capacity == 4);
+        testIntVectorPush(&vector, 4);
+        assert(vector.items != vector.small && vector.capacity == 4 * GROWTH_FACTOR);
+        for (i = 5; i < 100; i++)
+            testIntVectorPush(&vector, i);
+        assert(vector.length == 100 && testIntVectorGet(&vector, 99) == 99);
+
+        testIntVectorSet(&vector, 50, -1);
+        assert(testIntVectorPop(&vector) == 99 && vector.length == 99);
+        struct vector *generic = testIntVectorToVector(&vector);
+        assert(generic->length == 99 && get(int, generic, 50) == -1);
+        freeVector(generic);
+        testIntVectorFree(&vector);
+
+        testIntVectorInit(&vector);
+        testIntVectorReserve(&vector, 30);
+        assert(vector.capacity == 30 && vector.items != vector.small);
+        testIntVectorFree(&vector);
+    }
+
+    testGeneric();
+    testTyped();
+}
+
 void testLexer() {
     initLexer();
 
@@ -70,6 +156,20 @@ void testLexer() {
         printf("%s ", lexeme.token);
     }
     printf("\n");*/
+
+    void testPositions() {
+        struct vector *lexemes = readLexemes(
+                "int x; /* a\n"
+                "comment */ x := 10\n"
+                "\tend");
+        int expected[][2] = {{1, 1}, {1, 5}, {1, 6}, {2, 12}, {2, 14}, {2, 17}, {3, 2}};
+
+        assert(lexemes->length == 7);
+        forVector(lexemes, i, struct lexeme, lexeme,
+            assert(lexeme.line == expected[i][0] && lexeme.column == expected[i][1]););
+    }
+
+    testPositions();
 }
 
 void testParser() {
@@ -264,7 +364,7 @@ void testCodeGenerator() {
         assert(instructions != NULL);
         assert(instructionsEqual(instructions,
                     " inc 0 1"   // Reserve space for int x
-                    " sio 0 2"   // Read onto stack
+                    " read 0 2"  // Read onto stack
                     " sto 0 0"   // Store read value in x
                     " lod 0 0"   // Load x onto stack
                     " lit 0 3"   // Push the value of y onto stack
@@ -318,26 +418,2022 @@ void testCodeGenerator() {
         assert(expressionBecomes("5", "lit 0 5"));
         assert(expressionBecomes("-100", "lit 0 100, opr 0 1"));
         assert(expressionBecomes("5 + 10", "lit 0 5, lit 0 10, opr 0 2"));
-        assert(expressionBecomes("1 + 2 + 3", "lit 0 1, lit 0 2, lit 0 3, opr 0 2, opr 0 2"));
+        // The grammar parses this as 1 + (2 + 3), and the right operand needs
+        // more stack space, so it goes first.
+        assert(expressionBecomes("1 + 2 + 3", "lit 0 2, lit 0 3, opr 0 2, lit 0 1, opr 0 2"));
         assert(expressionBecomes("-3 * (5 + -10)",
-                    "lit 0 3,"
-                    "opr 0 1,"
                     "lit 0 5,"
                     "lit 0 10,"
                     "opr 0 1,"
                     "opr 0 2,"
+                    "lit 0 3,"
+                    "opr 0 1,"
                     "opr 0 4"));
+        // Subtraction and division can't be reordered.
+        assert(expressionBecomes("1 - (2 + 3)", "lit 0 1, lit 0 2, lit 0 3, opr 0 2, opr 0 3"));
+        // Numbers that don't fit in a lit are pushed in two halves, and need
+        // two stack slots.
+        assert(expressionBecomes("10000000",
+                    "lit 0 152, lit 0 65536, opr 0 4, lit 0 38528, opr 0 2"));
+        assert(expressionBecomes("-2147483647",
+                    "lit 0 32767, lit 0 65536, opr 0 4, lit 0 65535, opr 0 2, opr 0 1"));
+        assert(expressionBecomes("1 + 2147483647",
+                    "lit 0 32767, lit 0 65536, opr 0 4, lit 0 65535, opr 0 2, lit 0 1, opr 0 2"));
+
+        // A long right-leaning sum only ever needs two stack slots.
+        struct vector *lexemes = readLexemes("1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10");
+        struct vector *instructions = generateInstructions(parse(lexemes, 0, "expression", grammar));
+        assert(computeMaxStackDepth(instructions) == 2);
+
+        // A long chain of terms is generated in time linear in its length.
+        int numTerms = 20000;
+        char *chain = malloc(4 * numTerms);
+        int i, length = 0;
+        for (i = 0; i < numTerms; i++)
+            length += sprintf(&chain[length], "%s%d", (i == 0) ? "" : (i % 2) ? "+" : "*", i % 10);
+        lexemes = readLexemes(chain);
+        struct parseTree tree = parse(lexemes, 0, "expression", grammar);
+        clock_t start = clock();
+        instructions = generateInstructions(tree);
+        assert(clock() - start < CLOCKS_PER_SEC);
+        assert(instructions->length == 2 * numTerms - 1);
+        assert(computeMaxStackDepth(instructions) <= 3);
+        free(chain);
+    }
+
+    void testInstructionEncoding() {
+        assert(sizeof(struct instruction) == 4);
+
+        struct instruction instruction = makeInstruction(JPC, -1, MIN_MODIFIER);
+        assert(instruction.opcode == JPC);
+        assert(instruction.lexicalLevel == -1);
+        assert(instruction.modifier == MIN_MODIFIER);
+        assert(strcmp(getOpcodeName(instruction.opcode), "jpc") == 0);
+        assert(getOpcode("read") == READ);
+
+        // Instructions that don't fit are reported instead of being truncated.
+        clearGeneratorErrors();
+        struct generatorState *state = makeGeneratorState();
+        addInstruction(state, LIT, 0, MAX_MODIFIER);
+        assert(!generatorHasErrors());
+        addInstruction(state, LIT, 0, MAX_MODIFIER + 1);
+        addInstruction(state, LOD, MAX_LEXICAL_LEVEL + 1, 0);
+        assert(generatorHasErrors() && getGeneratorErrors()->length == 2);
+        assert(instructionsEqual(state->instructions, "lit 0 8388607"));
+        clearGeneratorErrors();
     }
 
     testIfStatement();
     testExpression();
+    testInstructionEncoding();
+}
+
+void testLineTable() {
+    void testEncoding() {
+        struct vector *lines = makeLineTable();
+        addLinePosition(lines, 0, 0, 0);
+        addLinePosition(lines, 1, 2, 5);
+        addLinePosition(lines, 2, 2, 5);
+        addLinePosition(lines, 3, 3, 1);
+        addLinePosition(lines, 5, 0, 0);
+        addLinePosition(lines, 6, 7, 3);
+
+        // Instructions without a position at the start are left out, and
+        // runs with the same position share an entry.
+        assert(lines->length == 4);
+        assert(findLinePosition(lines, 0).line == 0);
+        assert(findLinePosition(lines, 2).line == 2 && findLinePosition(lines, 2).column == 5);
+        assert(findLinePosition(lines, 4).line == 3);
+        assert(findLinePosition(lines, 5).line == 0);
+        assert(findLinePosition(lines, 100).line == 7);
+        assert(findLinePosition(NULL, 3).line == 0);
+
+        struct lineEntry *positions = expandLineTable(lines, 8);
+        assert(positions[1].line == 2 && positions[4].line == 3 && positions[7].column == 3);
+        struct vector *compressed = compressLineTable(positions, 8);
+        assert(compressed->length == lines->length);
+        forVector(lines, i, struct lineEntry, entry,
+            struct lineEntry other = get(struct lineEntry, compressed, i);
+            assert(entry.pc == other.pc && entry.line == other.line
+                && entry.column == other.column););
+
+        free(positions);
+        freeVector(compressed);
+        freeVector(lines);
+    }
+
+    void testGenerator() {
+        initLexer();
+        struct grammar grammar = {makeVector(struct rule)};
+        addRule(grammar, "begin-block", "beginsym statements endsym");
+        addRule(grammar, "statements", "statement semicolonsym statements");
+        addRule(grammar, "statements", "statement");
+        addRule(grammar, "statement", "assignment");
+        addRule(grammar, "statement", "write-statement");
+        addRule(grammar, "assignment", "identifier becomessym expression");
+        addRule(grammar, "write-statement", "writesym identifier");
+        addRule(grammar, "expression", "term add-or-subtract expression");
+        addRule(grammar, "expression", "term");
+        addRule(grammar, "add-or-subtract", "plussym");
+        addRule(grammar, "term", "factor multiply-or-divide term");
+        addRule(grammar, "term", "factor");
+        addRule(grammar, "multiply-or-divide", "slashsym");
+        addRule(grammar, "factor", "identifier");
+        addRule(grammar, "factor", "sign number");
+        addRule(grammar, "sign", "nothing");
+        addRule(grammar, "number", "numbersym");
+        addRule(grammar, "identifier", "identsym");
+
+        struct vector *lexemes = readLexemes(
+                "begin\n"
+                "  x := 1;\n"
+                "  y := x / 2;\n"
+                "  write y\n"
+                "end");
+        struct parseTree tree = parse(lexemes, 0, "begin-block", grammar);
+        assert(!isParseTreeError(tree));
+        assert(tree.line == 1 && tree.column == 1);
+
+        struct generatorState *state = makeGeneratorState();
+        state->lines = makeLineTable();
+        addVariable(state, pt(identifier x));
+        addVariable(state, pt(identifier y));
+        generate(tree, state);
+        assert(instructionsEqual(state->instructions,
+                    "lit 0 1, sto 0 0,"
+                    "lod 0 0, lit 0 2, opr 0 5, sto 0 1,"
+                    "lod 0 1, sio 0 1"));
+
+        // Each instruction is at the innermost tree that generates it: the
+        // number for a lit, the / for a division and the statement for a sto.
+        int expected[][2] = {{2, 8}, {2, 3}, {3, 8}, {3, 12}, {3, 10}, {3, 3}, {4, 3}, {4, 3}};
+        int pc;
+        for (pc = 0; pc < 8; pc++) {
+            struct lineEntry position = findLinePosition(state->lines, pc);
+            assert(position.line == expected[pc][0] && position.column == expected[pc][1]);
+        }
+    }
+
+    void testOptimizer() {
+        // The jmp to the next instruction is removed, and the other
+        // instructions keep their positions.
+        struct vector *instructions = parseInstructions(
+                "lit 0 1, jmp 0 2, sio 0 1, opr 0 0");
+        struct vector *lines = makeLineTable();
+        int pc;
+        for (pc = 0; pc < 4; pc++)
+            addLinePosition(lines, pc, pc + 1, 1);
+
+        struct vector *optimized = optimizeInstructionsWithLines(instructions, &lines);
+        assert(instructionsEqual(optimized, "lit 0 1, sio 0 1, opr 0 0"));
+        assert(findLinePosition(lines, 0).line == 1);
+        assert(findLinePosition(lines, 1).line == 3);
+        assert(findLinePosition(lines, 2).line == 4);
+
+        freeVector(optimized);
+        freeVector(lines);
+        freeVector(instructions);
+    }
+
+    void testObjectFile() {
+        struct vector *instructions = parseInstructions("lit 0 1, sio 0 1, opr 0 0");
+        struct vector *lines = makeLineTable();
+        addLinePosition(lines, 0, 3, 10);
+        addLinePosition(lines, 2, 4, 1);
+
+        int size;
+        unsigned char *bytes = encodeObjectFile(instructions, lines, &size);
+        assert(size == OBJECT_HEADER_SIZE + 4 * 3 + 12 * 2);
+        struct objectFile *object = decodeObjectFile(bytes, size);
+        assert(object != NULL && object->lines->length == 2);
+        assert(findLinePosition(object->lines, 1).line == 3);
+        assert(findLinePosition(object->lines, 1).column == 10);
+        assert(findLinePosition(object->lines, 2).line == 4);
+        freeObjectFile(object);
+
+        // The line table is covered by the checksum.
+        bytes[size - 8] ^= 1;
+        assert(decodeObjectFile(bytes, size) == NULL);
+        free(bytes);
+
+        // Version 1 files have no line table.
+        // The words are written in the machine's byte order, which is little
+        // endian on the machines the VM runs on.
+        uint32_t code = encodeInstruction(makeInstruction(OPR, 0, RET));
+        uint32_t words[] = {1, 1, 1, objectChecksum((unsigned char*)&code, 4), code};
+        unsigned char version1[OBJECT_V1_HEADER_SIZE + 4];
+        memcpy(version1, OBJECT_MAGIC, 4);
+        memcpy(version1 + 4, words, sizeof(words));
+        object = decodeObjectFile(version1, sizeof(version1));
+        assert(object != NULL && object->version == 1);
+        assert(object->codeLength == 1 && object->lines->length == 0);
+        freeObjectFile(object);
+
+        freeVector(lines);
+        freeVector(instructions);
+    }
+
+    testEncoding();
+    testGenerator();
+    testOptimizer();
+    testObjectFile();
+}
+
+void testCGenerator() {
+    void testExpressions() {
+        struct generatorState *state = makeGeneratorState();
+        addVariable(state, pt(identifier x));
+        addConstant(state, pt(identifier y), pt(number 007));
+
+        // 1 - (x / -2)
+        assert(strcmp(generateCExpression(pt(expression
+                            (term (factor (sign +) (number 1)))
+                            (add-or-subtract -)
+                            (expression
+                                (term (factor
+                                    (expression
+                                        (term
+                                            (factor (identifier x))
+                                            (multiply-or-divide /)
+                                            (term (factor (sign -) (number 2))))))))),
+                        state),
+                    "subtract(1, divide(pl0_x, -2))") == 0);
+        // Constants are replaced by their values, and numbers are printed in
+        // decimal.
+        assert(strcmp(generateCExpression(pt(condition
+                            (expression (term (factor (identifier x))))
+                            (rel-op <>)
+                            (expression (term (factor (identifier y))))),
+                        state),
+                    "pl0_x != 7") == 0);
+        assert(strcmp(generateCExpression(pt(condition
+                            odd (expression (term (factor (identifier y))))),
+                        state),
+                    "7 % 2 != 0") == 0);
+    }
+
+    void testProgram() {
+        // const y = 3;
+        // int x;
+        // begin
+        //     read x;
+        //     while x > y do x := x * x;
+        //     write x
+        // end.
+        struct parseTree tree = pt(program
+                (block
+                    (var-declaration (vars (var (identifier x))))
+                    (const-declaration
+                        (constants (constant (identifier y) (number 3))))
+                    (statement
+                        (begin-block
+                            (statements
+                                (statement (read-statement (identifier x)))
+                                (statements
+                                    (statement
+                                        (while-statement
+                                            (condition
+                                                (expression (term (factor (identifier x))))
+                                                (rel-op >)
+                                                (expression (term (factor (identifier y)))))
+                                            (statement
+                                                (assignment
+                                                    (identifier x)
+                                                    (expression
+                                                        (term
+                                                            (factor (identifier x))
+                                                            (multiply-or-divide *)
+                                                            (term (factor (identifier x)))))))))
+                                    (statements
+                                        (statement (write-statement (identifier x))))))))));
+
+        char *source = generateC(tree);
+        assert(!generatorHasErrors());
+        assert(strstr(source,
+                    "int main(void) {\n"
+                    "    int pl0_x = 0;\n"
+                    "\n"
+                    "    pl0_x = readNumber();\n"
+                    "    while (pl0_x > 3) {\n"
+                    "        pl0_x = multiply(pl0_x, pl0_x);\n"
+                    "    }\n"
+                    "    writeNumber(pl0_x);\n"
+                    "    return 0;\n"
+                    "}\n") != NULL);
+        freeParseTree(tree);
+
+        // Storing into a constant is an error, like in the code generator.
+        tree = pt(program
+                (block
+                    (const-declaration
+                        (constants (constant (identifier y) (number 3))))
+                    (statement (read-statement (identifier y)))));
+        generateC(tree);
+        assert(generatorHasErrors());
+        freeParseTree(tree);
+    }
+
+    testExpressions();
+    testProgram();
+}
+
+void testAsmGenerator() {
+    // Returns the assembly generated for the statement, with the variables
+    // x and y and the constant c = 5.
+    char *statementBecomes(struct parseTree statement) {
+        char *code;
+        size_t size;
+        struct asmGenerator generator = {open_memstream(&code, &size),
+            makeGeneratorState(), 0, 2, 0};
+        addVariable(generator.state, pt(identifier x));
+        addVariable(generator.state, pt(identifier y));
+        addConstant(generator.state, pt(identifier c), pt(number 5));
+
+        generateAsmStatement(&generator, statement);
+        fclose(generator.output);
+        return code;
+    }
+
+    void testTemporaries() {
+        struct asmGenerator generator = {NULL, makeGeneratorState(), 0, 2, 0};
+        assert(strcmp(asmTemporary(&generator, 0), "%ebx") == 0);
+        assert(generator.numSpillSlots == 0);
+        // Temporaries that don't fit in registers go after the variables.
+        assert(strcmp(asmTemporary(&generator, 13), "-16(%rbp)") == 0);
+        assert(generator.numSpillSlots == 2);
+    }
+
+    void testStatements() {
+        // x := y + 1 * c uses the operands directly.
+        assert(strcmp(statementBecomes(pt(assignment
+                            (identifier x)
+                            (expression
+                                (term (factor (identifier y)))
+                                (add-or-subtract +)
+                                (expression
+                                    (term
+                                        (factor (sign +) (number 1))
+                                        (multiply-or-divide *)
+                                        (term (factor (identifier c)))))))),
+                    "    movl $1, %ebx\n"
+                    "    imull $5, %ebx\n"
+                    "    addl -8(%rbp), %ebx\n"
+                    "    movl %ebx, -4(%rbp)\n") == 0);
+        // x := y moves through a register.
+        assert(strcmp(statementBecomes(pt(assignment
+                            (identifier x)
+                            (expression (term (factor (identifier y)))))),
+                    "    movl -8(%rbp), %eax\n"
+                    "    movl %eax, -4(%rbp)\n") == 0);
+        assert(strcmp(statementBecomes(pt(write-statement (identifier c))),
+                    "    movl $5, %edi\n"
+                    "    call pl0Write\n") == 0);
+    }
+
+    void testProgram() {
+        // int x; begin read x; write x end.
+        char *source = generateAsm(pt(program
+                    (block
+                        (var-declaration (vars (var (identifier x))))
+                        (statement
+                            (begin-block
+                                (statements
+                                    (statement (read-statement (identifier x)))
+                                    (statements
+                                        (statement (write-statement (identifier x))))))))));
+        assert(!generatorHasErrors());
+        assert(strstr(source,
+                    "_start:\n"
+                    "    movq %rsp, %rbp\n"
+                    "    subq $16, %rsp\n"
+                    "    movl $0, -4(%rbp)\n"
+                    "    call pl0Read\n"
+                    "    movl %eax, -4(%rbp)\n"
+                    "    movl -4(%rbp), %edi\n"
+                    "    call pl0Write\n") != NULL);
+    }
+
+    testTemporaries();
+    testStatements();
+    testProgram();
+}
+
+void testOptimizer() {
+    void testControlFlowGraph() {
+        // int x; begin x := 0; while x < 3 do x := x + 1; write x end.
+        struct vector *instructions = parseInstructions(
+                "inc 0 1, lit 0 0, sto 0 0,"
+                "lod 0 0, lit 0 3, opr 0 10, jpc 0 12,"
+                "lod 0 0, lit 0 1, opr 0 2, sto 0 0, jmp 0 3,"
+                "lod 0 0, sio 0 1, opr 0 0");
+        struct controlFlowGraph *cfg = buildControlFlowGraph(instructions);
+        computeLiveness(cfg);
+
+        assert(cfg->blocks->length == 4);
+        struct basicBlock header = get(struct basicBlock, cfg->blocks, 1);
+        assert(header.start == 3 && header.end == 7);
+        assert(header.successors->length == 2);
+        assert(header.predecessors->length == 2);
+        // x is read by the loop condition, but not before it's first set.
+        assert(header.liveIn[0]);
+        assert(!get(struct basicBlock, cfg->blocks, 0).liveIn[0]);
+
+        freeControlFlowGraph(cfg);
+        freeVector(instructions);
+    }
+
+    void testDeadStores() {
+        // x is never read, so both stores to it go away.
+        struct vector *instructions = parseInstructions(
+                "inc 0 2, lit 0 1, sto 0 0,"
+                "lod 0 1, lit 0 2, opr 0 4, sto 0 0,"
+                "read 0 2, sto 0 1, lod 0 1, sio 0 1, opr 0 0");
+        instructions = optimizeInstructions(instructions);
+        assert(instructionsEqual(instructions,
+                    "inc 0 2, read 0 2, sto 0 1, lod 0 1, sio 0 1, opr 0 0"));
+
+        // Stores whose value can't be recomputed for free have to stay.
+        instructions = optimizeInstructions(parseInstructions(
+                    "inc 0 1, read 0 2, sto 0 0, lit 0 1, lit 0 0, opr 0 5, sto 0 0, opr 0 0"));
+        assert(instructionsEqual(instructions,
+                    "inc 0 1, read 0 2, sto 0 0, lit 0 1, lit 0 0, opr 0 5, sto 0 0, opr 0 0"));
+    }
+
+    void testJumpThreading() {
+        struct vector *instructions = parseInstructions(
+                "read 0 2, jpc 0 3, jmp 0 5,"
+                "jmp 0 4, jmp 0 6,"
+                "opr 0 0,"
+                "lit 0 7, sio 0 1, opr 0 0");
+        instructions = optimizeInstructions(instructions);
+        assert(instructionsEqual(instructions,
+                    "read 0 2, jpc 0 3, opr 0 0, lit 0 7, sio 0 1, opr 0 0"));
+    }
+
+    void testCommonSubexpressions() {
+        // x := (a + b) * c; y := (a + b) * c + 1; write x; write y
+        struct vector *instructions = parseInstructions(
+                "inc 0 5,"
+                "lod 0 0, lod 0 1, opr 0 2, lod 0 2, opr 0 4, sto 0 3,"
+                "lod 0 0, lod 0 1, opr 0 2, lod 0 2, opr 0 4, lit 0 1, opr 0 2, sto 0 4,"
+                "lod 0 3, sio 0 1, lod 0 4, sio 0 1, opr 0 0");
+        int changed = 0;
+        instructions = eliminateCommonSubexpressions(instructions, &changed);
+        assert(changed);
+        assert(instructionsEqual(instructions,
+                    "inc 0 6,"
+                    "lod 0 0, lod 0 1, opr 0 2, lod 0 2, opr 0 4, sto 0 5, lod 0 5, sto 0 3,"
+                    "lod 0 5, lit 0 1, opr 0 2, sto 0 4,"
+                    "lod 0 3, sio 0 1, lod 0 4, sio 0 1, opr 0 0"));
+
+        // Reusing a + b once doesn't pay for the extra store and load, and a
+        // store to a in between means it's a different value anyway.
+        changed = 0;
+        instructions = eliminateCommonSubexpressions(parseInstructions(
+                    "inc 0 3,"
+                    "lod 0 0, lod 0 1, opr 0 2, sto 0 2,"
+                    "lod 0 1, lod 0 0, opr 0 2, sto 0 2,"
+                    "lit 0 1, sto 0 0,"
+                    "lod 0 0, lod 0 1, opr 0 2, lod 0 0, lod 0 1, opr 0 2, opr 0 4, sto 0 2,"
+                    "opr 0 0"), &changed);
+        assert(!changed);
+    }
+
+    void testLoopInvariants() {
+        // while i < n * 2 do i := i + n * 2; write i
+        struct vector *instructions = parseInstructions(
+                "inc 0 2,"
+                "lod 0 0, lod 0 1, lit 0 2, opr 0 4, opr 0 10, jpc 0 13,"
+                "lod 0 0, lod 0 1, lit 0 2, opr 0 4, opr 0 2, sto 0 0, jmp 0 1,"
+                "lod 0 0, sio 0 1, opr 0 0");
+        int changed = 0;
+        instructions = hoistLoopInvariants(instructions, &changed);
+        assert(changed);
+        assert(instructionsEqual(instructions,
+                    "inc 0 4,"
+                    "lod 0 1, lit 0 2, opr 0 4, sto 0 2,"
+                    "lod 0 1, lit 0 2, opr 0 4, sto 0 3,"
+                    "lod 0 0, lod 0 2, opr 0 10, jpc 0 17,"
+                    "lod 0 0, lod 0 3, opr 0 2, sto 0 0, jmp 0 9,"
+                    "lod 0 0, sio 0 1, opr 0 0"));
+
+        // Nothing is invariant if the loop stores to the variable.
+        changed = 0;
+        hoistLoopInvariants(parseInstructions(
+                    "inc 0 1,"
+                    "lod 0 0, lit 0 2, opr 0 4, jpc 0 9,"
+                    "lit 0 0, sto 0 0, jmp 0 1,"
+                    "opr 0 0, opr 0 0"), &changed);
+        assert(!changed);
+    }
+
+    testControlFlowGraph();
+    testDeadStores();
+    testJumpThreading();
+    testCommonSubexpressions();
+    testLoopInvariants();
+}
+
+void testObjectFile() {
+    struct vector *instructions = parseInstructions(
+            "inc 0 2,"
+            "lit 0 -8388608,"
+            "sto 0 0,"
+            "lod 0 0,"
+            "jpc 0 7,"
+            "lod -1 1,"
+            "sio 0 1,"
+            "opr 0 0");
+
+    void testRoundTrip() {
+        int size;
+        unsigned char *bytes = encodeObjectFile(instructions, NULL, &size);
+        assert(size == OBJECT_HEADER_SIZE + 4 * instructions->length);
+        assert(isObjectFile(bytes, size));
+
+        struct objectFile *object = decodeObjectFile(bytes, size);
+        assert(object != NULL);
+        assert(object->version == OBJECT_VERSION);
+        assert(object->codeLength == instructions->length);
+        assert(object->stackSize == computeMaxStackDepth(instructions));
+        assert(instructionsEqual(object->instructions,
+                    "inc 0 2, lit 0 -8388608, sto 0 0, lod 0 0, jpc 0 7,"
+                    "lod -1 1, sio 0 1, opr 0 0"));
+
+        freeObjectFile(object);
+        free(bytes);
+    }
+
+    void testCorruptFiles() {
+        int size;
+        unsigned char *bytes = encodeObjectFile(instructions, NULL, &size);
+
+        // Flipping a bit in the code is caught by the checksum.
+        bytes[OBJECT_HEADER_SIZE + 5] ^= 1;
+        assert(decodeObjectFile(bytes, size) == NULL);
+        bytes[OBJECT_HEADER_SIZE + 5] ^= 1;
+
+        assert(decodeObjectFile(bytes, size - 4) == NULL);
+        assert(decodeObjectFile(bytes, 3) == NULL);
+        bytes[0] = 'X';
+        assert(decodeObjectFile(bytes, size) == NULL);
+        assert(getObjectFileError() != NULL);
+
+        free(bytes);
+    }
+
+    void testLoadObjectFile() {
+        char filename[] = "/tmp/pl0-test-XXXXXX";
+        int fd = mkstemp(filename);
+        assert(fd >= 0);
+        FILE *file = fdopen(fd, "wb");
+        assert(writeObjectFile(file, instructions, NULL));
+        fclose(file);
+
+        struct objectFile *object = loadObjectFile(filename);
+        assert(object != NULL);
+        assert(object->codeLength == instructions->length);
+        freeObjectFile(object);
+        unlink(filename);
+
+        assert(loadObjectFile(filename) == NULL);
+    }
+
+    testRoundTrip();
+    testCorruptFiles();
+    testLoadObjectFile();
+    freeVector(instructions);
+}
+
+// Overflows the VM's stack on the thread, and puts the error in *error.
+void *overflowStack(void *error) {
+    struct vector *instructions = parseInstructions("lit 0 1, jmp 0 0");
+    struct vm *vm = makeVM(instructions, 1000);
+    runVM(vm);
+    *(char**)error = vm->error;
+    freeVM(vm);
+    freeVector(instructions);
+    return NULL;
+}
+
+void testVM() {
+    // Run the instructions with the given input in the fast loop, the tracing
+    // loop and the JIT, and check that they agree. Returns what the program
+    // printed, or the error message.
+    enum { FAST, TRACE, JIT };
+    char *run(char *instructionsString, char *input) {
+        struct vector *instructions = parseInstructions(instructionsString);
+        char *results[3];
+        int mode;
+        for (mode = FAST; mode <= JIT; mode++) {
+            char *output, *traceOutput;
+            size_t outputSize, traceSize;
+            struct vm *vm = makeVM(instructions, 100);
+            vm->input = fmemopen(input, strlen(input) + 1, "r");
+            vm->output = open_memstream(&output, &outputSize);
+            FILE *traceFile = open_memstream(&traceOutput, &traceSize);
+
+            int succeeded = (mode == FAST) ? runVM(vm)
+                : (mode == TRACE) ? traceVM(vm, traceFile) : runJIT(vm);
+            fclose(vm->input);
+            fclose(vm->output);
+            fclose(traceFile);
+            free(traceOutput);
+            results[mode] = succeeded ? output : vm->error;
+            freeVM(vm);
+        }
+
+        assert(strcmp(results[FAST], results[TRACE]) == 0);
+        assert(strcmp(results[FAST], results[JIT]) == 0);
+        freeVector(instructions);
+        return results[0];
+    }
+
+    void testArithmetic() {
+        assert(strcmp(run("lit 0 7, lit 0 3, opr 0 3, sio 0 1, opr 0 0", ""), "4\n") == 0);
+        assert(strcmp(run("lit 0 -7, lit 0 2, opr 0 5, sio 0 1,"
+                        "lit 0 -7, lit 0 2, opr 0 7, sio 0 1,"
+                        "lit 0 5, opr 0 6, opr 0 1, sio 0 1,"
+                        "lit 0 2, lit 0 3, opr 0 13, sio 0 1, opr 0 0", ""),
+                    "-3\n-1\n-1\n0\n") == 0);
+        assert(strcmp(run("read 0 2, read 0 2, opr 0 4, sio 0 1, opr 0 0", "6 7"), "42\n") == 0);
+    }
+
+    void testVariablesAndJumps() {
+        // Sum the numbers from 1 to 10.
+        assert(strcmp(run(
+                        "inc 0 2,"
+                        "lit 0 10, sto 0 0,"
+                        "lod 0 0, jpc 0 14,"
+                        "lod 0 1, lod 0 0, opr 0 2, sto 0 1,"
+                        "lod 0 0, lit 0 1, opr 0 3, sto 0 0,"
+                        "jmp 0 3,"
+                        "lod 0 1, sio 0 1, opr 0 0", ""), "55\n") == 0);
+    }
+
+    void testProcedures() {
+        // A recursive procedure that counts the main program's variable down
+        // to zero, through its static link.
+        assert(strcmp(run(
+                        "jmp 0 10,"
+                        "inc 0 4, lod 1 0, lit 0 1, opr 0 3, sto 1 0, lod 1 0, jpc 0 9,"
+                        "cal 1 1, opr 0 0,"
+                        "inc 0 1, lit 0 3, sto 0 0, cal 0 1, lod 0 0, sio 0 1, opr 0 0", ""),
+                    "0\n") == 0);
+    }
+
+    void testErrors() {
+        assert(strcmp(run("lit 0 1, jmp 0 0", ""), "Maximum stack height exceeded.") == 0);
+        assert(strcmp(run("lit 0 1, lit 0 0, opr 0 5, opr 0 0", ""), "Division by zero.") == 0);
+        assert(strcmp(run("lit 0 1", ""), "Ran out of code before reaching RET instruction.") == 0);
+        assert(strcmp(run("jmp 0 5", ""), "Jump to an address outside of the code.") == 0);
+        assert(strcmp(run("sio 0 1, opr 0 0", ""), "Stack underflow.") == 0);
+        assert(strcmp(run("inc 0 1, lod 0 1, opr 0 0", ""),
+                    "Access to an address outside of the stack.") == 0);
+
+        // The interpreters know which instruction failed.
+        struct vector *instructions = parseInstructions(
+                "lit 0 1, lit 0 0, opr 0 5, opr 0 0");
+        struct vm *vm = makeVM(instructions, 100);
+        assert(!runVM(vm) && vm->errorPc == 2);
+        freeVM(vm);
+        vm = makeVM(instructions, 100);
+        FILE *traceFile = fopen("/dev/null", "w");
+        assert(!traceVM(vm, traceFile) && vm->errorPc == 2);
+        fclose(traceFile);
+        freeVM(vm);
+        freeVector(instructions);
+    }
+
+    void testJIT() {
+        int canCompile(char *instructionsString) {
+            struct vector *instructions = parseInstructions(instructionsString);
+            struct vm *vm = makeVM(instructions, 100);
+            int result = canJIT(vm);
+            freeVM(vm);
+            freeVector(instructions);
+            return result;
+        }
+
+        assert(canCompile("inc 0 1, read 0 2, sto 0 0, lod 0 0, jpc 0 6, jmp 0 1, opr 0 0"));
+        // Procedures are interpreted.
+        assert(!canCompile("jmp 0 2, opr 0 0, cal 0 1, opr 0 0"));
+        // So are programs whose stack height isn't known ahead of time.
+        assert(!canCompile("lit 0 1, jmp 0 0"));
+        assert(!canCompile("read 0 2, jpc 0 3, lit 0 1, opr 0 0"));
+
+        // Division edge cases, which need special code.
+        assert(strcmp(run("lit 0 -65536, lit 0 32768, opr 0 4, lit 0 -1, opr 0 5, sio 0 1,"
+                        "lit 0 -65536, lit 0 32768, opr 0 4, lit 0 -1, opr 0 7, sio 0 1,"
+                        "lit 0 -9, lit 0 4, opr 0 7, sio 0 1, opr 0 0", ""),
+                    "-2147483648\n0\n-1\n") == 0);
+    }
+
+    void testStackGuard() {
+        // Returns the error from running the instructions in the fast loop
+        // with the given stack size, or NULL if they succeed.
+        char *runWithStackSize(char *instructionsString, int stackSize) {
+            struct vector *instructions = parseInstructions(instructionsString);
+            struct vm *vm = makeVM(instructions, stackSize);
+            vm->output = fopen("/dev/null", "w");
+            runVM(vm);
+            fclose(vm->output);
+            char *error = vm->error;
+            freeVM(vm);
+            freeVector(instructions);
+            return error;
+        }
+
+        // Filling the stack up to its limit is fine.
+        assert(runWithStackSize("lit 0 1, lit 0 2, lit 0 3, sio 0 1, sio 0 1, sio 0 1, opr 0 0", 3) == NULL);
+        assert(strcmp(runWithStackSize("lit 0 1, lit 0 2, lit 0 3, lit 0 4, lit 0 5, opr 0 0", 3),
+                    "Maximum stack height exceeded.") == 0);
+        assert(strcmp(runWithStackSize("jmp 0 2, opr 0 0, cal 0 1, opr 0 0", 3),
+                    "Maximum stack height exceeded.") == 0);
+        // The stack only takes up memory as it's used, so a huge one is fine.
+        assert(strcmp(runWithStackSize("lit 0 1, jmp 0 0", 1 << 26),
+                    "Maximum stack height exceeded.") == 0);
+        // The VM still works after catching an overflow.
+        assert(strcmp(run("lit 0 7, sio 0 1, opr 0 0", ""), "7\n") == 0);
+
+        // Overflows are caught on every thread, each with its own alternate
+        // signal stack for the handler, which is freed when the thread exits.
+        int i;
+        for (i = 0; i < 3; i++) {
+            char *error = NULL;
+            pthread_t thread;
+            pthread_create(&thread, NULL, overflowStack, &error);
+            pthread_join(thread, NULL);
+            assert(error != NULL && strcmp(error, "Maximum stack height exceeded.") == 0);
+        }
+    }
+
+    testArithmetic();
+    testVariablesAndJumps();
+    testProcedures();
+    testErrors();
+    testJIT();
+    testStackGuard();
+}
+
+void testVerifier() {
+    // Returns the verifier's error for the instructions, or NULL if they're
+    // verified.
+    char *verify(char *instructionsString, int stackSize) {
+        struct vector *instructions = parseInstructions(instructionsString);
+        struct verification *verification = verifyProgram(instructions, stackSize);
+        freeVector(instructions);
+        if (verification == NULL)
+            return getVerifierError();
+        freeVerification(verification);
+        return NULL;
+    }
+
+    void testHeights() {
+        struct vector *instructions = parseInstructions(
+                "inc 0 1, read 0 2, sto 0 0, lod 0 0, jpc 0 6, jmp 0 1, opr 0 0, lit 0 5");
+        struct verification *verification = verifyProgram(instructions, 100);
+        assert(verification != NULL);
+        int expected[] = {0, 1, 2, 1, 2, 1, 1, -1};
+        assert(memcmp(verification->heights, expected, sizeof(expected)) == 0);
+        assert(verification->maxHeight == 2);
+        freeVerification(verification);
+        freeVector(instructions);
+    }
+
+    void testErrors() {
+        assert(verify("lit 0 1, sio 0 1, opr 0 0", 100) == NULL);
+        assert(strcmp(verify("jmp 0 5, opr 0 0", 100),
+                    "Instruction 0 jumps to 5, outside of the code.") == 0);
+        assert(strcmp(verify("lit 0 1, jmp 0 0", 100),
+                    "Instruction 0 is reached with stack heights 0 and 1.") == 0);
+        assert(strcmp(verify("opr 0 2, opr 0 0", 100),
+                    "Instruction 0 underflows the stack.") == 0);
+        assert(strcmp(verify("lit 0 1, lit 0 2, opr 0 0", 1),
+                    "Instruction 1 overflows the stack of size 1.") == 0);
+        assert(strcmp(verify("inc 0 1, lod 0 1, opr 0 0", 100),
+                    "Instruction 1 accesses address 2, outside of the stack of height 1.") == 0);
+        assert(strcmp(verify("inc 0 1, lit 0 1, sto 1 0, opr 0 0", 100),
+                    "Instruction 2 uses lexical level 1, only 0 is supported.") == 0);
+        assert(strcmp(verify("jmp 0 2, opr 0 0, cal 0 1, opr 0 0", 100),
+                    "Instruction 2 calls a procedure, which isn't supported.") == 0);
+        assert(strcmp(verify("opr 0 20", 100), "Instruction 0 has unknown operation 20.") == 0);
+        // Unreachable code isn't checked.
+        assert(verify("opr 0 0, opr 0 20, sio 0 1", 100) == NULL);
+    }
+
+    void testUncheckedRun() {
+        // Verified programs run without the checks, and give the same results
+        // and errors as with them.
+        struct vector *instructions = parseInstructions(
+                "inc 0 1, lit 0 7, sto 0 0, lod 0 0, sio 0 1, lit 0 1, lit 0 0, opr 0 5,"
+                "opr 0 0");
+        int i;
+        for (i = 0; i < 2; i++) {
+            char *output;
+            size_t outputSize;
+            struct vm *vm = makeVM(instructions, 100);
+            assert(vm->verification != NULL);
+            if (i == 1) {
+                freeVerification(vm->verification);
+                vm->verification = NULL;
+            }
+            vm->output = open_memstream(&output, &outputSize);
+            assert(!runVM(vm));
+            fclose(vm->output);
+            assert(strcmp(output, "7\n") == 0);
+            assert(strcmp(vm->error, "Division by zero.") == 0);
+            assert(vm->errorPc == 7 && vm->instructionCount == 8);
+            free(output);
+            freeVM(vm);
+        }
+        freeVector(instructions);
+    }
+
+    testHeights();
+    testErrors();
+    testUncheckedRun();
+}
+
+void testFusion() {
+    void testFuse() {
+        struct vector *basic = parseInstructions(
+                "inc 0 1, lod 0 0, lit 0 1, opr 0 2, sto 0 0,"
+                "lod 0 0, lit 0 2, opr 0 5, sto 0 0, opr 0 0");
+        struct vector *fused = fuseInstructions(basic);
+        int opcode(int i) {
+            return get(struct instruction, fused, i).opcode;
+        }
+
+        // Only the first instruction of a sequence changes.
+        assert(fused->length == basic->length);
+        assert(opcode(1) == LOD_LIT_OPR_STO);
+        assert(opcode(2) == LIT && opcode(3) == OPR && opcode(4) == STO);
+        assert(get(struct instruction, fused, 1).modifier == 0);
+        // Division isn't fused.
+        assert(opcode(5) == LOD && opcode(6) == LIT && opcode(7) == OPR && opcode(8) == STO);
+
+        struct vector *unfused = unfuseInstructions(fused);
+        assert(memcmp(unfused->items, basic->items, sizeof(struct instruction) * basic->length)
+                == 0);
+        // A fused opcode without its sequence after it is just its first
+        // instruction.
+        assert(matchesFusedPattern(fused, 1, LOD_LIT_OPR_STO));
+        assert(!matchesFusedPattern(fused, 5, LOD_LIT_OPR_STO));
+        assert(unfuseInstruction(makeInstruction(OPR_JPC, 0, 9)).opcode == OPR);
+        assert(stackEffect(makeInstruction(LOD_LIT_OPR_STO, 0, 0)) == 1);
+
+        freeVector(basic);
+        freeVector(fused);
+        freeVector(unfused);
+    }
+
+    void testRun() {
+        // Run the instructions with and without fusing them, and check that
+        // they agree on everything, including where an error happened and how
+        // many instructions ran. Returns what the program printed, or the
+        // error message.
+        char *run(char *instructionsString) {
+            struct vector *basic = parseInstructions(instructionsString);
+            struct vector *fused = fuseInstructions(basic);
+            char *results[2];
+            int errorPcs[2];
+            long long counts[2];
+            int i;
+            for (i = 0; i < 2; i++) {
+                char *output;
+                size_t outputSize;
+                struct vm *vm = makeVM((i == 0) ? basic : fused, 100);
+                vm->output = open_memstream(&output, &outputSize);
+                int succeeded = runVM(vm);
+                fclose(vm->output);
+                results[i] = succeeded ? output : vm->error;
+                errorPcs[i] = vm->errorPc;
+                counts[i] = vm->instructionCount;
+                freeVM(vm);
+            }
+
+            assert(strcmp(results[0], results[1]) == 0);
+            assert(errorPcs[0] == errorPcs[1]);
+            assert(counts[0] == counts[1]);
+            freeVector(basic);
+            freeVector(fused);
+            return results[0];
+        }
+
+        // Count down from 10 and sum the numbers, with a compare and branch.
+        assert(strcmp(run(
+                        "inc 0 2, lit 0 10, sto 0 0, lit 0 0, sto 0 1,"
+                        "lod 0 0, lit 0 0, opr 0 12, jpc 0 20,"
+                        "lod 0 1, lod 0 0, opr 0 2, sto 0 1,"
+                        "lod 0 0, lit 0 1, opr 0 3, sto 0 0,"
+                        "lod 0 0, sio 0 1, jmp 0 5,"
+                        "lod 0 1, sio 0 1, opr 0 0"),
+                    "9\n8\n7\n6\n5\n4\n3\n2\n1\n0\n55\n") == 0);
+        // Jumping into the middle of a sequence.
+        assert(strcmp(run("inc 0 1, lit 0 5, jmp 0 4, lod 0 0, lit 0 2, opr 0 4, sio 0 1,"
+                        "opr 0 0"), "10\n") == 0);
+        // Errors in the middle of a sequence.
+        assert(strcmp(run("inc 0 1, lod 0 0, lit 0 1, opr 0 2, sto 0 3, opr 0 0"),
+                    "Access to an address outside of the stack.") == 0);
+        assert(strcmp(run("opr 0 2, sto 0 0, opr 0 0"), "Stack underflow.") == 0);
+    }
+
+    testFuse();
+    testRun();
+}
+
+void testIO() {
+    void testText() {
+        char input[] = "  12\n-7\t+3 2147483648 -2147483648 -x 5";
+        struct ioBuffer buffer;
+        openInputBuffer(&buffer, fmemopen(input, strlen(input), "r"), TEXT_IO);
+        int expected[] = {12, -7, 3, -2147483647 - 1, -2147483647 - 1, 0, 0};
+        int i;
+        for (i = 0; i < sizeof(expected) / sizeof(int); i++)
+            assert(readNumber(&buffer) == expected[i]);
+        fclose(buffer.file);
+        closeIOBuffer(&buffer);
+
+        char *output;
+        size_t outputSize;
+        openOutputBuffer(&buffer, open_memstream(&output, &outputSize), TEXT_IO);
+        writeNumber(&buffer, 0);
+        writeNumber(&buffer, -2147483647 - 1);
+        writeNumber(&buffer, 2147483647);
+        assert(closeIOBuffer(&buffer));
+        fclose(buffer.file);
+        assert(strcmp(output, "0\n-2147483648\n2147483647\n") == 0);
+        free(output);
+    }
+
+    void testLongStreams() {
+        // More numbers than fit in the buffers, in both modes.
+        int mode;
+        for (mode = TEXT_IO; mode <= BINARY_IO; mode++) {
+            char *output;
+            size_t outputSize;
+            struct ioBuffer buffer;
+            openOutputBuffer(&buffer, open_memstream(&output, &outputSize), mode);
+            int i;
+            for (i = 0; i < 100000; i++)
+                writeNumber(&buffer, i * 7919 - 400000000);
+            assert(closeIOBuffer(&buffer));
+            fclose(buffer.file);
+            assert(outputSize > IO_BUFFER_SIZE);
+
+            openInputBuffer(&buffer, fmemopen(output, outputSize, "r"), mode);
+            for (i = 0; i < 100000; i++)
+                assert(readNumber(&buffer) == i * 7919 - 400000000);
+            assert(readNumber(&buffer) == 0);
+            fclose(buffer.file);
+            closeIOBuffer(&buffer);
+            free(output);
+        }
+    }
+
+    void testMemoryBuffers() {
+        // Memory input only has a number once it's followed by something, or
+        // the input ended.
+        struct ioBuffer buffer;
+        openMemoryBuffer(&buffer, 0, TEXT_IO);
+        assert(!hasNumber(&buffer));
+        appendInput(&buffer, " -12", 4);
+        assert(!hasNumber(&buffer));
+        appendInput(&buffer, "3 4", 3);
+        assert(hasNumber(&buffer) && readNumber(&buffer) == -123);
+        assert(!hasNumber(&buffer));
+        endInput(&buffer);
+        assert(hasNumber(&buffer) && readNumber(&buffer) == 4);
+        assert(readNumber(&buffer) == 0);
+        closeIOBuffer(&buffer);
+
+        int number = 1234567;
+        openMemoryBuffer(&buffer, 0, BINARY_IO);
+        appendInput(&buffer, (char*)&number, 3);
+        assert(!hasNumber(&buffer));
+        appendInput(&buffer, (char*)&number + 3, 1);
+        assert(hasNumber(&buffer) && readNumber(&buffer) == 1234567);
+        closeIOBuffer(&buffer);
+
+        // Memory output grows to hold everything.
+        openMemoryBuffer(&buffer, 1, TEXT_IO);
+        int i;
+        for (i = 0; i < 1000; i++)
+            writeNumber(&buffer, i);
+        assert(buffer.end == 10 * 2 + 90 * 3 + 900 * 4);
+        assert(strncmp(buffer.data, "0\n1\n2\n", 6) == 0);
+        assert(strncmp(buffer.data + buffer.end - 4, "999\n", 4) == 0);
+        closeIOBuffer(&buffer);
+    }
+
+    testText();
+    testLongStreams();
+    testMemoryBuffers();
+}
+
+void testTrace() {
+    // The recursive procedure from testVM, which reads its input.
+    struct vector *instructions = parseInstructions(
+            "jmp 0 10,"
+            "inc 0 4, lod 1 0, lit 0 1, opr 0 3, sto 1 0, lod 1 0, jpc 0 9,"
+            "cal 1 1, opr 0 0,"
+            "inc 0 1, read 0 2, sto 0 0, cal 0 1, lod 0 0, sio 0 1, opr 0 0");
+
+    // Record the program into a trace file and read it back.
+    struct traceFile *record(int capacity, int samplePeriod) {
+        char output[16];
+        struct vm *vm = makeVM(instructions, 100);
+        vm->input = fmemopen("3", 1, "r");
+        vm->output = fmemopen(output, sizeof(output), "w");
+        struct traceBuffer *buffer = makeTraceBuffer(capacity, samplePeriod);
+        assert(recordVM(vm, buffer));
+
+        char filename[] = "/tmp/pl0-trace-XXXXXX";
+        int fd = mkstemp(filename);
+        assert(writeTraceFile(fd, buffer, vm->instructionCount));
+        close(fd);
+        struct traceFile *trace = readTraceFile(filename);
+        assert(trace != NULL);
+        assert(trace->header.instructionCount == vm->instructionCount);
+
+        unlink(filename);
+        fclose(vm->input);
+        fclose(vm->output);
+        freeTraceBuffer(buffer);
+        freeVM(vm);
+        return trace;
+    }
+
+    void testDecoding() {
+        // The decoded trace is the same as the one traceVM prints.
+        char *expected, *decoded;
+        size_t expectedSize, decodedSize;
+        struct vm *vm = makeVM(instructions, 100);
+        vm->input = fmemopen("3", 1, "r");
+        vm->output = fopen("/dev/null", "w");
+        FILE *expectedFile = open_memstream(&expected, &expectedSize);
+        printListing(expectedFile, instructions);
+        assert(traceVM(vm, expectedFile));
+        fclose(expectedFile);
+        fclose(vm->input);
+        fclose(vm->output);
+        freeVM(vm);
+
+        struct traceFile *trace = record(1024, 1);
+        assert(trace->header.numRecords == trace->header.instructionCount);
+        FILE *decodedFile = open_memstream(&decoded, &decodedSize);
+        decodeTrace(decodedFile, trace, instructions);
+        fclose(decodedFile);
+        assert(strcmp(expected, decoded) == 0);
+
+        freeTraceFile(trace);
+        free(expected);
+        free(decoded);
+    }
+
+    void testRingBuffer() {
+        // A full buffer keeps the most recent records, oldest first. The last
+        // instruction is the halt at 16 with an empty stack.
+        struct traceFile *trace = record(4, 1);
+        assert(trace->header.numRecords == 4);
+        assert(trace->header.totalRecords == trace->header.instructionCount);
+        assert(trace->records[3].pc == 16 && trace->records[3].sp == 0);
+        assert(trace->records[2].pc == 15 && trace->records[2].opcode == SIO);
+        assert(trace->records[1].pc == 14 && trace->records[1].top == 0);
+        freeTraceFile(trace);
+
+        // Sampling records every n-th instruction.
+        trace = record(1024, 5);
+        assert(trace->header.samplePeriod == 5);
+        assert(trace->header.numRecords == trace->header.instructionCount / 5);
+        assert(trace->records[0].pc == 13 && trace->records[0].opcode == CAL);
+        freeTraceFile(trace);
+
+        assert(readTraceFile("/nonexistent") == NULL);
+    }
+
+    testDecoding();
+    testRingBuffer();
+    freeVector(instructions);
+}
+
+void testProfile() {
+    // Sum the numbers from 1 to 10, like in testVM.
+    struct vector *instructions = parseInstructions(
+            "inc 0 2,"
+            "lit 0 10, sto 0 0,"
+            "lod 0 0, jpc 0 14,"
+            "lod 0 1, lod 0 0, opr 0 2, sto 0 1,"
+            "lod 0 0, lit 0 1, opr 0 3, sto 0 0,"
+            "jmp 0 3,"
+            "lod 0 1, sio 0 1, opr 0 0");
+    struct vm *vm = makeVM(instructions, 100);
+    vm->output = fopen("/dev/null", "w");
+    struct profile *profile = makeProfile(instructions->length);
+    assert(profileVM(vm, profile));
+    fclose(vm->output);
+
+    long long total = 0;
+    int i;
+    for (i = 0; i < instructions->length; i++)
+        total += profile->counts[i];
+    assert(total == vm->instructionCount);
+    assert(profile->counts[0] == 1 && profile->counts[3] == 11 && profile->counts[13] == 10);
+    assert(profile->taken[4] == 1 && profile->notTaken[4] == 10);
+
+    struct vector *loops = findLoops(profile, instructions);
+    assert(loops->length == 1);
+    struct hotLoop loop = get(struct hotLoop, loops, 0);
+    assert(loop.start == 3 && loop.end == 13);
+    assert(loop.iterations == 10 && loop.instructions == 2 * 11 + 9 * 10);
+
+    // Instructions in the loop have it on their stack.
+    char *collapsed;
+    size_t collapsedSize;
+    FILE *collapsedFile = open_memstream(&collapsed, &collapsedSize);
+    printCollapsedStacks(collapsedFile, profile, instructions, NULL);
+    fclose(collapsedFile);
+    assert(strstr(collapsed, "program;0 inc 0 2 1\n") != NULL);
+    assert(strstr(collapsed, "program;loop 3-13;4 jpc 0 14 11\n") != NULL);
+
+    free(collapsed);
+    freeVector(loops);
+    freeProfile(profile);
+    freeVM(vm);
+    freeVector(instructions);
+}
+
+void *serveInBackground(void *server) {
+    serveConnections((struct server*)server);
+    return NULL;
+}
+
+void testServer() {
+    void testProtocol() {
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        assert(sendJob(fds[0], JOB_OPTIMIZE, "int x; begin read x end.", "42\n", 3));
+        struct job *job = receiveJob(fds[1]);
+        assert(job != NULL && job->flags == JOB_OPTIMIZE && job->inputSize == 3);
+        assert(strcmp(job->source, "int x; begin read x end.") == 0);
+        assert(strcmp(job->input, "42\n") == 0);
+        freeJob(job);
+
+        struct jobResult result = {{JOB_RUNTIME_ERROR, 0, 0, 0, 7, 1, 2}, "1\n", "Oops."};
+        assert(sendJobResult(fds[1], &result));
+        struct jobResult *received = receiveJobResult(fds[0]);
+        assert(received != NULL && received->header.status == JOB_RUNTIME_ERROR);
+        assert(received->header.instructionCount == 7);
+        assert(strcmp(received->output, "1\n") == 0 && strcmp(received->error, "Oops.") == 0);
+        freeJobResult(received);
+
+        // A header without the magic number is a bad request.
+        struct jobHeader header = {"XXXX", 0, 0, 0};
+        assert(writeFully(fds[0], &header, sizeof(header)));
+        job = receiveJob(fds[1]);
+        assert(job != NULL && job->source == NULL);
+        freeJob(job);
+
+        // A closed connection has no more jobs.
+        close(fds[0]);
+        assert(receiveJob(fds[1]) == NULL);
+        close(fds[1]);
+    }
+
+    void testLatencies() {
+        struct latencyHistogram *histogram = make(struct latencyHistogram);
+        memset(histogram, 0, sizeof(*histogram));
+        // 1 us to 1 ms, which the percentiles have to be within 1/32 of.
+        long long i;
+        for (i = 1; i <= 1000; i++)
+            addLatency(histogram, i * 1000);
+        assert(histogram->count == 1000 && histogram->total == 500500000);
+        assert(latencyPercentile(histogram, 0) == 1000);
+        assert(latencyPercentile(histogram, 100) == 1000000);
+        int percentiles[] = {1, 50, 90, 99};
+        for (i = 0; i < 4; i++) {
+            long long expected = percentiles[i] * 10000LL;
+            long long latency = latencyPercentile(histogram, percentiles[i]);
+            assert(latency >= expected - expected / 32 && latency <= expected + expected / 32);
+        }
+
+        // Merging, small latencies, which are exact, and huge ones.
+        struct latencyHistogram *other = make(struct latencyHistogram);
+        memset(other, 0, sizeof(*other));
+        addLatency(other, 3);
+        addLatency(other, 1LL << 62);
+        mergeLatencies(histogram, other);
+        assert(histogram->count == 1002);
+        assert(latencyPercentile(histogram, 0) == 3 && latencyPercentile(histogram, 100) == 1LL << 62);
+        memset(other, 0, sizeof(*other));
+        addLatency(other, 5);
+        addLatency(other, 5);
+        addLatency(other, 9);
+        assert(latencyPercentile(other, 50) == 5 && latencyPercentile(other, 90) == 9);
+
+        char *output = NULL;
+        size_t size;
+        FILE *file = open_memstream(&output, &size);
+        printLatencies(file, other);
+        fclose(file);
+        assert(strncmp(output, "Latency: mean 0.0 us, min 0.0 us, p50 0.0 us", 44) == 0);
+        free(output);
+        free(other);
+        free(histogram);
+    }
+
+    void testJobs() {
+        char socketPath[] = "/tmp/pl0-test-XXXXXX";
+        close(mkstemp(socketPath));
+        struct contextLimits limits = {1000000, 0, 100};
+        struct server *server = startServer(socketPath, 2, limits);
+        assert(server != NULL);
+        pthread_t acceptor;
+        pthread_create(&acceptor, NULL, serveInBackground, server);
+
+        struct sockaddr_un address = {AF_UNIX};
+        strcpy(address.sun_path, socketPath);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+        struct jobResult *run(char *source, char *input) {
+            assert(sendJob(fd, JOB_OPTIMIZE, source, input, strlen(input)));
+            struct jobResult *result = receiveJobResult(fd);
+            assert(result != NULL);
+            return result;
+        }
+
+        // Several jobs on one connection.
+        struct jobResult *result = run("int x, y; begin read x; y := x * 2; write y end.", "21");
+        assert(result->header.status == JOB_SUCCEEDED && result->error == NULL);
+        assert(strcmp(result->output, "42\n") == 0 && result->header.instructionCount > 0);
+        freeJobResult(result);
+
+        result = run("int x; begin x := 1 / 0; write x end.", "");
+        assert(result->header.status == JOB_RUNTIME_ERROR);
+        assert(strncmp(result->error, "Division by zero.\n  at line 1,", 29) == 0);
+        freeJobResult(result);
+
+        result = run("begin x := end.", "");
+        assert(result->header.status == JOB_COMPILE_ERROR && result->error != NULL);
+        freeJobResult(result);
+
+        result = run("begin write y end.", "");
+        assert(result->header.status == JOB_COMPILE_ERROR);
+        assert(strstr(result->error, "Could not find symbol 'y'.") != NULL);
+        freeJobResult(result);
+
+        // Jobs that go over a limit fail, with the output up to the limit.
+        result = run("int x; begin x := 0; while 1 = 1 do x := x + 1 end.", "");
+        assert(result->header.status == JOB_RUNTIME_ERROR);
+        assert(strncmp(result->error, "Instruction limit exceeded.", 27) == 0);
+        assert(result->header.instructionCount >= 1000000);
+        freeJobResult(result);
+
+        result = run("int x; begin x := 0; while x < 1000 do begin write x; x := x + 1 end end.",
+                "");
+        assert(result->header.status == JOB_RUNTIME_ERROR);
+        assert(strncmp(result->error, "Output limit exceeded.", 22) == 0);
+        assert(strlen(result->output) == 100 && strncmp(result->output, "0\n1\n2\n", 6) == 0);
+        freeJobResult(result);
+
+        close(fd);
+        stopServer(server);
+        pthread_join(acceptor, NULL);
+        finishServer(server);
+        assert(access(socketPath, F_OK) != 0);
+        assert(server->stats.jobs == 6 && server->stats.failedJobs == 5);
+        assert(server->stats.latencies.count == 6);
+        freeServer(server);
+    }
+
+    // Clients that keep their connections open without sending jobs don't
+    // take up the workers.
+    void testIdleClients() {
+        char socketPath[] = "/tmp/pl0-test-XXXXXX";
+        close(mkstemp(socketPath));
+        struct contextLimits noLimits = {0, 0, 0};
+        struct server *server = startServer(socketPath, 2, noLimits);
+        assert(server != NULL);
+        pthread_t acceptor;
+        pthread_create(&acceptor, NULL, serveInBackground, server);
+
+        struct sockaddr_un address = {AF_UNIX};
+        strcpy(address.sun_path, socketPath);
+        int fds[3];
+        int i;
+        for (i = 0; i < 3; i++) {
+            fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+            assert(connect(fds[i], (struct sockaddr*)&address, sizeof(address)) == 0);
+        }
+        // Fail instead of hanging if the job isn't served.
+        struct timeval timeout = {5, 0};
+        setsockopt(fds[2], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        for (i = 0; i < 2; i++) {
+            assert(sendJob(fds[2], 0, "int x; begin x := 7; write x end.", "", 0));
+            struct jobResult *result = receiveJobResult(fds[2]);
+            assert(result != NULL && result->header.status == JOB_SUCCEEDED);
+            assert(strcmp(result->output, "7\n") == 0);
+            freeJobResult(result);
+        }
+
+        for (i = 0; i < 3; i++)
+            close(fds[i]);
+        stopServer(server);
+        pthread_join(acceptor, NULL);
+        finishServer(server);
+        assert(server->stats.jobs == 2);
+        freeServer(server);
+    }
+
+    // A job that never ends doesn't keep a stopped server from finishing.
+    void testStopping() {
+        char socketPath[] = "/tmp/pl0-test-XXXXXX";
+        close(mkstemp(socketPath));
+        struct contextLimits noLimits = {0, 0, 0};
+        struct server *server = startServer(socketPath, 1, noLimits);
+        assert(server != NULL);
+        pthread_t acceptor;
+        pthread_create(&acceptor, NULL, serveInBackground, server);
+
+        struct sockaddr_un address = {AF_UNIX};
+        strcpy(address.sun_path, socketPath);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+        assert(sendJob(fd, 0, "int x; begin x := 0; while 1 = 1 do x := x + 1 end.", "", 0));
+        usleep(100000);
+        stopServer(server);
+        pthread_join(acceptor, NULL);
+        finishServer(server);
+
+        // Unless the worker didn't get to the job before the server stopped,
+        // it was abandoned.
+        struct jobResult *result = receiveJobResult(fd);
+        if (result != NULL) {
+            assert(result->header.status == JOB_RUNTIME_ERROR);
+            assert(strstr(result->error, "The server stopped") == result->error);
+            freeJobResult(result);
+        }
+        close(fd);
+        freeServer(server);
+    }
+
+    testProtocol();
+    testLatencies();
+    testJobs();
+    testIdleClients();
+    testStopping();
+}
+
+void testScheduler() {
+    // Reads n and prints the sum of 1 to n.
+    char *sumProgram =
+        "inc 0 2, read 0 2, sto 0 0,"
+        "lod 0 0, jpc 0 14,"
+        "lod 0 1, lod 0 0, opr 0 2, sto 0 1,"
+        "lod 0 0, lit 0 1, opr 0 3, sto 0 0,"
+        "jmp 0 3,"
+        "lod 0 1, sio 0 1, opr 0 0";
+    struct contextLimits noLimits = {0, 0, 0};
+
+    // Returns the context's output as a string, which has to be freed.
+    char *getOutput(struct context *context) {
+        int size;
+        char *output = getContextOutput(context, &size);
+        return strndup(output, size);
+    }
+
+    void checkOutput(struct context *context, char *expected) {
+        char *output = getOutput(context);
+        assert(strcmp(output, expected) == 0);
+        free(output);
+    }
+
+    void testInterleaving() {
+        struct vector *instructions = parseInstructions(sumProgram);
+        struct scheduler *scheduler = makeScheduler(10, 100, noLimits);
+        struct context *first = spawnContext(scheduler, instructions, TEXT_IO);
+        struct context *second = spawnContext(scheduler, instructions, TEXT_IO);
+        addInput(scheduler, first, "1000\n", 5);
+        addInput(scheduler, second, "100\n", 4);
+        runScheduler(scheduler);
+
+        assert(first->state == CONTEXT_HALTED && second->state == CONTEXT_HALTED);
+        checkOutput(first, "500500\n");
+        checkOutput(second, "5050\n");
+        // Slices end at the first jump after 10 instructions, and every
+        // iteration has one.
+        assert(first->slices > 1000 / 2 && second->slices > 100 / 2);
+        assert(scheduler->slices == first->slices + second->slices);
+        assert(first->vm->instructionCount == 3 + 11 * 1000 + 5);
+
+        freeContext(scheduler, first);
+        freeContext(scheduler, second);
+        freeScheduler(scheduler);
+        freeVector(instructions);
+    }
+
+    void testBlockingReads() {
+        struct vector *instructions = parseInstructions(
+                "read 0 2, sio 0 1, read 0 2, sio 0 1, read 0 2, sio 0 1, opr 0 0");
+        struct scheduler *scheduler = makeScheduler(1000, 100, noLimits);
+        struct context *context = spawnContext(scheduler, instructions, TEXT_IO);
+        assert(runScheduler(scheduler) == 1 && context->state == CONTEXT_BLOCKED);
+
+        // A number without anything after it could go on.
+        addInput(scheduler, context, "4", 1);
+        assert(context->state == CONTEXT_READY);
+        runScheduler(scheduler);
+        assert(context->state == CONTEXT_BLOCKED);
+        checkOutput(context, "");
+
+        addInput(scheduler, context, "2 7", 3);
+        runScheduler(scheduler);
+        assert(context->state == CONTEXT_BLOCKED);
+        checkOutput(context, "42\n");
+
+        // Once the input ends, the rest is read like from a file.
+        endContextInput(scheduler, context);
+        runScheduler(scheduler);
+        assert(context->state == CONTEXT_HALTED);
+        checkOutput(context, "42\n7\n0\n");
+        assert(context->vm->instructionCount == 7);
+
+        freeContext(scheduler, context);
+        freeScheduler(scheduler);
+        freeVector(instructions);
+    }
+
+    void testFailures() {
+        // Returns the context's error after running the instructions with the
+        // limits, next to another context that has to be unaffected.
+        char *runWithLimits(char *instructionsString, struct contextLimits limits) {
+            struct vector *instructions = parseInstructions(instructionsString);
+            struct vector *sumInstructions = parseInstructions(sumProgram);
+            struct scheduler *scheduler = makeScheduler(100, 100, limits);
+            struct context *context = spawnContext(scheduler, instructions, TEXT_IO);
+            struct context *other = spawnContext(scheduler, sumInstructions, TEXT_IO);
+            addInput(scheduler, other, "10\n", 3);
+            runScheduler(scheduler);
+
+            assert(other->state == CONTEXT_HALTED);
+            checkOutput(other, "55\n");
+            char *error = context->vm->error;
+            assert((context->state == CONTEXT_FAILED) == (error != NULL));
+            freeContext(scheduler, context);
+            freeContext(scheduler, other);
+            freeScheduler(scheduler);
+            freeVector(instructions);
+            freeVector(sumInstructions);
+            return error;
+        }
+
+        assert(strcmp(runWithLimits("lit 0 1, lit 0 0, opr 0 5, opr 0 0", noLimits),
+                    "Division by zero.") == 0);
+        assert(strcmp(runWithLimits("lit 0 1, jmp 0 0", noLimits),
+                    "Maximum stack height exceeded.") == 0);
+        assert(strcmp(runWithLimits("jmp 0 0", (struct contextLimits){1000, 0, 0}),
+                    "Instruction limit exceeded.") == 0);
+        assert(strcmp(runWithLimits("jmp 0 0", (struct contextLimits){0, 50000000, 0}),
+                    "Time limit exceeded.") == 0);
+        assert(strcmp(runWithLimits("lit 0 7, sio 0 1, jmp 0 0", (struct contextLimits){0, 0, 100}),
+                    "Output limit exceeded.") == 0);
+        // Programs that stay within the limits are fine.
+        assert(runWithLimits("lit 0 7, sio 0 1, opr 0 0", (struct contextLimits){200, 0, 3}) == NULL);
+    }
+
+    void testManyContexts() {
+        struct vector *instructions = parseInstructions(sumProgram);
+        struct scheduler *scheduler = makeScheduler(50, 100, noLimits);
+        int numContexts = 10000;
+        struct context **contexts = (struct context**)malloc(sizeof(struct context*) * numContexts);
+        int i;
+        for (i = 0; i < numContexts; i++) {
+            contexts[i] = spawnContext(scheduler, instructions, TEXT_IO);
+            char *input = format("%d\n", i % 100);
+            addInput(scheduler, contexts[i], input, strlen(input));
+            free(input);
+        }
+        runScheduler(scheduler);
+
+        int numChunks = scheduler->stacks.chunks->length;
+        assert(numChunks == (numContexts + STACKS_PER_CHUNK - 1) / STACKS_PER_CHUNK);
+        for (i = 0; i < numContexts; i++) {
+            assert(contexts[i]->state == CONTEXT_HALTED);
+            char *expected = format("%d\n", (i % 100) * (i % 100 + 1) / 2);
+            checkOutput(contexts[i], expected);
+            free(expected);
+            freeContext(scheduler, contexts[i]);
+        }
+
+        // The stacks are reused.
+        assert(scheduler->stacks.free->length == numChunks * STACKS_PER_CHUNK);
+        for (i = 0; i < numContexts; i++)
+            contexts[i] = spawnContext(scheduler, instructions, TEXT_IO);
+        assert(scheduler->stacks.chunks->length == numChunks);
+        for (i = 0; i < numContexts; i++)
+            endContextInput(scheduler, contexts[i]);
+        runScheduler(scheduler);
+        for (i = 0; i < numContexts; i++) {
+            checkOutput(contexts[i], "0\n");
+            freeContext(scheduler, contexts[i]);
+        }
+
+        free(contexts);
+        freeScheduler(scheduler);
+        freeVector(instructions);
+    }
+
+    testInterleaving();
+    testBlockingReads();
+    testFailures();
+    testManyContexts();
+}
+
+void testBatch() {
+    char directory[] = "/tmp/pl0-batch-XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    char *path(char *name) {
+        return format("%s/%s", directory, name);
+    }
+    void writeFile(char *name, char *contents) {
+        char *filePath = path(name);
+        FILE *file = fopen(filePath, "w");
+        fputs(contents, file);
+        fclose(file);
+        free(filePath);
+    }
+
+    void testCompile() {
+        // Every file gets the same object file that compileSource makes.
+        char *sources[] = {
+            "int x; begin read x; write x end.",
+            "const c = 3; int x; begin x := c * 2; write x end.",
+            "int x; begin x := 0; while x < 10 do x := x + 1; write x end.",
+        };
+        int i;
+        for (i = 0; i < 30; i++) {
+            char *name = format("p%02d.pl0", i);
+            writeFile(name, sources[i % 3]);
+            free(name);
+        }
+        writeFile("bad.pl0", "int x; begin y := 1 end.");
+        writeFile("notes.txt", "Not a source file.");
+
+        struct vector *files = makeVector(struct batchFile);
+        assert(addBatchInputs(files, directory, NULL));
+        assert(files->length == 31 && checkBatchOutputs(files));
+        struct batchFile first = get(struct batchFile, files, 0);
+        assert(strcmp(first.inputPath + strlen(directory), "/bad.pl0") == 0);
+        assert(strcmp(first.outputPath + strlen(directory), "/bad.obj") == 0);
+
+        struct batchStats stats;
+        assert(!compileBatch(files, COMPILE_OPTIMIZE | COMPILE_FUSE, NULL, 4, &stats));
+        assert(stats.numFiles == 31 && stats.failedFiles == 1 && stats.numThreads == 4);
+        first = get(struct batchFile, files, 0);
+        assert(strstr(first.error, "Could not find symbol 'y'.") != NULL);
+
+        struct grammar grammar = PL0Grammar();
+        for (i = 1; i < files->length; i++) {
+            struct batchFile file = get(struct batchFile, files, i);
+            assert(file.error == NULL && file.numInstructions > 0);
+            struct vector *lines;
+            char *error;
+            struct vector *instructions = compileSource(sources[(i - 1) % 3], grammar,
+                    COMPILE_OPTIMIZE | COMPILE_FUSE, &lines, &error);
+            int expectedSize;
+            unsigned char *expected = encodeObjectFile(instructions, lines, &expectedSize);
+            unsigned char *written = (unsigned char*)malloc(expectedSize + 1);
+            FILE *output = fopen(file.outputPath, "rb");
+            assert(fread(written, 1, expectedSize + 1, output) == expectedSize);
+            assert(memcmp(written, expected, expectedSize) == 0);
+            fclose(output);
+            free(written);
+            free(expected);
+            freeVector(instructions);
+            freeVector(lines);
+        }
+        freeBatchFiles(files);
+    }
+
+    void testInputs() {
+        // File lists, and outputs that would overwrite each other.
+        writeFile("list", "\n/nonexistent/a.pl0\r\n/nonexistent/b\n");
+        struct vector *files = makeVector(struct batchFile);
+        char *listPath = path("list");
+        assert(addBatchInputs(files, listPath, "/out"));
+        assert(files->length == 2);
+        assert(strcmp(get(struct batchFile, files, 0).outputPath, "/out/a.obj") == 0);
+        assert(strcmp(get(struct batchFile, files, 1).outputPath, "/out/b.obj") == 0);
+        assert(checkBatchOutputs(files));
+        assert(addBatchInputs(files, listPath, "/out"));
+        assert(!checkBatchOutputs(files));
+
+        // Files in lists that can't be read fail on their own, but named
+        // files and directories have to be there.
+        struct batchStats stats;
+        assert(!compileBatch(files, 0, NULL, 2, &stats) && stats.failedFiles == 4);
+        assert(!addBatchInputs(files, "/nonexistent/a.pl0", NULL));
+        assert(!addBatchInputs(files, "/nonexistent", NULL));
+        free(listPath);
+        freeBatchFiles(files);
+
+        // A list can come through a pipe, and can name a directory, which
+        // fails like any other file that can't be read.
+        int pipeFds[2];
+        assert(pipe(pipeFds) == 0);
+        int i;
+        for (i = 0; i < 500; i++) {
+            char *line = format("/nonexistent/p%03d.pl0\n", i);
+            assert(write(pipeFds[1], line, strlen(line)) == strlen(line));
+            free(line);
+        }
+        char *line = format("%s\n", directory);
+        assert(write(pipeFds[1], line, strlen(line)) == strlen(line));
+        free(line);
+        close(pipeFds[1]);
+        files = makeVector(struct batchFile);
+        char *pipePath = format("/dev/fd/%d", pipeFds[0]);
+        assert(addBatchInputs(files, pipePath, "/out"));
+        close(pipeFds[0]);
+        free(pipePath);
+        assert(files->length == 501);
+        assert(strcmp(get(struct batchFile, files, 499).outputPath, "/out/p499.obj") == 0);
+        assert(!compileBatch(files, 0, NULL, 2, &stats) && stats.failedFiles == 501);
+        assert(strstr(get(struct batchFile, files, 500).error, "regular file") != NULL);
+        freeBatchFiles(files);
+    }
+
+    testCompile();
+    testInputs();
+
+    char *command = format("rm -r %s", directory);
+    assert(system(command) == 0);
+    free(command);
+}
+
+void testStats() {
+    struct vector *phases = makeVector(struct phaseStats);
+    struct phaseTimer timer = startPhase();
+    struct vector *lexemes = readLexemes("int x; begin x := 1 end.");
+    // The test doesn't count its allocations itself.
+    countAllocation(100);
+    countAllocation(28);
+    endPhase(phases, timer, "readLexemes", "tokens", lexemes->length);
+    timer = startPhase();
+    endPhase(phases, timer, "nothing", "bytes", 0);
+
+    assert(phases->length == 2);
+    struct phaseStats phase = get(struct phaseStats, phases, 0);
+    assert(strcmp(phase.name, "readLexemes") == 0 && phase.produced == 9);
+    assert(phase.allocations == 2 && phase.allocatedBytes == 128);
+    assert(phase.peakKilobytes > 0);
+    phase = get(struct phaseStats, phases, 1);
+    assert(phase.allocations == 0 && phase.allocatedBytes == 0);
+
+    char *output = NULL;
+    size_t size;
+    FILE *file = open_memstream(&output, &size);
+    printPhaseStats(file, phases, 1);
+    fclose(file);
+    char *start = "{\"phases\": [\n  {\"name\": \"readLexemes\", ";
+    assert(strncmp(output, start, strlen(start)) == 0);
+    assert(strstr(output, "\"produced\": 9, \"unit\": \"tokens\", \"allocations\": 2, "
+                "\"allocatedBytes\": 128, ") != NULL);
+    assert(strstr(output, "\"total\": {") != NULL && output[size - 2] == '}');
+    free(output);
+
+    file = open_memstream(&output, &size);
+    printPhaseStats(file, phases, 0);
+    fclose(file);
+    assert(strncmp(output, "Phase ", 6) == 0 && strstr(output, "9 tokens") != NULL);
+    assert(strstr(output, "\nTotal ") != NULL);
+    free(output);
+
+    // Every token is a node, and so is every rule that matched.
+    struct grammar grammar = PL0Grammar();
+    struct parseTree tree = parseProgram(lexemes, grammar);
+    assert(countParseTreeNodes(tree) > lexemes->length);
+    freeParseTreeVectors(tree);
+    freeGrammar(grammar);
+    forVector(lexemes, i, struct lexeme, lexeme,
+        free(lexeme.token););
+    freeVector(lexemes);
+    freeVector(phases);
+}
+
+void testCache() {
+    char directory[] = "/tmp/pl0-cache-XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    char *cachePath = format("%s/cache", directory);
+    char *program = "int x; begin read x; write x end.";
+    struct grammar grammar = PL0Grammar();
+
+    unsigned char *compileProgram(char *source, int options, int *size) {
+        struct vector *lines;
+        char *error;
+        struct vector *instructions = compileSource(source, grammar, options, &lines, &error);
+        unsigned char *bytes = encodeObjectFile(instructions, lines, size);
+        freeVector(instructions);
+        freeVector(lines);
+        return bytes;
+    }
+
+    void testKeys() {
+        char key[CACHE_KEY_SIZE], other[CACHE_KEY_SIZE];
+        makeCacheKey(program, strlen(program), 0, key);
+        makeCacheKey(program, strlen(program), 0, other);
+        assert(strcmp(key, other) == 0);
+        makeCacheKey(program, strlen(program), COMPILE_OPTIMIZE, other);
+        assert(strcmp(key, other) != 0);
+        makeCacheKey(program, strlen(program) - 1, 0, other);
+        assert(strcmp(key, other) != 0);
+        makeCacheKey("int y; begin read y; write y end.", strlen(program), 0, other);
+        assert(strcmp(key, other) != 0);
+    }
+
+    void testHits() {
+        struct compileCache *cache = openCompileCache(cachePath, 0);
+        assert(cache != NULL);
+        char key[CACHE_KEY_SIZE];
+        makeCacheKey(program, strlen(program), 0, key);
+        struct cacheEntry entry;
+        assert(!lookupCompileCache(cache, key, &entry));
+
+        int size;
+        unsigned char *bytes = compileProgram(program, 0, &size);
+        assert(storeCompileCache(cache, key, bytes, size));
+        assert(lookupCompileCache(cache, key, &entry));
+        assert(entry.size == size && memcmp(entry.bytes, bytes, size) == 0);
+        releaseCacheEntry(&entry);
+        assert(cache->stats.hits == 1 && cache->stats.misses == 1 && cache->stats.writes == 1);
+        // Storing an entry again replaces it, and its size only counts once.
+        assert(storeCompileCache(cache, key, bytes, size));
+        assert(cache->stats.writes == 2 && cache->stats.bytes == size);
+
+        // A damaged entry is a miss, and is removed along with its size.
+        char *path = format("%s/%s.obj", cachePath, key);
+        FILE *entryFile = fopen(path, "r+");
+        fputs("XXXX", entryFile);
+        fclose(entryFile);
+        assert(!lookupCompileCache(cache, key, &entry));
+        assert(access(path, F_OK) != 0 && cache->stats.bytes == 0);
+        free(path);
+        free(bytes);
+        closeCompileCache(cache);
+
+        // The stats add up over every time the cache is opened.
+        cache = openCompileCache(cachePath, 0);
+        assert(!lookupCompileCache(cache, key, &entry));
+        struct cacheStats totals;
+        getCacheTotals(cache, &totals);
+        assert(totals.hits == 1 && totals.misses == 3 && totals.writes == 2);
+        assert(totals.bytes == 0);
+        closeCompileCache(cache);
+
+        char *filePath = format("%s/file", directory);
+        FILE *file = fopen(filePath, "w");
+        fclose(file);
+        assert(openCompileCache(filePath, 0) == NULL);
+        free(filePath);
+    }
+
+    void testEviction() {
+        // Each entry is the same size, so the limit fits 10 of them, and
+        // eviction leaves 9.
+        char *sources[20];
+        char keys[20][CACHE_KEY_SIZE];
+        int i, size;
+        unsigned char *bytes = compileProgram(program, 0, &size);
+        free(bytes);
+        char *evictionPath = format("%s/eviction", directory);
+        struct compileCache *cache = openCompileCache(evictionPath, 10 * size);
+        for (i = 0; i < 20; i++) {
+            sources[i] = format("int x%02d; begin read x%02d; write x%02d end.", i, i, i);
+            makeCacheKey(sources[i], strlen(sources[i]), 0, keys[i]);
+            bytes = compileProgram(sources[i], 0, &size);
+            assert(storeCompileCache(cache, keys[i], bytes, size));
+            free(bytes);
+
+            // Using the first entry keeps it from being evicted. Entries'
+            // modification times can be too close together to order them.
+            struct cacheEntry entry;
+            struct timespec pause = {0, 10000000};
+            nanosleep(&pause, NULL);
+            assert(lookupCompileCache(cache, keys[0], &entry));
+            releaseCacheEntry(&entry);
+        }
+        assert(cache->stats.evictions == 10 && cache->stats.bytes == 10 * size);
+        int found = 0;
+        for (i = 0; i < 20; i++) {
+            struct cacheEntry entry;
+            if (lookupCompileCache(cache, keys[i], &entry)) {
+                assert(i == 0 || i >= 11);
+                found++;
+                releaseCacheEntry(&entry);
+            }
+            free(sources[i]);
+        }
+        assert(found == 10);
+        closeCompileCache(cache);
+        free(evictionPath);
+    }
+
+    void testBatchCache() {
+        char *batchPath = format("%s/batch", directory);
+        assert(mkdir(batchPath, 0755) == 0);
+        int i;
+        for (i = 0; i < 4; i++) {
+            char *sourcePath = format("%s/p%d.pl0", batchPath, i);
+            FILE *file = fopen(sourcePath, "w");
+            fputs((i == 3) ? "begin y := 1 end." : program, file);
+            fclose(file);
+            free(sourcePath);
+        }
+
+        // Files with the same source code share an entry, and files that
+        // don't compile aren't cached.
+        struct compileCache *cache = openCompileCache(cachePath, 0);
+        struct batchStats stats;
+        int round;
+        for (round = 0; round < 2; round++) {
+            struct vector *files = makeVector(struct batchFile);
+            assert(addBatchInputs(files, batchPath, NULL));
+            assert(!compileBatch(files, COMPILE_FUSE, cache, 1, &stats));
+            assert(stats.failedFiles == 1 && stats.cachedFiles == ((round == 0) ? 2 : 3));
+            struct batchFile file = get(struct batchFile, files, 2);
+            struct objectFile *object = loadObjectFile(file.outputPath);
+            assert(object != NULL && file.numInstructions == object->codeLength);
+            freeObjectFile(object);
+            freeBatchFiles(files);
+        }
+        closeCompileCache(cache);
+        free(batchPath);
+    }
+
+    testKeys();
+    testHits();
+    testEviction();
+    testBatchCache();
+
+    free(cachePath);
+    char *command = format("rm -r %s", directory);
+    assert(system(command) == 0);
+    free(command);
+}
+
+// What compileMany compiles, and the object file that it should get.
+struct compileManyArguments {
+    char *program;
+    unsigned char *expected;
+    int expectedSize;
+};
+
+// Compile the program and a program with an error with a context of the
+// thread's own. Not nested in testLibrary, since a nested function that
+// refers to its parent's variables needs an executable stack.
+void *compileMany(void *argument) {
+    struct compileManyArguments *arguments = (struct compileManyArguments*)argument;
+    char *program = arguments->program;
+    struct pl0Context *context = makePL0Context();
+    int i, size;
+    for (i = 0; i < 200; i++) {
+        if (i % 2 == 0) {
+            assert(compilePL0(context, program, strlen(program), PL0_OPTIMIZE | PL0_FUSE));
+            unsigned char *objectFile = getPL0ObjectFile(context, &size);
+            assert(size == arguments->expectedSize
+                    && memcmp(objectFile, arguments->expected, size) == 0);
+        } else {
+            assert(!compilePL0(context, "begin y := 1 end.", 17, 0));
+            getPL0Diagnostics(context, &size);
+            assert(size == 1);
+        }
+    }
+    freePL0Context(context);
+    return NULL;
+}
+
+void testLibrary() {
+    char *program = "int x; begin read x; x := x * 2; write x end.";
+
+    void testCompile() {
+        // The source doesn't have to be null-terminated, and the results are
+        // the same as compileSource's.
+        struct pl0Context *context = makePL0Context();
+        char *padded = format("%sXXXX", program);
+        assert(compilePL0(context, padded, strlen(program), PL0_OPTIMIZE));
+        int count;
+        struct instruction *instructions = getPL0Instructions(context, &count);
+        getPL0Diagnostics(context, &count);
+        assert(count == 0);
+
+        struct grammar grammar = PL0Grammar();
+        struct vector *lines;
+        char *error;
+        struct vector *expected = compileSource(program, grammar, COMPILE_OPTIMIZE,
+                &lines, &error);
+        getPL0Instructions(context, &count);
+        assert(count == expected->length);
+        assert(memcmp(instructions, expected->items,
+                    sizeof(struct instruction) * count) == 0);
+        int size, expectedSize;
+        unsigned char *objectFile = getPL0ObjectFile(context, &size);
+        unsigned char *expectedObjectFile = encodeObjectFile(expected, lines, &expectedSize);
+        assert(size == expectedSize && memcmp(objectFile, expectedObjectFile, size) == 0);
+        assert(getPL0ObjectFile(context, &size) == objectFile);
+
+        free(expectedObjectFile);
+        freeVector(expected);
+        freeVector(lines);
+        freeGrammar(grammar);
+        free(padded);
+        freePL0Context(context);
+    }
+
+    void testDiagnostics() {
+        struct pl0Context *context = makePL0Context();
+        void assertDiagnostic(char *source, int phase, int line, int column,
+                char *message) {
+            int count;
+            assert(!compilePL0(context, source, strlen(source), 0));
+            assert(getPL0Instructions(context, &count) == NULL && count == 0);
+            assert(getPL0ObjectFile(context, &count) == NULL && count == 0);
+            struct pl0Diagnostic *diagnostics = getPL0Diagnostics(context, &count);
+            assert(count >= 1);
+            assert(diagnostics[0].phase == phase);
+            assert(diagnostics[0].line == line && diagnostics[0].column == column);
+            assert(strcmp(diagnostics[0].message, message) == 0);
+        }
+
+        // Parse errors are where the parser got the furthest.
+        assertDiagnostic("int x;\nbegin x = 1 end.", PL0_PARSER_DIAGNOSTIC, 2, 9,
+                "Expected 'becomessym' but got '=' while parsing assignment.");
+        assertDiagnostic("int x; begin x := 1 end. x", PL0_PARSER_DIAGNOSTIC, 1, 26,
+                "Expected end of file but got 'x' after the program.");
+        assertDiagnostic("int x; begin x := 1 end", PL0_PARSER_DIAGNOSTIC, 0, 0,
+                "Expected 'periodsym' but got end of file while parsing program.");
+        assertDiagnostic("int x;\nbegin\n  write y\nend.", PL0_GENERATOR_DIAGNOSTIC, 3, 3,
+                "Could not find symbol 'y'.");
+
+        // Compiling again or resetting forgets the diagnostics.
+        int count;
+        assert(compilePL0(context, program, strlen(program), 0));
+        getPL0Diagnostics(context, &count);
+        assert(count == 0);
+        assertDiagnostic("begin write y end.", PL0_GENERATOR_DIAGNOSTIC, 1, 7,
+                "Could not find symbol 'y'.");
+        resetPL0Context(context);
+        getPL0Diagnostics(context, &count);
+        assert(count == 0);
+        assert(getPL0Instructions(context, &count) == NULL && count == 0);
+        freePL0Context(context);
+    }
+
+    void testThreads() {
+        // Contexts on different threads compile at the same time.
+        struct pl0Context *reference = makePL0Context();
+        assert(compilePL0(reference, program, strlen(program), PL0_OPTIMIZE | PL0_FUSE));
+        int expectedSize;
+        unsigned char *expected = getPL0ObjectFile(reference, &expectedSize);
+
+        struct compileManyArguments arguments = {program, expected, expectedSize};
+        pthread_t threads[4];
+        int i;
+        for (i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, compileMany, &arguments);
+        for (i = 0; i < 4; i++)
+            pthread_join(threads[i], NULL);
+        freePL0Context(reference);
+    }
+
+    testCompile();
+    testDiagnostics();
+    testThreads();
 }
 
 int main() {
     testTestUtil();
+    testVector();
     testLexer();
     testParser();
     testCodeGenerator();
+    testLineTable();
+    testCGenerator();
+    testAsmGenerator();
+    testOptimizer();
+    testObjectFile();
+    testVM();
+    testVerifier();
+    testFusion();
+    testIO();
+    testTrace();
+    testProfile();
+    testScheduler();
+    testServer();
+    testBatch();
+    testLibrary();
+    testCache();
+    testStats();
 
     printf("All tests passed.\n");
 